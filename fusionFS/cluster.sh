@@ -0,0 +1,120 @@
+#!/bin/bash
+#
+# A FusionFS cluster of N nodes on one Linux host, for testing and benchmarking the
+# distributed code paths (remote fetch and removal, ZHT routing and replication) without
+# real machines. Run it from the fusionFS directory after compileAll.sh.
+#
+#	./cluster.sh start N [dir]	start N nodes under dir (default ./cluster)
+#	./cluster.sh stop [dir]		unmount and stop everything of the cluster
+#	./cluster.sh status [dir]	list the nodes and whether their processes run
+#
+# Node i (0 based) is 127.0.1.(i+1): all of 127/8 is loopback on Linux, so every node has an
+# address of its own without any setup. It gets
+#	dir/<ip>/root, dir/<ip>/mount	its FusionFS root directory and mount point
+#	a ZHT server on port ZHT_PORT+i	(dir/neighbor lists them all)
+#	an ffsnetd on <ip>:FFSNET_PORT
+#	a fusionfs mount, told its identity, the ZHT members and where the other nodes keep
+#				their files by the FUSIONFS_* variables (src/util.c, src/fusionfs.c)
+# and logs and pids in dir/<ip>. Environment:
+#	ZHT_PORT	first ZHT port, 50000
+#	ZHT_CFG		ZHT configuration, src/zht/zht.cfg (NUM_REPLICAS > 0 for replication)
+#	FFSNET_PORT	the ffsnetd port of all nodes, 9000
+#	NO_MOUNT=1	start ZHT and ffsnetd only: fusionfs refuses to run as root and needs
+#			/dev/fuse and fusermount
+#
+
+HOME_DIR=$(cd "$(dirname "$0")" && pwd)
+ZHT_PORT=${ZHT_PORT:-50000}
+ZHT_CFG=${ZHT_CFG:-$HOME_DIR/src/zht/zht.cfg}
+FFSNET_PORT=${FFSNET_PORT:-9000}
+
+node_ip() {
+	echo 127.0.1.$(($1 + 1))
+}
+
+cluster_start() {
+	local n=$1 dir=$2 i ip
+	if [ -z "$n" ] || [ "$n" -lt 1 ] || [ "$n" -gt 254 ]; then
+		echo "usage: $0 start N [dir], 1 <= N <= 254"
+		exit 1
+	fi
+	if [ -f "$dir/neighbor" ]; then
+		echo "$dir holds a cluster already, stop it first"
+		exit 1
+	fi
+	mkdir -p "$dir"
+	dir=$(cd "$dir" && pwd)
+	cp "$ZHT_CFG" "$dir/zht.cfg"
+	for ((i = 0; i < n; i++)); do
+		echo "localhost $((ZHT_PORT + i))"
+	done > "$dir/neighbor"
+
+	for ((i = 0; i < n; i++)); do
+		ip=$(node_ip $i)
+		mkdir -p "$dir/$ip/root" "$dir/$ip/mount"
+		(cd "$dir/$ip" && exec "$HOME_DIR/src/zht/bin/server_zht" $((ZHT_PORT + i)) \
+			"$dir/neighbor" "$dir/zht.cfg" TCP > zht.log 2>&1) &
+		echo $! > "$dir/$ip/zht.pid"
+		(cd "$dir/$ip" && LD_LIBRARY_PATH="$HOME_DIR/src/udt/src:$LD_LIBRARY_PATH" \
+			exec "$HOME_DIR/src/ffsnet/ffsnetd" $FFSNET_PORT $ip > ffsnetd.log 2>&1) &
+		echo $! > "$dir/$ip/ffsnetd.pid"
+	done
+	sleep 1
+
+	for ((i = 0; i < n; i++)); do
+		ip=$(node_ip $i)
+		[ "$NO_MOUNT" = 1 ] && continue
+		(cd "$dir/$ip" && \
+			LD_LIBRARY_PATH="$HOME_DIR/src/ffsnet:$HOME_DIR/src/udt/src:$LD_LIBRARY_PATH" \
+			FUSIONFS_IP=$ip FUSIONFS_FFSNET_PORT=$FFSNET_PORT \
+			FUSIONFS_ZHT_NEIGHBOR="$dir/neighbor" FUSIONFS_ZHT_CONFIG="$dir/zht.cfg" \
+			FUSIONFS_PEER_ROOT="$dir/%s/root" \
+			"$HOME_DIR/src/fusionfs" root mount > fusionfs.out 2>&1) \
+			|| echo "node $ip: fusionfs failed, see $dir/$ip/fusionfs.out"
+	done
+	cluster_status "$dir"
+}
+
+cluster_stop() {
+	local dir=$1 node
+	[ -f "$dir/neighbor" ] || { echo "no cluster in $dir"; exit 1; }
+	for node in "$dir"/127.*; do
+		mountpoint -q "$node/mount" && fusermount -u "$node/mount"
+		[ -f "$node/ffsnetd.pid" ] && kill $(cat "$node/ffsnetd.pid") 2> /dev/null
+		[ -f "$node/zht.pid" ] && kill $(cat "$node/zht.pid") 2> /dev/null
+		rm -f "$node/ffsnetd.pid" "$node/zht.pid"
+	done
+	rm -f "$dir/neighbor"
+}
+
+running() {
+	[ -f "$1" ] && kill -0 $(cat "$1") 2> /dev/null && echo up || echo down
+}
+
+cluster_status() {
+	local dir=$1 node ip
+	[ -f "$dir/neighbor" ] || { echo "no cluster in $dir"; exit 1; }
+	for node in $(ls -d "$dir"/127.* | sort -t . -k 4 -n); do
+		ip=$(basename "$node")
+		echo "$ip: zht $(running "$node/zht.pid") (port" \
+			"$(sed -n "${ip##*.}p" "$dir/neighbor" | cut -d' ' -f2))," \
+			"ffsnetd $(running "$node/ffsnetd.pid")," \
+			"mount $(mountpoint -q "$node/mount" && echo up || echo down) ($node/mount)"
+	done
+}
+
+case "$1" in
+start)
+	cluster_start "$2" "${3:-./cluster}"
+	;;
+stop)
+	cluster_stop "${2:-./cluster}"
+	;;
+status)
+	cluster_status "${2:-./cluster}"
+	;;
+*)
+	echo "usage: $0 start N [dir] | stop [dir] | status [dir]"
+	exit 1
+	;;
+esac
@@ -6,6 +6,7 @@
  * Author: dzhao8@hawk.iit.edu
  *
  * Update history:
+ *		- 10/19/2026: _recvfile_udt() and _sendfile_udt() return 0 on success
  * 		- 07/18/2012: add ffs_mkdir()
  * 		- 07/17/2012: add ffs_rmfile()
  *		- 06/18/2012: initial development
@@ -25,6 +26,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits.h>
+#include <unistd.h>
 #include <udt.h>
 
 #include "ffsnet.h"
@@ -240,6 +242,8 @@ _recvfile_udt(const char *remote_ip, const char *server_port, const char *remote
 
 	/* use this function to release the UDT library */
 	UDT::cleanup();	
+
+	return 0;
 }
 
 /*
@@ -326,6 +330,8 @@ _sendfile_udt(const char *remote_ip, const char *server_port, const char *local_
 
 	/* use this function to release the UDT library */
 	UDT::cleanup();	
+
+	return 0;
 }
 
 /*
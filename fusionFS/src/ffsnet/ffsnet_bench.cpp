@@ -0,0 +1,375 @@
+/**
+ * File name: ffsnet_bench.cpp
+ *
+ * Function: throughput and concurrency benchmark of ffs_sendfile() and ffs_recvfile()
+ *
+ * Author: dzhao8@hawk.iit.edu
+ *
+ * Update history:
+ *		- 10/19/2026: initial development
+ *
+ * Runs against an ffsnetd on this machine, over loopback. For every protocol, file size
+ * and number of concurrent clients it uploads files to the daemon (send) and downloads them
+ * again (recv), every transfer on a connection of its own as FusionFS does, and prints one
+ * CSV line: MB/s, files/s, the average and worst transfer time, and the CPU seconds per GB
+ * moved of this process and, if it started the daemon itself, of the daemon. The connection
+ * setup cost comes first: the time of an ffs_mkdir() of an existing directory, a request
+ * that moves no data.
+ *
+ * Each client thread transfers a file at least once and at most -n times, fewer when the
+ * point would move more than -b bytes. Files go to the working directory: a source file
+ * per size, and size * concurrency bytes each for the uploaded and the downloaded copies.
+ *
+ * Usage: ./ffsnet_bench [-d ffsnetd] [-P port] [-w workdir] [-p proto,...]
+ *		[-s size,...] [-c clients,...] [-n files] [-b bytes]
+ *		default: an ffsnetd already listening on port 9000, workdir /tmp/ffsnet_bench,
+ *		udt, sizes 4K,64K,1M,16M,256M,1G (up to 10G and more with K, M, G suffixes),
+ *		clients 1,2,4,8, at most 100 files per client and 1G per point
+ *		-d starts the given ffsnetd on the port and stops it at the end.
+ *
+ * To compile:
+ *		g++ ffsnet_bench.cpp -o ffsnet_bench -L. -lffsnet -I../udt/src -L../udt/src -ludt -lstdc++ -lpthread
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "ffsnet.h"
+
+using namespace std;
+
+#define SETUP_PROBES 50
+
+string port("9000");
+string workdir("/tmp/ffsnet_bench");
+pid_t daemon_pid = -1;
+
+struct client {
+	pthread_t thread;
+	int id;
+	const char *proto;
+	int send; /* 1: upload, 0: download */
+	int64_t size;
+	int files;
+	vector<double> times; /* sec per transfer */
+	int errors;
+};
+
+double
+now_sec()
+{
+	struct timeval t;
+	gettimeofday(&t, 0);
+	return (double) t.tv_sec + (double) t.tv_usec / 1000000.0;
+}
+
+/* user + system seconds of this process, all threads */
+double
+self_cpu()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+			+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+/* user + system seconds of the daemon we started, -1 otherwise */
+double
+daemon_cpu()
+{
+	if (daemon_pid < 0)
+		return -1;
+	char path[64], buf[1024];
+	sprintf(path, "/proc/%d/stat", (int) daemon_pid);
+	FILE *f = fopen(path, "r");
+	if (NULL == f)
+		return -1;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	char *p = strrchr(buf, ')'); /* the command name may hold spaces */
+	unsigned long utime, stime;
+	if (NULL == p || 2 != sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime))
+		return -1;
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int64_t
+parse_size(const char *s)
+{
+	char *end;
+	int64_t v = strtoll(s, &end, 10);
+	switch (*end) {
+	case 'G': case 'g': v <<= 10;
+	/* no break */
+	case 'M': case 'm': v <<= 10;
+	/* no break */
+	case 'K': case 'k': v <<= 10;
+	}
+	return v;
+}
+
+vector<string>
+split(const char *list)
+{
+	vector<string> out;
+	string s(list);
+	size_t start = 0, comma;
+	while (string::npos != (comma = s.find(',', start))) {
+		out.push_back(s.substr(start, comma - start));
+		start = comma + 1;
+	}
+	out.push_back(s.substr(start));
+	return out;
+}
+
+string
+source_name(int64_t size)
+{
+	char name[PATH_MAX];
+	sprintf(name, "%s/source.%lld", workdir.c_str(), (long long) size);
+	return name;
+}
+
+string
+copy_name(const char *dir, int64_t size, int id)
+{
+	char name[PATH_MAX];
+	sprintf(name, "%s/%s/%lld.%d", workdir.c_str(), dir, (long long) size, id);
+	return name;
+}
+
+/* the file uploads read, written once and kept for later runs */
+int
+make_source(int64_t size)
+{
+	string name = source_name(size);
+	struct stat st;
+	if (0 == stat(name.c_str(), &st) && st.st_size == size)
+		return 0;
+	int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(name.c_str());
+		return -1;
+	}
+	vector<char> buf(1 << 20);
+	unsigned int seed = 1;
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (char) rand_r(&seed);
+	for (int64_t left = size; left > 0;) {
+		ssize_t n = write(fd, &buf[0], left < (int64_t) buf.size() ? left : buf.size());
+		if (n <= 0) {
+			perror(name.c_str());
+			close(fd);
+			return -1;
+		}
+		left -= n;
+	}
+	close(fd);
+	return 0;
+}
+
+void*
+transfer(void *arg)
+{
+	struct client *c = (struct client*) arg;
+	string source = source_name(c->size);
+	string remote = copy_name("remote", c->size, c->id);
+	string local = copy_name("local", c->size, c->id);
+	for (int i = 0; i < c->files; i++) {
+		double start = now_sec();
+		int retstat;
+		if (c->send)
+			retstat = ffs_sendfile(c->proto, "127.0.0.1", port.c_str(), source.c_str(),
+					remote.c_str());
+		else
+			retstat = ffs_recvfile(c->proto, "127.0.0.1", port.c_str(), remote.c_str(),
+					local.c_str());
+		c->times.push_back(now_sec() - start);
+		if (retstat)
+			c->errors++;
+	}
+	return NULL;
+}
+
+/* all clients move their files at once, one CSV line */
+void
+run_point(const char *proto, int send, int64_t size, int clients, int max_files,
+		int64_t budget)
+{
+	int files = (int) (budget / (size * clients));
+	files = files < 1 ? 1 : files > max_files ? max_files : files;
+
+	vector<struct client> cs(clients);
+	double cpu = self_cpu(), dcpu = daemon_cpu();
+	double start = now_sec();
+	for (int i = 0; i < clients; i++) {
+		cs[i].id = i;
+		cs[i].proto = proto;
+		cs[i].send = send;
+		cs[i].size = size;
+		cs[i].files = files;
+		cs[i].errors = 0;
+		pthread_create(&cs[i].thread, NULL, transfer, &cs[i]);
+	}
+	for (int i = 0; i < clients; i++)
+		pthread_join(cs[i].thread, NULL);
+	double sec = now_sec() - start;
+	cpu = self_cpu() - cpu;
+	if (dcpu >= 0)
+		dcpu = daemon_cpu() - dcpu;
+
+	vector<double> times;
+	int errors = 0;
+	for (int i = 0; i < clients; i++) {
+		times.insert(times.end(), cs[i].times.begin(), cs[i].times.end());
+		errors += cs[i].errors;
+	}
+	sort(times.begin(), times.end());
+	double sum = 0;
+	for (size_t i = 0; i < times.size(); i++)
+		sum += times[i];
+	double gb = (double) size * times.size() / (1 << 30);
+	printf("%s,%s,%lld,%d,%d,%d,%.3f,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f", proto,
+			send ? "send" : "recv", (long long) size, clients, (int) times.size(), errors,
+			sec, size * times.size() / sec / (1 << 20), times.size() / sec,
+			sum / times.size() * 1000, times[times.size() / 2] * 1000,
+			times.back() * 1000, cpu / gb);
+	if (dcpu >= 0)
+		printf(",%.3f\n", dcpu / gb);
+	else
+		printf(",\n");
+	fflush(stdout);
+}
+
+/* an ffs_mkdir() of a directory that exists: connect, one request, one reply */
+void
+run_setup(const char *proto)
+{
+	vector<double> times;
+	int errors = 0;
+	for (int i = 0; i < SETUP_PROBES; i++) {
+		double start = now_sec();
+		if (ffs_mkdir(proto, "127.0.0.1", port.c_str(), workdir.c_str()))
+			errors++;
+		times.push_back(now_sec() - start);
+	}
+	sort(times.begin(), times.end());
+	double sum = 0;
+	for (size_t i = 0; i < times.size(); i++)
+		sum += times[i];
+	printf("# %s connection setup: avg %.3f ms, p50 %.3f ms, max %.3f ms, %d errors\n",
+			proto, sum / times.size() * 1000, times[times.size() / 2] * 1000,
+			times.back() * 1000, errors);
+}
+
+void
+usage(const char *name)
+{
+	cout << "usage: " << name << " [-d ffsnetd] [-P port] [-w workdir] [-p proto,...] "
+			"[-s size,...] [-c clients,...] [-n files] [-b bytes]" << endl;
+}
+
+int
+main(int argc, char* argv[])
+{
+	const char *ffsnetd = NULL;
+	vector<string> protos = split("udt");
+	vector<string> sizes = split("4K,64K,1M,16M,256M,1G");
+	vector<string> levels = split("1,2,4,8");
+	int max_files = 100;
+	int64_t budget = 1 << 30;
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "d:P:w:p:s:c:n:b:"))) {
+		switch (c) {
+		case 'd': ffsnetd = optarg; break;
+		case 'P': port = optarg; break;
+		case 'w': workdir = optarg; break;
+		case 'p': protos = split(optarg); break;
+		case 's': sizes = split(optarg); break;
+		case 'c': levels = split(optarg); break;
+		case 'n': max_files = atoi(optarg); break;
+		case 'b': budget = parse_size(optarg); break;
+		default: usage(argv[0]); return -1;
+		}
+	}
+	if (max_files <= 0 || budget <= 0 || '/' != workdir[0]) { /* ffsnetd needs full paths */
+		usage(argv[0]);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	string mkdirs = "mkdir -p " + workdir + "/remote " + workdir + "/local";
+	if (system(mkdirs.c_str())) {
+		cout << "cannot create " << workdir << endl;
+		return -1;
+	}
+
+	if (NULL != ffsnetd) {
+		daemon_pid = fork();
+		if (0 == daemon_pid) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, 1);
+			execl(ffsnetd, ffsnetd, port.c_str(), (char*) NULL);
+			perror(ffsnetd);
+			_exit(1);
+		}
+		usleep(500000);
+		if (waitpid(daemon_pid, NULL, WNOHANG) == daemon_pid) {
+			cout << "cannot start " << ffsnetd << endl;
+			return -1;
+		}
+	}
+
+	for (size_t p = 0; p < protos.size(); p++) {
+		const char *proto = protos[p].c_str();
+		/* one small upload first: ffs_mkdir() takes any protocol, the transfers do not */
+		string probe = copy_name("remote", 0, 0);
+		if (make_source(4096) || ffs_sendfile(proto, "127.0.0.1", port.c_str(),
+				source_name(4096).c_str(), probe.c_str())) {
+			printf("# %s: cannot upload to ffsnetd, skipped\n", proto);
+			continue;
+		}
+		unlink(probe.c_str());
+		run_setup(proto);
+		printf("proto,direction,size,clients,files,errors,sec,MB_per_sec,files_per_sec,"
+				"avg_ms,p50_ms,max_ms,client_cpu_sec_per_GB,daemon_cpu_sec_per_GB\n");
+		for (size_t s = 0; s < sizes.size(); s++) {
+			int64_t size = parse_size(sizes[s].c_str());
+			if (size <= 0 || make_source(size))
+				continue;
+			for (size_t l = 0; l < levels.size(); l++) {
+				int clients = atoi(levels[l].c_str());
+				if (clients <= 0)
+					continue;
+				run_point(proto, 1, size, clients, max_files, budget);
+				run_point(proto, 0, size, clients, max_files, budget);
+				for (int i = 0; i < clients; i++) {
+					unlink(copy_name("remote", size, i).c_str());
+					unlink(copy_name("local", size, i).c_str());
+				}
+			}
+		}
+	}
+
+	if (daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+	}
+	return 0;
+}
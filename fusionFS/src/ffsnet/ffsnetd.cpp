@@ -6,6 +6,7 @@
  * Author: dzhao8@hawk.iit.edu
  *
  * Update history:
+ *		- 10/19/2026: optional address to listen on, for several daemons on one host
  *		- 07/18/2012: add mkdir(), this is not being used for now. It's not been tested either.
  * 		- 07/17/2012: add rmfile()
  * 		- 07/07/2012: better error handling - close file handle and iofs if failure occurs
@@ -29,6 +30,7 @@
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <cerrno>
+#include <unistd.h>
 
 using namespace std;
 
@@ -36,9 +38,9 @@ void* transfile(void*);
 
 int main(int argc, char* argv[])
 {
-	/* usage: ffsd [server_port] */
-	if ((2 < argc) || ((2 == argc) && (0 == atoi(argv[1])))) {
-		cout << "usage: ffsd [server_port]" << endl;
+	/* usage: ffsd [server_port [listen_ip]] */
+	if ((3 < argc) || ((2 <= argc) && (0 == atoi(argv[1])))) {
+		cout << "usage: ffsd [server_port [listen_ip]]" << endl;
 		return 0;
 	}
 
@@ -54,10 +56,13 @@ int main(int argc, char* argv[])
 	hints.ai_socktype = SOCK_STREAM;
 
 	string service("9000"); /* default server port */
-	if (2 == argc)
+	if (2 <= argc)
 		service = argv[1];
 
-	if (0 != getaddrinfo(NULL, service.c_str(), &hints, &res)) {
+	/* all addresses unless one is given: nodes sharing a host are told apart by it */
+	const char *node = (3 == argc) ? argv[2] : NULL;
+
+	if (0 != getaddrinfo(node, service.c_str(), &hints, &res)) {
 		cout << "illegal port number or port is busy.\n" << endl;
 		return 0;
 	}
@@ -190,6 +190,21 @@ static void fusion_fullpath(char fpath[PATH_MAX], const char *path)
 			FUSION_DATA->rootdir, path, fpath);
 }
 
+// The name ffsnetd on node IP knows PATH by. Every node has the same
+// rootdir, unless FUSIONFS_PEER_ROOT says where a node's is: a format
+// with one %s, the node's address (several nodes on one host, see
+// cluster.sh).
+static void fusion_remotepath(char rpath[PATH_MAX], const char *ip, const char *path)
+{
+	const char *peer_root = getenv("FUSIONFS_PEER_ROOT");
+	if (peer_root == NULL || !*peer_root) {
+		fusion_fullpath(rpath, path);
+		return;
+	}
+	snprintf(rpath, PATH_MAX, peer_root, ip);
+	strncat(rpath, path, PATH_MAX - strlen(rpath) - 1);
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -251,16 +266,19 @@ int fusion_getattr(const char *path, struct stat *statbuf)
 	else { /* if file exists in ZHT */
 		log_msg("\n ===========DFZ debug: _getattr() zht_lookup() = %s. \n\n", res);
 
+		char rpath[PATH_MAX] = {0};
+		fusion_remotepath(rpath, res, path);
+
 		if (access(fpath, F_OK)) { /*if it isn't on this node, copy it over*/
 
-			ffs_recvfile_c("udt", res, "9000", fpath, fpath);
+			ffs_recvfile_c("udt", res, net_ffsnetport(), rpath, fpath);
 
 			log_msg("\n ===========DFZ debug: _getattr() %s transferred from %s. \n\n",
 					fpath, res);
 		}
 		else if (strcmp("/", path) /*even it's in local node, it could be outdated.*/
 				&& strcmp(res, myaddr)) {
-			ffs_recvfile_c("udt", res, "9000", fpath, fpath);
+			ffs_recvfile_c("udt", res, net_ffsnetport(), rpath, fpath);
 
 			log_msg("\n ===========DFZ debug: _getattr() %s transferred from %s because local copy might be outdated. \n\n",
 					fpath, res);
@@ -491,7 +509,9 @@ int fusion_unlink(const char *path)
 
 	log_msg("\n DFZ debug: _unlink() remote rmfile.\n\n");
 	/*or we need to remove the remote file*/
-	ffs_rmfile_c("udt", oldaddr, "9000", fpath);
+	char rpath[PATH_MAX] = {0};
+	fusion_remotepath(rpath, oldaddr, path);
+	ffs_rmfile_c("udt", oldaddr, net_ffsnetport(), rpath);
 
 	return retstat;
 }
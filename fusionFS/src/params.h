@@ -11,6 +11,11 @@
 
 /* DFZ FusionFS Constants */
 #define ZHT_LOOKUP_FAIL -2
+/* misses of getattr are remembered that long, 0: never. Off by default: a file another
+ * node just created would be reported missing (ENOENT) for up to this many msec. Only
+ * worth it for a namespace one node writes; FUSIONFS_ZHT_NEGATIVE_MSEC sets it then, see
+ * c_zht_negative_cache */
+#define ZHT_NEGATIVE_TTL_MSEC 0
 
 // need this to get pwrite().  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
@@ -43,9 +43,16 @@
 #include "util.h"
 
 /*
- * get the ip address of the local machine
+ * get the ip address of the local machine, or the identity FUSIONFS_IP gives this node
+ * when several of them run on one host (see cluster.sh)
  */
 int net_getmyip(char *addr) {
+	const char *identity = getenv("FUSIONFS_IP");
+	if (identity != NULL && *identity) {
+		strcpy(addr, identity);
+		return 0;
+	}
+
 //	char hostname[PATH_MAX] = {0};
 //	struct hostent *host = (struct hostent *) malloc(sizeof(struct hostent));
 //
@@ -88,6 +95,14 @@ int net_getmyip(char *addr) {
 	return 0;
 }
 
+/*
+ * the port ffsnetd listens on, the same on every node: FUSIONFS_FFSNET_PORT or 9000
+ */
+const char *net_ffsnetport() {
+	const char *port = getenv("FUSIONFS_FFSNET_PORT");
+	return (port != NULL && *port) ? port : "9000";
+}
+
 /**
  *********************************************************
  *********************************************************
@@ -199,8 +214,17 @@ int zht_set_openmode(const char *virtualfname, int openmode)
 
 int zht_init()
 {
+	/* FUSIONFS_ZHT_NEIGHBOR and FUSIONFS_ZHT_CONFIG point elsewhere, see cluster.sh */
+	const char *neighbor = getenv("FUSIONFS_ZHT_NEIGHBOR");
+	const char *config = getenv("FUSIONFS_ZHT_CONFIG");
+
 	/* use TCP by default */
-	c_zht_init("./src/zht/neighbor", "./src/zht/zht.cfg", true);
+	c_zht_init(neighbor != NULL ? neighbor : "./src/zht/neighbor",
+			config != NULL ? config : "./src/zht/zht.cfg", true);
+	/* getattr of a path about to be created misses twice, that can be answered locally,
+	 * but only where no other node creates files: see ZHT_NEGATIVE_TTL_MSEC */
+	const char *negative = getenv("FUSIONFS_ZHT_NEGATIVE_MSEC");
+	c_zht_negative_cache(negative != NULL ? atoi(negative) : ZHT_NEGATIVE_TTL_MSEC);
 
 //	/* DFZ: debug info */
 //	printf("\n =====DFZ debug: %s \n", "zht_init() succeeded. ");
@@ -220,100 +244,30 @@ int zht_free()
 
 int zht_insert(const char *key, const char *value)
 {
-//	return c_zht_insert2(key, value);
-	Package package = PACKAGE__INIT; // Package
-	package.virtualpath = (char*)key;
-	package.realfullpath = (char*)value;
-	package.has_operation = true;
-	package.operation = 3; //1 for look up, 2 for remove, 3 for insert
-
-	char *buf; // Buffer to store serialized data
-	unsigned len; // Length of serialized data
-
-	len = package__get_packed_size(&package);
-	buf = (char*) calloc(len, sizeof(char));
-	package__pack(&package, (uint8_t *)buf);
-
-	int ret = c_zht_insert(buf);
+	/* typed call: no Package to pack here, the client encodes the request once */
+	int ret = c_zht_put(key, value, strlen(value));
 	if (ret)
-		fprintf(stderr, "c_zht_insert, return code %d. \n", ret);
-
-	free(buf); // Free the allocated serialized buffer
+		fprintf(stderr, "c_zht_put, return code %d. \n", ret);
 
 	return 0;
 }
 
 int zht_lookup(const char *key, char *val)
 {
-//	return c_zht_lookup2(key, val);
-//	size_t len;
-//	return c_zht_lookup2(key, val, &len);
+	size_t ln = (ZHT_MAX_BUFF) - 1; //room in val (callers pass ZHT_MAX_BUFF), then the length
 
-	char *buf; // Buffer to store serialized data
-	unsigned len; // Length of serialized data
-	char result[ZHT_MAX_BUFF] = {0}; //return result
-	size_t ln; //return length
-
-	Package package = PACKAGE__INIT; // Package
-	package.virtualpath = (char*)key;
-	package.realfullpath = "";
-	package.has_operation = true;
-	package.operation = 1; //1 for look up, 2 for remove, 3 for insert
-
-	len = package__get_packed_size(&package);
-	buf = (char*) calloc(len, sizeof(char));
-	package__pack(&package, (uint8_t *)buf);
-
-	int lret = c_zht_lookup(buf, result, &ln);
-	if (lret == 0 && ln > 0) {
-		Package *lkPackage;
-//		char *lkBuf = (char*) calloc(ln, sizeof(char));
-//		char lkBuf[ln + 1] = {0};
-//		strncpy(lkBuf, result, ln);
-		lkPackage = package__unpack(NULL, ln, (const uint8_t *)result);
-
-		if (lkPackage == NULL) {
-			fprintf(stderr, "error unpacking lookup result\n");
-		}
-//		else {
-//			fprintf(stderr,
-//					"c_zht_lookup, return {key}:{value} ==>\n{%s}:{%s}\n",
-//					lkPackage->virtualpath, lkPackage->realfullpath);
-//		}
-
-//		free(lkBuf);
-
-		strcpy(val, lkPackage->realfullpath);
-		package__free_unpacked(lkPackage, NULL);
-	}
-
-	free(buf); // Free the allocated serialized buffer
+	int lret = c_zht_get(key, val, &ln);
+	if (lret == 0)
+		val[ln] = '\0';
 
 	return 0;
 }
 
 int zht_remove(const char *key)
 {
-//	return c_zht_remove2(key);
-
-	Package package = PACKAGE__INIT; // Package
-	package.virtualpath = (char*)key;
-	package.realfullpath = "";
-	package.has_operation = true;
-	package.operation = 2; //1 for look up, 2 for remove, 3 for insert
-
-	char *buf; // Buffer to store serialized data
-	unsigned len; // Length of serialized data
-
-	len = package__get_packed_size(&package);
-	buf = (char*) calloc(len, sizeof(char));
-	package__pack(&package, (uint8_t *)buf);
-
-	int ret = c_zht_remove(buf);
+	int ret = c_zht_erase(key);
 	if (ret)
-		fprintf(stderr, "c_zht_remove, return code %d\n", ret);
-
-	free(buf); // Free the allocated serialized buffer
+		fprintf(stderr, "c_zht_erase, return code %d\n", ret);
 
 	return 0;
 }
@@ -1,368 +1,610 @@
-//#include <kchashdb.h>
-//#include <kcprotodb.h>
-#include <string>
-#include <cstring>
-#include <iostream>
-#include <sstream>
-#include <fstream>
-
-#include <algorithm>
-//#include "d3_transport.h"
-//#include "meta.pb.h"
-#include <signal.h>
-#include <sys/time.h>
-#include <stdlib.h>
+/*
+ * benchmark_client.cpp
+ *
+ *  YCSB style load generator. Loads a number of records, then runs a mix of reads
+ *  (get), updates (put of an existing key) and inserts (put of a new key) from several
+ *  threads, the keys drawn from a uniform, zipfian or latest distribution, and finally
+ *  erases what it wrote. Closed loop by default: each thread sends its next request as
+ *  soon as the last one is answered. With a target rate the threads follow a schedule
+ *  instead and latency is counted from when a request was due, not from when it went out,
+ *  so a stalled server shows up in the percentiles (coordinated omission) rather than
+ *  only as fewer requests.
+ *
+ *  Prints ops, throughput and latency percentiles every interval, and per operation at the
+ *  end, as CSV. The same seed gives the same keys and the same sequence of operations.
+ *
+ *  Usage: ./benchmark_client <num_operations> <memberList> <configFile> <TCP|UDP> [options]
+ *    -t threads       client threads (1)
+ *    -c connections   TCP: connections per server, shared by the threads; UDP: clients,
+ *                     each with its own socket (default: one per thread)
+ *    -k records       records loaded before the run (10000)
+ *    -w a|b|c|d       YCSB workload: a 50% read 50% update zipfian, b 95/5 zipfian (default),
+ *                     c read only zipfian, d 95% read 5% insert latest
+ *    -r -u -i frac    read, update, insert proportions, override the workload's
+ *    -d dist          uniform, zipfian or latest, overrides the workload's
+ *    -v bytes         value size (100)
+ *    -R ops/sec       target rate over all threads (0: closed loop)
+ *    -D seconds       run that long instead of num_operations
+ *    -I seconds       report interval (1)
+ *    -o file          write the per interval CSV there instead of to stdout
+ *    -s seed          (1)
+ *    -n               do not load, the records are there from an earlier run (-K)
+ *    -K               keep the records, do not erase them at the end
+ */
+
 #include <stdio.h>
-#include <list>
-#include <vector>
-#include <netdb.h>
-//#include "zht_util.h" //zhouxb
-//raman-client-replication-s
-//#include "d3_sys_globals.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <error.h>
+#include <sys/prctl.h>
+#include <string>
+#include <vector>
+#include <set>
 #include "lru_cache.h"
+#include "cpp_zhtclient.h"
 
-#include "cpp_zhtclient.h" //zhouxb
 using namespace std;
 
-//int NUM_REPLICAS = 0;
-struct thread_data {
-	vector<struct HostEntity> hostList;
-	list<string> packageList;
-};
-vector<struct HostEntity> hostList;
-list<string> myPackagelist;
-bool TCP;
 int UDP_SOCKET = -1;
 int CACHE_SIZE = 1024;
 LRUCache<string, int> connectionCache(CACHE_SIZE); //initialized here.
 
-void sig_pipe(int signum) {
-	printf("SIGPIPE Caught!\n");
-	signal(SIGPIPE, sig_pipe);
-}
-
-/*
+enum {
+	OP_READ, OP_UPDATE, OP_INSERT, OPS
+};
+const char *opNames[OPS] = { "read", "update", "insert" };
 
- //zhouxb
-
- class ZHTClient {
- public:
- int REPLICATION_TYPE; //serverside or client side. -1:error
- int NUM_REPLICAS; //-1:error
- int protocolType; //1:1TCP; 2:UDP; 3.... Reserved.  -1:error
- vector<struct HostEntity> memberList;
- ZHTClient();
-
- int initialize(string configFilePath, string memberListFilePath);
- struct HostEntity str2Host(string str);
- struct HostEntity str2Host(string str, int &index);
- int str2Sock(string str);
- int str2SockLRU(string str, bool tcp);
- int insert(string str); //following functions should only know string, address where to can be calculated.
- int insert(string str, int sock); // only for test
- int lookup(string str, string &returnStr);
- int lookup(string str, string &returnStr, int sock); // only for test
- int remove(string str);
- int tearDownTCP(bool tcp); //only for TCP
-
- };
- */
+enum {
+	DIST_UNIFORM, DIST_ZIPFIAN, DIST_LATEST
+};
 
-int benchmarkInsert(string cfgFile, string memberList, vector<string> &pkgList,
-		ZHTClient &clientRet, int numTest, int lenString) {
+//latency histogram in usec: exact below 64, then 32 buckets per power of two (3% wide)
+#define HIST_EXACT 64
+#define HIST_SUB 32
+#define HIST_BUCKETS (HIST_EXACT + 40 * HIST_SUB)
 
-//	ZHTClient client;
+struct Histogram {
+	vector<long long> counts;
+	long long total;
+	double sum;
+	long long max;
 
-//	if (clientRet.initialize(cfgFile, memberList) != 0) { //zhouxb
-	if (clientRet.initialize(cfgFile, memberList, TCP) != 0) {
-		cout << "Crap! ZHTClient initialization failed, program exits." << endl;
-		return -1;
+	Histogram() :
+			counts(HIST_BUCKETS, 0), total(0), sum(0), max(0) {
 	}
 
-//	clientRet = client; //reserve this client object for other benchmark(lookup/remove) to use.
-
-//vector<string> pkgList;
-//	int i = 0; //zhouxb
-	for (int i = 0; i < numTest; i++) {
-		Package package, package_ret;
-		package.set_virtualpath(randomString(lenString)); //as key
-		package.set_isdir(true);
-		package.set_replicano(5); //orginal--Note: never let it be nagative!!!
-		package.set_operation(3); // 3 for insert, 1 for look up, 2 for remove
-		package.set_realfullpath(
-				"Some-Real-longer-longer-and-longer-Paths--------");
-		package.add_listitem("item-----2");
-		package.add_listitem("item-----3");
-		package.add_listitem("item-----4");
-		package.add_listitem("item-----5");
-		package.add_listitem("item-----6");
-		string str = package.SerializeAsString();
-//		cout << "package size = " << str.size() << endl;
-//		cout<<"Client.cpp:benchmarkInsert: "<<endl;
-//		cout<<"string: "<<str<<endl;
-//		cout<<"Insert str: "<<str.c_str()<<endl;
-//		cout<<"data(): "<< str.data()<<endl;
-
-		pkgList.push_back(str);
+	static int index(long long v) {
+		if (v < HIST_EXACT)
+			return v < 0 ? 0 : (int) v;
+		int e = 63 - __builtin_clzll((unsigned long long) v); //>= 6
+		int shift = e - 5;
+		int i = HIST_EXACT + (e - 6) * HIST_SUB + (int) (v >> shift) - HIST_SUB;
+		return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
 	}
 
-	double start = 0;
-	double end = 0;
-	start = getTime_msec();
-	int errCount = 0;
-	vector<string>::iterator it;
-	int c = 0;
-//	cout << "-----2" << endl;
-
-//	string sampleString  = *(pkgList.begin());
-//	struct HostEntity aHost = client.str2Host(sampleString);
-	/*
-	 int sock = makeClientSocket("localhost", 50000, 1);
-	 cout<<"client sock = "<< sock<<endl;
-	 reuseSock(sock);
-	 */
-
-	for (it = pkgList.begin(); it != pkgList.end(); it++) {
+	static long long upper(int i) { //largest value of bucket I
+		if (i < HIST_EXACT)
+			return i;
+		int e = (i - HIST_EXACT) / HIST_SUB + 6;
+		long long sub = (i - HIST_EXACT) % HIST_SUB + HIST_SUB;
+		return ((sub + 1) << (e - 5)) - 1;
+	}
 
-//		cout <<"insert count "<< c << endl;
+	void add(long long v) {
+		counts[index(v)]++;
+		total++;
+		sum += v;
+		if (v > max)
+			max = v;
+	}
 
-		c++;
+	void merge(const Histogram &h) {
+		for (int i = 0; i < HIST_BUCKETS; i++)
+			counts[i] += h.counts[i];
+		total += h.total;
+		sum += h.sum;
+		if (h.max > max)
+			max = h.max;
+	}
 
-		string str_ins = *it;
-//cout << "-----1" << endl;
-		int ret = clientRet.insert(str_ins);
-//cout << "-----2" << endl;
-		if (ret < 0) {
+	void reset() {
+		counts.assign(HIST_BUCKETS, 0);
+		total = 0;
+		sum = 0;
+		max = 0;
+	}
 
-			errCount++;
+	long long percentile(double p) const {
+		if (total == 0)
+			return 0;
+		long long rank = (long long) ceil(p / 100 * total);
+		long long seen = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= rank)
+				return upper(i) < max ? upper(i) : max;
 		}
-
+		return max;
 	}
-//close(sock);
-	end = getTime_msec();
+};
 
-	cout << "Inserted " << numTest - errCount << " packages out of " << numTest
-			<< ", cost " << end - start << " ms" << endl;
+//xorshift64*, one per thread so that runs repeat
+struct Random {
+	uint64_t s;
 
-	return 0;
+	Random(uint64_t seed) :
+			s(seed * 0x9e3779b97f4a7c15ULL + 1) {
+	}
 
-}
+	uint64_t next() {
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		return s * 2685821657736338717ULL;
+	}
 
-int benmarkTimeAnalize(string cfgFile, string memberList,
-		vector<string> &pkgList, ZHTClient &clientRet, int numTest,
-		int lenString, string Recordpath) {
-	ZHTClient client;
+	double unit() { //[0, 1)
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+};
 
-//	if (client.initialize(cfgFile, memberList) != 0) {
-	if (client.initialize(cfgFile, memberList, TCP) != 0) {
-		cout << "Crap! ZHTClient initialization failed, program exits." << endl;
-		return -1;
+//zipfian over [0, n) with the YCSB constant 0.99 (Gray et al., "Quickly generating
+//billion-record synthetic databases"). Grows with the inserts, the sum carried on.
+struct Zipfian {
+	long long n;
+	double theta, alpha, zetan, eta;
+
+	void init(long long items) {
+		n = 0;
+		theta = 0.99;
+		alpha = 1 / (1 - theta);
+		zetan = 0;
+		grow(items);
 	}
 
-	double timeRecord[numTest]; //={0};
-//	bzero(timeRecord, sizeof(timeRecord));
-	clientRet = client; //reserve this client object for other benchmark(lookup/remove) to use.
-
-	//vector<string> pkgList;
-	int i = 0;
-	for (i = 0; i < numTest; i++) {
-		Package package, package_ret;
-		package.set_virtualpath(randomString(lenString)); //as key
-		package.set_isdir(true);
-		package.set_replicano(5); //orginal--Note: never let it be nagative!!!
-		package.set_operation(3); // 3 for insert, 1 for look up, 2 for remove
-		package.set_realfullpath(
-				"Some-Real-longer-longer-and-longer-Paths--------");
-		package.add_listitem("item-----1");
-		package.add_listitem("item-----2");
-		package.add_listitem("item-----3");
-		package.add_listitem("item-----4");
-		package.add_listitem("item-----5");
-		string str = package.SerializeAsString();
-//		cout << "package size = " << str.size() << endl;
-//		cout<<"Client.cpp:benchmarkInsert: "<<endl;
-//		cout<<"string: "<<str<<endl;
-//		cout<<"Insert str: "<<str.c_str()<<endl;
-//		cout<<"data(): "<< str.data()<<endl;
-
-		pkgList.push_back(str);
+	void grow(long long items) {
+		for (long long i = n + 1; i <= items; i++)
+			zetan += 1 / pow((double) i, theta);
+		n = items;
+		double zeta2 = 1 + 1 / pow(2.0, theta);
+		eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
 	}
 
-	double start = 0;
-	double end = 0;
-	double istart = 0;
-	double iend = 0;
-	int errCount = 0;
-	vector<string>::iterator it;
-	int c = 0;
-
-	ofstream record;
-	record.open(Recordpath.c_str());
-
-	start = getTime_msec();
-	for (it = pkgList.begin(); it != pkgList.end(); it++) {
-//		cout<<c<<endl;
-		c++;
-		double interval = 0;
-		istart = getTime_usec();
-		int op_ret = client.insert((*it));
-		iend = getTime_usec();
-
-		if (op_ret < 0) {
-			errCount++;
-			interval = -1;
-		} else
-			interval = iend - istart;
-		record << interval << endl;
-		timeRecord[c] = interval;
+	long long next(Random &r) {
+		double u = r.unit();
+		double uz = u * zetan;
+		if (uz < 1)
+			return 0;
+		if (uz < 1 + pow(0.5, theta))
+			return 1;
+		long long v = (long long) (n * pow(eta * u - eta + 1, alpha));
+		return v < n ? v : n - 1;
+	}
+};
 
+static uint64_t fnv64(uint64_t v) {
+	uint64_t h = 14695981039346656037ULL;
+	for (int i = 0; i < 8; i++) {
+		h ^= v & 0xff;
+		h *= 1099511628211ULL;
+		v >>= 8;
 	}
-	end = getTime_msec();
-	record.close();
+	return h;
+}
 
-	cout << "Inserted " << numTest - errCount << " packages out of " << numTest
-			<< ", cost " << end - start << " ms" << endl;
+//settings
+int numOps;
+int threads = 1;
+int conns = 0;
+long long records = 10000;
+double mix[OPS] = { 0.95, 0.05, 0 };
+int dist = DIST_ZIPFIAN;
+int valueSize = 100;
+double rate = 0;
+double duration = 0;
+double interval = 1;
+FILE *csv = stdout;
+uint64_t seed = 1;
+bool load = true;
+bool keep = false;
+
+vector<ZHTClient*> clients;
+Zipfian zipf;
+long long nextKey; //records and inserts started, the keys are 0..nextKey-1
+long long doneKeys; //keys 0..doneKeys-1 are written, reads and updates choose among them
+set<long long> doneAhead; //inserts that returned before an earlier one
+pthread_mutex_t doneMutex = PTHREAD_MUTEX_INITIALIZER;
+double runStart, runEnd; //usec
+
+struct Worker {
+	int id;
+	pthread_t thread;
+	ZHTClient *client;
+	long long first, count; //load and erase: the keys of this thread; run: its operations
+	Random rand;
+	Zipfian zipf; //a copy, grown to doneKeys before each draw
+	pthread_mutex_t mutex; //the reporter takes the interval histogram
+	Histogram latency[OPS]; //from when the request was due
+	Histogram service[OPS]; //from when it went out, differs only with a target rate
+	long long errors[OPS];
+	Histogram tick;
+	long long tickErrors;
+	bool done;
+
+	Worker() :
+			rand(0) {
+	}
+};
+vector<Worker*> workers;
 
-	return 0;
+string keyOf(long long keynum) {
+	char key[40];
+	sprintf(key, "/ycsb/user%llu", (unsigned long long) keynum);
+	return key;
 }
 
-float benchmarkLookup(vector<string> strList, ZHTClient &client) {
-	vector<string>::iterator it;
-
-	/*
-	 for (it = strList.begin(); it != strList.end(); it++) {
-	 Package package;
-	 package.ParseFromString((*it));
-	 package.set_operation(1); // 3 for insert, 1 for look up, 2 for remove
-	 package.set_replicano(3); //5: original, 3 not original
-
-	 strList.erase(it);
-	 string newStr = package.SerializeAsString();
-	 strList.push_back(newStr);
-	 }
-	 */
-	double start = 0;
-	double end = 0;
-	start = getTime_msec();
-	int errCount = 0;
-//cout << "Client: benchmarkLookup: start lookup \n";
-	int c = 0;
-	for (it = strList.begin(); it != strList.end(); it++) {
-		string result;
-//		cout <<"insert count "<< c << endl;
-		c++;
-
-//		cout<<"lookup: "<<i<<endl;
-//		cout << "Client: What I want to find: \n";
-//		cout <<"Lookup: "<< (*it).c_str() << endl;
-		if (client.lookup((*it), result) < 0) {
-
-			errCount++;
-		} else if (result.empty()) { //empty string
-			errCount++;
-		}
-//		cout << "Client: What I get: ";
-//		cout << result.c_str() << endl;
+//an insert returned, failed or not: move doneKeys past every key finished without a gap
+void keyDone(long long key) {
+	pthread_mutex_lock(&doneMutex);
+	doneAhead.insert(key);
+	while (!doneAhead.empty() && *doneAhead.begin() == doneKeys) {
+		doneAhead.erase(doneAhead.begin());
+		doneKeys++;
 	}
+	pthread_mutex_unlock(&doneMutex);
+}
 
-	end = getTime_msec();
+long long chooseKey(Worker *w) {
+	pthread_mutex_lock(&doneMutex);
+	long long count = doneKeys;
+	pthread_mutex_unlock(&doneMutex);
+	if (dist != DIST_UNIFORM && count > w->zipf.n)
+		w->zipf.grow(count);
+	switch (dist) {
+	case DIST_UNIFORM:
+		return (long long) (w->rand.next() % (uint64_t) count);
+	case DIST_LATEST:
+		return count - 1 - w->zipf.next(w->rand);
+	default: //scrambled, so that the popular keys land on different servers
+		return (long long) (fnv64(w->zipf.next(w->rand)) % (uint64_t) w->zipf.n);
+	}
+}
 
-	cout << "Lookup " << strList.size() - errCount << " packages out of "
-			<< strList.size() << ", cost " << end - start << " ms" << endl;
-	return 0;
+void *loadThread(void *arg) {
+	Worker *w = (Worker*) arg;
+	string value(valueSize, 'v');
+	for (long long k = w->first; k < w->first + w->count; k++)
+		if (w->client->put(keyOf(k), value) != 0)
+			w->errors[OP_INSERT]++;
+	return NULL;
 }
 
-float benchmarkRemove(vector<string> strList, ZHTClient &client) {
-	vector<string>::iterator it;
+void *eraseThread(void *arg) {
+	Worker *w = (Worker*) arg;
+	for (long long k = w->first; k < w->first + w->count; k++)
+		w->client->erase(keyOf(k));
+	return NULL;
+}
 
-	for (it = strList.begin(); it != strList.end(); it++) {
-		Package package;
-		package.ParseFromString((*it));
-		package.set_operation(2); // 3 for insert, 1 for look up, 2 for remove
-		package.set_replicano(5); //5: original, 3 not original
+void *runThread(void *arg) {
+	Worker *w = (Worker*) arg;
+	prctl(PR_SET_TIMERSLACK, 1UL); //else sleeps overshoot by 50 usec, counted as latency
+	string value(valueSize, 'v');
+	string got;
+	double period = rate > 0 ? threads * 1E6 / rate : 0;
+	for (long long i = 0; duration > 0 || i < w->count; i++) {
+		double due = period > 0 ? runStart + w->id * period / threads + i * period :
+						getTime_usec();
+		if (duration > 0 && due >= runEnd)
+			break;
+		double now = getTime_usec();
+		if (due > now)
+			usleep((useconds_t) (due - now));
+
+		double pick = w->rand.unit();
+		int op = pick < mix[OP_READ] ? OP_READ :
+					pick < mix[OP_READ] + mix[OP_UPDATE] ? OP_UPDATE : OP_INSERT;
+		for (int k = 0; k < valueSize; k += 8) //values differ from put to put
+			value[k] = 'a' + (char) (w->rand.next() % 26);
+		double sent = getTime_usec();
+		int status;
+		if (op == OP_READ)
+			status = w->client->get(keyOf(chooseKey(w)), got);
+		else if (op == OP_UPDATE)
+			status = w->client->put(keyOf(chooseKey(w)), value);
+		else {
+			long long key = __sync_fetch_and_add(&nextKey, 1);
+			status = w->client->put(keyOf(key), value);
+			keyDone(key);
+		}
+		double end = getTime_usec();
+
+		pthread_mutex_lock(&w->mutex);
+		w->latency[op].add((long long) (end - (period > 0 ? due : sent)));
+		w->service[op].add((long long) (end - sent));
+		w->tick.add((long long) (end - (period > 0 ? due : sent)));
+		if (status != 0) {
+			w->errors[op]++;
+			w->tickErrors++;
+		}
+		pthread_mutex_unlock(&w->mutex);
+	}
+	pthread_mutex_lock(&w->mutex);
+	w->done = true;
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
 
-		strList.erase(it);
-		string newStr = package.SerializeAsString();
-		strList.push_back(newStr);
+//split N keys or operations over the threads and run BODY on each
+void runAll(long long first, long long n, void *(*body)(void*)) {
+	for (int t = 0; t < threads; t++) {
+		Worker *w = workers[t];
+		w->first = first + n / threads * t + (t < n % threads ? t : n % threads);
+		w->count = n / threads + (t < n % threads ? 1 : 0);
+		pthread_create(&w->thread, NULL, body, w);
 	}
+	for (int t = 0; t < threads; t++)
+		pthread_join(workers[t]->thread, NULL);
+}
 
-	double start = 0;
-	double end = 0;
-	start = getTime_msec();
-	int errCount = 0;
-	int c = 0;
-	for (it = strList.begin(); it != strList.end(); it++) {
-		string result;
-		c++;
-//		cout <<"Remove count "<< c << endl;
-
-//		cout <<"Remove: "<< (*it).c_str() << endl;
-		if (client.remove((*it)) < 0) {
-			errCount++;
-		}
+void printStats(const char *name, const Histogram &h, long long errors, double sec) {
+	printf("%s,%lld,%lld,%.0f,%.1f,%lld,%lld,%lld,%lld,%lld\n", name, h.total, errors,
+			h.total / sec, h.total > 0 ? h.sum / h.total : 0.0, h.percentile(50),
+			h.percentile(90), h.percentile(99), h.percentile(99.9), h.max);
+}
 
+void run() {
+	printf("# run: %d threads, %s loop%s\n", threads, rate > 0 ? "open" : "closed",
+			rate > 0 ? ", latency from when each request was due" : "");
+	fprintf(csv, "sec,ops,ops_per_sec,errors,avg_usec,p50_usec,p90_usec,p99_usec,"
+			"p999_usec,max_usec\n");
+	fflush(stdout);
+	runStart = getTime_usec() + 1000;
+	runEnd = runStart + duration * 1E6;
+	for (int t = 0; t < threads; t++) {
+		Worker *w = workers[t];
+		w->count = numOps / threads + (t < numOps % threads ? 1 : 0);
+		pthread_create(&w->thread, NULL, runThread, w);
 	}
 
-	end = getTime_msec();
+	double last = runStart;
+	bool running = true;
+	while (running) {
+		double wake = last + interval * 1E6;
+		while (getTime_usec() < wake) {
+			usleep(10000);
+			bool all = true;
+			for (int t = 0; t < threads; t++) {
+				pthread_mutex_lock(&workers[t]->mutex);
+				all = all && workers[t]->done;
+				pthread_mutex_unlock(&workers[t]->mutex);
+			}
+			if (all) {
+				running = false;
+				break;
+			}
+		}
+		Histogram tick;
+		long long errors = 0;
+		for (int t = 0; t < threads; t++) {
+			pthread_mutex_lock(&workers[t]->mutex);
+			tick.merge(workers[t]->tick);
+			errors += workers[t]->tickErrors;
+			workers[t]->tick.reset();
+			workers[t]->tickErrors = 0;
+			pthread_mutex_unlock(&workers[t]->mutex);
+		}
+		double now = getTime_usec();
+		double sec = (now - last) / 1E6;
+		fprintf(csv, "%.1f,%lld,%.0f,%lld,%.1f,%lld,%lld,%lld,%lld,%lld\n",
+				(now - runStart) / 1E6, tick.total, tick.total / sec, errors,
+				tick.total > 0 ? tick.sum / tick.total : 0.0, tick.percentile(50),
+				tick.percentile(90), tick.percentile(99), tick.percentile(99.9), tick.max);
+		fflush(csv);
+		last = now;
+	}
+	for (int t = 0; t < threads; t++)
+		pthread_join(workers[t]->thread, NULL);
+	double sec = (getTime_usec() - runStart) / 1E6;
+
+	printf("op,count,errors,ops_per_sec,avg_usec,p50_usec,p90_usec,p99_usec,p999_usec,"
+			"max_usec\n");
+	Histogram all;
+	long long allErrors = 0;
+	for (int op = 0; op < OPS; op++) {
+		Histogram h, s;
+		long long errors = 0;
+		for (int t = 0; t < threads; t++) {
+			h.merge(workers[t]->latency[op]);
+			s.merge(workers[t]->service[op]);
+			errors += workers[t]->errors[op];
+		}
+		if (h.total == 0)
+			continue;
+		printStats(opNames[op], h, errors, sec);
+		if (rate > 0)
+			printStats((string(opNames[op]) + "_service").c_str(), s, errors, sec);
+		all.merge(h);
+		allErrors += errors;
+	}
+	printStats("all", all, allErrors, sec);
+}
 
-	cout << "Remove " << strList.size() - errCount << " packages out of "
-			<< strList.size() << ", cost " << end - start << " ms" << endl;
-	return 0;
+int parseArgs(int argc, char *argv[]) {
+	char workload = 'b';
+	int distSet = -1;
+	double mixSet[OPS] = { -1, -1, -1 };
+	int c;
+	optind = 5;
+	while ((c = getopt(argc, argv, "t:c:k:w:r:u:i:d:v:R:D:I:o:s:nK")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'k':
+			records = atoll(optarg);
+			break;
+		case 'w':
+			workload = optarg[0];
+			break;
+		case 'r':
+			mixSet[OP_READ] = atof(optarg);
+			break;
+		case 'u':
+			mixSet[OP_UPDATE] = atof(optarg);
+			break;
+		case 'i':
+			mixSet[OP_INSERT] = atof(optarg);
+			break;
+		case 'd':
+			distSet = !strcmp(optarg, "uniform") ? DIST_UNIFORM :
+						!strcmp(optarg, "latest") ? DIST_LATEST :
+						!strcmp(optarg, "zipfian") ? DIST_ZIPFIAN : -2;
+			break;
+		case 'v':
+			valueSize = atoi(optarg);
+			break;
+		case 'R':
+			rate = atof(optarg);
+			break;
+		case 'D':
+			duration = atof(optarg);
+			break;
+		case 'I':
+			interval = atof(optarg);
+			break;
+		case 'o':
+			csv = fopen(optarg, "w");
+			if (csv == NULL) {
+				perror(optarg);
+				return -1;
+			}
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			load = false;
+			break;
+		case 'K':
+			keep = true;
+			break;
+		default:
+			return -1;
+		}
+	}
 
+	switch (workload) {
+	case 'a':
+		mix[OP_READ] = 0.5, mix[OP_UPDATE] = 0.5, mix[OP_INSERT] = 0;
+		break;
+	case 'b':
+		break;
+	case 'c':
+		mix[OP_READ] = 1, mix[OP_UPDATE] = 0, mix[OP_INSERT] = 0;
+		break;
+	case 'd':
+		mix[OP_READ] = 0.95, mix[OP_UPDATE] = 0, mix[OP_INSERT] = 0.05;
+		dist = DIST_LATEST;
+		break;
+	default:
+		return -1;
+	}
+	if (mixSet[OP_READ] >= 0 || mixSet[OP_UPDATE] >= 0 || mixSet[OP_INSERT] >= 0)
+		for (int op = 0; op < OPS; op++)
+			mix[op] = mixSet[op] > 0 ? mixSet[op] : 0;
+	double total = mix[OP_READ] + mix[OP_UPDATE] + mix[OP_INSERT];
+	if (total <= 0 || distSet == -2)
+		return -1;
+	for (int op = 0; op < OPS; op++)
+		mix[op] /= total;
+	if (distSet >= 0)
+		dist = distSet;
+	if (threads <= 0 || records <= 0 || valueSize <= 0 || interval <= 0)
+		return -1;
+	if (conns <= 0)
+		conns = threads;
 	return 0;
 }
-//This is an example.
 
-int benchmarkALL(int numTest, int strLen) { //103+length
-//	int para = strLen - 128;
-	return 0;
-}
-int main(int argc, char* argv[]) {
-//	cout << "Usage: ./client <num_operations> <memberList> <configFile>"<< endl;
-	/*//	For BG/P
-	 const string cmd = "cat /proc/personality.sh | grep BG_PSETORG";
-	 string torusID = executeShell(cmd);
-	 torusID.resize(torusID.size() - 1);
-	 int pid = getpid();
-	 unsigned int v = myhash(torusID.c_str(), 1000000) + pid;
-	 //cout<<"client: pid = "<<pid<<endl;
-
-	 //cout<<"Client random n = "<<v<<endl;
-	 srand(v);
-	 */
-	char* isTCP = argv[4];
-//	cout<<"Protocol = "<<isTCP<<endl;
-	if (!strcmp("TCP", isTCP)) {
-		TCP = true;
-	} else {
-		TCP = false;
+int main(int argc, char *argv[]) {
+	if (argc < 5 || parseArgs(argc, argv) != 0) {
+		printf("Usage: %s <num_operations> <memberList> <configFile> <TCP|UDP> "
+				"[-t threads] [-c connections] [-k records] [-w a|b|c|d] [-r read] "
+				"[-u update] [-i insert] [-d uniform|zipfian|latest] [-v value_size] "
+				"[-R ops_per_sec] [-D seconds] [-I seconds] [-o csv_file] [-s seed] "
+				"[-n] [-K]\n", argv[0]);
+		return 1;
+	}
+	numOps = atoi(argv[1]);
+	bool tcp = !strcmp("TCP", argv[4]);
+	signal(SIGPIPE, SIG_IGN);
+
+	//TCP: one client, its pool holds the connections; UDP: a client serializes its
+	//calls on its socket, so the threads share CONNS of them
+	for (int i = 0; i < (tcp ? 1 : conns); i++) {
+		ZHTClient *client = new ZHTClient();
+		if (client->initialize(argv[3], argv[2], tcp) != 0) {
+			printf("ZHTClient initialization failed, program exits.\n");
+			return 1;
+		}
+		if (tcp)
+			client->setPoolSize(conns);
+		clients.push_back(client);
+	}
+	for (int t = 0; t < threads; t++) {
+		Worker *w = new Worker();
+		w->id = t;
+		w->client = clients[t % clients.size()];
+		w->rand = Random(seed * 1000003 + t);
+		pthread_mutex_init(&w->mutex, NULL);
+		memset(w->errors, 0, sizeof(w->errors));
+		w->tickErrors = 0;
+		w->done = false;
+		workers.push_back(w);
+	}
+	zipf.init(records);
+	for (int t = 0; t < threads; t++)
+		workers[t]->zipf = zipf;
+	nextKey = doneKeys = records;
+	printf("# %s, %d threads, %d %s, %lld records of %d bytes, read %.2f update %.2f "
+			"insert %.2f, %s, seed %llu\n", tcp ? "TCP" : "UDP", threads, conns,
+			tcp ? "connections per server" : "clients", records, valueSize, mix[OP_READ],
+			mix[OP_UPDATE], mix[OP_INSERT],
+			dist == DIST_UNIFORM ? "uniform" : dist == DIST_LATEST ? "latest" : "zipfian",
+			(unsigned long long) seed);
+
+	if (load) {
+		double start = getTime_usec();
+		runAll(0, records, loadThread);
+		double sec = (getTime_usec() - start) / 1E6;
+		long long errors = 0;
+		for (int t = 0; t < threads; t++) {
+			errors += workers[t]->errors[OP_INSERT];
+			workers[t]->errors[OP_INSERT] = 0;
+		}
+		printf("# load: %lld records in %.2f sec, %.0f ops/sec, %lld errors\n", records,
+				sec, records / sec, errors);
 	}
 
-	int numOper = atoi(argv[1]);
-//cout<<"numOper = "<<numOper<<endl;	
-	string cfgFile(argv[3]);
-//cout<<"cfgFile = "<<cfgFile<<endl;
-	string memberList(argv[2]);
-//cout<<"memberList: "<<memberList<<endl;
-	vector<string> pkgList;
-	ZHTClient testClient;
-//	int pid = getpid();
-	char* tmpStr;
-	stringstream ss; //create a stringstream
-//	ss << pid;
-
-//	string recordFile = "record." + ss.str();
-//	benmarkTimeAnalize(cfgFile, memberList, pkgList, testClient, numOper, 15, recordFile);
-//cout<<"start to insert..."<<endl;
-	benchmarkInsert(cfgFile, memberList, pkgList, testClient, numOper, 15); //25fro 128bytes.
-//cout << "Client:main, start lookup \n";
-	benchmarkLookup(pkgList, testClient);
-	benchmarkRemove(pkgList, testClient);
-//	testClient.tearDownTCP(TCP);
-	testClient.tearDownTCP(); //zhouxb
-	return 0;
+	run();
 
+	if (!keep) {
+		double start = getTime_usec();
+		runAll(0, nextKey, eraseThread);
+		printf("# erase: %lld records in %.2f sec\n", nextKey,
+				(getTime_usec() - start) / 1E6);
+	}
+	if (csv != stdout)
+		fclose(csv);
+	for (size_t i = 0; i < clients.size(); i++)
+		clients[i]->tearDownTCP();
+	return 0;
 }
-
@@ -0,0 +1,91 @@
+/*
+ * benchmark_embedded.cpp
+ *
+ *  Starts a ZHT server inside this process (zhtServerStart) and times put/get/erase on
+ *  keys it owns twice: through the in-process path, then with that path turned off, over a
+ *  loopback connection to the very same server. Prints the average usec per operation.
+ *  Any other servers of the member list must be running.
+ *
+ *  Usage: ./benchmark_embedded <port> <memberList> <configFile> [ops]
+ *         port must be this host's entry in the member list, ops defaults to 100000.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "lru_cache.h"
+#include "cpp_zhtclient.h"
+
+using namespace std;
+
+int UDP_SOCKET = -1;
+int CACHE_SIZE = 1024;
+LRUCache<string, int> connectionCache(CACHE_SIZE);
+
+double now_usec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec * 1E6 + tp.tv_usec;
+}
+
+void run(ZHTClient &client, const vector<string> &keys, const char *path) {
+	string value(64, 'v'), got;
+	int errors = 0;
+	double start = now_usec();
+	for (size_t i = 0; i < keys.size(); i++)
+		if (client.put(keys[i], value) != 0)
+			errors++;
+	double put = now_usec();
+	for (size_t i = 0; i < keys.size(); i++)
+		if (client.get(keys[i], got) != 0)
+			errors++;
+	double get = now_usec();
+	for (size_t i = 0; i < keys.size(); i++)
+		if (client.erase(keys[i]) != 0)
+			errors++;
+	double erase = now_usec();
+	int n = keys.size();
+	printf("%-10s put %8.2f  get %8.2f  erase %8.2f usec/op, %d errors\n", path,
+			(put - start) / n, (get - put) / n, (erase - get) / n, errors);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		printf("Usage: %s <port> <memberList> <configFile> [ops]\n", argv[0]);
+		return 1;
+	}
+	int port = atoi(argv[1]);
+	int ops = argc > 4 ? atoi(argv[4]) : 100000;
+
+	if (zhtServerStart(port, argv[2], argv[3], true) != 0) {
+		printf("cannot start the embedded server\n");
+		return 1;
+	}
+	ZHTClient client;
+	if (client.initialize(argv[3], argv[2], true) != 0) {
+		printf("cannot initialize the client\n");
+		return 1;
+	}
+
+	//only keys the embedded server owns, the others would measure the remote servers
+	vector<string> keys;
+	int n = client.memberList.size();
+	for (int i = 0; (int) keys.size() < ops; i++) {
+		char key[32];
+		sprintf(key, "/embedded/%d", i);
+		if (zhtIsLocal(client.memberList.at(myhash(key, n))))
+			keys.push_back(key);
+		if (keys.empty() && i > 1000) {
+			printf("port %d is not in the member list\n", port);
+			return 1;
+		}
+	}
+
+	run(client, keys, "in-process");
+	zhtSetLocalServer("", -1, NULL);
+	run(client, keys, "loopback");
+	client.tearDownTCP();
+	return 0;
+}
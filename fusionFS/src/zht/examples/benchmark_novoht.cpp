@@ -0,0 +1,112 @@
+/*
+ * benchmark_novoht.cpp
+ *
+ *  Throughput of NoVoHT under concurrent access: preload KEYS entries into a small table and
+ *  report the insert latency percentiles while it grows, then let 1, 2, 4 ... up to
+ *  MAX_THREADS threads run a get/put mix on random keys and report ops/sec. With a db file
+ *  MAX_THREADS threads then run the same mix on a persistent table once per durability level.
+ *
+ *  Usage: ./benchmark_novoht <keys> <ops_per_thread> <max_threads> [get_percent [db_file]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include "novoht.h"
+
+using namespace std;
+
+NoVoHT *table;
+vector<string> keys;
+int numOps;
+int getPercent;
+
+double now_sec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec / 1E6;
+}
+
+void *work(void *arg) {
+	unsigned int seed = (unsigned long) arg * 104729 + 7;
+	string value;
+	for (int i = 0; i < numOps; i++) {
+		const string &key = keys[rand_r(&seed) % keys.size()];
+		if ((int) (rand_r(&seed) % 100) < getPercent)
+			table->get(key, value);
+		else
+			table->put(key, key);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		cout << "Usage: " << argv[0]
+				<< " <keys> <ops_per_thread> <max_threads> [get_percent [db_file]]"
+				<< endl;
+		return 1;
+	}
+	int numKeys = atoi(argv[1]);
+	numOps = atoi(argv[2]);
+	int maxThreads = atoi(argv[3]);
+	getPercent = argc > 4 ? atoi(argv[4]) : 90;
+	string file = argc > 5 ? argv[5] : "";
+
+	//start small so the preload goes through every resize
+	table = new NoVoHT("", 1024, 1000, 0.7);
+	char buf[32];
+	vector<double> latency(numKeys);
+	for (int i = 0; i < numKeys; i++) {
+		sprintf(buf, "/bench/key-%d", i);
+		keys.push_back(buf);
+		double start = now_sec();
+		table->put(buf, buf);
+		latency[i] = now_sec() - start;
+	}
+	sort(latency.begin(), latency.end());
+	printf("insert latency growing to %d keys (usec): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+			numKeys, latency[numKeys / 2] * 1E6, latency[numKeys * 99 / 100] * 1E6,
+			latency[(long) numKeys * 999 / 1000] * 1E6, latency[numKeys - 1] * 1E6);
+
+	cout << "threads\tops/sec\t(" << getPercent << "% get, " << numKeys
+			<< " keys)" << endl;
+	for (int n = 1; n <= maxThreads; n *= 2) {
+		vector<pthread_t> threads(n);
+		double start = now_sec();
+		for (long t = 0; t < n; t++)
+			pthread_create(&threads[t], NULL, work, (void*) t);
+		for (int t = 0; t < n; t++)
+			pthread_join(threads[t], NULL);
+		double elapsed = now_sec() - start;
+		printf("%d\t%.0f\n", n, (double) n * numOps / elapsed);
+	}
+	delete table;
+	if (file.empty())
+		return 0;
+
+	const char *levels[] = { "memory", "async", "group" };
+	cout << "durability\tops/sec\t(" << maxThreads << " threads, " << file << ")" << endl;
+	for (int level = NOVOHT_SYNC_MEMORY; level <= NOVOHT_SYNC_GROUP; level++) {
+		unlink(file.c_str());
+		unlink((file + ".snap").c_str());
+		table = new NoVoHT(file, numKeys * 2, numKeys * 4, 0.7);
+		table->setDurability(level);
+		vector<pthread_t> threads(maxThreads);
+		double start = now_sec();
+		for (long t = 0; t < maxThreads; t++)
+			pthread_create(&threads[t], NULL, work, (void*) t);
+		for (int t = 0; t < maxThreads; t++)
+			pthread_join(threads[t], NULL);
+		double elapsed = now_sec() - start;
+		printf("%s\t\t%.0f\n", levels[level], (double) maxThreads * numOps / elapsed);
+		delete table;
+	}
+	return 0;
+}
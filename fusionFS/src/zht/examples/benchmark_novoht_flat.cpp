@@ -0,0 +1,109 @@
+/*
+ * benchmark_novoht_flat.cpp
+ *
+ *  Chained NoVoHT against the open addressing NoVoHTFlat: insert, hit, miss and remove
+ *  throughput plus resident bytes per entry. Each table runs in its own child process so
+ *  the memory numbers don't mix.
+ *
+ *  Usage: ./benchmark_novoht_flat [entries] [value_size]     (default 10000000 entries, 16 bytes)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "novoht.h"
+#include "novoht_flat.h"
+
+using namespace std;
+
+int numKeys;
+int valueSize;
+
+double now_sec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec / 1E6;
+}
+
+long rss_bytes() {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+string key_of(int i) {
+	char buf[32];
+	sprintf(buf, "/bench/key-%d", i);
+	return buf;
+}
+
+template<class Table>
+void run(const char *name, Table *table) {
+	string value(valueSize, 'v');
+	string got;
+	vector<int> order(numKeys);
+	unsigned int seed = 42;
+	for (int i = 0; i < numKeys; i++)
+		order[i] = rand_r(&seed) % numKeys;
+
+	long before = rss_bytes();
+	double start = now_sec();
+	for (int i = 0; i < numKeys; i++)
+		table->put(key_of(i), value);
+	double insert = now_sec() - start;
+	long bytes = rss_bytes() - before;
+
+	start = now_sec();
+	int found = 0;
+	for (int i = 0; i < numKeys; i++)
+		found += table->get(key_of(order[i]), got) == 0;
+	double hit = now_sec() - start;
+
+	start = now_sec();
+	for (int i = 0; i < numKeys; i++)
+		found += table->get(key_of(numKeys + order[i]), got) == 0;
+	double miss = now_sec() - start;
+
+	start = now_sec();
+	for (int i = 0; i < numKeys; i += 2)
+		table->remove(key_of(i));
+	double rem = now_sec() - start;
+
+	if (found != numKeys)
+		fprintf(stderr, "%s: found %d of %d keys\n", name, found, numKeys);
+	printf("%-8s %12.0f %12.0f %12.0f %12.0f %10.1f\n", name, numKeys / insert,
+			numKeys / hit, numKeys / miss, (numKeys / 2) / rem,
+			(double) bytes / numKeys);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	numKeys = argc > 1 ? atoi(argv[1]) : 10000000;
+	valueSize = argc > 2 ? atoi(argv[2]) : 16;
+
+	printf("%d entries, %d byte values, ops/sec\n", numKeys, valueSize);
+	printf("%-8s %12s %12s %12s %12s %10s\n", "table", "insert", "get hit",
+			"get miss", "remove", "bytes/ent");
+	fflush(stdout);
+
+	if (fork() == 0) {
+		run("chained", new NoVoHT("", numKeys, 1000, 0.7));
+		_exit(0);
+	}
+	wait(NULL);
+	if (fork() == 0) {
+		run("flat", new NoVoHTFlat(numKeys));
+		_exit(0);
+	}
+	wait(NULL);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * benchmark_storage.cpp
+ *
+ *  Runs one workload against every storage engine the server can use (STORAGE_ENGINE in
+ *  zht.cfg): insert, lookup hit, lookup miss, overwrite, prefix scan and remove, reported in
+ *  ops/sec together with resident bytes per pair. Each engine runs in its own child process.
+ *
+ *  Usage: ./benchmark_storage [pairs] [value_size] [db_file]
+ *         default 1000000 pairs of 128 bytes; with db_file novoht also writes its log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+
+using namespace std;
+
+const int SCANS = 20;
+const int SCAN_LIMIT = 100;
+
+int numKeys;
+int valueSize;
+
+double now_sec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec / 1E6;
+}
+
+long rss_bytes() {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+//paths spread over 1000 directories, like the metadata the server holds
+string key_of(int i) {
+	char buf[64];
+	sprintf(buf, "/fusionfs/dir-%03d/file-%d", i % 1000, i);
+	return buf;
+}
+
+void run(StorageEngine *engine) {
+	string value(valueSize, 'v');
+	string got;
+	vector<int> order(numKeys);
+	unsigned int seed = 42;
+	for (int i = 0; i < numKeys; i++)
+		order[i] = rand_r(&seed) % numKeys;
+
+	long before = rss_bytes();
+	double start = now_sec();
+	for (int i = 0; i < numKeys; i++)
+		engine->put(key_of(i), value);
+	double insert = now_sec() - start;
+	long bytes = rss_bytes() - before;
+
+	start = now_sec();
+	int found = 0;
+	for (int i = 0; i < numKeys; i++)
+		found += engine->get(key_of(order[i]), got) == 0;
+	double hit = now_sec() - start;
+
+	start = now_sec();
+	for (int i = 0; i < numKeys; i++)
+		found += engine->get(key_of(numKeys + order[i]), got) == 0;
+	double miss = now_sec() - start;
+
+	start = now_sec();
+	for (int i = 0; i < numKeys; i++)
+		engine->put(key_of(order[i]), got);
+	double update = now_sec() - start;
+
+	start = now_sec();
+	vector<pair<string, string> > out;
+	char prefix[32];
+	for (int i = 0; i < SCANS; i++) {
+		sprintf(prefix, "/fusionfs/dir-%03d/", i * 37 % 1000);
+		engine->scan(prefix, "", SCAN_LIMIT, out);
+	}
+	double scan = now_sec() - start;
+
+	start = now_sec();
+	for (int i = 0; i < numKeys; i += 2)
+		engine->remove(key_of(i));
+	double rem = now_sec() - start;
+
+	if (found != numKeys)
+		fprintf(stderr, "%s: found %d of %d keys\n", engine->name(), found,
+				numKeys);
+	printf("%-7s %11.0f %11.0f %11.0f %11.0f %11.1f %11.0f %9.1f\n",
+			engine->name(), numKeys / insert, numKeys / hit, numKeys / miss,
+			numKeys / update, SCANS / scan, (numKeys / 2) / rem,
+			(double) bytes / numKeys);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	valueSize = argc > 2 ? atoi(argv[2]) : 128;
+	string file = argc > 3 ? argv[3] : "";
+	const char *engines[] = { "novoht", "flat", "map", "cstr" };
+
+	printf("%d pairs, %d byte values, ops/sec\n", numKeys, valueSize);
+	printf("%-7s %11s %11s %11s %11s %11s %11s %9s\n", "engine", "insert",
+			"get hit", "get miss", "overwrite", "scan", "remove", "bytes/ent");
+	fflush(stdout);
+	for (int e = 0; e < 4; e++) {
+		if (fork() == 0) {
+			StorageEngine *engine = createStorageEngine(engines[e], file);
+			run(engine);
+			delete engine;
+			_exit(0);
+		}
+		wait(NULL);
+		if (!file.empty()) {
+			unlink(file.c_str());
+			unlink((file + ".snap").c_str());
+		}
+	}
+	return 0;
+}
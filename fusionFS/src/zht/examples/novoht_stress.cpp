@@ -0,0 +1,164 @@
+/*
+ * novoht_stress.cpp
+ *
+ *  Multi-threaded correctness test for NoVoHT: every thread works on its own keys (checked
+ *  against a private copy) and on a set of shared keys (checked for torn values), starting
+ *  from a tiny table so that resizes keep happening underneath. With a db file the table is
+ *  reopened afterwards and must come back from the log unchanged. A cache size runs the
+ *  table in spill mode, values then live in the value files and a small cache.
+ *
+ *  Usage: ./novoht_stress <threads> <ops_per_thread> [db_file [cache_bytes]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glob.h>
+#include <map>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include "novoht.h"
+
+using namespace std;
+
+const int PRIVATE_KEYS = 2000; //per thread
+const int SHARED_KEYS = 200;
+
+NoVoHT *table;
+int numOps;
+int failures = 0;
+
+struct worker {
+	int id;
+	pthread_t thread;
+	map<string, string> mine; //what the table must hold for our private keys
+};
+
+string itos(int i) {
+	stringstream ss;
+	ss << i;
+	return ss.str();
+}
+
+void fail(const string &what) {
+	__sync_fetch_and_add(&failures, 1);
+	cerr << "FAIL: " << what << endl;
+}
+
+void *work(void *arg) {
+	struct worker *w = (struct worker*) arg;
+	unsigned int seed = w->id * 7919 + 1;
+	string value;
+
+	for (int i = 0; i < numOps; i++) {
+		int r = rand_r(&seed) % 100;
+		if (r < 70) { //private key
+			string key = "t" + itos(w->id) + "-" + itos(rand_r(&seed) % PRIVATE_KEYS);
+			int op = rand_r(&seed) % 3;
+			if (op == 0) {
+				string val = key + "=" + itos(i);
+				if (i % 7 == 0) //long binary values must survive the log
+					val += string(400, '\t') + string(1, '\0') + "end";
+				table->put(key, val);
+				w->mine[key] = val;
+			} else if (op == 1) {
+				int found = table->get(key, value);
+				map<string, string>::iterator it = w->mine.find(key);
+				if (it == w->mine.end() ? found == 0 : (found != 0 || value != it->second))
+					fail("lookup of " + key);
+			} else {
+				int ret = table->remove(key);
+				bool had = w->mine.erase(key) > 0;
+				if (had != (ret == 0))
+					fail("remove of " + key);
+			}
+		} else { //shared key, everybody writes it
+			string key = "shared-" + itos(rand_r(&seed) % SHARED_KEYS);
+			if (r < 85) {
+				table->put(key, key + ":" + itos(w->id));
+			} else if (table->get(key, value) == 0) {
+				if (value.compare(0, key.size() + 1, key + ":") != 0)
+					fail("torn value " + value + " for " + key);
+			}
+		}
+	}
+	return NULL;
+}
+
+//shared is filled on the first call and compared on the next one
+void verify(struct worker *workers, int numThreads, map<string, string> &shared,
+		size_t expected) {
+	string value;
+	for (int t = 0; t < numThreads; t++) {
+		map<string, string>::iterator it;
+		for (it = workers[t].mine.begin(); it != workers[t].mine.end(); it++) {
+			if (table->get(it->first, value) != 0 || value != it->second)
+				fail("final content of " + it->first);
+		}
+	}
+	bool first = shared.empty();
+	for (int k = 0; k < SHARED_KEYS; k++) {
+		string key = "shared-" + itos(k);
+		if (table->get(key, value) != 0)
+			continue;
+		expected++;
+		if (first)
+			shared[key] = value;
+		else if (shared[key] != value)
+			fail("reloaded content of " + key);
+	}
+	if ((size_t) table->getSize() != expected)
+		fail("size " + itos(table->getSize()) + ", expected " + itos(expected));
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		cout << "Usage: " << argv[0]
+				<< " <threads> <ops_per_thread> [db_file [cache_bytes]]" << endl;
+		return 1;
+	}
+	int numThreads = atoi(argv[1]);
+	numOps = atoi(argv[2]);
+	string file = argc > 3 ? argv[3] : "";
+	long cache = argc > 4 ? atol(argv[4]) : 0;
+	if (!file.empty()) { //the checks assume an empty table
+		glob_t g;
+		unlink(file.c_str());
+		if (glob((file + ".*").c_str(), 0, NULL, &g) == 0)
+			for (size_t i = 0; i < g.gl_pathc; i++)
+				unlink(g.gl_pathv[i]);
+		globfree(&g);
+	}
+
+	table = new NoVoHT(file, 64, 1000, 0.7, cache);
+	struct worker *workers = new worker[numThreads];
+	for (int t = 0; t < numThreads; t++) {
+		workers[t].id = t;
+		pthread_create(&workers[t].thread, NULL, work, &workers[t]);
+	}
+	size_t expected = 0;
+	for (int t = 0; t < numThreads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		expected += workers[t].mine.size();
+	}
+
+	//after the dust settles the table must match every private copy exactly.
+	map<string, string> shared;
+	verify(workers, numThreads, shared, expected);
+	if (!file.empty()) {
+		delete table;
+		table = new NoVoHT(file, 64, 1000, 0.7, cache);
+		verify(workers, numThreads, shared, expected);
+	}
+
+	cout << (failures == 0 ? "PASS" : "FAIL") << ": " << numThreads
+			<< " threads x " << numOps << " ops, " << table->getSize()
+			<< " keys, capacity " << table->getCap() << ", " << failures
+			<< " failures" << endl;
+	delete table;
+	delete[] workers;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+/*
+ * replica_roundtrip.cpp
+ *
+ *  Replication check for running servers whose config has NUM_REPLICAS > 0: puts keys with
+ *  empty values and with values holding NULs, then asks every server directly (a lookup
+ *  with replicano 3 is answered from its own table) and expects each key on its own
+ *  server and its NUM_REPLICAS replicas with the exact bytes. After erase no server may
+ *  have it any more. Replicas are updated without waiting, so every check is retried for
+ *  up to two seconds before it counts as a failure. c_zht_get_std must refuse a value that
+ *  does not fit into the room it is given.
+ *
+ *  Usage: ./replica_roundtrip <memberList> <configFile> [keys]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <iostream>
+#include "lru_cache.h"
+#include "cpp_zhtclient.h"
+#include "c_zhtclientStd.h"
+#include "net_util.h"
+
+using namespace std;
+
+int UDP_SOCKET = -1;
+int CACHE_SIZE = 1024;
+LRUCache<string, int> connectionCache(CACHE_SIZE);
+
+const int REPLY_SIZE = 65535;
+const int RETRY_USEC = 100000;
+const int RETRIES = 20;
+
+int failures = 0;
+
+string itos(int i) {
+	stringstream ss;
+	ss << i;
+	return ss.str();
+}
+
+void fail(const string &what) {
+	failures++;
+	cerr << "FAIL: " << what << endl;
+}
+
+//empty, NULs inside, NULs only
+string valueOf(int i) {
+	string s = itos(i);
+	switch (i % 3) {
+	case 0:
+		return "";
+	case 1:
+		return "a" + string(1, '\0') + s + string(2, '\0') + "z";
+	default:
+		return string(i % 7 + 1, '\0');
+	}
+}
+
+//lookup on the server behind SOCK only: 0 and its value, -2 if it has no such key, -1
+int directGet(int sock, const string &key, string &value) {
+	Package package;
+	package.set_virtualpath(key);
+	package.set_operation(1);
+	package.set_replicano(3); //a copy, no replica reads
+	string req = package.SerializeAsString();
+	if (send(sock, req.data(), req.size(), MSG_NOSIGNAL) != (int) req.size())
+		return -1;
+	char buff[REPLY_SIZE];
+	int got = recvReplyTCP(sock, buff, sizeof(buff));
+	if (got < 3)
+		return -1;
+	int status = atoi(string(buff, 3).c_str());
+	if (status != 0)
+		return status;
+	Package stored;
+	if (!stored.ParseFromArray(buff + 3, got - 3))
+		return -1;
+	value = stored.realfullpath();
+	return 0;
+}
+
+//servers holding KEY, with exactly VALUE unless ANYVALUE
+int copies(vector<int> &socks, const string &key, const string &value, bool anyValue) {
+	int n = 0;
+	for (size_t s = 0; s < socks.size(); s++) {
+		string got;
+		if (directGet(socks[s], key, got) == 0 && (anyValue || got == value))
+			n++;
+	}
+	return n;
+}
+
+//wait until every key is on WANT servers, with its value unless it was ERASED
+void expectCopies(vector<int> &socks, int keys, int want, bool erased) {
+	for (int i = 0; i < keys; i++) {
+		string key = "rt/" + itos(i);
+		int n = -1;
+		for (int r = 0; r < RETRIES; r++) {
+			n = copies(socks, key, valueOf(i), erased);
+			if (n == want)
+				break;
+			usleep(RETRY_USEC);
+		}
+		if (n != want)
+			fail(key + (erased ? " erased" : " put") + ": on " + itos(n) + " servers, "
+					+ itos(want) + " expected");
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		cout << "Usage: " << argv[0] << " <memberList> <configFile> [keys]" << endl;
+		return 1;
+	}
+	ZHTClient client;
+	if (client.initialize(argv[2], argv[1], true) != 0) {
+		cerr << "Cannot initialize the client." << endl;
+		return 1;
+	}
+	int keys = argc > 3 ? atoi(argv[3]) : 300;
+	int n = client.memberList.size();
+	if (client.NUM_REPLICAS <= 1 || n < 2) { //the client counts the key's own server too
+		cerr << "Needs NUM_REPLICAS > 0 and two servers or more." << endl;
+		return 1;
+	}
+	int want = client.NUM_REPLICAS < n ? client.NUM_REPLICAS : n;
+
+	vector<int> socks(n);
+	for (int s = 0; s < n; s++) {
+		socks[s] = makeClientSocket(client.memberList[s].host.c_str(),
+				client.memberList[s].port, true);
+		if (socks[s] < 0) {
+			cerr << "Cannot connect to " << client.memberList[s].host << ":"
+					<< client.memberList[s].port << endl;
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < keys; i++) {
+		string key = "rt/" + itos(i), value;
+		if (client.put(key, valueOf(i)) != 0)
+			fail(key + ": put");
+		else if (client.get(key, value) != 0 || value != valueOf(i))
+			fail(key + ": get does not return what put stored");
+	}
+	expectCopies(socks, keys, want, false);
+
+	char small[2];
+	size_t room = sizeof(small);
+	if (keys > 1 && (c_zht_get_std((ZHTClient_c) &client, "rt/1", small, &room) != -4
+			|| room != valueOf(1).size()))
+		fail("rt/1: c_zht_get_std with too little room");
+
+	for (int i = 0; i < keys; i++)
+		if (client.erase("rt/" + itos(i)) != 0)
+			fail("rt/" + itos(i) + ": erase");
+	expectCopies(socks, keys, 0, true);
+
+	for (int s = 0; s < n; s++)
+		close(socks[s]);
+	client.tearDownTCP();
+	cout << (failures == 0 ? "PASS" : "FAILED") << ": " << keys << " keys, " << want
+			<< " copies each" << endl;
+	return failures == 0 ? 0 : 1;
+}
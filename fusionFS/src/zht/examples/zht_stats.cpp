@@ -0,0 +1,139 @@
+/*
+ * zht_stats.cpp
+ *
+ *  Asks every server in the member list for its statistics (operation 7). Without an
+ *  interval it prints each server's full report once; with one it prints a line per server
+ *  every interval seconds: request rate since the last poll, table load, lookup/insert p99
+ *  and replication backlog, marking servers well above the average rate as hot.
+ *
+ *  Usage: ./zht_stats <memberList> <configFile> <TCP|UDP> [interval_sec]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <iostream>
+#include "lru_cache.h"
+#include "cpp_zhtclient.h"
+
+using namespace std;
+
+int UDP_SOCKET = -1;
+int CACHE_SIZE = 1024;
+LRUCache<string, int> connectionCache(CACHE_SIZE);
+
+const char *OPS[] = { "lookup", "remove", "insert", "multi_lookup", "multi_remove",
+		"multi_insert", "other" };
+
+map<string, string> parse(const string &report) {
+	map<string, string> fields;
+	stringstream in(report);
+	string line;
+	while (getline(in, line)) {
+		size_t space = line.find(' ');
+		if (space != string::npos)
+			fields[line.substr(0, space)] = line.substr(space + 1);
+	}
+	return fields;
+}
+
+long long field(map<string, string> &fields, const string &name) {
+	map<string, string>::iterator it = fields.find(name);
+	return it == fields.end() ? 0 : atoll(it->second.c_str());
+}
+
+long long totalOps(map<string, string> &fields) {
+	long long total = 0;
+	for (int op = 0; op < 7; op++)
+		total += field(fields, string(OPS[op]) + "_count");
+	return total;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		cout << "Usage: " << argv[0]
+				<< " <memberList> <configFile> <TCP|UDP> [interval_sec]" << endl;
+		return 1;
+	}
+	ZHTClient client;
+	if (client.initialize(argv[2], argv[1], !strcmp("TCP", argv[3])) != 0) {
+		cerr << "Cannot initialize the client." << endl;
+		return 1;
+	}
+	int interval = argc > 4 ? atoi(argv[4]) : 0;
+	int n = client.memberList.size();
+
+	if (interval <= 0) {
+		for (int i = 0; i < n; i++) {
+			string report;
+			cout << "== " << client.memberList[i].host << ":"
+					<< client.memberList[i].port << endl;
+			if (client.stats(i, report) != 0)
+				cout << "no answer" << endl;
+			else
+				cout << report;
+		}
+		client.tearDownTCP();
+		return 0;
+	}
+
+	vector<long long> lastOps(n, -1);
+	while (1) {
+		vector<map<string, string> > fields(n);
+		vector<bool> up(n);
+		vector<double> rate(n, 0);
+		double sum = 0;
+		int counted = 0;
+		for (int i = 0; i < n; i++) {
+			string report;
+			up[i] = client.stats(i, report) == 0;
+			if (!up[i])
+				continue;
+			fields[i] = parse(report);
+			long long ops = totalOps(fields[i]);
+			if (lastOps[i] >= 0 && ops >= lastOps[i]) {
+				rate[i] = (double) (ops - lastOps[i]) / interval;
+				sum += rate[i];
+				counted++;
+			}
+			lastOps[i] = ops;
+		}
+
+		printf("%-24s %10s %10s %6s %10s %10s %6s %10s\n", "server", "ops/sec",
+				"size", "load", "lookup_p99", "insert_p99", "conns", "unacked");
+		for (int i = 0; i < n; i++) {
+			stringstream name;
+			name << client.memberList[i].host << ":" << client.memberList[i].port;
+			if (!up[i]) {
+				printf("%-24s no answer\n", name.str().c_str());
+				continue;
+			}
+			map<string, string> &f = fields[i];
+			long long cap = field(f, "capacity");
+			long long unacked = 0;
+			for (int r = 0; r < field(f, "replicas"); r++) {
+				stringstream key;
+				key << "replica_" << r << "_unacked_bytes";
+				unacked += field(f, key.str());
+			}
+			char load[16] = "-";
+			if (cap > 0)
+				sprintf(load, "%.2f", (double) field(f, "size") / cap);
+			printf("%-24s %10.0f %10lld %6s %10lld %10lld %6lld %10lld%s%s\n",
+					name.str().c_str(), rate[i], field(f, "size"), load,
+					field(f, "lookup_usec_p99"), field(f, "insert_usec_p99"),
+					field(f, "connections_open"), unacked,
+					counted > 1 && rate[i] > 2 * sum / counted ? "  HOT" : "",
+					field(f, "resizing") ? "  RESIZING" : "");
+		}
+		printf("\n");
+		fflush(stdout);
+		sleep(interval);
+	}
+	return 0;
+}
@@ -19,6 +19,17 @@
 
 #include <stddef.h>
 
+#ifndef ZHT_FUTURE_C_DEFINED
+#define ZHT_FUTURE_C_DEFINED
+typedef void* ZHTFuture_c;
+
+/* called on the ZHT event loop thread once a request submitted with a callback is answered.
+ * RESULT/N are only meaningful for lookup, RESULT is not NUL terminated.
+ * */
+typedef void (*c_zht_callback)(int status, const char *result, size_t n,
+		void *arg);
+#endif
+
 ZHT_CPP(extern "C" {)
 
 	/* wrapp C++ ZHTClient::initialize.
@@ -67,11 +78,60 @@ ZHT_CPP(extern "C" {)
 	 * */
 	int c_zht_remove2(const char *key);
 
-	/* wrapp C++ ZHTClient::teardown.
+	/* wrapp C++ ZHTClient::put, get and erase: KEY and VALUE as they are, no Package on the
+	 * caller's side. VALUE may hold N bytes including NULs. For get, *N is the room in RESULT
+	 * when called and the size of the value on return; RESULT is not NUL terminated.
+	 * return code: 0 if succeeded, or -1 if empty key or failed, -2 if not found, -4 if the
+	 * value is larger than *N (nothing is copied, *N tells the room it needs).
+	 * */
+	int c_zht_put(const char *key, const char *value, size_t n);
+
+	int c_zht_get(const char *key, char *result, size_t *n);
+
+	int c_zht_erase(const char *key);
+
+	/* wrapp C++ ZHTClient::setNegativeCache: misses are remembered for TTLMSEC, 0 turns it off.
+	 * return code: 0 if succeeded.
+	 * */
+	int c_zht_negative_cache(int ttlMsec);
+
+	/* wrapp C++ ZHTClient::tearDownTCP and frees the client, which must not be used afterwards.
 	 * return code: 0 if succeeded, or -1 if failed.
 	 * */
 	int c_zht_teardown();
 
+	/* wrapp C++ ZHTClient::insertAsync, lookupAsync and removeAsync.
+	 * PAIR is expected to be a serialization string with protocol-buffer-c-binding representation.
+	 * Requests are answered by a background event loop, so many can be in flight at once.
+	 * return: a future to be passed to c_zht_wait exactly once, never NULL.
+	 * */
+	ZHTFuture_c c_zht_insert_async(const char *pair);
+
+	ZHTFuture_c c_zht_lookup_async(const char *pair);
+
+	ZHTFuture_c c_zht_remove_async(const char *pair);
+
+	/* callback versions of the above, CALLBACK is invoked exactly once with ARG.
+	 * return code: 0 if submitted, or -1 if failed (CALLBACK has already been invoked).
+	 * */
+	int c_zht_insert_cb(const char *pair, c_zht_callback callback, void *arg);
+
+	int c_zht_lookup_cb(const char *pair, c_zht_callback callback, void *arg);
+
+	int c_zht_remove_cb(const char *pair, c_zht_callback callback, void *arg);
+
+	/* test whether FUTURE is answered without blocking.
+	 * return code: 1 if answered, or 0 if still in flight.
+	 * */
+	int c_zht_ready(ZHTFuture_c future);
+
+	/* block until FUTURE is answered and release it.
+	 * RESULT: lookup result, may be NULL for insert and remove.
+	 * N: actual number of characters read.
+	 * return code: same as c_zht_insert, c_zht_lookup or c_zht_remove.
+	 * */
+	int c_zht_wait(ZHTFuture_c future, char *result, size_t *n);
+
 ZHT_CPP	(})
 
 #endif
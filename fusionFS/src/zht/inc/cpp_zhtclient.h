@@ -2,6 +2,13 @@
 #define CPP_ZHTCLIENT_H_
 
 #include "zht_util.h"
+#include "zht_async.h"
+#include "zht_udp.h"
+#include "zht_pool.h"
+#include "zht_hedge.h"
+#include "zht_watch.h"
+#include "zht_local.h"
+#include "zht_bloom.h"
 
 
 
@@ -14,6 +21,7 @@ public:
 	int protocolType; //1:1TCP; 2:UDP; 3.... Reserved.  -1:error
 	vector<struct HostEntity> memberList;
 	ZHTClient();
+	~ZHTClient(); //tearDownTCP() and the rest of what the client holds
 
 	int initialize(string configFilePath, string memberListFilePath, bool tcp);
 	struct HostEntity str2Host(string str);
@@ -27,6 +35,109 @@ public:
 	int remove(string str);
 	int tearDownTCP(); //only for TCP
 
+	//typed versions of insert/lookup/remove: KEY is routed as is and the request is encoded
+	//once, without building a Package. The value is kept as the stored package's
+	//realFullPath, so lookup sees what put stored and get what insert stored.
+	int put(const string &key, const string &value);
+	int get(const string &key, string &value); //0 found, -2 not found
+	int erase(const string &key);
+	//time to live: put stores VALUE for TTLMSEC, expire gives an existing key TTLMSEC to live
+	//(0: forever again). A plain put or insert clears it. Needs the novoht engine, -3 otherwise.
+	int put(const string &key, const string &value, int ttlMsec);
+	int expire(const string &key, int ttlMsec);
+	//leases: KEY is held by HOLDER for TTLMSEC unless renewed. acquire returns 0 when granted
+	//(or renewed, if HOLDER has it already), -5 when someone else holds it, their name and
+	//the msec left then go to OWNER and LEFTMSEC if given. renew and release return -2 when
+	//HOLDER does not hold KEY (any more).
+	int acquireLease(const string &key, const string &holder, int ttlMsec,
+			string *owner = NULL, int *leftMsec = NULL);
+	int renewLease(const string &key, const string &holder, int ttlMsec);
+	int releaseLease(const string &key, const string &holder);
+	//"name value" lines from server memberList[index] (operation 7), 0 on success
+	int stats(int index, string &result);
+	//one page of the keys starting with PREFIX, from all servers at once and merged in key
+	//order: up to LIMIT (0: the servers' page size, 1000) key/value pairs sorting after
+	//CURSOR. Start with an empty CURSOR; it is set to where the next page starts, and is
+	//empty again after the last page. Returns the number of pairs, -1 if a server failed.
+	int scan(const string &prefix, int limit, string &cursor,
+			vector<pair<string, string> > &out);
+	//watches, TCP only: once watch() returns 0 the servers push a notice for every change
+	//(ZHT_WATCH_CHANGED) or removal (ZHT_WATCH_REMOVED) of KEY, or with PREFIX of any key
+	//starting with it, to CALLBACK on the client's watch thread. ZHT_WATCH_LOST means a
+	//server's notices may have been missed; ZHT_WATCH_RESTORED follows once its watches are
+	//back, after which what was cached from it should be read again. A prefix watch goes
+	//to every server: -1 if any of them failed, the others keep it until unwatch().
+	int setWatchCallback(ZHTWatchCallback callback, void *arg);
+	int watch(const string &key, bool prefix = false);
+	int unwatch(const string &key, bool prefix = false);
+	//negative lookups: a lookup/get that misses brings back the block of its server's Bloom
+	//filter the key falls into, kept for TTLMSEC (0, the default: off). Lookups of keys
+	//it rules out return -2 without asking, so a key another client inserts may be
+	//reported missing for up to TTLMSEC; this client's own inserts are seen at once.
+	int setNegativeCache(int ttlMsec);
+
+	//non-blocking versions, only for TCP (UDP falls back to the blocking call).
+	//The returned future must be wait()ed and then deleted by the caller.
+	ZHTFuture* insertAsync(string str);
+	ZHTFuture* lookupAsync(string str);
+	ZHTFuture* removeAsync(string str);
+	//callback versions: CALLBACK runs on the event loop thread, return 0 if submitted.
+	int insertAsync(string str, ZHTCallback callback, void *arg);
+	int lookupAsync(string str, ZHTCallback callback, void *arg);
+	int removeAsync(string str, ZHTCallback callback, void *arg);
+	int setAsyncConnections(int connsPerHost); //before the first async call, default 4
+	//TCP: connections per server the blocking calls may open, default 8. Each call checks
+	//one out, so that many threads can talk to one server at a time.
+	int setPoolSize(int connsPerHost);
+	//UDP: first retransmission after USEC (doubled every time), give up after RETRIES
+	int setUdpTimeout(int usec, int retries);
+	//lookup/get with NUM_REPLICAS > 0: over TCP a read still unanswered after DELAYUSEC (0:
+	//the p95 of recent reads, -1: never) goes to the next replica as well and the first
+	//answer wins; all give up after TIMEOUTUSEC. A server failing SUSPECTAFTER reads in a
+	//row is read last for SUSPECTUSEC. Negative values keep the current setting.
+	int setHedging(int delayUsec, int timeoutUsec, int suspectAfter, int suspectUsec);
+
+	//many keys at once: one frame per server, all servers in parallel (over UDP one datagram
+	//per frame). STATUSES gets one code
+	//per input string, in order. Return 0 if every key succeeded, -2 otherwise.
+	int multiInsert(const vector<string> &strs, vector<int> &statuses);
+	int multiLookup(const vector<string> &strs, vector<string> &results,
+			vector<int> &statuses);
+	int multiRemove(const vector<string> &strs, vector<int> &statuses);
+
+private:
+	ZHTClient(const ZHTClient &); //owns its connections and threads, never copied
+	ZHTClient &operator=(const ZHTClient &);
+
+	int asyncConnsPerHost;
+	ZHTAsyncEngine *asyncEngine;
+	ZHTUdpTransport *udp; //UDP only
+	ZHTConnPool *pool; //TCP blocking calls
+	ZHTHedge *hedge; //replica-aware reads
+	ZHTWatcher *watcher; //created by the first watch call
+	ZHTNegativeCache *negative;
+	struct HostEntity &keyHost(const string &key);
+	int udpStatus(const struct HostEntity &dest, const string &str);
+	int poolCall(const struct HostEntity &dest, const char *req, int len, char *buff,
+			int size);
+	int readCall(const string &key, const char *req, int len, char *buff, int size);
+	int replicaCall(int primary, const char *req, int len, char *buff, int size,
+			int &replier);
+	void inserted(const string &key);
+	int hedgedCall(int primary, const vector<int> &order, const char *req, int len,
+			char *buff, int size, int &replier);
+	int typedCall(int operation, int replicano, const string &key,
+			const string *value, char *buff, int size, int openMode = -1);
+	int leaseCall(int operation, const string &key, const string &holder, int ttlMsec,
+			string *owner, int *leftMsec);
+	int watchCall(int operation, const string &key, bool prefix);
+	int preparePackage(string &str, int operation, int replicano);
+	int submitAsync(string str, int operation, int replicano,
+			ZHTFuture *future);
+	int startAsync();
+	int multiOperation(int operation, const vector<string> &strs,
+			vector<string> &results, vector<int> &statuses);
+
 };
 
 #endif
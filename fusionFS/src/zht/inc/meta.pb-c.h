@@ -26,7 +26,7 @@ struct  _Package
   protobuf_c_boolean has_isdir;
   protobuf_c_boolean isdir;
   size_t n_listitem;
-  char **listitem;
+  ProtobufCBinaryData *listitem;
   protobuf_c_boolean has_openmode;
   int32_t openmode;
   protobuf_c_boolean has_mode;
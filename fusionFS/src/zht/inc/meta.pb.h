@@ -124,7 +124,7 @@ class Package : public ::google::protobuf::Message {
   inline bool isdir() const;
   inline void set_isdir(bool value);
   
-  // repeated string listItem = 5;
+  // repeated bytes listItem = 5;
   inline int listitem_size() const;
   inline void clear_listitem();
   static const int kListItemFieldNumber = 5;
@@ -132,11 +132,11 @@ class Package : public ::google::protobuf::Message {
   inline ::std::string* mutable_listitem(int index);
   inline void set_listitem(int index, const ::std::string& value);
   inline void set_listitem(int index, const char* value);
-  inline void set_listitem(int index, const char* value, size_t size);
+  inline void set_listitem(int index, const void* value, size_t size);
   inline ::std::string* add_listitem();
   inline void add_listitem(const ::std::string& value);
   inline void add_listitem(const char* value);
-  inline void add_listitem(const char* value, size_t size);
+  inline void add_listitem(const void* value, size_t size);
   inline const ::google::protobuf::RepeatedPtrField< ::std::string>& listitem() const;
   inline ::google::protobuf::RepeatedPtrField< ::std::string>* mutable_listitem();
   
@@ -376,7 +376,7 @@ inline void Package::set_isdir(bool value) {
   isdir_ = value;
 }
 
-// repeated string listItem = 5;
+// repeated bytes listItem = 5;
 inline int Package::listitem_size() const {
   return listitem_.size();
 }
@@ -395,7 +395,7 @@ inline void Package::set_listitem(int index, const ::std::string& value) {
 inline void Package::set_listitem(int index, const char* value) {
   listitem_.Mutable(index)->assign(value);
 }
-inline void Package::set_listitem(int index, const char* value, size_t size) {
+inline void Package::set_listitem(int index, const void* value, size_t size) {
   listitem_.Mutable(index)->assign(
     reinterpret_cast<const char*>(value), size);
 }
@@ -408,7 +408,7 @@ inline void Package::add_listitem(const ::std::string& value) {
 inline void Package::add_listitem(const char* value) {
   listitem_.Add()->assign(value);
 }
-inline void Package::add_listitem(const char* value, size_t size) {
+inline void Package::add_listitem(const void* value, size_t size) {
   listitem_.Add()->assign(reinterpret_cast<const char*>(value), size);
 }
 inline const ::google::protobuf::RepeatedPtrField< ::std::string>&
@@ -13,6 +13,8 @@ int svr_accept(int sock, bool tcp);
 int makeClientSocket(const char* host, int port, bool tcp);
 
 int generalSendTo(const char* host, int port, int to_sock, const char* buff, bool tcp);
+//len bytes of buff, which may hold NULs (a serialized Package)
+int generalSendTo(const char* host, int port, int to_sock, const char* buff, int len, bool tcp);
 int generalSendBack(int to_sock, const char* buff_sendback, struct sockaddr_in sendbackAddr, int flag, bool tcp);
 int generalReceive(int sock, void* recvBuff, int maxRecvSize, struct sockaddr_in & recvAddr, int flag, bool tcp);
 
@@ -20,11 +22,15 @@ int generalReceive(int sock, void* recvBuff, int maxRecvSize, struct sockaddr_in
 
 int generalSendTCP(int to_sock, const char* buff);
 int generalReveiveTCP(int sock, void *buffer, size_t size, int flags);
+//one whole reply of a server: every TCP reply is its length (int32) and then the reply.
+//Up to size bytes of it into buffer, the rest is read and dropped; bytes kept or -1.
+int recvReplyTCP(int sock, char *buffer, int size);
 
 
 //int serverReceive(int sock, void *buffer, size_t size, int flags, bool tcp);
 
 int udpSendTo(int toSock, const char* host, int port, const char* buff);
+int udpSendTo(int toSock, const char* host, int port, const char* buff, int len);
 int udpRecvFrom(int sock, void* recvBuff, int maxRecvSize, struct sockaddr_in & recvAddr, int flag);
 int udpSendBack(int sock, const char* buff_sendback, struct sockaddr_in sendbackAddr, int flag);
 
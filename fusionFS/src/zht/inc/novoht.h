@@ -3,53 +3,240 @@
 #include "novoht.h"
 #include <string>
 #include <stdio.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <pthread.h>
 using namespace std;
 
+//number of bucket lock stripes, the table size is always kept a multiple of it so
+//every key maps to the same stripe (hash % NOVOHT_STRIPES) whatever the table size.
+#define NOVOHT_STRIPES 64
+
+//old buckets moved to the new array by every put/remove while a resize is going on
+#define NOVOHT_MIGRATE_STEP 2
+
+//db file layout: NOVOHT_LOG_MAGIC, then one record per update since the last snapshot
+//   crc32 (4) | type (1) | key length (4) | value length (4) | key | value
+//crc32 covers everything after itself, a torn or corrupt tail is cut off on load.
+#define NOVOHT_LOG_MAGIC "NoVoHT01"
+#define NOVOHT_LOG_PUT 1
+#define NOVOHT_LOG_DEL 2
+#define NOVOHT_LOG_REF 3      //spill mode put, the value is a 16 byte vref
+#define NOVOHT_LOG_TTL 4      //the key's deadline, 8 bytes of usec since the epoch, 0: none
+
+//what a put/remove that returned 0 survives, see setDurability()
+#define NOVOHT_SYNC_MEMORY 0  //records are written in NOVOHT_LOG_BUFFER chunks, a crash loses the rest
+#define NOVOHT_SYNC_ASYNC 1   //written at once, fdatasync'd every interval: a process crash loses nothing
+#define NOVOHT_SYNC_GROUP 2   //returns once an fdatasync covers it, concurrent updates share one
+#define NOVOHT_LOG_BUFFER (64 << 10)
+#define NOVOHT_ASYNC_USEC 1000000
+#define NOVOHT_GROUP_USEC 1000       //group commit: at most one fdatasync per interval...
+#define NOVOHT_GROUP_RECORDS 64      //...unless that many updates are waiting for it
+
+//<db file>.snap layout, written by a forked child and mmap'd on load:
+//   NOVOHT_SNAP_MAGIC | pairs (8) | buckets (8) | file length (8)
+//   then per pair: hash (8) | key length (4) | value length (4) | key | value
+#define NOVOHT_SNAP_MAGIC "NoVoSnp1"
+#define NOVOHT_SNAP_HEADER 32
+#define NOVOHT_SNAP_BUFFER (1 << 20)
+#define NOVOHT_SNAP_REF_MAGIC "NoVoSnpR"   //same layout, every value is a 16 byte vref
+
+//spill mode (a value cache size is given): the table keeps keys and vrefs only, values sit
+//in <db file>.values.<gen> as crc32 (4) | length (4) | value and are read through a bounded
+//LRU cache. Once most of the value bytes are garbage every live value is copied into a new
+//generation and the older files go away with the next snapshot.
+#define NOVOHT_SPILL_CACHE (64 << 20)   //cache for a db found with value files but opened without one
+#define NOVOHT_GC_MIN (64 << 20)        //no value rewrite for less garbage than that
+#define NOVOHT_GC_BUCKETS 256           //buckets per stripe lock while rewriting values
+
+//per key expiry, see novoht_ttl.cpp: a deadline is also filed in a hashed timer wheel of
+//NOVOHT_WHEEL_SLOTS slots of NOVOHT_WHEEL_TICK usec, so expireDue() only looks at the slots
+//whose time has come. Entries are never taken out of the wheel, one whose key got another
+//deadline (or none) meanwhile is dropped when its slot comes up. Snapshots do not carry
+//deadlines, every snapshot writes them to the fresh log instead.
+#define NOVOHT_WHEEL_SLOTS 1024
+#define NOVOHT_WHEEL_TICK 10000
+
+struct vref{
+   unsigned int gen;
+   unsigned int len;
+   long long off;
+};
+
+class ValueCache;
+
 struct kvpair{
    struct kvpair * next;
    string key;
    string val;
    //int val;
-   fpos_t pos;
+   vref ref;   //spill mode only, val stays empty. gen 0: no value yet
+   long long expires;   //usec since the epoch, 0: never. Past it the pair is gone for readers
 };
 
 class NoVoHT{
    int size;
    kvpair** kvpairs;
-   kvpair** oldpairs;
-   bool resizing;
-   bool map_lock;
-   bool write_lock;
-   int numEl;
-   FILE * dbfile;
+   kvpair** oldpairs;                        //non NULL while a resize is moving entries over
+   int oldsize;
+   int migrated[NOVOHT_STRIPES];             //next old bucket to move, per stripe
+   volatile int unmigrated;                  //old buckets left
+   volatile unsigned int helpCursor;
+   pthread_mutex_t stripes[NOVOHT_STRIPES];  //bucket b is guarded by stripes[b % NOVOHT_STRIPES]
+   pthread_mutex_t file_lock;                //dbfd and snapshot state, taken after a stripe
+   volatile int numEl;
+   int dbfd;
    string filename;
-   int nRem;
+   int logged;                               //records in the log since the last snapshot
+   bool loading;                             //replaying the log, don't append to it
+   bool snapshotting;
+   bool snapshotterStarted;
+   pthread_t snapshotter;
+   pthread_cond_t snapshot_done;             //signalled with file_lock when snapshotting goes false
+   int durability;                           //NOVOHT_SYNC_*
+   int syncUsec;
+   int syncRecords;
+   string logBuf;                            //NOVOHT_SYNC_MEMORY records not written yet
+   unsigned long long appended;              //records ever appended, under file_lock
+   unsigned long long synced;                //how many of them an fdatasync covered
+   bool syncing;                             //an fdatasync is running or being waited for
+   long long lastSync;                       //usec
+   bool deferred;                            //group commit left to the caller, see deferSync()
+   pthread_cond_t log_synced;                //with file_lock: syncing went false
+   pthread_cond_t log_grown;                 //with file_lock: syncRecords are waiting
+   void init(string, int, int, float, long);
+   void lockAll();
+   void unlockAll();
    void resize(int ns);
-   int write(kvpair *);
+   kvpair **bucket(unsigned long long);
+   bool migrate(int, int);
+   bool helpMigrate();
+   void finishResize();
+   int write(char, const string&, const string&);
+   int writeLocked(char, const string&, const string&);
+   bool flushLog();
+   int syncLog();
+   void waitSync();
+   bool syncFiles(int);
    //void writeFile();
    void readFile();
-   int mark(fpos_t);
-   int magicNumber;
+   void readTextFile(FILE *);
+   bool readSnapshot();
+   long replay(FILE *);
+   void maybeSnapshot();
+   static void *snapshotEntry(void *);
+   int takeSnapshot();
+   bool writeSnapshot(const char *, char *);
+   bool rotateLog();
+   void unrotateLog();
+   void reopenLog();
+   int magicNumber;                          //no snapshot before that many log records
+   //spill mode, see novoht_spill.cpp
+   bool spill;
+   ValueCache *cache;
+   pthread_mutex_t value_lock;               //appending to writeFd, taken after a stripe
+   pthread_rwlock_t values_rw;               //valueFds, written when a generation comes or goes
+   map<unsigned int, int> valueFds;          //generation -> fd
+   unsigned int writeGen;
+   int writeFd;
+   long long writeEnd;
+   unsigned int firstGen;                    //older generations are dropped by the next snapshot
+   volatile long long valueLive;             //bytes of the value files still referenced
+   volatile long long valueGarbage;          //and the rest of them
+   int store(const string &, const string &, const vref *);
+   string valueFile(unsigned int);
+   void openValueFiles(long);
+   void closeValueFiles();
+   int appendValue(const string &, vref &);
+   int readValue(const vref &, string &);
+   void liveValue(const vref &);
+   void dropValue(const vref &);
+   int keepRef(kvpair *, const vref &, const string *);
+   int fetchValue(kvpair *, string &);
+   void forgetValue(kvpair *);
+   bool gcDue();
+   int collectValues();
+   int collectStripe(int, unsigned int);
+   int moveValues(kvpair *, unsigned int);
+   void dropValueGens();
    float resizeNum;
+   set<string> *ordered;                     //keepOrder(): every key, sorted; NULL without
+   pthread_mutex_t order_lock;               //guards ordered, taken after a stripe
+   void orderAdd(const string &);
+   void orderDel(const string &);
+   //expiry, see novoht_ttl.cpp
+   vector<pair<string, long long> > wheel[NOVOHT_WHEEL_SLOTS];   //key and the deadline filed
+   long long wheelTick;                      //next tick expireDue() looks at
+   pthread_mutex_t wheel_lock;               //taken after a stripe
+   volatile int expired;
+   void wheelAdd(const string &, long long);
+   void relogExpiries();
+   int removeIf(const string &, long long);
+   volatile int resizes;                     //events since the table was opened, for stats
+   volatile int snapshots;
+   volatile int collections;
    public:
         NoVoHT();
         //NoVoHT(int);
         //NoVoHT(char *);
         NoVoHT(string, int, int);
         NoVoHT(string, int, int, float);
+        NoVoHT(string, int, int, float, long);  //last one > 0: spill values, cache that many bytes
         //NoVoHT(char *, NoVoHT*);
         ~NoVoHT();
-        int writeFile();
-        int put(string,  string);
-        string* get(string);
-        int remove(string);
-        int getSize() {return numEl;}
+        int writeFile();           //snapshot now, waits for it
+        int snapshot();            //snapshot in the background, the table keeps serving
+        //NOVOHT_SYNC_MEMORY, _ASYNC (default) or _GROUP. usec is the fdatasync interval,
+        //records the group size that triggers one early; 0 takes the defaults.
+        void setDurability(int level, int usec = 0, int records = 0);
+        //group commit by the caller: from now on a _GROUP put/remove returns as soon as its
+        //record is written, and sync() makes everything written so far durable with one
+        //fdatasync. For a single threaded server that answers updates only after sync().
+        //false (and nothing changes) if the level is not _GROUP or there is no file.
+        bool deferSync();
+        int sync();                //0 done, -2 fdatasync failed
+        int put(const string&, const string&);
+        string* get(string);       //pointer into the table, only safe without concurrent writers,
+                                   //NULL in spill mode
+        int get(const string&, string&);  //copy of the value, 0 found, -1 not found
+        int remove(const string&);
+        //the key disappears at DEADLINE (usec since the epoch, 0: never again). put clears
+        //it. 0 done, -1 not found, -2 write failure
+        int expire(const string&, long long deadline);
+        long long getExpiry(const string&);   //0 none, -1 not found
+        //remove the keys whose deadline passed, returns how many and adds them to reaped
+        int expireDue(vector<string> *reaped = NULL);
+        //up to limit pairs (all if limit <= 0) whose key starts with prefix and sorts after
+        //after, in key order. Walks the whole table unless keepOrder() was called.
+        int scan(const string &prefix, const string &after, int limit,
+                 vector<pair<string, string> > &out);
+        //from now on keep a sorted index of the keys next to the table (built from what is
+        //loaded), so scan only touches the keys it returns. Costs a set insert per new key.
+        void keepOrder();
+        //VISIT(key, ARG) once for every live key, in no order and without reading a value;
+        //returns how many. It runs under a stripe lock and must not call into the table.
+        int forEachKey(void (*visit)(const string&, void*), void *arg);
+        int pin(string);           //spill mode: keep the value in memory, 0 done, -1 not found
+        int unpin(string);
+        int getSize() {return __sync_fetch_and_add(&numEl, 0);}
         int getCap() {return size;}
+        int getResizes() {return resizes;}
+        bool isResizing() {return oldpairs != NULL;}
+        int getSnapshots() {return snapshots;}       //log compactions that succeeded
+        int getCollections() {return collections;}   //spill mode value file compactions
+        int getExpired() {return expired;}
 };
 
-unsigned long long hash (string k);
+unsigned long long hash (const string &k);
 
 void fsu(kvpair *);
 
 char *readTabString(FILE*, char*);
+
+unsigned int novohtCrc32(const char *, size_t, unsigned int crc = 0);
+
+bool novohtWriteAll(int fd, const char *, size_t);
+
+long long novohtNowUsec();
 #endif
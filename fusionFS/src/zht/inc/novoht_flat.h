@@ -0,0 +1,70 @@
+/*
+ * novoht_flat.h
+ *
+ *  Open addressing variant of NoVoHT. Slots are grouped by 16 with one control byte per
+ *  slot (empty, deleted or 7 bits of the hash) so a whole group is probed with a single
+ *  SSE2 compare. Keys up to FLAT_INLINE_KEY bytes live in the slot itself, longer keys
+ *  and all values live in one contiguous arena addressed by offset.
+ *
+ *  In memory only, no db file.
+ */
+
+#ifndef NOVOHT_FLAT_H
+#define NOVOHT_FLAT_H
+#include <string>
+#include <vector>
+#include <set>
+#include <stdint.h>
+#include <pthread.h>
+using namespace std;
+
+#define FLAT_GROUP 16
+#define FLAT_INLINE_KEY 16
+
+struct flatslot{
+   uint32_t klen;
+   uint32_t vlen;
+   uint64_t voff;                  //value offset in the arena
+   union {
+      char inl[FLAT_INLINE_KEY];   //klen <= FLAT_INLINE_KEY
+      uint64_t off;                //otherwise key offset in the arena
+   } key;
+};
+
+class NoVoHTFlat{
+   size_t cap;                     //slots, power of two and multiple of FLAT_GROUP
+   signed char *ctrl;              //cap control bytes, 16 byte aligned
+   flatslot *slots;
+   char *arena;
+   size_t arenaLen;
+   size_t arenaCap;
+   size_t garbage;                 //arena bytes no slot points at anymore
+   size_t numEl;
+   size_t numDel;                  //tombstones
+   pthread_rwlock_t lock;
+   set<string> *ordered;           //keepOrder(): every key, sorted, under lock; NULL without
+   void init(size_t);
+   long find(const string&, uint64_t);
+   size_t freeSlot(uint64_t);
+   void rehash(size_t);
+   void compact();
+   void reserve(size_t);
+   uint64_t append(const char*, size_t);
+   const char *keyOf(const flatslot&);
+   public:
+        NoVoHTFlat();
+        NoVoHTFlat(int);
+        ~NoVoHTFlat();
+        int put(string, string);        //0 success
+        int get(string, string&);       //0 found, -1 not found
+        int remove(string);             //0 success, -1 not found
+        int scan(const string &prefix, const string &after, int limit,
+                 vector<pair<string, string> > &out);   //same as NoVoHT::scan
+        void keepOrder();               //same as NoVoHT::keepOrder
+        int forEachKey(void (*visit)(const string&, void*), void *arg); //same as NoVoHT's
+        int getSize() {return numEl;}
+        int getCap() {return cap;}
+        size_t memUsage();              //bytes held by control bytes, slots and arena
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * storage_engine.h
+ *
+ *  Key-value stores the ZHT server can run on, picked with STORAGE_ENGINE in zht.cfg:
+ *    novoht  chained NoVoHT, persistent if STORAGE_FILE is set (default), values spill to
+ *            disk behind a STORAGE_CACHE_MB value cache if that is set too
+ *    flat    open addressing NoVoHTFlat, memory only
+ *    map     std::map<string, string>, memory only, ordered
+ *    cstr    std::map over malloc'd C strings, memory only, ordered
+ *  STORAGE_INDEX=ordered gives novoht and flat a sorted index of their keys, so a prefix
+ *  scan reads only the keys it returns instead of the whole table.
+ */
+
+#ifndef STORAGE_ENGINE_H_
+#define STORAGE_ENGINE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "novoht.h"
+#include "novoht_flat.h"
+
+using namespace std;
+
+typedef void (*StorageKeyVisitor)(const string &key, void *arg);
+
+class StorageEngine {
+public:
+	virtual ~StorageEngine() {
+	}
+
+	//put overwrites. 0 success, -1 not found, -2 or less storage error.
+	virtual int put(const string &key, const string &value) = 0;
+	virtual int get(const string &key, string &value) = 0;
+	virtual int remove(const string &key) = 0;
+	//up to limit pairs (all if limit <= 0) with the given key prefix that sort after
+	//after, in key order; returns how many.
+	virtual int scan(const string &prefix, const string &after, int limit,
+			vector<pair<string, string> > &out) = 0;
+	//VISIT(key, ARG) once for every key, in no order and without reading a value: one
+	//pass, where paging through scan is quadratic on the hash engines. Returns how many.
+	//VISIT runs under the engine's lock and must not call into the engine.
+	virtual int forEachKey(StorageKeyVisitor visit, void *arg) = 0;
+	//the key disappears at deadline (usec since the epoch, 0: never again); put clears it.
+	//0 done, -1 not found, -3 the engine has no expiry (only novoht has).
+	virtual int setExpiry(const string & /*key*/, long long /*deadline*/) {
+		return -3;
+	}
+	virtual long long getExpiry(const string & /*key*/) { //0 none, -1 not found
+		return 0;
+	}
+	//remove what expired by now, returns how many; their keys go to REAPED if given
+	virtual int expireDue(vector<string> * /*reaped*/ = NULL) {
+		return 0;
+	}
+	//group commit by the caller: true if updates now return before their fdatasync and
+	//sync() has to make them durable, false if they take care of that themselves.
+	virtual bool deferSync() {
+		return false;
+	}
+	virtual int sync() { //0 done, -2 failed
+		return 0;
+	}
+	//persist a point-in-time image, -1 if the engine keeps nothing on disk.
+	virtual int snapshot() = 0;
+	virtual int size() = 0;
+	virtual const char *name() = 0;
+	//engine specific counters (capacity, resizes, compactions) for the stats operation
+	virtual void stats(vector<pair<string, long long> > & /*out*/) {
+	}
+};
+
+//NULL if the name is unknown. file is only used by persistent engines, "" for none.
+//cacheBytes > 0 keeps only that much of the values in memory (novoht with a file).
+//durability is a NOVOHT_SYNC_* level, syncUsec and syncRecords tune it (0: defaults).
+//ordered keeps the sorted key index of the hash engines, the others are sorted anyway.
+StorageEngine *createStorageEngine(const string &engine, const string &file,
+		long cacheBytes = 0, int durability = NOVOHT_SYNC_ASYNC, int syncUsec = 0,
+		int syncRecords = 0, bool ordered = false);
+
+class NoVoHTEngine: public StorageEngine {
+public:
+	NoVoHTEngine(const string &file, long cacheBytes = 0,
+			int durability = NOVOHT_SYNC_ASYNC, int syncUsec = 0, int syncRecords = 0,
+			bool ordered = false);
+	~NoVoHTEngine();
+	int put(const string &key, const string &value);
+	int get(const string &key, string &value);
+	int remove(const string &key);
+	int scan(const string &prefix, const string &after, int limit,
+			vector<pair<string, string> > &out);
+	int forEachKey(StorageKeyVisitor visit, void *arg);
+	int setExpiry(const string &key, long long deadline);
+	long long getExpiry(const string &key);
+	int expireDue(vector<string> *reaped = NULL);
+	bool deferSync();
+	int sync();
+	int snapshot();
+	int size();
+	const char *name();
+	void stats(vector<pair<string, long long> > &out);
+private:
+	NoVoHT *table;
+	bool persistent;
+};
+
+class FlatEngine: public StorageEngine {
+public:
+	FlatEngine(bool ordered = false);
+	int put(const string &key, const string &value);
+	int get(const string &key, string &value);
+	int remove(const string &key);
+	int scan(const string &prefix, const string &after, int limit,
+			vector<pair<string, string> > &out);
+	int forEachKey(StorageKeyVisitor visit, void *arg);
+	int snapshot();
+	int size();
+	const char *name();
+	void stats(vector<pair<string, long long> > &out);
+private:
+	NoVoHTFlat table;
+};
+
+class MapEngine: public StorageEngine {
+public:
+	MapEngine();
+	~MapEngine();
+	int put(const string &key, const string &value);
+	int get(const string &key, string &value);
+	int remove(const string &key);
+	int scan(const string &prefix, const string &after, int limit,
+			vector<pair<string, string> > &out);
+	int forEachKey(StorageKeyVisitor visit, void *arg);
+	int snapshot();
+	int size();
+	const char *name();
+private:
+	map<string, string> table;
+	pthread_mutex_t mutex;
+};
+
+struct charscmp {
+	bool operator()(const char* s1, const char* s2) const;
+};
+
+//keys are NUL terminated copies, values are length prefixed so packages may contain NULs.
+class CStrEngine: public StorageEngine {
+public:
+	CStrEngine();
+	~CStrEngine();
+	int put(const string &key, const string &value);
+	int get(const string &key, string &value);
+	int remove(const string &key);
+	int scan(const string &prefix, const string &after, int limit,
+			vector<pair<string, string> > &out);
+	int forEachKey(StorageKeyVisitor visit, void *arg);
+	int snapshot();
+	int size();
+	const char *name();
+private:
+	typedef map<const char*, char*, charscmp> CStrMap;
+	CStrMap table;
+	pthread_mutex_t mutex;
+};
+
+#endif /* STORAGE_ENGINE_H_ */
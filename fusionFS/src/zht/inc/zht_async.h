@@ -0,0 +1,98 @@
+/*
+ * zht_async.h
+ *
+ *  Non-blocking request engine used by ZHTClient::insertAsync/lookupAsync/removeAsync.
+ *  One event loop thread drives a small set of TCP connections per server, so many
+ *  requests can be outstanding to many servers at once.
+ */
+
+#ifndef ZHT_ASYNC_H_
+#define ZHT_ASYNC_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include "zht_util.h"
+
+using namespace std;
+
+//called from the event loop thread once the server answered, result is only filled for lookup.
+typedef void (*ZHTCallback)(int status, const string &result, void *arg);
+
+class ZHTFuture {
+public:
+	ZHTFuture(int operation, ZHTCallback callback, void *arg);
+	~ZHTFuture();
+
+	bool ready(); //true once the answer (or an error) arrived
+	int wait(); //block until ready, return the status code
+	int wait(string &result); //same, also hand back the lookup result
+
+	void complete(int status, const string &result); //called by the engine only
+
+	int operation; //1 for look up, 2 for remove, 3 for insert, 4-6 batch versions
+	bool selfDestroy; //callback style: engine deletes the future after the callback
+
+private:
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool done;
+	int status;
+	string result;
+	ZHTCallback callback;
+	void *arg;
+};
+
+class ZHTAsyncEngine {
+public:
+	ZHTAsyncEngine(int connsPerHost);
+	~ZHTAsyncEngine();
+
+	int start(); //spawn the event loop thread, 0 if succeeded
+	void stop(); //fail everything in flight with -1, close connections, join the loop.
+	//Called from a callback it only makes the loop end, a later stop() cleans up.
+	int submit(const struct HostEntity &dest, const string &request,
+			ZHTFuture *future); //0 if queued, -1 if engine not running
+	int inFlight(); //requests sent or queued but not answered yet
+
+private:
+	struct Request {
+		string data;
+		ZHTFuture *future;
+	};
+
+	struct Conn {
+		int sock;
+		string endpoint; //"host:port", key into idle/waiting
+		Request req; //req.future == NULL means idle
+		size_t sent;
+		string in;
+	};
+
+	static void *loopEntry(void *engine);
+	void loop();
+	Conn *connect(const struct HostEntity &dest, const string &endpoint);
+	void dispatch(Conn *conn, const Request &req);
+	int flush(Conn *conn);
+	bool consume(Conn *conn, int &status, string &result);
+	void drop(Conn *conn, vector<Request> &failed);
+	void finish(Conn *conn);
+
+	int connsPerHost;
+	int efd;
+	int wakeFds[2];
+	bool running;
+	bool started; //the loop thread exists and is not joined yet
+	int pending;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	map<string, int> connCount; //open connections per endpoint
+	map<string, vector<Conn*> > idle;
+	map<string, deque<Request> > waiting; //queued while all connections of an endpoint are busy
+	map<string, struct HostEntity> endpoints;
+	vector<Conn*> conns;
+};
+
+#endif /* ZHT_ASYNC_H_ */
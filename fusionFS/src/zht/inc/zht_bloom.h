@@ -0,0 +1,82 @@
+/*
+ * zht_bloom.h
+ *
+ *  Negative lookups. A server keeps a Bloom filter of the keys it stores, cut into blocks of
+ *  ZHT_BLOOM_BLOCK bytes so that all bits of a key fall into one block. A lookup that asks
+ *  for it (mode ZHT_BLOOM_ASK) and misses gets the key's block back instead of "Empty";
+ *  ZHTNegativeCache keeps such blocks on the client for a short time and answers the
+ *  lookups of keys they rule out by itself.
+ */
+
+#ifndef ZHT_BLOOM_H_
+#define ZHT_BLOOM_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+using namespace std;
+
+#define ZHT_BLOOM_BLOCK 4096 //bytes, the unit a client fetches
+#define ZHT_BLOOM_BITS_PER_KEY 10 //about 1% false positives
+#define ZHT_BLOOM_HASHES 7
+#define ZHT_BLOOM_ASK 0x4e4547 //in the mode field of a lookup: send the block on a miss
+//a miss with a block: "-02", ZHT_BLOOM_MAGIC, int32 number of blocks, int32 block index
+//and the ZHT_BLOOM_BLOCK bytes of the block
+#define ZHT_BLOOM_MAGIC "ZB1"
+#define ZHT_BLOOM_HEADER 11
+#define ZHT_NEGATIVE_MAX_BLOCKS 4096 //client: blocks kept over all servers, 16 MB
+
+//where KEY's bits are, the same on servers and clients
+int bloomBlockOf(const string &key, int blocks);
+void bloomSet(char *block, const string &key);
+bool bloomTest(const char *block, const string &key);
+
+//server side: the filter of one table
+class ZHTBloom {
+public:
+	ZHTBloom();
+
+	void reset(long long keys); //empty, sized for KEYS keys
+	void add(const string &key);
+	bool mayContain(const string &key);
+	int blocks() { return nblocks; }
+	const char *block(int index) { return &bits[(size_t) index * ZHT_BLOOM_BLOCK]; }
+	long long capacity() { return (long long) nblocks * ZHT_BLOOM_BLOCK * 8 / ZHT_BLOOM_BITS_PER_KEY; }
+
+private:
+	vector<char> bits;
+	int nblocks;
+};
+
+//client side: blocks that came with misses, by member, good for the ttl
+class ZHTNegativeCache {
+public:
+	ZHTNegativeCache();
+	~ZHTNegativeCache();
+
+	void setTtl(int ttlMsec); //0 turns it off and drops what is kept
+	bool on() { return ttlUsec > 0; }
+	bool absent(int member, const string &key); //a fresh block of MEMBER rules KEY out
+	//DATA, LEN: what follows "-02" in a miss with a block, false if it is not one
+	bool store(int member, const char *data, int len);
+	void added(int member, const string &key); //an insert of this client, now visible to it
+
+private:
+	struct Block {
+		string bits;
+		long long fetched; //usec
+	};
+	struct Member {
+		int blocks; //of the server's filter when they were fetched, a change drops them
+		map<int, Block> cached;
+	};
+
+	map<int, Member> members;
+	int cachedBlocks;
+	long long ttlUsec;
+	pthread_mutex_t mutex;
+};
+
+#endif /* ZHT_BLOOM_H_ */
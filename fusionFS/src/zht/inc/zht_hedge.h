@@ -0,0 +1,73 @@
+/*
+ * zht_hedge.h
+ *
+ *  What the client's replica-aware reads know about the servers: recent read latencies,
+ *  from which the hedge delay (their p95) is taken, and consecutive failures per member.
+ *  A server that failed ZHT_SUSPECT_AFTER times in a row is suspect for ZHT_SUSPECT_USEC:
+ *  its reads go to the replicas first, and it is tried again afterwards. A server that
+ *  merely lost the race to a replica is no failure unless it does not answer at all.
+ */
+
+#ifndef ZHT_HEDGE_H_
+#define ZHT_HEDGE_H_
+
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+#define ZHT_HEDGE_SAMPLES 256 //latencies kept for the p95
+#define ZHT_HEDGE_MIN_USEC 200 //never hedge sooner, a p95 of a quiet run can be tiny
+#define ZHT_HEDGE_DEFAULT_USEC 5000 //until enough latencies are known
+#define ZHT_READ_TIMEOUT_USEC 2000000 //a read with replicas gives up after that long
+#define ZHT_SUSPECT_AFTER 3
+#define ZHT_SUSPECT_USEC 1000000
+#define ZHT_LOSERS_MAX 1024 //race losers watched for their late answer
+
+class ZHTHedge {
+public:
+	ZHTHedge();
+	~ZHTHedge();
+
+	//DELAY_USEC 0 hedges after the observed p95, -1 never. Negative arguments keep the value.
+	void configure(int delayUsec, int timeoutUsec, int suspectAfter, int suspectUsec);
+	int delay(); //usec after which a read goes to the next replica too, -1 never
+	int timeout();
+	void record(long long usec); //latency of an answered read
+	void failed(int member); //no answer, or the answer came too late
+	void succeeded(int member);
+	//MEMBER lost the race to a replica. FD, a dup of its connection that now belongs to
+	//the hedge, is watched by settle(): a late answer is no failure, none within timeout()
+	//is one, and so is a connection the server closed.
+	void lost(int member, int fd);
+	void settle();
+	bool suspect(int member);
+
+private:
+	struct Peer {
+		int failures; //in a row
+		long long suspectUntil;
+	};
+
+	struct Loser {
+		int member;
+		int fd;
+		long long since;
+	};
+
+	Peer &peer(int member);
+	void failedLocked(int member);
+
+	long long samples[ZHT_HEDGE_SAMPLES];
+	int sampleCount; //total recorded, the ring holds the last ZHT_HEDGE_SAMPLES
+	int p95; //recomputed every ZHT_HEDGE_SAMPLES / 8 samples
+	int delayUsec;
+	int timeoutUsec;
+	int suspectAfter;
+	int suspectUsec;
+	vector<Peer> peers; //by member list index
+	vector<Loser> losers;
+	pthread_mutex_t mutex;
+};
+
+#endif /* ZHT_HEDGE_H_ */
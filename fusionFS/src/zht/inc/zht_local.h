@@ -0,0 +1,33 @@
+/*
+ * zht_local.h
+ *
+ *  Embedded mode: zhtServerStart() runs a ZHT server on a thread of the calling process
+ *  (the server is built for that as obj/zht_server.o). The server then registers itself
+ *  here, and every ZHTClient of the process serves the requests whose key it owns by a
+ *  plain function call, without a socket, a connection or a copy through the kernel.
+ *  Other processes and servers reach it over the network as usual.
+ */
+
+#ifndef ZHT_LOCAL_H_
+#define ZHT_LOCAL_H_
+
+#include <string>
+#include "zht_util.h"
+
+using namespace std;
+
+//serve one request of this process: the reply, byte for byte what a socket would carry,
+//goes into buff (truncated to size); returns its length, -1 if there was none
+typedef int (*ZHTLocalServe)(const char *req, int len, char *buff, int size);
+
+//called by the embedded server once it is listening, with its own member list entry.
+//A NULL serve turns the in-process path off again.
+void zhtSetLocalServer(const string &host, int port, ZHTLocalServe serve);
+bool zhtIsLocal(const struct HostEntity &dest); //dest is the server running in this process
+int zhtLocalCall(const char *req, int len, char *buff, int size);
+
+//start the server of this process with the arguments of server_zht; returns once it
+//listens, -1 if it could not be started. Defined by obj/zht_server.o.
+int zhtServerStart(int port, const string &memberFile, const string &cfgFile, bool tcp);
+
+#endif /* ZHT_LOCAL_H_ */
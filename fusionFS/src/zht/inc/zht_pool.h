@@ -0,0 +1,56 @@
+/*
+ * zht_pool.h
+ *
+ *  Connections of the blocking ZHTClient calls, pooled per server endpoint (host and port).
+ *  A caller checks a connection out, runs one request/reply on it and checks it back in,
+ *  so concurrent callers never share a socket. Idle connections are checked before they
+ *  are handed out again; a broken one is closed and replaced by a new connection.
+ */
+
+#ifndef ZHT_POOL_H_
+#define ZHT_POOL_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "zht_util.h"
+
+using namespace std;
+
+#define ZHT_POOL_SIZE 8 //connections per endpoint
+
+class ZHTConnPool {
+public:
+	ZHTConnPool(int maxPerEndpoint = ZHT_POOL_SIZE);
+	~ZHTConnPool();
+
+	//a connected socket to DEST for the caller alone, waits while all maxPerEndpoint
+	//connections are checked out. -1 if no connection can be made.
+	int checkout(const struct HostEntity &dest);
+	//hand SOCK back after use. BROKEN (a send or receive failed, or the reply was not read
+	//completely) closes it instead of keeping it for the next caller.
+	void checkin(const struct HostEntity &dest, int sock, bool broken);
+	void setSize(int maxPerEndpoint);
+	void closeAll(); //close the idle connections
+
+private:
+	struct Endpoint {
+		vector<int> idle;
+		int open; //idle and checked out
+		bool resolved;
+		sockaddr_in addr;
+	};
+
+	Endpoint &endpoint(const struct HostEntity &dest);
+	int connectTo(const struct HostEntity &dest, Endpoint &ep);
+	bool healthy(int sock);
+
+	map<pair<string, int>, Endpoint> endpoints; //(host, port)
+	int maxPerEndpoint;
+	pthread_mutex_t mutex;
+	pthread_cond_t freed; //a connection came back or was closed
+};
+
+#endif /* ZHT_POOL_H_ */
@@ -0,0 +1,79 @@
+/*
+ * zht_udp.h
+ *
+ *  Datagram transport used by ZHTClient when it is initialized for UDP. Every request
+ *  carries an id the server echoes in its reply; the client retransmits until the reply
+ *  arrives (doubling the timeout each time) and the server answers a retransmitted update
+ *  from its duplicate cache instead of running it again. Batches go out with sendmmsg and
+ *  come back with recvmmsg. Every call takes a socket of its own out of the transport for
+ *  its whole round, so threads sharing a client wait for their own replies only.
+ */
+
+#ifndef ZHT_UDP_H_
+#define ZHT_UDP_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "zht_util.h"
+
+using namespace std;
+
+//datagram layout: ZHT_UDP_MAGIC (4) | request id (8) | request or reply, same bytes as over TCP.
+//The leading zero byte never starts a serialized Package, so the server still takes bare
+//requests from older clients (and answers them bare).
+#define ZHT_UDP_MAGIC "\0ZU1"
+#define ZHT_UDP_HEADER 12
+#define ZHT_UDP_MAX_PAYLOAD (65507 - ZHT_UDP_HEADER)
+#define ZHT_UDP_BATCH 32 //datagrams per sendmmsg/recvmmsg
+#define ZHT_UDP_TIMEOUT_USEC 20000 //first retransmission, doubled every time
+#define ZHT_UDP_RETRIES 6
+
+void udpPutHeader(char *buff, unsigned long long id);
+//true and the id if buff starts with a header
+bool udpGetHeader(const char *buff, int len, unsigned long long &id);
+
+class ZHTUdpTransport {
+public:
+	ZHTUdpTransport();
+	~ZHTUdpTransport();
+
+	int open(); //0 if the socket is ready
+	void setTimeout(int usec, int retries);
+
+	//send REQUEST to DEST and wait for its reply, 0 if one came back, -1 if every
+	//retransmission timed out
+	int call(const struct HostEntity &dest, const string &request, string &reply);
+	//all requests at once, REQUESTS[i] goes to DESTS[i]. STATUSES[i] is 0 and REPLIES[i]
+	//filled for every answered request, -1 for the ones that timed out.
+	void callMany(const vector<struct HostEntity> &dests, const vector<string> &requests,
+			vector<string> &replies, vector<int> &statuses);
+
+private:
+	struct Socket {
+		int sock;
+		char *recvBuf; //ZHT_UDP_BATCH datagrams of 64K
+		long long recvTimeout; //SO_RCVTIMEO currently set on sock, usec
+	};
+
+	Socket *newSocket();
+	Socket *checkout(); //an idle socket or a new one, NULL if none can be made
+	void checkin(Socket *s);
+	bool resolve(const struct HostEntity &dest, sockaddr_in &addr);
+	int sendBatch(int sock, const vector<sockaddr_in> &addrs,
+			const vector<string> &requests, const vector<int> &which,
+			unsigned long long base);
+
+	vector<Socket*> all;
+	vector<Socket*> idle; //not in a call; replies that came too late are skipped by id
+	bool opened;
+	unsigned long long nextId;
+	int timeoutUsec;
+	int retries;
+	pthread_mutex_t mutex; //the sockets, ids, settings and addrCache, not the calls
+	map<pair<string, int>, sockaddr_in> addrCache; //(host, port), resolved once
+};
+
+#endif /* ZHT_UDP_H_ */
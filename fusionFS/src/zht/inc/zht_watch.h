@@ -0,0 +1,100 @@
+/*
+ * zht_watch.h
+ *
+ *  Watches: a client registers a key or a prefix with the server (operation 13, 14 drops
+ *  it again) over a connection of its own, and the server pushes a short notice down that
+ *  connection whenever a watched key is changed or removed. ZHTWatcher is the client half,
+ *  one such connection per server and a thread that reads them and runs the callback. The
+ *  server half lives in server_general.cpp.
+ */
+
+#ifndef ZHT_WATCH_H_
+#define ZHT_WATCH_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <pthread.h>
+#include "zht_util.h"
+
+using namespace std;
+
+//server to client on a watch connection: int32 length of the rest, one event byte and the
+//key, or for ZHT_WATCH_ACK the int32 status of the watch/unwatch request it answers.
+//Requests go the other way as ordinary Packages, one at a time: each waits for its ack.
+#define ZHT_WATCH_ACK 'A'
+#define ZHT_WATCH_CHANGED 'C' //inserted, overwritten, leased
+#define ZHT_WATCH_REMOVED 'R' //removed, released, expired
+//client only, passed to the callback with an empty key: the connection to the member went
+//away and notices may have been missed, then it is back and every watch registered again
+#define ZHT_WATCH_LOST 'L'
+#define ZHT_WATCH_RESTORED 'S'
+
+#define ZHT_WATCH_TIMEOUT_USEC 2000000 //watch()/unwatch() give up waiting for the ack
+#define ZHT_WATCH_RETRY_USEC 1000000 //a lost connection that had watches is retried that often
+
+//runs on the watcher's thread, which must not be blocked for long nor call watch() itself.
+//MEMBER is the index of the server in the member list.
+typedef void (*ZHTWatchCallback)(int event, const string &key, int member, void *arg);
+
+class ZHTWatcher {
+public:
+	ZHTWatcher(const vector<struct HostEntity> &members);
+	~ZHTWatcher();
+
+	void setCallback(ZHTWatchCallback callback, void *arg);
+	//register (OPERATION 13) or drop (14) a watch on MEMBER: 0 once the server acknowledged
+	//it, its status if it refused, -1 if it could not be reached or did not answer in time
+	int request(int member, int operation, const string &key, bool prefix);
+
+private:
+	struct Request {
+		string data;
+		int operation;
+		pair<string, bool> watch; //key, prefix
+		bool user; //from request(), else the registration of a reconnected watch
+		bool sent;
+		bool done;
+		bool abandoned; //request() gave up on it, the thread deletes it
+		int status;
+	};
+
+	struct Event {
+		int event;
+		string key;
+		int member;
+	};
+
+	struct Conn {
+		int sock;
+		string in;
+		deque<Request*> outbox; //the head is the one sent, waiting for its ack
+		set<pair<string, bool> > watches; //acknowledged, registered again on reconnect
+		int resyncing; //registrations of a reconnect still in the outbox
+		long long retryAt;
+		bool lost; //LOST was reported, RESTORED is due once the watches are back
+	};
+
+	static void *loopEntry(void *watcher);
+	void loop();
+	int start();
+	void connect(int member, vector<Event> &events);
+	void lose(int member, vector<Event> &events);
+	void sendNext(int member, vector<Event> &events);
+	void consume(int member, vector<Event> &events);
+	void finish(Request *req, int status);
+	void wake();
+
+	vector<struct HostEntity> members;
+	vector<Conn> conns;
+	ZHTWatchCallback callback;
+	void *arg;
+	bool running;
+	pthread_t thread;
+	int wakeFds[2];
+	pthread_mutex_t mutex;
+	pthread_cond_t answered;
+};
+
+#endif /* ZHT_WATCH_H_ */
@@ -43,8 +43,71 @@ int c_zht_remove2(const char *key) {
 	return c_zht_remove2_std(zhtClient, key);
 }
 
+int c_zht_put(const char *key, const char *value, size_t n) {
+
+	return c_zht_put_std(zhtClient, key, value, n);
+}
+
+int c_zht_get(const char *key, char *result, size_t *n) {
+
+	return c_zht_get_std(zhtClient, key, result, n);
+}
+
+int c_zht_erase(const char *key) {
+
+	return c_zht_erase_std(zhtClient, key);
+}
+
+int c_zht_negative_cache(int ttlMsec) {
+
+	return c_zht_negative_cache_std(zhtClient, ttlMsec);
+}
+
 int c_zht_teardown() {
 
-	return c_zht_teardown_std(zhtClient);
+	int ret = c_zht_teardown_std(zhtClient);
+	zhtClient = NULL;
+
+	return ret;
 }
 
+
+ZHTFuture_c c_zht_insert_async(const char *pair) {
+
+	return c_zht_insert_async_std(zhtClient, pair);
+}
+
+ZHTFuture_c c_zht_lookup_async(const char *pair) {
+
+	return c_zht_lookup_async_std(zhtClient, pair);
+}
+
+ZHTFuture_c c_zht_remove_async(const char *pair) {
+
+	return c_zht_remove_async_std(zhtClient, pair);
+}
+
+int c_zht_insert_cb(const char *pair, c_zht_callback callback, void *arg) {
+
+	return c_zht_insert_cb_std(zhtClient, pair, callback, arg);
+}
+
+int c_zht_lookup_cb(const char *pair, c_zht_callback callback, void *arg) {
+
+	return c_zht_lookup_cb_std(zhtClient, pair, callback, arg);
+}
+
+int c_zht_remove_cb(const char *pair, c_zht_callback callback, void *arg) {
+
+	return c_zht_remove_cb_std(zhtClient, pair, callback, arg);
+}
+
+int c_zht_ready(ZHTFuture_c future) {
+
+	return c_zht_ready_std(future);
+}
+
+int c_zht_wait(ZHTFuture_c future, char *result, size_t *n) {
+
+	return c_zht_wait_std(future, result, n);
+}
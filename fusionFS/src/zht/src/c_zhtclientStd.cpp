@@ -19,6 +19,7 @@ int c_zht_init_std(ZHTClient_c * zhtClient, const char *memberConfig,
 
 	if (zhtcppClient->initialize(zhtStr, memberStr, tcp) != 0) {
 		printf("Crap! ZHTClient initialization failed, program exits.");
+		delete zhtcppClient;
 
 		return -1;
 	}
@@ -121,10 +122,148 @@ int c_zht_remove2_std(ZHTClient_c zhtClient, const char *key) {
 	return zhtcppClient->remove(package.SerializeAsString());
 }
 
+int c_zht_put_std(ZHTClient_c zhtClient, const char *key, const char *value,
+		size_t n) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	return zhtcppClient->put(key, string(value, n));
+}
+
+int c_zht_get_std(ZHTClient_c zhtClient, const char *key, char *result,
+		size_t *n) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	string value;
+	int ret = zhtcppClient->get(key, value);
+
+	size_t room = *n;
+	*n = value.size();
+	if (value.size() > room)
+		return -4;
+	memcpy(result, value.data(), value.size());
+
+	return ret;
+}
+
+int c_zht_erase_std(ZHTClient_c zhtClient, const char *key) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	return zhtcppClient->erase(key);
+}
+
+int c_zht_negative_cache_std(ZHTClient_c zhtClient, int ttlMsec) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	return zhtcppClient->setNegativeCache(ttlMsec);
+}
+
 int c_zht_teardown_std(ZHTClient_c zhtClient) {
 
 	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
 
-	return zhtcppClient->tearDownTCP();
+	delete zhtcppClient; //closes its connections and stops its threads
+	return 0;
+}
+
+
+ZHTFuture_c c_zht_insert_async_std(ZHTClient_c zhtClient, const char *pair) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	string str(pair);
+
+	return (ZHTFuture_c) zhtcppClient->insertAsync(str);
+}
+
+ZHTFuture_c c_zht_lookup_async_std(ZHTClient_c zhtClient, const char *pair) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	string str(pair);
+
+	return (ZHTFuture_c) zhtcppClient->lookupAsync(str);
 }
 
+ZHTFuture_c c_zht_remove_async_std(ZHTClient_c zhtClient, const char *pair) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	string str(pair);
+
+	return (ZHTFuture_c) zhtcppClient->removeAsync(str);
+}
+
+struct c_callback_arg {
+	c_zht_callback callback;
+	void *arg;
+};
+
+static void c_callback_bridge(int status, const string &result, void *arg) {
+
+	struct c_callback_arg *cb = (struct c_callback_arg *) arg;
+
+	cb->callback(status, result.data(), result.size(), cb->arg);
+
+	delete cb;
+}
+
+int c_zht_insert_cb_std(ZHTClient_c zhtClient, const char *pair,
+		c_zht_callback callback, void *arg) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	struct c_callback_arg *cb = new c_callback_arg;
+	cb->callback = callback;
+	cb->arg = arg;
+
+	return zhtcppClient->insertAsync(string(pair), c_callback_bridge, cb);
+}
+
+int c_zht_lookup_cb_std(ZHTClient_c zhtClient, const char *pair,
+		c_zht_callback callback, void *arg) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	struct c_callback_arg *cb = new c_callback_arg;
+	cb->callback = callback;
+	cb->arg = arg;
+
+	return zhtcppClient->lookupAsync(string(pair), c_callback_bridge, cb);
+}
+
+int c_zht_remove_cb_std(ZHTClient_c zhtClient, const char *pair,
+		c_zht_callback callback, void *arg) {
+
+	ZHTClient * zhtcppClient = (ZHTClient *) zhtClient;
+
+	struct c_callback_arg *cb = new c_callback_arg;
+	cb->callback = callback;
+	cb->arg = arg;
+
+	return zhtcppClient->removeAsync(string(pair), c_callback_bridge, cb);
+}
+
+int c_zht_ready_std(ZHTFuture_c future) {
+
+	return ((ZHTFuture *) future)->ready() ? 1 : 0;
+}
+
+int c_zht_wait_std(ZHTFuture_c future, char *result, size_t *n) {
+
+	ZHTFuture *cppFuture = (ZHTFuture *) future;
+
+	string resultStr;
+	int ret = cppFuture->wait(resultStr);
+	delete cppFuture;
+
+	if (result != NULL)
+		memcpy(result, resultStr.data(), resultStr.size());
+	if (n != NULL)
+		*n = resultStr.size();
+
+	return ret;
+}
@@ -103,7 +103,7 @@ static const ProtobufCFieldDescriptor package__field_descriptors[9] =
     "listItem",
     5,
     PROTOBUF_C_LABEL_REPEATED,
-    PROTOBUF_C_TYPE_STRING,
+    PROTOBUF_C_TYPE_BYTES,
     PROTOBUF_C_OFFSETOF(Package, n_listitem),
     PROTOBUF_C_OFFSETOF(Package, listitem),
     NULL,
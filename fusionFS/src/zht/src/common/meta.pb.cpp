@@ -83,7 +83,7 @@ void protobuf_AddDesc_meta_2eproto() {
   ::google::protobuf::DescriptorPool::InternalAddGeneratedFile(
     "\n\nmeta.proto\"\250\001\n\007Package\022\023\n\013virtualPath\030"
     "\001 \001(\t\022\013\n\003num\030\002 \001(\005\022\024\n\014realFullPath\030\003 \001(\t"
-    "\022\r\n\005isDir\030\004 \001(\010\022\020\n\010listItem\030\005 \003(\t\022\020\n\010ope"
+    "\022\r\n\005isDir\030\004 \001(\010\022\020\n\010listItem\030\005 \003(\014\022\020\n\010ope"
     "nMode\030\006 \001(\005\022\014\n\004mode\030\007 \001(\005\022\021\n\tOperation\030\010"
     " \001(\005\022\021\n\treplicaNo\030\t \001(\005", 183);
   ::google::protobuf::MessageFactory::InternalRegisterGeneratedFile(
@@ -274,16 +274,13 @@ bool Package::MergePartialFromCodedStream(
         break;
       }
       
-      // repeated string listItem = 5;
+      // repeated bytes listItem = 5;
       case 5: {
         if (::google::protobuf::internal::WireFormatLite::GetTagWireType(tag) ==
             ::google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
          parse_listItem:
-          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+          DO_(::google::protobuf::internal::WireFormatLite::ReadBytes(
                 input, this->add_listitem()));
-          ::google::protobuf::internal::WireFormat::VerifyUTF8String(
-            this->listitem(0).data(), this->listitem(0).length(),
-            ::google::protobuf::internal::WireFormat::PARSE);
         } else {
           goto handle_uninterpreted;
         }
@@ -402,12 +399,9 @@ void Package::SerializeWithCachedSizes(
     ::google::protobuf::internal::WireFormatLite::WriteBool(4, this->isdir(), output);
   }
   
-  // repeated string listItem = 5;
+  // repeated bytes listItem = 5;
   for (int i = 0; i < this->listitem_size(); i++) {
-  ::google::protobuf::internal::WireFormat::VerifyUTF8String(
-    this->listitem(i).data(), this->listitem(i).length(),
-    ::google::protobuf::internal::WireFormat::SERIALIZE);
-    ::google::protobuf::internal::WireFormatLite::WriteString(
+    ::google::protobuf::internal::WireFormatLite::WriteBytes(
       5, this->listitem(i), output);
   }
   
@@ -469,13 +463,10 @@ void Package::SerializeWithCachedSizes(
     target = ::google::protobuf::internal::WireFormatLite::WriteBoolToArray(4, this->isdir(), target);
   }
   
-  // repeated string listItem = 5;
+  // repeated bytes listItem = 5;
   for (int i = 0; i < this->listitem_size(); i++) {
-    ::google::protobuf::internal::WireFormat::VerifyUTF8String(
-      this->listitem(i).data(), this->listitem(i).length(),
-      ::google::protobuf::internal::WireFormat::SERIALIZE);
     target = ::google::protobuf::internal::WireFormatLite::
-      WriteStringToArray(5, this->listitem(i), target);
+      WriteBytesToArray(5, this->listitem(i), target);
   }
   
   // optional int32 openMode = 6;
@@ -566,10 +557,10 @@ int Package::ByteSize() const {
     }
     
   }
-  // repeated string listItem = 5;
+  // repeated bytes listItem = 5;
   total_size += 1 * this->listitem_size();
   for (int i = 0; i < this->listitem_size(); i++) {
-    total_size += ::google::protobuf::internal::WireFormatLite::StringSize(
+    total_size += ::google::protobuf::internal::WireFormatLite::BytesSize(
       this->listitem(i));
   }
   
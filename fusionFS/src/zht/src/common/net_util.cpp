@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -48,6 +49,8 @@ int makeSvrSocket(int port, bool tcp) { //only for svr
 	}
 
 	if (tcp == true) {
+		//a restarted server must not wait for the old connections to leave TIME_WAIT
+		reuseSock(svrSock);
 		//for TCP works. may not work for UDP
 		if (bind(svrSock, (struct sockaddr *) &svrAdd_in,
 				sizeof(struct sockaddr)) < 0) {
@@ -145,7 +148,11 @@ int makeClientSocket(const char* host, int port, bool tcp) {
 //general send, include TCP & UDP
 int generalSendTo(const char* host, int port, int to_sock, const char* buff,
 		bool tcp) {
-	int buff_size = strlen(buff);
+	return generalSendTo(host, port, to_sock, buff, strlen(buff), tcp);
+}
+
+int generalSendTo(const char* host, int port, int to_sock, const char* buff,
+		int buff_size, bool tcp) {
 	int sentSize;
 
 //	cout << buff_size << "{" << buff << "}" << endl;
@@ -158,7 +165,7 @@ int generalSendTo(const char* host, int port, int to_sock, const char* buff,
 			return -1;
 		}
 	} else { //UDP
-		sentSize = udpSendTo(to_sock, host, port, buff);
+		sentSize = udpSendTo(to_sock, host, port, buff, buff_size);
 	}
 	return sentSize;
 }
@@ -294,6 +301,37 @@ int generalReveiveTCP(int sock, void *buffer, size_t size, int flags) {
 	return recv(sock, buffer, size, flags);
 }
 
+//exactly size bytes into buffer, -1 if the connection failed or closed first
+static int recvAllTCP(int sock, char *buffer, int size) {
+	int got = 0;
+	while (got < size) {
+		int r = recv(sock, buffer + got, size - got, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return got;
+}
+
+int recvReplyTCP(int sock, char *buffer, int size) {
+	int32_t length;
+	if (recvAllTCP(sock, (char*) &length, sizeof(int32_t)) < 0 || length < 0)
+		return -1;
+	int kept = length < size ? length : size;
+	if (recvAllTCP(sock, buffer, kept) < 0)
+		return -1;
+	char rest[4096];
+	for (int left = length - kept; left > 0;) { //too long for buffer, drop the tail
+		int n = recvAllTCP(sock, rest, left < (int) sizeof(rest) ? left : sizeof(rest));
+		if (n < 0)
+			return -1;
+		left -= n;
+	}
+	return kept;
+}
+
 int generalReceiveUDP(int sock, char* host, int port, void *buffer, size_t size,
 		int flags, bool tcp) {
 	unsigned int addrLen;
@@ -331,6 +369,10 @@ int simpleRecvUDP(int sock, void *buffer, size_t size, int flag,
 
 // toSock can be made by makeClientSock()
 int udpSendTo(int toSock, const char* host, int port, const char* buff) {
+	return udpSendTo(toSock, host, port, buff, strlen(buff));
+}
+
+int udpSendTo(int toSock, const char* host, int port, const char* buff, int len) {
 	struct hostent *hp;
 	struct sockaddr_in server;
 	server.sin_family = AF_INET;
@@ -338,7 +380,7 @@ int udpSendTo(int toSock, const char* host, int port, const char* buff) {
 
 	bcopy((char *) hp->h_addr, (char *) &server.sin_addr, hp->h_length);
 	server.sin_port = htons(port);
-	int ret = sendto(toSock, buff, strlen(buff), 0, (struct sockaddr*) &server,
+	int ret = sendto(toSock, buff, len, 0, (struct sockaddr*) &server,
 			sizeof(struct sockaddr));
 	if (ret < 0) {
 		cerr << "net_util.cpp: udpSendTo error: " << strerror(errno) << endl;
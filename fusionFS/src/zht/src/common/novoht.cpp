@@ -1,23 +1,23 @@
 #include <stddef.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <new>
 #include <string>
 #include <locale>
 #include <stdio.h>
 #include <iostream>
+#include <map>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
 #include "../../inc/novoht.h"
 
 NoVoHT::NoVoHT(){
-   kvpairs = new kvpair*[1000];
-   size = 1000;
-   numEl = 0;
-   magicNumber = 1000;
-   resizeNum = -1;
-   resizing=false;
-   map_lock=false;
-   write_lock=false;
-   resizing = false;
-   oldpairs = NULL;
+   init("", 1000, 1000, 0, 0);
 }
 
 /*
@@ -37,42 +37,13 @@ NoVoHT::NoVoHT(char * f){
 }
 */
 NoVoHT::NoVoHT(string f,int s, int m){
-   kvpairs = new kvpair*[s];
-   for (int x = 0;x<s;x++){
-      kvpairs[x] = NULL;
-   }
-   resizing=false;
-   map_lock=false;
-   write_lock=false;
-   magicNumber = m;
-   nRem = 0;
-   resizeNum = 0;
-   size = s;
-   numEl=0;
-   filename=f;
-   dbfile = fopen(f.c_str(), "r+");
-   if (!dbfile) dbfile = fopen(f.c_str(), "w+");
-   readFile();
-   oldpairs = NULL;
+   init(f, s, m, 0, 0);
 }
 NoVoHT::NoVoHT(string f,int s, int m, float r){
-   kvpairs = new kvpair*[s];
-   for (int x = 0;x<s;x++){
-      kvpairs[x] = NULL;
-   }
-   resizing=false;
-   map_lock=false;
-   write_lock=false;
-   magicNumber = m;
-   nRem = 0;
-   resizeNum = r;
-   size = s;
-   numEl=0;
-   filename=f;
-   dbfile = fopen(f.c_str(), "r+");
-   if (!dbfile) dbfile = fopen(f.c_str(), "w+");
-   readFile();
-   oldpairs = NULL;
+   init(f, s, m, r, 0);
+}
+NoVoHT::NoVoHT(string f,int s, int m, float r, long c){
+   init(f, s, m, r, c);
 }
 /*
 NoVoHT::NoVoHT(char * f, NoVoHT *map){
@@ -82,179 +53,835 @@ NoVoHT::NoVoHT(char * f, NoVoHT *map){
    file = f;
    readFile();
 }*/
-NoVoHT::~NoVoHT(){
-   if (dbfile){
-      writeFile();
-      fclose(dbfile);
+
+void NoVoHT::init(string f, int s, int m, float r, long c){
+   //round up so that a bucket and all its keys share one stripe
+   if (s < NOVOHT_STRIPES) s = NOVOHT_STRIPES;
+   s = (s + NOVOHT_STRIPES - 1) / NOVOHT_STRIPES * NOVOHT_STRIPES;
+   kvpairs = (kvpair**) calloc(s, sizeof(kvpair*));
+   if (kvpairs == NULL) throw std::bad_alloc();
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      pthread_mutex_init(&stripes[x], NULL);
    }
+   pthread_mutex_init(&file_lock, NULL);
+   pthread_cond_init(&snapshot_done, NULL);
+   pthread_cond_init(&log_synced, NULL);
+   pthread_cond_init(&log_grown, NULL);
+   pthread_mutex_init(&value_lock, NULL);
+   pthread_rwlock_init(&values_rw, NULL);
+   pthread_mutex_init(&order_lock, NULL);
+   ordered = NULL;
+   pthread_mutex_init(&wheel_lock, NULL);
+   wheelTick = novohtNowUsec() / NOVOHT_WHEEL_TICK;
+   expired = 0;
+   magicNumber = m;
+   logged = 0;
+   resizeNum = r;
+   resizes = snapshots = collections = 0;
+   size = s;
+   numEl=0;
+   filename=f;
+   oldpairs = NULL;
+   oldsize = 0;
+   unmigrated = 0;
+   helpCursor = 0;
+   dbfd = -1;
+   loading = false;
+   snapshotting = false;
+   snapshotterStarted = false;
+   appended = synced = 0;
+   syncing = false;
+   lastSync = 0;
+   deferred = false;
+   setDurability(NOVOHT_SYNC_ASYNC);
+   spill = false;
+   cache = NULL;
+   writeGen = firstGen = 0;
+   writeFd = -1;
+   writeEnd = valueLive = valueGarbage = 0;
+   if (!filename.empty()) openValueFiles(c);
+   readFile();
+}
+
+NoVoHT::~NoVoHT(){
+   pthread_mutex_lock(&file_lock);
+   while (snapshotting) pthread_cond_wait(&snapshot_done, &file_lock);
+   waitSync();
+   if (dbfd >= 0 && flushLog() && durability != NOVOHT_SYNC_MEMORY) syncFiles(dbfd);
+   pthread_mutex_unlock(&file_lock);
+   if (snapshotterStarted) pthread_join(snapshotter, NULL);
+   if (dbfd >= 0) close(dbfd);
+   closeValueFiles();
    for (int i = 0; i < size; i++){
       fsu(kvpairs[i]);
    }
-   delete [] kvpairs;
+   free(kvpairs);
+   if (oldpairs != NULL){
+      for (int i = 0; i < oldsize; i++){
+         fsu(oldpairs[i]);
+      }
+      free(oldpairs);
+   }
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      pthread_mutex_destroy(&stripes[x]);
+   }
+   pthread_cond_destroy(&snapshot_done);
+   pthread_cond_destroy(&log_synced);
+   pthread_cond_destroy(&log_grown);
+   pthread_mutex_destroy(&file_lock);
+   pthread_rwlock_destroy(&values_rw);
+   pthread_mutex_destroy(&value_lock);
+   delete ordered;
+   pthread_mutex_destroy(&order_lock);
+   pthread_mutex_destroy(&wheel_lock);
+}
+
+//stripes are always taken in ascending order
+void NoVoHT::lockAll(){
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      pthread_mutex_lock(&stripes[x]);
+   }
+}
+
+void NoVoHT::unlockAll(){
+   for (int x = NOVOHT_STRIPES-1; x >= 0; x--){
+      pthread_mutex_unlock(&stripes[x]);
+   }
 }
 
 //0 success, -1 no insert, -2 no write
-int NoVoHT::put(string k, string v){
-   //while(resizing || map_lock){ /* Wait till done */}
-   while(map_lock){ }
-   map_lock=true;
-   if (numEl >= size*resizeNum) {
-      if (resizeNum !=0){
-         resize(size*2);
-      }
+int NoVoHT::put(const string &k, const string &v){
+   return store(k, v, NULL);
+}
+
+//in spill mode ref says where v already is (log replay), without one v is appended to the
+//value file first
+int NoVoHT::store(const string &k, const string &v, const vref *ref){
+   unsigned long long h = hash(k);
+   int x = h%NOVOHT_STRIPES;
+   pthread_mutex_lock(&stripes[x]);   //oldpairs and size only change under every stripe
+   if (resizeNum != 0 && oldpairs == NULL
+         && __sync_fetch_and_add(&numEl, 0) >= size*resizeNum) {
+      int ns = size*2;
+      pthread_mutex_unlock(&stripes[x]);
+      resize(ns);   //takes every stripe itself, so not while holding ours
+      pthread_mutex_lock(&stripes[x]);
    }
-   int slot;
-   slot = hash(k)%size;
-   kvpair *cur = kvpairs[slot];
-   kvpair *add = new kvpair;
-   add->key = k;
-   add->val = v;
-   add->next = NULL;
-   if (cur == NULL){
-      kvpairs[slot] = add;
-      numEl++;
-      map_lock=false;
-      return write(add);
+   bool moved = migrate(x, NOVOHT_MIGRATE_STEP);
+   vref r;
+   if (spill && ref == NULL && appendValue(v, r) != 0){
+      pthread_mutex_unlock(&stripes[x]);
+      if (moved || helpMigrate()) finishResize();
+      return -2;
    }
-   while (cur->next != NULL){
-      if (k.compare(cur->key) == 0) {
-         cur->val = v;
-         mark(cur->pos);
-         delete add;
-         map_lock=false;
-         return write(cur);
-      }
+   kvpair **slot = bucket(h);
+   kvpair *cur = *slot, *last = NULL;
+   while (cur != NULL && k.compare(cur->key) != 0){
+      last = cur;
       cur = cur->next;
    }
-   if (k.compare(cur->key) == 0) {
-      cur->val=v;
-      mark(cur->pos);
-      delete add;
-      map_lock=false;
-      return write(cur);
-   }
-   cur->next = add;
-   numEl++;
-   map_lock=false;
-   return write(add);
+   if (cur == NULL){
+      cur = new kvpair;
+      cur->key = k;
+      cur->next = NULL;
+      cur->ref.gen = 0;
+      cur->expires = 0;
+      if (last == NULL) *slot = cur;
+      else last->next = cur;
+      __sync_fetch_and_add(&numEl, 1);
+      if (ordered) orderAdd(k);
+   } else cur->expires = 0;   //a new value starts without a deadline, a stale wheel entry is ignored
+   int ret;
+   if (!spill){
+      cur->val = v;
+      ret = write(NOVOHT_LOG_PUT, k, v);
+   } else if (ref == NULL) ret = keepRef(cur, r, &v);
+   else ret = keepRef(cur, *ref, NULL);
+   pthread_mutex_unlock(&stripes[x]);
+   if (moved || helpMigrate()) finishResize();
+   if (ret == 0) ret = syncLog();
+   maybeSnapshot();
+   return ret;
 }
 
 string* NoVoHT::get(string k){
-   while(map_lock){ /* Wait till done */}
-   int loc = hash(k)%size;
-   kvpair *cur = kvpairs[loc];
+   unsigned long long h = hash(k);
+   pthread_mutex_t *lock = &stripes[h%NOVOHT_STRIPES];
+   pthread_mutex_lock(lock);
+   kvpair *cur = *bucket(h);
    while (cur != NULL && !k.empty()){
-      if (k.compare(cur->key) == 0) return &(cur->val);
+      if (k.compare(cur->key) == 0) break;
       cur = cur->next;
    }
-   return NULL;
+   if (cur != NULL && cur->expires != 0 && cur->expires <= novohtNowUsec()) cur = NULL;
+   pthread_mutex_unlock(lock);
+   return (cur == NULL || k.empty() || spill ? NULL : &(cur->val));
 }
 
-//return 0 for success, -1 fail to remove, -2+ write failure
-int NoVoHT::remove(string k){
-   while(map_lock){ /* Wait till done */}
-   int ret =0;
-   int loc = hash(k)%size;
-   kvpair *cur = kvpairs[loc];
-   if (cur == NULL) return ret-1;       //not found
-   if (k.compare(cur->key) ==0) {
-      fpos_t toRem = kvpairs[loc]->pos;
-      kvpairs[loc] = cur->next;
-      numEl--;
-      ret+=mark(toRem);
-      delete cur;
-      nRem++;
-      if (nRem == magicNumber) {ret+=writeFile(); nRem = 0;} //write and save write success
-      return ret;
-   }
-   while(cur != NULL){
-      if (cur->next == NULL) return ret-1;
-      else if (k.compare(cur->next->key)==0){
-         kvpair *r = cur->next;
-         cur->next = r->next;
-         ret+=mark(r->pos);              //mark and sace status code
-         delete r;
-         numEl--;
-         nRem++;
-         if (nRem == magicNumber) {ret+=writeFile(); nRem = 0;}              //mark and sace status code
+int NoVoHT::get(const string &k, string &v){
+   if (k.empty()) return -1;
+   unsigned long long h = hash(k);
+   pthread_mutex_t *lock = &stripes[h%NOVOHT_STRIPES];
+   pthread_mutex_lock(lock);
+   kvpair *cur = *bucket(h);
+   while (cur != NULL){
+      if (k.compare(cur->key) == 0) {
+         if (cur->expires != 0 && cur->expires <= novohtNowUsec()) break;   //expireDue removes it
+         int ret = 0;
+         if (spill) ret = fetchValue(cur, v);
+         else v = cur->val;
+         pthread_mutex_unlock(lock);
          return ret;
       }
       cur = cur->next;
    }
-   return ret-1;        //not found
+   pthread_mutex_unlock(lock);
+   return -1;
 }
 
-//return 0 if success -2 if failed
-//write hashmap to file
-int NoVoHT::writeFile(){
-   while (write_lock){}
-   if (!dbfile)return (filename.compare("") == 0 ? 0 : -2);
-   write_lock=true;
+//return 0 for success, -1 fail to remove, -2+ write failure
+int NoVoHT::remove(const string &k){
+   return removeIf(k, -1);
+}
+
+//remove, but with IFEXPIRES >= 0 only while the key's deadline is still that one
+int NoVoHT::removeIf(const string &k, long long ifExpires){
+   unsigned long long h = hash(k);
+   int x = h%NOVOHT_STRIPES;
+   pthread_mutex_lock(&stripes[x]);
    int ret =0;
-   rewind(dbfile);
-   ftruncate(fileno(dbfile), 0);
-   for (int i=0; i<size;i++){
-      kvpair *cur = kvpairs[i];
-      while (cur != NULL){
-         if(!cur->key.empty() && !cur->val.empty()){
-                fgetpos(dbfile, &(cur->pos));
-                fprintf(dbfile, "%s\t%s\t", cur->key.c_str(), cur->val.c_str());
+   bool moved = migrate(x, NOVOHT_MIGRATE_STEP);
+   kvpair **slot = bucket(h);
+   kvpair *cur = *slot;
+   kvpair *prev = NULL;
+   while (cur != NULL && k.compare(cur->key) != 0){
+      prev = cur;
+      cur = cur->next;
+   }
+   if (cur == NULL || (ifExpires >= 0 && cur->expires != ifExpires)) {
+      pthread_mutex_unlock(&stripes[x]);
+      if (moved || helpMigrate()) finishResize();
+      return ret-1;        //not found
+   }
+   if (prev == NULL) *slot = cur->next;
+   else prev->next = cur->next;
+   if (spill) forgetValue(cur);
+   delete cur;
+   __sync_fetch_and_sub(&numEl, 1);
+   if (ordered) orderDel(k);
+   ret+=write(NOVOHT_LOG_DEL, k, "");
+   pthread_mutex_unlock(&stripes[x]);
+   if (moved || helpMigrate()) finishResize();
+   if (ret == 0) ret = syncLog();
+   maybeSnapshot();
+   return ret;
+}
+
+//keep the limit smallest keys seen so far
+static void scanAdd(map<string, string> &acc, kvpair *cur, const string &prefix,
+      const string &after, int limit, long long now){
+   for (; cur != NULL; cur = cur->next){
+      if (cur->key.compare(0, prefix.size(), prefix) != 0 || cur->key <= after) continue;
+      if (cur->expires != 0 && cur->expires <= now) continue;
+      if (limit > 0 && (int) acc.size() >= limit){
+         if (cur->key >= acc.rbegin()->first) continue;
+         acc.erase(--acc.end());
+      }
+      acc[cur->key] = cur->val;
+   }
+}
+
+void NoVoHT::orderAdd(const string &k){
+   pthread_mutex_lock(&order_lock);
+   ordered->insert(k);
+   pthread_mutex_unlock(&order_lock);
+}
+
+void NoVoHT::orderDel(const string &k){
+   pthread_mutex_lock(&order_lock);
+   ordered->erase(k);
+   pthread_mutex_unlock(&order_lock);
+}
+
+void NoVoHT::keepOrder(){
+   if (ordered) return;
+   lockAll();
+   set<string> *keys = new set<string>();
+   for (int b = 0; b < size; b++){
+      for (kvpair *cur = kvpairs[b]; cur != NULL; cur = cur->next) keys->insert(cur->key);
+   }
+   for (int b = 0; oldpairs && b < oldsize; b++){   //buckets a resize has not moved yet
+      for (kvpair *cur = oldpairs[b]; cur != NULL; cur = cur->next) keys->insert(cur->key);
+   }
+   ordered = keys;
+   unlockAll();
+}
+
+int NoVoHT::scan(const string &prefix, const string &after, int limit,
+      vector<pair<string, string> > &out){
+   if (ordered){
+      //keys under order_lock, then the values one get at a time. A key removed in between is
+      //skipped, so go on after the last one seen until the page is full or the keys run out.
+      out.clear();
+      string from = after;
+      bool more = true;
+      while (more && (limit <= 0 || (int) out.size() < limit)){
+         vector<string> keys;
+         int want = limit > 0 ? limit - out.size() : NOVOHT_STRIPES * 16;
+         pthread_mutex_lock(&order_lock);
+         set<string>::iterator it = from < prefix ? ordered->lower_bound(prefix)
+               : ordered->upper_bound(from);
+         for (; it != ordered->end() && (int) keys.size() < want; it++){
+            if (it->compare(0, prefix.size(), prefix) != 0) break;
+            keys.push_back(*it);
+         }
+         more = (int) keys.size() == want;
+         pthread_mutex_unlock(&order_lock);
+         for (size_t i = 0; i < keys.size(); i++){
+            string v;
+            if (get(keys[i], v) == 0) out.push_back(make_pair(keys[i], v));
          }
-         cur = cur->next;
+         if (!keys.empty()) from = keys.back();
       }
+      return out.size();
    }
-   write_lock=false;
-   return ret;
+   map<string, string> acc;
+   long long now = novohtNowUsec();
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      pthread_mutex_lock(&stripes[x]);
+      for (int b = x; b < size; b += NOVOHT_STRIPES){
+         scanAdd(acc, kvpairs[b], prefix, after, limit, now);
+      }
+      for (int b = (oldpairs ? migrated[x] : oldsize); b < oldsize; b += NOVOHT_STRIPES){
+         scanAdd(acc, oldpairs[b], prefix, after, limit, now);
+      }
+      pthread_mutex_unlock(&stripes[x]);
+   }
+   //spill mode only collected the keys
+   for (map<string, string>::iterator it = acc.begin(); spill && it != acc.end(); ){
+      if (get(it->first, it->second) == 0) ++it;
+      else acc.erase(it++);
+   }
+   out.assign(acc.begin(), acc.end());
+   return out.size();
+}
+
+static int visitKeys(kvpair *cur, void (*visit)(const string&, void*), void *arg,
+      long long now){
+   int n = 0;
+   for (; cur != NULL; cur = cur->next){
+      if (cur->expires != 0 && cur->expires <= now) continue;
+      visit(cur->key, arg);
+      n++;
+   }
+   return n;
+}
+
+int NoVoHT::forEachKey(void (*visit)(const string&, void*), void *arg){
+   int n = 0;
+   long long now = novohtNowUsec();
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      pthread_mutex_lock(&stripes[x]);
+      for (int b = x; b < size; b += NOVOHT_STRIPES){
+         n += visitKeys(kvpairs[b], visit, arg, now);
+      }
+      for (int b = (oldpairs ? migrated[x] : oldsize); b < oldsize; b += NOVOHT_STRIPES){
+         n += visitKeys(oldpairs[b], visit, arg, now);
+      }
+      pthread_mutex_unlock(&stripes[x]);
+   }
+   return n;
+}
+
+static unsigned int crcTable[256];
+static struct crcInit{
+   crcInit(){
+      for (unsigned int i = 0; i < 256; i++){
+         unsigned int c = i;
+         for (int j = 0; j < 8; j++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+         crcTable[i] = c;
+      }
+   }
+} crcInitializer;
+
+//CRC-32 (IEEE), pass the previous result as crc to continue over several buffers
+unsigned int novohtCrc32(const char *p, size_t n, unsigned int crc){
+   crc = ~crc;
+   for (size_t i = 0; i < n; i++){
+      crc = crcTable[(crc ^ (unsigned char) p[i]) & 0xff] ^ (crc >> 8);
+   }
+   return ~crc;
+}
+
+static void appendRecord(string &out, char type, const string &k, const string &v){
+   char head[13];
+   unsigned int kl = k.size(), vl = v.size();
+   head[4] = type;
+   memcpy(head+5, &kl, 4);
+   memcpy(head+9, &vl, 4);
+   unsigned int crc = novohtCrc32(head+4, 9);
+   crc = novohtCrc32(k.data(), kl, crc);
+   crc = novohtCrc32(v.data(), vl, crc);
+   memcpy(head, &crc, 4);
+   out.append(head, 13);
+   out.append(k);
+   out.append(v);
+}
+
+bool novohtWriteAll(int fd, const char *p, size_t n){
+   while (n > 0){
+      ssize_t w = ::write(fd, p, n);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) return false;
+      p += w;
+      n -= w;
+   }
+   return true;
 }
 
 //success 0 fail -2
-//resize the hashmap's base size
+//append one record to the log, caller holds the key's stripe
+int NoVoHT::write(char type, const string &k, const string &v){
+   if (loading) return 0;
+   if (dbfd < 0) return (filename.compare("") == 0 ? 0 : -2);
+   pthread_mutex_lock(&file_lock);
+   int ret = writeLocked(type, k, v);
+   pthread_mutex_unlock(&file_lock);
+   return ret;
+}
+
+//append one record, caller holds file_lock
+int NoVoHT::writeLocked(char type, const string &k, const string &v){
+   string rec;
+   appendRecord(rec, type, k, v);
+   int ret = 0;
+   if (durability == NOVOHT_SYNC_MEMORY){
+      logBuf.append(rec);
+      if (logBuf.size() >= NOVOHT_LOG_BUFFER && !flushLog()) ret = -2;
+   } else if (!novohtWriteAll(dbfd, rec.data(), rec.size())) ret = -2;
+   logged++;
+   appended++;
+   if (syncing && appended - synced >= (unsigned long long) syncRecords)
+      pthread_cond_signal(&log_grown);
+   return ret;
+}
+
+void NoVoHT::setDurability(int level, int usec, int records){
+   pthread_mutex_lock(&file_lock);
+   if (level == NOVOHT_SYNC_MEMORY || level == NOVOHT_SYNC_GROUP) durability = level;
+   else durability = NOVOHT_SYNC_ASYNC;
+   if (durability != NOVOHT_SYNC_GROUP) deferred = false;
+   if (durability != NOVOHT_SYNC_MEMORY && dbfd >= 0) flushLog();
+   syncUsec = usec > 0 ? usec : (durability == NOVOHT_SYNC_GROUP ? NOVOHT_GROUP_USEC
+         : NOVOHT_ASYNC_USEC);
+   syncRecords = records > 0 ? records : NOVOHT_GROUP_RECORDS;
+   pthread_mutex_unlock(&file_lock);
+}
+
+//write out the buffered records, caller holds file_lock
+bool NoVoHT::flushLog(){
+   if (logBuf.empty()) return true;
+   bool ok = novohtWriteAll(dbfd, logBuf.data(), logBuf.size());
+   logBuf.clear();
+   return ok;
+}
+
+//caller holds file_lock, returns with no fdatasync running so dbfd may change
+void NoVoHT::waitSync(){
+   while (syncing) pthread_cond_wait(&log_synced, &file_lock);
+}
+
+//the values a REF record points at have to be down before the record
+bool NoVoHT::syncFiles(int fd){
+   bool ok = true;
+   if (spill){
+      pthread_rwlock_rdlock(&values_rw);
+      for (map<unsigned int, int>::iterator it = valueFds.begin(); it != valueFds.end(); ++it){
+         ok = fdatasync(it->second) == 0 && ok;
+      }
+      pthread_rwlock_unlock(&values_rw);
+   }
+   return fdatasync(fd) == 0 && ok;
+}
+
+long long novohtNowUsec(){
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+//called by put/remove after appending, without a stripe held. Group commit: the first one in
+//waits until syncUsec after the last fdatasync (or until syncRecords updates pile up) and
+//issues one for everybody, the others wait for it. Async: whoever comes along once the
+//interval is over does the fdatasync, nobody waits.
+int NoVoHT::syncLog(){
+   if (loading) return 0;
+   pthread_mutex_lock(&file_lock);   //a snapshot swaps dbfd under it
+   if (dbfd < 0 || durability == NOVOHT_SYNC_MEMORY || deferred){
+      pthread_mutex_unlock(&file_lock);
+      return 0;
+   }
+   unsigned long long mine = appended;
+   int ret = 0;
+   while (synced < mine){
+      long long wait = lastSync + syncUsec - novohtNowUsec();
+      if (durability == NOVOHT_SYNC_ASYNC && (syncing || wait > 0)) break;
+      if (syncing){
+         pthread_cond_wait(&log_synced, &file_lock);
+         continue;
+      }
+      syncing = true;
+      while (wait > 0 && appended - synced < (unsigned long long) syncRecords){
+         long long until = novohtNowUsec() + wait;
+         struct timespec ts;
+         ts.tv_sec = until / 1000000;
+         ts.tv_nsec = until % 1000000 * 1000;
+         pthread_cond_timedwait(&log_grown, &file_lock, &ts);
+         wait = lastSync + syncUsec - novohtNowUsec();
+      }
+      unsigned long long upto = appended;
+      int fd = dbfd;
+      pthread_mutex_unlock(&file_lock);
+      bool ok = syncFiles(fd);
+      pthread_mutex_lock(&file_lock);
+      if (ok && upto > synced) synced = upto;
+      lastSync = novohtNowUsec();
+      syncing = false;
+      pthread_cond_broadcast(&log_synced);
+      if (!ok){
+         ret = -2;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&file_lock);
+   return ret;
+}
+
+bool NoVoHT::deferSync(){
+   pthread_mutex_lock(&file_lock);
+   deferred = dbfd >= 0 && durability == NOVOHT_SYNC_GROUP;
+   bool ret = deferred;
+   pthread_mutex_unlock(&file_lock);
+   return ret;
+}
+
+int NoVoHT::sync(){
+   pthread_mutex_lock(&file_lock);
+   waitSync();
+   if (dbfd < 0 || synced == appended){
+      pthread_mutex_unlock(&file_lock);
+      return 0;
+   }
+   syncing = true;
+   unsigned long long upto = appended;
+   int fd = dbfd;
+   pthread_mutex_unlock(&file_lock);
+   bool ok = syncFiles(fd);
+   pthread_mutex_lock(&file_lock);
+   if (ok && upto > synced) synced = upto;
+   lastSync = novohtNowUsec();
+   syncing = false;
+   pthread_cond_broadcast(&log_synced);
+   pthread_mutex_unlock(&file_lock);
+   return ok ? 0 : -2;
+}
+
+//start a background snapshot once the log holds more records than both magicNumber and the
+//live pairs, so the snapshot cost stays proportional to the number of updates
+void NoVoHT::maybeSnapshot(){
+   if (loading) return;
+   pthread_mutex_lock(&file_lock);
+   bool due = dbfd >= 0 && !snapshotting && logged >= magicNumber
+         && logged >= __sync_fetch_and_add(&numEl, 0);
+   pthread_mutex_unlock(&file_lock);
+   if (due) snapshot();
+}
+
+//0 if a background snapshot was started, -1 if one is running already or there is no file
+int NoVoHT::snapshot(){
+   pthread_mutex_lock(&file_lock);
+   int ret = -1;
+   if (dbfd >= 0 && !snapshotting){
+      if (snapshotterStarted) pthread_join(snapshotter, NULL);   //already past its last lock
+      snapshotting = true;
+      snapshotterStarted = pthread_create(&snapshotter, NULL, snapshotEntry, this) == 0;
+      if (snapshotterStarted) ret = 0;
+      else snapshotting = false;
+   }
+   pthread_mutex_unlock(&file_lock);
+   return ret;
+}
+
+void *NoVoHT::snapshotEntry(void *table){
+   NoVoHT *t = (NoVoHT*) table;
+   if (t->spill && t->gcDue()) t->collectValues();   //ends with a snapshot too
+   else t->takeSnapshot();
+   return NULL;
+}
+
+//return 0 if success -2 if failed
+//take a snapshot now, waits for a running one first
+int NoVoHT::writeFile(){
+   if (dbfd < 0) return (filename.compare("") == 0 ? 0 : -2);
+   pthread_mutex_lock(&file_lock);
+   while (snapshotting) pthread_cond_wait(&snapshot_done, &file_lock);
+   snapshotting = true;
+   pthread_mutex_unlock(&file_lock);
+   return takeSnapshot();
+}
+
+//append the records of log from to log to
+static bool appendLog(const string &from, const string &to){
+   int in = open(from.c_str(), O_RDONLY);
+   int out = open(to.c_str(), O_WRONLY | O_APPEND);
+   bool ok = in >= 0 && out >= 0 && lseek(in, 8, SEEK_SET) == 8;
+   char buf[65536];
+   ssize_t n = 0;
+   while (ok && (n = read(in, buf, sizeof(buf))) > 0){
+      ok = novohtWriteAll(out, buf, n);
+   }
+   if (in >= 0) close(in);
+   if (out >= 0) close(out);
+   return ok && n == 0;
+}
+
+//caller holds file_lock
+void NoVoHT::reopenLog(){
+   waitSync();
+   if (dbfd >= 0) close(dbfd);
+   dbfd = open(filename.c_str(), O_WRONLY);
+   if (dbfd >= 0) lseek(dbfd, 0, SEEK_END);
+}
+
+//start a fresh log, the records so far go to <file>.old (appended if a failed snapshot left
+//one behind). Caller holds every stripe and file_lock.
+bool NoVoHT::rotateLog(){
+   string old = filename + ".old";
+   //updates already appended are in the snapshot only once the child is done, make them
+   //as durable as their level says right here
+   waitSync();
+   if (!flushLog()) return false;
+   if (durability != NOVOHT_SYNC_MEMORY){
+      if (!syncFiles(dbfd)) return false;
+      synced = appended;
+      lastSync = novohtNowUsec();
+      pthread_cond_broadcast(&log_synced);
+   }
+   if (access(old.c_str(), F_OK) == 0){
+      if (!appendLog(filename, old)) return false;
+   } else if (rename(filename.c_str(), old.c_str()) != 0) return false;
+   int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || !novohtWriteAll(fd, NOVOHT_LOG_MAGIC, 8)){
+      if (fd >= 0) close(fd);
+      rename(old.c_str(), filename.c_str());   //.old has everything, keep using it
+      reopenLog();
+      return false;
+   }
+   close(dbfd);
+   dbfd = fd;
+   logged = 0;
+   return true;
+}
+
+//a snapshot failed after rotating the log, put the two halves back together
+void NoVoHT::unrotateLog(){
+   string old = filename + ".old";
+   flushLog();
+   if (appendLog(filename, old) && rename(old.c_str(), filename.c_str()) == 0) reopenLog();
+}
+
+struct snapWriter{
+   int fd;
+   bool refs;
+   char *buf;
+   size_t len;
+   unsigned long long count;
+   unsigned long long bytes;
+   bool ok;
+   void add(const char *p, size_t n){
+      if (len + n > NOVOHT_SNAP_BUFFER){
+         ok = ok && novohtWriteAll(fd, buf, len);
+         len = 0;
+      }
+      if (n > NOVOHT_SNAP_BUFFER) ok = ok && novohtWriteAll(fd, p, n);
+      else {
+         memcpy(buf+len, p, n);
+         len += n;
+      }
+      bytes += n;
+   }
+   void add(kvpair *cur){
+      for (; cur != NULL; cur = cur->next){
+         char head[16];
+         unsigned long long h = hash(cur->key);
+         unsigned int kl = cur->key.size();
+         unsigned int vl = refs ? sizeof(vref) : cur->val.size();
+         memcpy(head, &h, 8);
+         memcpy(head+8, &kl, 4);
+         memcpy(head+12, &vl, 4);
+         add(head, 16);
+         add(cur->key.data(), kl);
+         if (refs) add((const char*) &cur->ref, vl);
+         else add(cur->val.data(), vl);
+         count++;
+      }
+   }
+};
+
+//dump the table to path. Runs in the forked child, so it must not allocate: buf is handed in.
+bool NoVoHT::writeSnapshot(const char *path, char *buf){
+   snapWriter w;
+   //the snapshot outlives the log records pointing at those values
+   for (map<unsigned int, int>::iterator it = valueFds.begin(); it != valueFds.end(); ++it){
+      if (fsync(it->second) != 0) return false;
+   }
+   w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (w.fd < 0) return false;
+   w.refs = spill;
+   w.buf = buf;
+   w.len = 0;
+   w.count = 0;
+   w.bytes = NOVOHT_SNAP_HEADER;
+   w.ok = lseek(w.fd, NOVOHT_SNAP_HEADER, SEEK_SET) == NOVOHT_SNAP_HEADER;
+   for (int b = 0; b < size && w.ok; b++){
+      w.add(kvpairs[b]);
+   }
+   for (int b = 0; oldpairs != NULL && b < oldsize && w.ok; b++){
+      if (b >= migrated[b%NOVOHT_STRIPES]) w.add(oldpairs[b]);
+   }
+   w.ok = w.ok && novohtWriteAll(w.fd, buf, w.len);
+   char head[NOVOHT_SNAP_HEADER];
+   unsigned long long buckets = size;
+   memcpy(head, spill ? NOVOHT_SNAP_REF_MAGIC : NOVOHT_SNAP_MAGIC, 8);
+   memcpy(head+8, &w.count, 8);
+   memcpy(head+16, &buckets, 8);
+   memcpy(head+24, &w.bytes, 8);
+   w.ok = w.ok && pwrite(w.fd, head, NOVOHT_SNAP_HEADER, 0) == NOVOHT_SNAP_HEADER;
+   w.ok = w.ok && fsync(w.fd) == 0;
+   close(w.fd);
+   return w.ok;
+}
+
+//caller set snapshotting. With every stripe held the log is rotated and the process forks; the
+//child writes the table as of that instant to <file>.snap.tmp while the parent goes on serving
+//and appending to the fresh log. put/get only wait for the rotation and the fork itself.
+int NoVoHT::takeSnapshot(){
+   string snap = filename + ".snap";
+   string tmp = snap + ".tmp";
+   string old = filename + ".old";
+   char *buf = (char*) malloc(NOVOHT_SNAP_BUFFER);
+   pid_t pid = -1;
+   if (buf != NULL){
+      lockAll();
+      pthread_mutex_lock(&file_lock);
+      if (rotateLog()){
+         relogExpiries();
+         pid = fork();
+         if (pid == 0) _exit(writeSnapshot(tmp.c_str(), buf) ? 0 : 1);
+         if (pid < 0) unrotateLog();
+      }
+      pthread_mutex_unlock(&file_lock);
+      unlockAll();
+      free(buf);
+   }
+   int status = 0;
+   bool ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+         && WEXITSTATUS(status) == 0;
+   pthread_mutex_lock(&file_lock);
+   ok = ok && rename(tmp.c_str(), snap.c_str()) == 0;
+   if (ok) unlink(old.c_str());   //everything in it is in the snapshot now
+   if (ok) snapshots++;
+   if (ok && spill) dropValueGens();
+   else if (pid > 0){
+      unlink(tmp.c_str());
+      unrotateLog();
+   }
+   snapshotting = false;
+   pthread_cond_broadcast(&snapshot_done);
+   pthread_mutex_unlock(&file_lock);
+   return ok ? 0 : -2;
+}
+
+//start growing the table to ns buckets. Only swaps the arrays, the entries are moved over a
+//few buckets at a time by the following put/remove calls, so no single insert pays for them.
 void NoVoHT::resize(int ns){
-   resizing = true;
-   int olds = size;
-   size = ns;
+   lockAll();
+   //someone else may have grown the table while we waited
+   if (oldpairs != NULL || __sync_fetch_and_add(&numEl, 0) < size*resizeNum
+         || ns <= size) {
+      unlockAll();
+      return;
+   }
+   kvpair **np = (kvpair**) calloc(ns, sizeof(kvpair*));   //zero pages come lazily
+   if (np == NULL) {
+      unlockAll();
+      return;
+   }
    oldpairs = kvpairs;
-   kvpairs = new kvpair*[ns];
-   for (int z=0; z<ns; z++) { kvpairs[z] = NULL;}
-   numEl = 0;
-   for (int i=0; i<olds;i++){
-      kvpair *cur = oldpairs[i];
+   oldsize = size;
+   kvpairs = np;
+   size = ns;
+   for (int x = 0; x < NOVOHT_STRIPES; x++){
+      migrated[x] = x;
+   }
+   __sync_lock_test_and_set(&unmigrated, oldsize);   //helpMigrate reads it without a stripe
+   resizes++;
+   unlockAll();
+}
+
+//where a key with hash h lives right now, caller holds stripe h%NOVOHT_STRIPES.
+//Old bucket b of stripe x has been moved once b < migrated[x].
+kvpair **NoVoHT::bucket(unsigned long long h){
+   if (oldpairs != NULL){
+      int ob = h%oldsize;
+      if (ob >= migrated[h%NOVOHT_STRIPES]) return &oldpairs[ob];
+   }
+   return &kvpairs[h%size];
+}
+
+//move up to n old buckets of stripe x into the new array, caller holds stripe x.
+//true if that was the last old bucket of the whole table.
+bool NoVoHT::migrate(int x, int n){
+   if (oldpairs == NULL) return false;
+   bool last = false;
+   while (n-- > 0 && migrated[x] < oldsize){
+      kvpair *cur = oldpairs[migrated[x]];
+      oldpairs[migrated[x]] = NULL;
       while (cur != NULL){
+         kvpair *next = cur->next;
          int pos = hash(cur->key)%size;
-         kvpair * tmp = kvpairs[pos];
+         cur->next = kvpairs[pos];
          kvpairs[pos] = cur;
-         cur = cur->next;
-         kvpairs[pos]->next = tmp;
+         cur = next;
       }
+      migrated[x] += NOVOHT_STRIPES;
+      last = __sync_sub_and_fetch(&unmigrated, 1) == 0;
    }
-   delete [] oldpairs;
-   resizing = false;
+   return last;
 }
 
-//success 0 fail -2
-//write kvpair to file
-int NoVoHT::write(kvpair * p){
-   while (write_lock){}
-   if (!dbfile)return (filename.compare("") == 0 ? 0 : -2);
-   write_lock=true;
-   fseek(dbfile, 0, SEEK_END);
-   fgetpos(dbfile, &(p->pos));
-   fprintf(dbfile, "%s\t%s\t", p->key.c_str(), p->val.c_str());
-   write_lock=false;
-   return 0;
+//move some other stripe along too, so stripes nobody writes to still finish
+bool NoVoHT::helpMigrate(){
+   if (__sync_fetch_and_add(&unmigrated, 0) == 0) return false;   //no stripe held to look at oldpairs
+   int x = __sync_fetch_and_add(&helpCursor, 1)%NOVOHT_STRIPES;
+   if (pthread_mutex_trylock(&stripes[x]) != 0) return false;
+   bool last = migrate(x, NOVOHT_MIGRATE_STEP);
+   pthread_mutex_unlock(&stripes[x]);
+   return last;
 }
 
-//success 0 fail -2
-//mark line in file for deletion
-int NoVoHT::mark(fpos_t position){
-   while(write_lock){}
-   if (!dbfile)return (filename.compare("") == 0 ? 0 : -2);
-   write_lock=true;
-   fsetpos(dbfile, &position);
-   fputc((int) '~', dbfile);
-   write_lock=false;
-   return 0;
+//drop the old array once every bucket has moved
+void NoVoHT::finishResize(){
+   lockAll();
+   if (oldpairs != NULL && __sync_fetch_and_add(&unmigrated, 0) == 0){
+      free(oldpairs);
+      oldpairs = NULL;
+      oldsize = 0;
+   }
+   unlockAll();
 }
+
+//only used to read files written in the old tab separated format
 char *readTabString(FILE *file, char *buffer){
    int n =0;
    char t;
@@ -270,22 +897,178 @@ char *readTabString(FILE *file, char *buffer){
    return (n == 0 ? NULL : buffer);
 }
 
-void NoVoHT::readFile(){
-   if(!dbfile) return;
+void NoVoHT::readTextFile(FILE *in){
    char s[300];
    char v[300];
-   while(readTabString(dbfile, s) != NULL){
+   while(readTabString(in, s) != NULL){
       string key(s);
-      if (readTabString(dbfile, v) == NULL) break;
+      if (readTabString(in, v) == NULL) break;
       string val(v);
       if (key[0] != '~'){
          put(key,val);
       }
    }
-   writeFile();
 }
 
-unsigned long long hash(string k){ //FNV hash
+//false at the end of the log or on a torn/corrupt record
+static bool readRecord(FILE *in, char &type, string &k, string &v){
+   char head[13];
+   unsigned int crc, kl, vl;
+   if (fread(head, 1, 13, in) != 13) return false;
+   memcpy(&crc, head, 4);
+   type = head[4];
+   memcpy(&kl, head+5, 4);
+   memcpy(&vl, head+9, 4);
+   if (type != NOVOHT_LOG_PUT && type != NOVOHT_LOG_DEL && type != NOVOHT_LOG_REF
+         && type != NOVOHT_LOG_TTL) return false;
+   if (kl > (1u << 30) || vl > (1u << 30)) return false;
+   k.resize(kl);
+   v.resize(vl);
+   if (kl && fread(&k[0], 1, kl, in) != kl) return false;
+   if (vl && fread(&v[0], 1, vl, in) != vl) return false;
+   unsigned int c = novohtCrc32(head+4, 9);
+   c = novohtCrc32(k.data(), kl, c);
+   c = novohtCrc32(v.data(), vl, c);
+   return c == crc;
+}
+
+//map <file>.snap and build the table straight from it: one sequential pass, no resizes, no
+//locks and nothing logged. true if the snapshot was written without spilling and the values
+//had to be moved out to the value file.
+bool NoVoHT::readSnapshot(){
+   string snap = filename + ".snap";
+   int fd = open(snap.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   char *m = (char*) MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size >= NOVOHT_SNAP_HEADER)
+      m = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (m == MAP_FAILED) return false;
+   madvise(m, st.st_size, MADV_SEQUENTIAL);
+   unsigned long long count, buckets, bytes;
+   memcpy(&count, m+8, 8);
+   memcpy(&buckets, m+16, 8);
+   memcpy(&bytes, m+24, 8);
+   bool refs = memcmp(m, NOVOHT_SNAP_REF_MAGIC, 8) == 0;
+   if ((!refs && memcmp(m, NOVOHT_SNAP_MAGIC, 8) != 0) || (refs && !spill)
+         || bytes != (unsigned long long) st.st_size
+         || buckets % NOVOHT_STRIPES != 0 || buckets > (1u << 31)){
+      cerr << "NoVoHT: ignoring bad snapshot " << snap << endl;
+      munmap(m, st.st_size);
+      return false;
+   }
+   if ((int) buckets > size){
+      free(kvpairs);
+      kvpairs = (kvpair**) calloc(buckets, sizeof(kvpair*));
+      if (kvpairs == NULL) throw std::bad_alloc();
+      size = buckets;
+   }
+   const char *p = m + NOVOHT_SNAP_HEADER, *end = m + st.st_size;
+   for (unsigned long long i = 0; i < count && p + 16 <= end; i++){
+      unsigned long long h;
+      unsigned int kl, vl;
+      memcpy(&h, p, 8);
+      memcpy(&kl, p+8, 4);
+      memcpy(&vl, p+12, 4);
+      if ((unsigned long long) (end - p - 16) < (unsigned long long) kl + vl) break;
+      if (refs && vl != sizeof(vref)) break;
+      kvpair *add = new kvpair;
+      add->key.assign(p+16, kl);
+      add->ref.gen = 0;
+      add->expires = 0;   //deadlines come back from the log
+      if (refs) memcpy(&add->ref, p+16+kl, sizeof(vref));
+      else if (!spill) add->val.assign(p+16+kl, vl);
+      else appendValue(string(p+16+kl, vl), add->ref);
+      if (add->ref.gen != 0) liveValue(add->ref);
+      add->next = kvpairs[h%size];
+      kvpairs[h%size] = add;
+      numEl++;
+      p += 16 + kl + vl;
+   }
+   munmap(m, st.st_size);
+   return spill && !refs;
+}
+
+//apply the records of a log positioned after its magic, returns the offset after the last
+//good one
+long NoVoHT::replay(FILE *in){
+   char type;
+   string k, v;
+   long good = ftell(in);
+   while (readRecord(in, type, k, v)){
+      if (type == NOVOHT_LOG_PUT) put(k, v);
+      else if (type == NOVOHT_LOG_DEL) remove(k);
+      else if (type == NOVOHT_LOG_TTL){
+         long long deadline;
+         if (v.size() == sizeof(deadline)){
+            memcpy(&deadline, v.data(), sizeof(deadline));
+            expire(k, deadline);
+         }
+      }
+      else if (spill && v.size() == sizeof(vref)){   //without spill the value files are gone
+         vref r;
+         memcpy(&r, v.data(), sizeof(vref));
+         store(k, "", &r);
+      }
+      logged++;
+      good = ftell(in);
+   }
+   return good;
+}
+
+//load <file>.snap, then <file>.old if a snapshot was interrupted, then the log. A torn tail
+//of the log is cut off and appending goes on after the last good record. A file in the old
+//text format is loaded and turned into a snapshot plus an empty log.
+void NoVoHT::readFile(){
+   if (filename.empty()) return;
+   long good = 0;
+   bool text = false;
+   char magic[8];
+   loading = true;
+   bool reformat = readSnapshot();
+   string old = filename + ".old";
+   FILE *in = fopen(old.c_str(), "rb");
+   bool leftover = in != NULL;
+   if (in){
+      if (fread(magic, 1, 8, in) == 8 && memcmp(magic, NOVOHT_LOG_MAGIC, 8) == 0) replay(in);
+      fclose(in);
+   }
+   in = fopen(filename.c_str(), "rb");
+   if (in){
+      size_t n = fread(magic, 1, 8, in);
+      if (n == 8 && memcmp(magic, NOVOHT_LOG_MAGIC, 8) == 0){
+         good = replay(in);
+      } else if (n > 0 && (n == 8 || memcmp(magic, NOVOHT_LOG_MAGIC, n) != 0)){
+         rewind(in);
+         readTextFile(in);
+         text = true;
+      }
+      fclose(in);
+   }
+   loading = false;
+   if (text){
+      string snap = filename + ".snap";
+      string tmp = snap + ".tmp";
+      char *buf = (char*) malloc(NOVOHT_SNAP_BUFFER);
+      bool ok = buf != NULL && writeSnapshot(tmp.c_str(), buf)
+            && rename(tmp.c_str(), snap.c_str()) == 0;
+      free(buf);
+      if (!ok) return;   //leave the text file alone, no logging
+      good = 0;
+   }
+   dbfd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+   if (dbfd < 0) return;
+   if (good == 0){
+      if (ftruncate(dbfd, 0) != 0 || !novohtWriteAll(dbfd, NOVOHT_LOG_MAGIC, 8)) return;
+      good = 8;
+   } else if (ftruncate(dbfd, good) != 0) return;
+   lseek(dbfd, good, SEEK_SET);
+   if (leftover || reformat) writeFile();
+   else maybeSnapshot();
+}
+
+unsigned long long hash(const string &k){ //FNV hash
 #if SIZE_OF_LONG_LONG_INT==8
 #define FNV_PRIME 14695981039346656037
 #define FNV_OFFSET 1099511628211
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <map>
+#include "../../inc/novoht.h"
+#include "../../inc/novoht_flat.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FLAT_EMPTY ((signed char) -128)
+#define FLAT_DELETED ((signed char) -2)
+#define FLAT_MIN_ARENA 4096
+
+//FNV alone leaves the low bits poorly mixed, they pick both the group and the tag
+static inline uint64_t flatHash(const string &k){
+   uint64_t h = ::hash(k);
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
+
+//bit i set if control byte i of the group equals c
+static inline unsigned matchByte(const signed char *g, signed char c){
+#ifdef __SSE2__
+   __m128i grp = _mm_load_si128((const __m128i*) g);
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_set1_epi8(c)));
+#else
+   unsigned m = 0;
+   for (int i = 0; i < FLAT_GROUP; i++)
+      if (g[i] == c) m |= 1u << i;
+   return m;
+#endif
+}
+
+//bit i set if slot i of the group is empty or deleted (both have the high bit set)
+static inline unsigned matchFree(const signed char *g){
+#ifdef __SSE2__
+   return _mm_movemask_epi8(_mm_load_si128((const __m128i*) g));
+#else
+   unsigned m = 0;
+   for (int i = 0; i < FLAT_GROUP; i++)
+      if (g[i] < 0) m |= 1u << i;
+   return m;
+#endif
+}
+
+NoVoHTFlat::NoVoHTFlat(){
+   init(1000);
+}
+
+NoVoHTFlat::NoVoHTFlat(int s){
+   init(s > 0 ? s : 1000);
+}
+
+//room for s entries below the 7/8 load limit
+void NoVoHTFlat::init(size_t s){
+   cap = FLAT_GROUP;
+   while (cap * 7 / 8 < s) cap *= 2;
+   void *c;
+   if (posix_memalign(&c, FLAT_GROUP, cap) != 0) throw std::bad_alloc();
+   ctrl = (signed char*) c;
+   memset(ctrl, FLAT_EMPTY, cap);
+   slots = (flatslot*) malloc(cap * sizeof(flatslot));
+   arenaCap = FLAT_MIN_ARENA;
+   arena = (char*) malloc(arenaCap);
+   if (!slots || !arena) throw std::bad_alloc();
+   arenaLen = 0;
+   garbage = 0;
+   numEl = 0;
+   numDel = 0;
+   ordered = NULL;
+   pthread_rwlock_init(&lock, NULL);
+}
+
+NoVoHTFlat::~NoVoHTFlat(){
+   free(ctrl);
+   free(slots);
+   free(arena);
+   delete ordered;
+   pthread_rwlock_destroy(&lock);
+}
+
+const char *NoVoHTFlat::keyOf(const flatslot &s){
+   return s.klen <= FLAT_INLINE_KEY ? s.key.inl : arena + s.key.off;
+}
+
+//make room for n more arena bytes, may compact so offsets are only stable until the next call
+void NoVoHTFlat::reserve(size_t n){
+   if (arenaLen + n > arenaCap){
+      if (garbage > arenaLen / 2) compact();
+      size_t nc = arenaCap;
+      while (arenaLen + n > nc) nc *= 2;
+      if (nc != arenaCap){
+         char *na = (char*) realloc(arena, nc);
+         if (!na) throw std::bad_alloc();
+         arena = na;
+         arenaCap = nc;
+      }
+   }
+}
+
+uint64_t NoVoHTFlat::append(const char *p, size_t n){
+   reserve(n);
+   uint64_t off = arenaLen;
+   memcpy(arena + off, p, n);
+   arenaLen += n;
+   return off;
+}
+
+//copy every live key and value into a fresh arena, dropping the garbage
+void NoVoHTFlat::compact(){
+   char *na = (char*) malloc(arenaCap);
+   if (!na) throw std::bad_alloc();
+   size_t len = 0;
+   for (size_t i = 0; i < cap; i++){
+      if (ctrl[i] < 0) continue;
+      flatslot &s = slots[i];
+      if (s.klen > FLAT_INLINE_KEY){
+         memcpy(na + len, arena + s.key.off, s.klen);
+         s.key.off = len;
+         len += s.klen;
+      }
+      memcpy(na + len, arena + s.voff, s.vlen);
+      s.voff = len;
+      len += s.vlen;
+   }
+   free(arena);
+   arena = na;
+   arenaLen = len;
+   garbage = 0;
+}
+
+//slot index or -1, probes groups in triangular order which visits each group once
+long NoVoHTFlat::find(const string &k, uint64_t h){
+   size_t groups = cap / FLAT_GROUP;
+   size_t g = (h >> 7) & (groups - 1);
+   signed char tag = h & 0x7f;
+   for (size_t i = 0; i < groups; i++){
+      const signed char *grp = ctrl + g * FLAT_GROUP;
+      unsigned m = matchByte(grp, tag);
+      while (m){
+         size_t idx = g * FLAT_GROUP + __builtin_ctz(m);
+         const flatslot &s = slots[idx];
+         if (s.klen == k.size() && memcmp(keyOf(s), k.data(), s.klen) == 0)
+            return idx;
+         m &= m - 1;
+      }
+      if (matchByte(grp, FLAT_EMPTY)) return -1;
+      g = (g + i + 1) & (groups - 1);
+   }
+   return -1;
+}
+
+//first empty or deleted slot on the probe sequence, the table is never full
+size_t NoVoHTFlat::freeSlot(uint64_t h){
+   size_t groups = cap / FLAT_GROUP;
+   size_t g = (h >> 7) & (groups - 1);
+   for (size_t i = 0; ; i++){
+      unsigned m = matchFree(ctrl + g * FLAT_GROUP);
+      if (m) return g * FLAT_GROUP + __builtin_ctz(m);
+      g = (g + i + 1) & (groups - 1);
+   }
+}
+
+void NoVoHTFlat::rehash(size_t ncap){
+   signed char *octrl = ctrl;
+   flatslot *oslots = slots;
+   size_t ocap = cap;
+   void *c;
+   if (posix_memalign(&c, FLAT_GROUP, ncap) != 0) throw std::bad_alloc();
+   ctrl = (signed char*) c;
+   memset(ctrl, FLAT_EMPTY, ncap);
+   slots = (flatslot*) malloc(ncap * sizeof(flatslot));
+   if (!slots) throw std::bad_alloc();
+   cap = ncap;
+   for (size_t i = 0; i < ocap; i++){
+      if (octrl[i] < 0) continue;
+      const flatslot &s = oslots[i];
+      uint64_t h = flatHash(string(keyOf(s), s.klen));
+      size_t idx = freeSlot(h);
+      ctrl[idx] = h & 0x7f;
+      slots[idx] = s;
+   }
+   numDel = 0;
+   free(octrl);
+   free(oslots);
+   if (garbage > arenaLen / 2) compact();
+}
+
+int NoVoHTFlat::put(string k, string v){
+   uint64_t h = flatHash(k);
+   pthread_rwlock_wrlock(&lock);
+   long idx = find(k, h);
+   if (idx >= 0){
+      flatslot &s = slots[idx];
+      if (v.size() <= s.vlen){      //overwrite in place
+         memcpy(arena + s.voff, v.data(), v.size());
+         garbage += s.vlen - v.size();
+      } else {
+         reserve(v.size());
+         garbage += s.vlen;
+         s.voff = append(v.data(), v.size());
+      }
+      s.vlen = v.size();
+      pthread_rwlock_unlock(&lock);
+      return 0;
+   }
+   if ((numEl + numDel + 1) > cap * 7 / 8){
+      //mostly tombstones: clean them up in place rather than growing
+      rehash(numDel > cap / 4 ? cap : cap * 2);
+   }
+   //one reserve for key and value so no compaction runs between the two appends
+   reserve(v.size() + (k.size() > FLAT_INLINE_KEY ? k.size() : 0));
+   size_t pos = freeSlot(h);
+   if (ctrl[pos] == FLAT_DELETED) numDel--;
+   ctrl[pos] = h & 0x7f;
+   flatslot &s = slots[pos];
+   s.klen = k.size();
+   if (s.klen <= FLAT_INLINE_KEY) memcpy(s.key.inl, k.data(), s.klen);
+   else s.key.off = append(k.data(), s.klen);
+   s.vlen = v.size();
+   s.voff = append(v.data(), v.size());
+   numEl++;
+   if (ordered) ordered->insert(k);
+   pthread_rwlock_unlock(&lock);
+   return 0;
+}
+
+int NoVoHTFlat::get(string k, string &v){
+   if (k.empty()) return -1;
+   uint64_t h = flatHash(k);
+   pthread_rwlock_rdlock(&lock);
+   long idx = find(k, h);
+   if (idx >= 0) v.assign(arena + slots[idx].voff, slots[idx].vlen);
+   pthread_rwlock_unlock(&lock);
+   return idx >= 0 ? 0 : -1;
+}
+
+int NoVoHTFlat::remove(string k){
+   uint64_t h = flatHash(k);
+   pthread_rwlock_wrlock(&lock);
+   long idx = find(k, h);
+   if (idx < 0){
+      pthread_rwlock_unlock(&lock);
+      return -1;
+   }
+   flatslot &s = slots[idx];
+   garbage += s.vlen + (s.klen > FLAT_INLINE_KEY ? s.klen : 0);
+   //groups are aligned, so a probe reaching a group that still has an empty slot stops there
+   //anyway: no tombstone needed
+   signed char *grp = ctrl + (idx / FLAT_GROUP) * FLAT_GROUP;
+   if (matchByte(grp, FLAT_EMPTY)) ctrl[idx] = FLAT_EMPTY;
+   else {
+      ctrl[idx] = FLAT_DELETED;
+      numDel++;
+   }
+   numEl--;
+   if (ordered) ordered->erase(k);
+   pthread_rwlock_unlock(&lock);
+   return 0;
+}
+
+int NoVoHTFlat::scan(const string &prefix, const string &after, int limit,
+      vector<pair<string, string> > &out){
+   pthread_rwlock_rdlock(&lock);
+   if (ordered){
+      out.clear();
+      set<string>::iterator it = after < prefix ? ordered->lower_bound(prefix)
+            : ordered->upper_bound(after);
+      for (; it != ordered->end() && (limit <= 0 || (int) out.size() < limit); it++){
+         if (it->compare(0, prefix.size(), prefix) != 0) break;
+         const flatslot &s = slots[find(*it, flatHash(*it))];
+         out.push_back(make_pair(*it, string(arena + s.voff, s.vlen)));
+      }
+      pthread_rwlock_unlock(&lock);
+      return out.size();
+   }
+   map<string, string> acc;
+   for (size_t i = 0; i < cap; i++){
+      if (ctrl[i] < 0) continue;
+      const flatslot &s = slots[i];
+      string k(keyOf(s), s.klen);
+      if (k.compare(0, prefix.size(), prefix) != 0 || k <= after) continue;
+      if (limit > 0 && (int) acc.size() >= limit){
+         if (k >= acc.rbegin()->first) continue;
+         acc.erase(--acc.end());
+      }
+      acc[k].assign(arena + s.voff, s.vlen);
+   }
+   pthread_rwlock_unlock(&lock);
+   out.assign(acc.begin(), acc.end());
+   return out.size();
+}
+
+int NoVoHTFlat::forEachKey(void (*visit)(const string&, void*), void *arg){
+   int n = 0;
+   pthread_rwlock_rdlock(&lock);
+   for (size_t i = 0; i < cap; i++){
+      if (ctrl[i] < 0) continue;
+      visit(string(keyOf(slots[i]), slots[i].klen), arg);
+      n++;
+   }
+   pthread_rwlock_unlock(&lock);
+   return n;
+}
+
+void NoVoHTFlat::keepOrder(){
+   pthread_rwlock_wrlock(&lock);
+   if (ordered == NULL){
+      ordered = new set<string>();
+      for (size_t i = 0; i < cap; i++){
+         if (ctrl[i] >= 0) ordered->insert(string(keyOf(slots[i]), slots[i].klen));
+      }
+   }
+   pthread_rwlock_unlock(&lock);
+}
+
+size_t NoVoHTFlat::memUsage(){
+   return sizeof(*this) + cap + cap * sizeof(flatslot) + arenaCap;
+}
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <map>
+#include "../../inc/novoht.h"
+#include "../../inc/lru_cache.h"
+
+//NoVoHT spill mode: keys and vrefs stay in the table, values go to <db file>.values.<gen>
+
+struct valueBytes{
+   unsigned long operator()(const string &v){ return v.size() + 64; }   //rough node overhead
+};
+
+//values read lately plus the pinned ones, which never count against the limit
+class ValueCache{
+   LRUCache<string, string, valueBytes> lru;
+   map<string, string> pinned;
+   pthread_mutex_t lock;
+   public:
+      ValueCache(unsigned long bytes) : lru(bytes) { pthread_mutex_init(&lock, NULL); }
+      ~ValueCache() { pthread_mutex_destroy(&lock); }
+      bool fetch(const string &k, string &v){
+         pthread_mutex_lock(&lock);
+         map<string, string>::iterator it = pinned.find(k);
+         bool found = it != pinned.end();
+         if (found) v = it->second;
+         else found = lru.fetch(k, v);
+         pthread_mutex_unlock(&lock);
+         return found;
+      }
+      void put(const string &k, const string &v){
+         pthread_mutex_lock(&lock);
+         map<string, string>::iterator it = pinned.find(k);
+         if (it != pinned.end()) it->second = v;
+         else lru.insert(k, v);
+         pthread_mutex_unlock(&lock);
+      }
+      void forget(const string &k){
+         pthread_mutex_lock(&lock);
+         pinned.erase(k);
+         lru.remove(k);
+         pthread_mutex_unlock(&lock);
+      }
+      void pin(const string &k, const string &v){
+         pthread_mutex_lock(&lock);
+         lru.remove(k);
+         pinned[k] = v;
+         pthread_mutex_unlock(&lock);
+      }
+      void unpin(const string &k){
+         pthread_mutex_lock(&lock);
+         map<string, string>::iterator it = pinned.find(k);
+         if (it != pinned.end()){
+            lru.insert(k, it->second);
+            pinned.erase(it);
+         }
+         pthread_mutex_unlock(&lock);
+      }
+};
+
+static bool preadAll(int fd, char *p, size_t n, off_t off){
+   while (n > 0){
+      ssize_t r = pread(fd, p, n, off);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return false;
+      p += r;
+      n -= r;
+      off += r;
+   }
+   return true;
+}
+
+static bool pwriteAll(int fd, const char *p, size_t n, off_t off){
+   while (n > 0){
+      ssize_t w = pwrite(fd, p, n, off);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) return false;
+      p += w;
+      n -= w;
+      off += w;
+   }
+   return true;
+}
+
+string NoVoHT::valueFile(unsigned int gen){
+   char suffix[32];
+   sprintf(suffix, ".values.%u", gen);
+   return filename + suffix;
+}
+
+//open every value file of the db. Spill mode is on when a cache size is given or when value
+//files are there already: their refs would be useless without them.
+void NoVoHT::openValueFiles(long cacheBytes){
+   size_t slash = filename.rfind('/');
+   string dir = slash == string::npos ? "." : filename.substr(0, slash+1);
+   string prefix = (slash == string::npos ? filename : filename.substr(slash+1)) + ".values.";
+   DIR *d = opendir(dir.c_str());
+   struct dirent *e;
+   while (d != NULL && (e = readdir(d)) != NULL){
+      if (strncmp(e->d_name, prefix.c_str(), prefix.size()) != 0) continue;
+      char *end;
+      unsigned long gen = strtoul(e->d_name + prefix.size(), &end, 10);
+      if (*end != '\0' || gen == 0) continue;
+      int fd = open(valueFile(gen).c_str(), O_RDWR);
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) != 0){
+         if (fd >= 0) close(fd);
+         continue;
+      }
+      valueFds[gen] = fd;
+      valueGarbage += st.st_size;   //until the load finds the refs to it
+      if (gen >= writeGen){
+         writeGen = gen;
+         writeFd = fd;
+         writeEnd = st.st_size;
+      }
+   }
+   if (d != NULL) closedir(d);
+   if (valueFds.empty()){
+      if (cacheBytes <= 0) return;
+      writeFd = open(valueFile(1).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (writeFd < 0){
+         cerr << "NoVoHT: no value file for " << filename << ", keeping values in memory" << endl;
+         return;
+      }
+      writeGen = 1;
+      writeEnd = 0;
+      valueFds[1] = writeFd;
+   } else if (cacheBytes <= 0) cacheBytes = NOVOHT_SPILL_CACHE;
+   firstGen = valueFds.begin()->first;
+   cache = new ValueCache(cacheBytes);
+   spill = true;
+}
+
+void NoVoHT::closeValueFiles(){
+   for (map<unsigned int, int>::iterator it = valueFds.begin(); it != valueFds.end(); ++it){
+      close(it->second);
+   }
+   valueFds.clear();
+   delete cache;
+   cache = NULL;
+}
+
+//append v to the current value file, caller holds the key's stripe
+int NoVoHT::appendValue(const string &v, vref &r){
+   char head[8];
+   unsigned int len = v.size();
+   unsigned int crc = novohtCrc32(v.data(), len);
+   memcpy(head, &crc, 4);
+   memcpy(head+4, &len, 4);
+   pthread_mutex_lock(&value_lock);
+   bool ok = pwriteAll(writeFd, head, 8, writeEnd)
+         && pwriteAll(writeFd, v.data(), len, writeEnd + 8);
+   if (ok){
+      r.gen = writeGen;
+      r.len = len;
+      r.off = writeEnd;
+      writeEnd += 8 + len;
+      __sync_fetch_and_add(&valueGarbage, 8 + len);   //until keepRef
+   }
+   pthread_mutex_unlock(&value_lock);
+   return ok ? 0 : -2;
+}
+
+//0 or -1 if the value can't be read back or fails its crc, caller holds the key's stripe
+int NoVoHT::readValue(const vref &r, string &v){
+   pthread_rwlock_rdlock(&values_rw);
+   map<unsigned int, int>::iterator it = valueFds.find(r.gen);
+   char head[8];
+   v.resize(r.len);
+   bool ok = it != valueFds.end() && preadAll(it->second, head, 8, r.off)
+         && (r.len == 0 || preadAll(it->second, &v[0], r.len, r.off + 8));
+   pthread_rwlock_unlock(&values_rw);
+   unsigned int crc, len;
+   memcpy(&crc, head, 4);
+   memcpy(&len, head+4, 4);
+   if (ok && len == r.len && crc == novohtCrc32(v.data(), r.len)) return 0;
+   cerr << "NoVoHT: bad value at " << valueFile(r.gen) << ":" << r.off << endl;
+   return -1;
+}
+
+void NoVoHT::liveValue(const vref &r){
+   __sync_fetch_and_add(&valueLive, 8 + r.len);
+   __sync_fetch_and_sub(&valueGarbage, 8 + r.len);
+}
+
+void NoVoHT::dropValue(const vref &r){
+   if (r.gen == 0) return;
+   __sync_fetch_and_sub(&valueLive, 8 + r.len);
+   __sync_fetch_and_add(&valueGarbage, 8 + r.len);
+}
+
+//point cur at r and log it. v is the value when known, it goes to the cache.
+int NoVoHT::keepRef(kvpair *cur, const vref &r, const string *v){
+   dropValue(cur->ref);
+   cur->ref = r;
+   liveValue(r);
+   if (v != NULL) cache->put(cur->key, *v);
+   else cache->forget(cur->key);
+   return write(NOVOHT_LOG_REF, cur->key, string((const char*) &r, sizeof(vref)));
+}
+
+int NoVoHT::fetchValue(kvpair *cur, string &v){
+   if (cache->fetch(cur->key, v)) return 0;
+   if (cur->ref.gen == 0 || readValue(cur->ref, v) != 0) return -1;
+   cache->put(cur->key, v);
+   return 0;
+}
+
+void NoVoHT::forgetValue(kvpair *cur){
+   dropValue(cur->ref);
+   cache->forget(cur->key);
+}
+
+//0 done, -1 not found. Outside spill mode every value is in memory already.
+int NoVoHT::pin(string k){
+   unsigned long long h = hash(k);
+   pthread_mutex_t *lock = &stripes[h%NOVOHT_STRIPES];
+   pthread_mutex_lock(lock);
+   kvpair *cur = *bucket(h);
+   while (cur != NULL && k.compare(cur->key) != 0) cur = cur->next;
+   string v;
+   int ret = cur == NULL ? -1 : 0;
+   if (cur != NULL && spill && (ret = fetchValue(cur, v)) == 0) cache->pin(k, v);
+   pthread_mutex_unlock(lock);
+   return ret;
+}
+
+int NoVoHT::unpin(string k){
+   unsigned long long h = hash(k);
+   pthread_mutex_t *lock = &stripes[h%NOVOHT_STRIPES];
+   pthread_mutex_lock(lock);
+   kvpair *cur = *bucket(h);
+   while (cur != NULL && k.compare(cur->key) != 0) cur = cur->next;
+   if (cur != NULL && spill) cache->unpin(k);
+   pthread_mutex_unlock(lock);
+   return cur == NULL ? -1 : 0;
+}
+
+bool NoVoHT::gcDue(){
+   long long garbage = __sync_fetch_and_add(&valueGarbage, 0);   //puts change both under their stripes
+   return garbage > NOVOHT_GC_MIN && garbage > __sync_fetch_and_add(&valueLive, 0);
+}
+
+//runs on the snapshot thread instead of a plain snapshot. New values go to a fresh generation,
+//every live value still in an older one is copied over, then the snapshot makes the new refs
+//durable and drops the older files.
+int NoVoHT::collectValues(){
+   collections++;
+   pthread_mutex_lock(&value_lock);
+   unsigned int gen = writeGen + 1;
+   int fd = open(valueFile(gen).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd >= 0){
+      pthread_rwlock_wrlock(&values_rw);
+      valueFds[gen] = fd;
+      pthread_rwlock_unlock(&values_rw);
+      writeGen = gen;
+      writeFd = fd;
+      writeEnd = 0;
+   }
+   pthread_mutex_unlock(&value_lock);
+   if (fd < 0) return takeSnapshot();
+   //values can only be appended to gen from now on, but a resize may carry entries past us
+   //while the stripe is unlocked, so go again until a pass finds nothing
+   int moved;
+   do {
+      moved = 0;
+      for (int x = 0; x < NOVOHT_STRIPES && moved >= 0; x++){
+         int n = collectStripe(x, gen);
+         moved = n < 0 ? -1 : moved + n;
+      }
+   } while (moved > 0);
+   if (moved == 0) firstGen = gen;
+   return takeSnapshot();
+}
+
+//copy the values of stripe x older than gen, NOVOHT_GC_BUCKETS buckets per lock.
+//Values moved or -1 on error.
+int NoVoHT::collectStripe(int x, unsigned int gen){
+   int moved = 0;
+   for (int b = x; moved >= 0; b += NOVOHT_STRIPES*NOVOHT_GC_BUCKETS){
+      pthread_mutex_lock(&stripes[x]);
+      bool done = b >= size && (oldpairs == NULL || b >= oldsize);
+      for (int i = 0, c = b; !done && i < NOVOHT_GC_BUCKETS && moved >= 0;
+            i++, c += NOVOHT_STRIPES){
+         int n = c < size ? moveValues(kvpairs[c], gen) : 0;
+         if (n >= 0 && oldpairs != NULL && c < oldsize && c >= migrated[x]){
+            int m = moveValues(oldpairs[c], gen);
+            n = m < 0 ? m : n + m;
+         }
+         moved = n < 0 ? -1 : moved + n;
+      }
+      pthread_mutex_unlock(&stripes[x]);
+      if (done) break;
+   }
+   return moved;
+}
+
+int NoVoHT::moveValues(kvpair *cur, unsigned int gen){
+   int moved = 0;
+   string v;
+   for (; cur != NULL; cur = cur->next){
+      if (cur->ref.gen == 0 || cur->ref.gen >= gen) continue;
+      vref r;
+      if (readValue(cur->ref, v) != 0 || appendValue(v, r) != 0) return -1;
+      dropValue(cur->ref);
+      cur->ref = r;
+      liveValue(r);
+      moved++;
+   }
+   return moved;
+}
+
+//a snapshot made it, the generations before firstGen are not referenced any more.
+//Caller holds file_lock.
+void NoVoHT::dropValueGens(){
+   pthread_rwlock_wrlock(&values_rw);
+   while (!valueFds.empty() && valueFds.begin()->first < firstGen){
+      map<unsigned int, int>::iterator it = valueFds.begin();
+      struct stat st;
+      if (fstat(it->second, &st) == 0) __sync_fetch_and_sub(&valueGarbage, st.st_size);
+      close(it->second);
+      unlink(valueFile(it->first).c_str());
+      valueFds.erase(it);
+   }
+   pthread_rwlock_unlock(&values_rw);
+}
@@ -0,0 +1,93 @@
+#include <string.h>
+#include "../../inc/novoht.h"
+
+//NoVoHT key expiry: the deadline lives in the pair, the timer wheel only says when to look
+
+//caller holds the key's stripe. A deadline already past goes into the slot looked at next.
+void NoVoHT::wheelAdd(const string &k, long long deadline){
+   long long tick = deadline / NOVOHT_WHEEL_TICK;
+   pthread_mutex_lock(&wheel_lock);
+   if (tick < wheelTick) tick = wheelTick;
+   wheel[tick % NOVOHT_WHEEL_SLOTS].push_back(make_pair(k, deadline));
+   pthread_mutex_unlock(&wheel_lock);
+}
+
+int NoVoHT::expire(const string &k, long long deadline){
+   if (deadline < 0) deadline = 0;
+   unsigned long long h = hash(k);
+   int x = h%NOVOHT_STRIPES;
+   pthread_mutex_lock(&stripes[x]);
+   kvpair *cur = *bucket(h);
+   while (cur != NULL && k.compare(cur->key) != 0) cur = cur->next;
+   if (cur == NULL || (cur->expires != 0 && cur->expires <= novohtNowUsec())){
+      pthread_mutex_unlock(&stripes[x]);
+      return -1;
+   }
+   cur->expires = deadline;
+   if (deadline != 0) wheelAdd(k, deadline);
+   int ret = write(NOVOHT_LOG_TTL, k, string((const char*) &deadline, sizeof(deadline)));
+   pthread_mutex_unlock(&stripes[x]);
+   if (ret == 0) ret = syncLog();
+   maybeSnapshot();
+   return ret;
+}
+
+long long NoVoHT::getExpiry(const string &k){
+   unsigned long long h = hash(k);
+   pthread_mutex_t *lock = &stripes[h%NOVOHT_STRIPES];
+   pthread_mutex_lock(lock);
+   kvpair *cur = *bucket(h);
+   while (cur != NULL && k.compare(cur->key) != 0) cur = cur->next;
+   long long deadline = cur == NULL ? -1 : cur->expires;
+   if (deadline > 0 && deadline <= novohtNowUsec()) deadline = -1;
+   pthread_mutex_unlock(lock);
+   return deadline;
+}
+
+//walk the slots from the last call up to now, at most one round. Entries due are taken out
+//under wheel_lock and removed afterwards, each only if its key still has that deadline.
+int NoVoHT::expireDue(vector<string> *reaped){
+   long long now = novohtNowUsec();
+   long long nowTick = now / NOVOHT_WHEEL_TICK;
+   vector<pair<string, long long> > due;
+   pthread_mutex_lock(&wheel_lock);
+   long long first = wheelTick;
+   if (nowTick - first >= NOVOHT_WHEEL_SLOTS) first = nowTick - NOVOHT_WHEEL_SLOTS + 1;
+   for (long long t = first; t <= nowTick; t++){
+      vector<pair<string, long long> > &slot = wheel[t % NOVOHT_WHEEL_SLOTS];
+      size_t keep = 0;
+      for (size_t i = 0; i < slot.size(); i++){
+         if (slot[i].second <= now) due.push_back(slot[i]);
+         else slot[keep++] = slot[i];   //a later round
+      }
+      slot.resize(keep);
+   }
+   wheelTick = nowTick;   //the current slot is looked at again, its tick is not over yet
+   pthread_mutex_unlock(&wheel_lock);
+   int n = 0;
+   for (size_t i = 0; i < due.size(); i++){
+      if (removeIf(due[i].first, due[i].second) == 0){
+         n++;
+         if (reaped != NULL) reaped->push_back(due[i].first);
+      }
+   }
+   __sync_fetch_and_add(&expired, n);
+   return n;
+}
+
+//caller holds every stripe and file_lock, right after the log was rotated: the snapshot
+//being taken has no deadlines, so the fresh log gets one TTL record per key that has one
+void NoVoHT::relogExpiries(){
+   pthread_mutex_lock(&wheel_lock);
+   for (int s = 0; s < NOVOHT_WHEEL_SLOTS; s++){
+      for (size_t i = 0; i < wheel[s].size(); i++){
+         const string &k = wheel[s][i].first;
+         long long deadline = wheel[s][i].second;
+         kvpair *cur = *bucket(hash(k));
+         while (cur != NULL && k.compare(cur->key) != 0) cur = cur->next;
+         if (cur != NULL && cur->expires == deadline)
+            writeLocked(NOVOHT_LOG_TTL, k, string((const char*) &deadline, sizeof(deadline)));
+      }
+   }
+   pthread_mutex_unlock(&wheel_lock);
+}
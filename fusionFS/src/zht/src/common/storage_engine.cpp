@@ -0,0 +1,332 @@
+/*
+ * storage_engine.cpp
+ *
+ *  The engines behind StorageEngine, see storage_engine.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "storage_engine.h"
+
+StorageEngine *createStorageEngine(const string &engine, const string &file,
+		long cacheBytes, int durability, int syncUsec, int syncRecords, bool ordered) {
+	if (engine.empty() || engine == "novoht")
+		return new NoVoHTEngine(file, cacheBytes, durability, syncUsec, syncRecords,
+				ordered);
+	if (engine == "flat")
+		return new FlatEngine(ordered);
+	if (engine == "map")
+		return new MapEngine();
+	if (engine == "cstr")
+		return new CStrEngine();
+	return NULL;
+}
+
+//================================ NoVoHT ===============================
+
+NoVoHTEngine::NoVoHTEngine(const string &file, long cacheBytes, int durability,
+		int syncUsec, int syncRecords, bool ordered) {
+	table = new NoVoHT(file, 100000, 10000, 0.7, cacheBytes);
+	table->setDurability(durability, syncUsec, syncRecords);
+	if (ordered)
+		table->keepOrder();
+	persistent = !file.empty();
+}
+
+NoVoHTEngine::~NoVoHTEngine() {
+	delete table;
+}
+
+int NoVoHTEngine::put(const string &key, const string &value) {
+	return table->put(key, value) == 0 ? 0 : -2;
+}
+
+int NoVoHTEngine::get(const string &key, string &value) {
+	return table->get(key, value);
+}
+
+int NoVoHTEngine::remove(const string &key) {
+	int ret = table->remove(key);
+	return ret == 0 || ret == -1 ? ret : -2;
+}
+
+int NoVoHTEngine::scan(const string &prefix, const string &after, int limit,
+		vector<pair<string, string> > &out) {
+	return table->scan(prefix, after, limit, out);
+}
+
+int NoVoHTEngine::forEachKey(StorageKeyVisitor visit, void *arg) {
+	return table->forEachKey(visit, arg);
+}
+
+int NoVoHTEngine::setExpiry(const string &key, long long deadline) {
+	int ret = table->expire(key, deadline);
+	return ret == 0 || ret == -1 ? ret : -2;
+}
+
+long long NoVoHTEngine::getExpiry(const string &key) {
+	return table->getExpiry(key);
+}
+
+int NoVoHTEngine::expireDue(vector<string> *reaped) {
+	return table->expireDue(reaped);
+}
+
+bool NoVoHTEngine::deferSync() {
+	return table->deferSync();
+}
+
+int NoVoHTEngine::sync() {
+	return table->sync();
+}
+
+int NoVoHTEngine::snapshot() {
+	return persistent ? table->writeFile() : -1;
+}
+
+int NoVoHTEngine::size() {
+	return table->getSize();
+}
+
+const char *NoVoHTEngine::name() {
+	return "novoht";
+}
+
+void NoVoHTEngine::stats(vector<pair<string, long long> > &out) {
+	out.push_back(make_pair("capacity", (long long) table->getCap()));
+	out.push_back(make_pair("resizes", (long long) table->getResizes()));
+	out.push_back(make_pair("resizing", (long long) table->isResizing()));
+	out.push_back(make_pair("snapshots", (long long) table->getSnapshots()));
+	out.push_back(make_pair("value_collections", (long long) table->getCollections()));
+	out.push_back(make_pair("expired", (long long) table->getExpired()));
+}
+
+//================================ NoVoHTFlat ===============================
+
+FlatEngine::FlatEngine(bool ordered) {
+	if (ordered)
+		table.keepOrder();
+}
+
+int FlatEngine::put(const string &key, const string &value) {
+	return table.put(key, value);
+}
+
+int FlatEngine::get(const string &key, string &value) {
+	return table.get(key, value);
+}
+
+int FlatEngine::remove(const string &key) {
+	return table.remove(key);
+}
+
+int FlatEngine::scan(const string &prefix, const string &after, int limit,
+		vector<pair<string, string> > &out) {
+	return table.scan(prefix, after, limit, out);
+}
+
+int FlatEngine::forEachKey(StorageKeyVisitor visit, void *arg) {
+	return table.forEachKey(visit, arg);
+}
+
+int FlatEngine::snapshot() {
+	return -1;
+}
+
+int FlatEngine::size() {
+	return table.getSize();
+}
+
+const char *FlatEngine::name() {
+	return "flat";
+}
+
+void FlatEngine::stats(vector<pair<string, long long> > &out) {
+	out.push_back(make_pair("capacity", (long long) table.getCap()));
+}
+
+//================================ std::map ===============================
+
+MapEngine::MapEngine() {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+MapEngine::~MapEngine() {
+	pthread_mutex_destroy(&mutex);
+}
+
+int MapEngine::put(const string &key, const string &value) {
+	pthread_mutex_lock(&mutex);
+	table[key] = value;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int MapEngine::get(const string &key, string &value) {
+	pthread_mutex_lock(&mutex);
+	map<string, string>::iterator it = table.find(key);
+	bool found = it != table.end();
+	if (found)
+		value = it->second;
+	pthread_mutex_unlock(&mutex);
+	return found ? 0 : -1;
+}
+
+int MapEngine::remove(const string &key) {
+	pthread_mutex_lock(&mutex);
+	size_t n = table.erase(key);
+	pthread_mutex_unlock(&mutex);
+	return n > 0 ? 0 : -1;
+}
+
+int MapEngine::scan(const string &prefix, const string &after, int limit,
+		vector<pair<string, string> > &out) {
+	out.clear();
+	pthread_mutex_lock(&mutex);
+	map<string, string>::iterator it = after < prefix ?
+			table.lower_bound(prefix) : table.upper_bound(after);
+	for (; it != table.end() && (limit <= 0 || (int) out.size() < limit);
+			it++) {
+		if (it->first.compare(0, prefix.size(), prefix) != 0)
+			break;
+		out.push_back(*it);
+	}
+	pthread_mutex_unlock(&mutex);
+	return out.size();
+}
+
+int MapEngine::forEachKey(StorageKeyVisitor visit, void *arg) {
+	pthread_mutex_lock(&mutex);
+	for (map<string, string>::iterator it = table.begin(); it != table.end(); it++)
+		visit(it->first, arg);
+	int n = table.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+int MapEngine::snapshot() {
+	return -1;
+}
+
+int MapEngine::size() {
+	pthread_mutex_lock(&mutex);
+	int n = table.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+const char *MapEngine::name() {
+	return "map";
+}
+
+//================================ C strings ===============================
+
+bool charscmp::operator()(const char* s1, const char* s2) const {
+	return strcmp(s1, s2) < 0;
+}
+
+static char *newValue(const string &value) {
+	size_t len = value.size();
+	char *v = (char*) malloc(sizeof(size_t) + len);
+	memcpy(v, &len, sizeof(size_t));
+	memcpy(v + sizeof(size_t), value.data(), len);
+	return v;
+}
+
+static void readValue(const char *v, string &value) {
+	size_t len;
+	memcpy(&len, v, sizeof(size_t));
+	value.assign(v + sizeof(size_t), len);
+}
+
+CStrEngine::CStrEngine() {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+CStrEngine::~CStrEngine() {
+	for (CStrMap::iterator it = table.begin(); it != table.end(); it++) {
+		free((char*) it->first);
+		free(it->second);
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+int CStrEngine::put(const string &key, const string &value) {
+	char *v = newValue(value);
+	pthread_mutex_lock(&mutex);
+	CStrMap::iterator it = table.find(key.c_str());
+	if (it != table.end()) {
+		free(it->second);
+		it->second = v;
+	} else {
+		table.insert(CStrMap::value_type(strdup(key.c_str()), v));
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int CStrEngine::get(const string &key, string &value) {
+	pthread_mutex_lock(&mutex);
+	CStrMap::iterator it = table.find(key.c_str());
+	bool found = it != table.end();
+	if (found)
+		readValue(it->second, value);
+	pthread_mutex_unlock(&mutex);
+	return found ? 0 : -1;
+}
+
+int CStrEngine::remove(const string &key) {
+	pthread_mutex_lock(&mutex);
+	CStrMap::iterator it = table.find(key.c_str());
+	bool found = it != table.end();
+	if (found) {
+		char *k = (char*) it->first;
+		free(it->second);
+		table.erase(it);
+		free(k); //only after erase, the map compares with it
+	}
+	pthread_mutex_unlock(&mutex);
+	return found ? 0 : -1;
+}
+
+int CStrEngine::scan(const string &prefix, const string &after, int limit,
+		vector<pair<string, string> > &out) {
+	out.clear();
+	pthread_mutex_lock(&mutex);
+	CStrMap::iterator it = after < prefix ?
+			table.lower_bound(prefix.c_str()) : table.upper_bound(after.c_str());
+	for (; it != table.end() && (limit <= 0 || (int) out.size() < limit);
+			it++) {
+		if (strncmp(it->first, prefix.c_str(), prefix.size()) != 0)
+			break;
+		string value;
+		readValue(it->second, value);
+		out.push_back(make_pair(string(it->first), value));
+	}
+	pthread_mutex_unlock(&mutex);
+	return out.size();
+}
+
+int CStrEngine::forEachKey(StorageKeyVisitor visit, void *arg) {
+	pthread_mutex_lock(&mutex);
+	for (CStrMap::iterator it = table.begin(); it != table.end(); it++)
+		visit(it->first, arg);
+	int n = table.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+int CStrEngine::snapshot() {
+	return -1;
+}
+
+int CStrEngine::size() {
+	pthread_mutex_lock(&mutex);
+	int n = table.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+const char *CStrEngine::name() {
+	return "cstr";
+}
@@ -0,0 +1,501 @@
+/*
+ * zht_async.cpp
+ *
+ *  Event loop behind the asynchronous ZHT client calls. Every connection carries at most
+ *  one request at a time (the server answers in order and frames nothing), so concurrency
+ *  comes from several connections per server and from talking to many servers at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sstream>
+#include "../../inc/net_util.h"
+#include "../../inc/zht_async.h"
+
+#define ASYNC_MAXEVENTS 64
+#define ASYNC_RECV_SIZE 65535
+
+ZHTFuture::ZHTFuture(int operation, ZHTCallback callback, void *arg) {
+	this->operation = operation;
+	this->callback = callback;
+	this->arg = arg;
+	this->selfDestroy = (callback != NULL);
+	this->done = false;
+	this->status = -1;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+ZHTFuture::~ZHTFuture() {
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool ZHTFuture::ready() {
+	pthread_mutex_lock(&mutex);
+	bool ret = done;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+int ZHTFuture::wait() {
+	string ignored;
+	return wait(ignored);
+}
+
+int ZHTFuture::wait(string &result) {
+	pthread_mutex_lock(&mutex);
+	while (!done)
+		pthread_cond_wait(&cond, &mutex);
+	result = this->result;
+	int ret = status;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void ZHTFuture::complete(int status, const string &result) {
+	//done before the callback runs, so it sees its own future ready. A waiter may delete a
+	//future without callback as soon as the mutex is released, nothing touches *this then.
+	ZHTCallback callback = this->callback;
+	void *arg = this->arg;
+	pthread_mutex_lock(&mutex);
+	this->status = status;
+	this->result = result;
+	done = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	if (callback != NULL) //callback style: the engine deletes the future only after this
+		callback(status, result, arg);
+}
+
+static int setNonBlocking(int sock) {
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+ZHTAsyncEngine::ZHTAsyncEngine(int connsPerHost) {
+	this->connsPerHost = connsPerHost > 0 ? connsPerHost : 1;
+	this->efd = -1;
+	this->wakeFds[0] = this->wakeFds[1] = -1;
+	this->running = false;
+	this->started = false;
+	this->pending = 0;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ZHTAsyncEngine::~ZHTAsyncEngine() {
+	stop();
+	pthread_mutex_destroy(&mutex);
+}
+
+int ZHTAsyncEngine::start() {
+	if (running)
+		return 0;
+	if (started) { //stopped by a callback, the loop is not joined yet
+		if (pthread_equal(pthread_self(), thread))
+			return -1;
+		stop();
+	}
+
+	efd = epoll_create(1);
+	if (efd == -1) {
+		cerr << "zht_async: epoll_create failed: " << strerror(errno) << endl;
+		return -1;
+	}
+	if (pipe(wakeFds) != 0) {
+		cerr << "zht_async: pipe failed: " << strerror(errno) << endl;
+		close(efd);
+		efd = -1;
+		return -1;
+	}
+	setNonBlocking(wakeFds[0]);
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL; //NULL marks the wake pipe
+	epoll_ctl(efd, EPOLL_CTL_ADD, wakeFds[0], &event);
+
+	running = true;
+	started = true;
+	if (pthread_create(&thread, NULL, loopEntry, this) != 0) {
+		cerr << "zht_async: failed to start the event loop." << endl;
+		running = false;
+		started = false;
+		close(wakeFds[0]);
+		close(wakeFds[1]);
+		close(efd);
+		efd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+//from a callback, on the loop thread itself, this only tells the loop to end after the
+//current round: it cannot join itself. The next stop() from another thread, at the latest
+//the destructor's, joins it and cleans up.
+void ZHTAsyncEngine::stop() {
+	pthread_mutex_lock(&mutex);
+	if (!started) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	bool wake = running;
+	running = false;
+	bool self = pthread_equal(pthread_self(), thread);
+	if (!self)
+		started = false; //this call joins the loop
+	pthread_mutex_unlock(&mutex);
+
+	char c = 0;
+	if (wake)
+		write(wakeFds[1], &c, 1);
+	if (self)
+		return;
+	pthread_join(thread, NULL);
+
+	//the loop is gone, fail whatever never got an answer.
+	vector<ZHTFuture*> failed;
+	for (size_t i = 0; i < conns.size(); i++) {
+		if (conns[i]->req.future != NULL)
+			failed.push_back(conns[i]->req.future);
+		close(conns[i]->sock);
+		delete conns[i];
+	}
+	map<string, deque<Request> >::iterator it;
+	for (it = waiting.begin(); it != waiting.end(); it++) {
+		for (size_t i = 0; i < it->second.size(); i++)
+			failed.push_back(it->second[i].future);
+	}
+	conns.clear();
+	idle.clear();
+	waiting.clear();
+	connCount.clear();
+	endpoints.clear();
+	pending = 0;
+
+	close(wakeFds[0]);
+	close(wakeFds[1]);
+	close(efd);
+	efd = -1;
+
+	for (size_t i = 0; i < failed.size(); i++) {
+		bool del = failed[i]->selfDestroy;
+		failed[i]->complete(-1, "");
+		if (del)
+			delete failed[i];
+	}
+}
+
+int ZHTAsyncEngine::inFlight() {
+	pthread_mutex_lock(&mutex);
+	int ret = pending;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+int ZHTAsyncEngine::submit(const struct HostEntity &dest, const string &request,
+		ZHTFuture *future) {
+	stringstream ss;
+	ss << dest.host << ":" << dest.port;
+	string endpoint = ss.str();
+
+	Request req;
+	req.data = request;
+	req.future = future;
+
+	pthread_mutex_lock(&mutex);
+	if (!running) {
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	pending++;
+
+	vector<Conn*> &spare = idle[endpoint];
+	if (!spare.empty()) {
+		Conn *conn = spare.back();
+		spare.pop_back();
+		dispatch(conn, req);
+	} else if (connCount[endpoint] < connsPerHost) {
+		Conn *conn = connect(dest, endpoint);
+		if (conn == NULL) {
+			pending--;
+			pthread_mutex_unlock(&mutex);
+			bool del = future->selfDestroy;
+			future->complete(-1, "");
+			if (del)
+				delete future;
+			return 0;
+		}
+		dispatch(conn, req);
+	} else {
+		waiting[endpoint].push_back(req);
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+//called with mutex held
+ZHTAsyncEngine::Conn *ZHTAsyncEngine::connect(const struct HostEntity &dest,
+		const string &endpoint) {
+	int sock = makeClientSocket(dest.host.c_str(), dest.port, true);
+	if (sock <= 0) {
+		cerr << "zht_async: making connection to " << endpoint << " failed."
+				<< endl;
+		return NULL;
+	}
+	reuseSock(sock);
+	setNonBlocking(sock);
+
+	Conn *conn = new Conn;
+	conn->sock = sock;
+	conn->endpoint = endpoint;
+	conn->req.future = NULL;
+	conn->sent = 0;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event) == -1) {
+		cerr << "zht_async: epoll_ctl failed: " << strerror(errno) << endl;
+		close(sock);
+		delete conn;
+		return NULL;
+	}
+
+	conns.push_back(conn);
+	connCount[endpoint]++;
+	endpoints[endpoint] = dest;
+	return conn;
+}
+
+//called with mutex held. Send errors show up as EPOLLERR/EPOLLHUP in the loop.
+void ZHTAsyncEngine::dispatch(Conn *conn, const Request &req) {
+	conn->req = req;
+	conn->sent = 0;
+	conn->in.clear();
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.data.ptr = conn;
+	event.events = EPOLLIN;
+	if (flush(conn) != 0)
+		event.events |= EPOLLOUT;
+	epoll_ctl(efd, EPOLL_CTL_MOD, conn->sock, &event);
+}
+
+//0 if the whole request is out, 1 if some is left, -1 on error
+int ZHTAsyncEngine::flush(Conn *conn) {
+	const string &data = conn->req.data;
+	while (conn->sent < data.size()) {
+		ssize_t n = send(conn->sock, data.data() + conn->sent,
+				data.size() - conn->sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			shutdown(conn->sock, SHUT_RDWR); //make sure epoll reports it
+			return -1;
+		}
+		conn->sent += n;
+	}
+	return 0;
+}
+
+//the reply is complete once its length (int32, see recvReplyTCP) and that many bytes are
+//in. Same layout the blocking client expects inside: "%03d"+result for lookup, batches and
+//scans, int32 otherwise.
+bool ZHTAsyncEngine::consume(Conn *conn, int &status, string &result) {
+	int32_t length;
+	if (conn->in.size() < sizeof(int32_t))
+		return false;
+	memcpy(&length, conn->in.data(), sizeof(int32_t));
+	if (length < 0 || conn->in.size() < sizeof(int32_t) + length)
+		return false;
+	const char *reply = conn->in.data() + sizeof(int32_t);
+	int operation = conn->req.future->operation;
+	if (operation == 1 || (operation >= 4 && operation <= 6) || operation == 8) {
+		if (length < 3)
+			status = -1;
+		else {
+			status = atoi(string(reply, 3).c_str());
+			result.assign(reply + 3, length - 3);
+		}
+		return true;
+	}
+	if (length < (int32_t) sizeof(int32_t))
+		status = -1;
+	else {
+		int32_t ret;
+		memcpy(&ret, reply, sizeof(int32_t));
+		status = ret;
+	}
+	return true;
+}
+
+//called with mutex held: the request on CONN is answered, move on to the next queued one.
+void ZHTAsyncEngine::finish(Conn *conn) {
+	conn->req.future = NULL;
+	conn->req.data.clear();
+	conn->in.clear();
+	pending--;
+
+	deque<Request> &queue = waiting[conn->endpoint];
+	if (!queue.empty()) {
+		Request next = queue.front();
+		queue.pop_front();
+		dispatch(conn, next);
+	} else {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.data.ptr = conn;
+		event.events = EPOLLIN;
+		epoll_ctl(efd, EPOLL_CTL_MOD, conn->sock, &event);
+		idle[conn->endpoint].push_back(conn);
+	}
+}
+
+//called with mutex held: the connection is broken, close it and hand back what it carried.
+void ZHTAsyncEngine::drop(Conn *conn, vector<Request> &failed) {
+	if (conn->req.future != NULL) {
+		failed.push_back(conn->req);
+		pending--;
+	}
+	close(conn->sock);
+
+	vector<Conn*> &spare = idle[conn->endpoint];
+	for (size_t i = 0; i < spare.size(); i++) {
+		if (spare[i] == conn) {
+			spare.erase(spare.begin() + i);
+			break;
+		}
+	}
+	for (size_t i = 0; i < conns.size(); i++) {
+		if (conns[i] == conn) {
+			conns.erase(conns.begin() + i);
+			break;
+		}
+	}
+	string endpoint = conn->endpoint;
+	connCount[endpoint]--;
+	delete conn;
+
+	//requests queued behind the broken connection need a fresh one.
+	deque<Request> &queue = waiting[endpoint];
+	if (!queue.empty() && connCount[endpoint] == 0) {
+		Conn *fresh = connect(endpoints[endpoint], endpoint);
+		if (fresh == NULL) {
+			while (!queue.empty()) {
+				failed.push_back(queue.front());
+				queue.pop_front();
+				pending--;
+			}
+		} else {
+			Request next = queue.front();
+			queue.pop_front();
+			dispatch(fresh, next);
+		}
+	}
+}
+
+void *ZHTAsyncEngine::loopEntry(void *engine) {
+	((ZHTAsyncEngine*) engine)->loop();
+	return NULL;
+}
+
+void ZHTAsyncEngine::loop() {
+	struct epoll_event events[ASYNC_MAXEVENTS];
+	char buff[ASYNC_RECV_SIZE];
+
+	while (1) {
+		int n = epoll_wait(efd, events, ASYNC_MAXEVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			cerr << "zht_async: epoll_wait failed: " << strerror(errno) << endl;
+			return;
+		}
+
+		vector<pair<ZHTFuture*, int> > completed;
+		vector<string> results;
+		vector<Request> failed;
+
+		pthread_mutex_lock(&mutex);
+		for (int i = 0; i < n; i++) {
+			Conn *conn = (Conn*) events[i].data.ptr;
+			if (conn == NULL) { //wake pipe
+				char c;
+				while (read(wakeFds[0], &c, 1) > 0)
+					;
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && conn->req.future != NULL) {
+				int r = flush(conn);
+				if (r == 0) {
+					struct epoll_event event;
+					memset(&event, 0, sizeof(event));
+					event.data.ptr = conn;
+					event.events = EPOLLIN;
+					epoll_ctl(efd, EPOLL_CTL_MOD, conn->sock, &event);
+				} else if (r < 0) {
+					drop(conn, failed);
+					continue;
+				}
+			}
+
+			if (events[i].events & EPOLLIN) {
+				ssize_t count = recv(conn->sock, buff, sizeof(buff), 0);
+				if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					continue;
+				if (count <= 0 || conn->req.future == NULL) {
+					//closed, failed, or the server talked without being asked.
+					drop(conn, failed);
+					continue;
+				}
+				conn->in.append(buff, count);
+
+				int status;
+				string result;
+				if (consume(conn, status, result)) {
+					completed.push_back(make_pair(conn->req.future, status));
+					results.push_back(result);
+					finish(conn);
+				}
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				drop(conn, failed);
+			}
+		}
+		bool stopping = !running;
+		pthread_mutex_unlock(&mutex);
+
+		//user code runs outside the lock, callbacks may submit more requests.
+		for (size_t i = 0; i < completed.size(); i++) {
+			ZHTFuture *f = completed[i].first;
+			bool del = f->selfDestroy;
+			f->complete(completed[i].second, results[i]);
+			if (del)
+				delete f;
+		}
+		for (size_t i = 0; i < failed.size(); i++) {
+			ZHTFuture *f = failed[i].future;
+			bool del = f->selfDestroy;
+			f->complete(-1, "");
+			if (del)
+				delete f;
+		}
+
+		if (stopping)
+			return;
+	}
+}
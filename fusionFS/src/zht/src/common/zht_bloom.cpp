@@ -0,0 +1,174 @@
+/*
+ * zht_bloom.cpp
+ *
+ *  Blocked Bloom filter of a server's keys and the client's cache of its blocks, see
+ *  zht_bloom.h.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "../../inc/zht_bloom.h"
+
+static long long nowUsec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return (long long) tp.tv_sec * 1000000 + tp.tv_usec;
+}
+
+static uint64_t mix(uint64_t h) { //murmur3 finalizer
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+//FNV-1a, then two mixed words: one picks the block, one the bits inside it
+static void bloomHash(const string &key, uint64_t &blockHash, uint64_t &bitHash) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.size(); i++) {
+		h ^= (unsigned char) key[i];
+		h *= 1099511628211ULL;
+	}
+	blockHash = mix(h);
+	bitHash = mix(h ^ 0x9e3779b97f4a7c15ULL);
+}
+
+int bloomBlockOf(const string &key, int blocks) {
+	uint64_t blockHash, bitHash;
+	bloomHash(key, blockHash, bitHash);
+	return (int) (blockHash % (uint64_t) blocks);
+}
+
+//double hashing inside the block, ZHT_BLOOM_BLOCK * 8 is a power of two
+#define BLOOM_BIT(bitHash, i) \
+	((uint32_t) ((bitHash) + (i) * (((bitHash) >> 32) | 1)) & (ZHT_BLOOM_BLOCK * 8 - 1))
+
+void bloomSet(char *block, const string &key) {
+	uint64_t blockHash, bitHash;
+	bloomHash(key, blockHash, bitHash);
+	for (int i = 0; i < ZHT_BLOOM_HASHES; i++) {
+		uint32_t bit = BLOOM_BIT(bitHash, i);
+		block[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+bool bloomTest(const char *block, const string &key) {
+	uint64_t blockHash, bitHash;
+	bloomHash(key, blockHash, bitHash);
+	for (int i = 0; i < ZHT_BLOOM_HASHES; i++) {
+		uint32_t bit = BLOOM_BIT(bitHash, i);
+		if ((block[bit >> 3] & (1 << (bit & 7))) == 0)
+			return false;
+	}
+	return true;
+}
+
+ZHTBloom::ZHTBloom() {
+	reset(0);
+}
+
+void ZHTBloom::reset(long long keys) {
+	long long bytes = keys * ZHT_BLOOM_BITS_PER_KEY / 8;
+	nblocks = (int) (bytes / ZHT_BLOOM_BLOCK) + 1;
+	bits.assign((size_t) nblocks * ZHT_BLOOM_BLOCK, 0);
+}
+
+void ZHTBloom::add(const string &key) {
+	bloomSet(&bits[(size_t) bloomBlockOf(key, nblocks) * ZHT_BLOOM_BLOCK], key);
+}
+
+bool ZHTBloom::mayContain(const string &key) {
+	return bloomTest(&bits[(size_t) bloomBlockOf(key, nblocks) * ZHT_BLOOM_BLOCK], key);
+}
+
+ZHTNegativeCache::ZHTNegativeCache() {
+	cachedBlocks = 0;
+	ttlUsec = 0;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ZHTNegativeCache::~ZHTNegativeCache() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void ZHTNegativeCache::setTtl(int ttlMsec) {
+	pthread_mutex_lock(&mutex);
+	ttlUsec = ttlMsec > 0 ? ttlMsec * 1000LL : 0;
+	if (ttlUsec == 0) {
+		members.clear();
+		cachedBlocks = 0;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ZHTNegativeCache::absent(int member, const string &key) {
+	bool ruledOut = false;
+	pthread_mutex_lock(&mutex);
+	map<int, Member>::iterator m = members.find(member);
+	if (m != members.end()) {
+		map<int, Block>::iterator b = m->second.cached.find(
+				bloomBlockOf(key, m->second.blocks));
+		if (b != m->second.cached.end()) {
+			if (nowUsec() - b->second.fetched >= ttlUsec) {
+				m->second.cached.erase(b); //stale, the next miss brings it again
+				cachedBlocks--;
+			} else
+				ruledOut = !bloomTest(b->second.bits.data(), key);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return ruledOut;
+}
+
+bool ZHTNegativeCache::store(int member, const char *data, int len) {
+	if (len != ZHT_BLOOM_HEADER + ZHT_BLOOM_BLOCK
+			|| memcmp(data, ZHT_BLOOM_MAGIC, 3) != 0)
+		return false;
+	int32_t blocks, index;
+	memcpy(&blocks, data + 3, sizeof(int32_t));
+	memcpy(&index, data + 7, sizeof(int32_t));
+	if (blocks <= 0 || index < 0 || index >= blocks)
+		return false;
+
+	pthread_mutex_lock(&mutex);
+	if (ttlUsec > 0) {
+		if (cachedBlocks >= ZHT_NEGATIVE_MAX_BLOCKS) {
+			members.clear();
+			cachedBlocks = 0;
+		}
+		map<int, Member>::iterator it = members.find(member);
+		if (it == members.end()) {
+			Member fresh;
+			fresh.blocks = blocks;
+			it = members.insert(make_pair(member, fresh)).first;
+		}
+		Member &m = it->second;
+		if (m.blocks != blocks) { //the server rebuilt its filter with another size
+			cachedBlocks -= m.cached.size();
+			m.cached.clear();
+			m.blocks = blocks;
+		}
+		Block &b = m.cached[index];
+		if (b.bits.empty())
+			cachedBlocks++;
+		b.bits.assign(data + ZHT_BLOOM_HEADER, ZHT_BLOOM_BLOCK);
+		b.fetched = nowUsec();
+	}
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+void ZHTNegativeCache::added(int member, const string &key) {
+	pthread_mutex_lock(&mutex);
+	map<int, Member>::iterator m = members.find(member);
+	if (m != members.end()) {
+		map<int, Block>::iterator b = m->second.cached.find(
+				bloomBlockOf(key, m->second.blocks));
+		if (b != m->second.cached.end())
+			bloomSet(&b->second.bits[0], key);
+	}
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,171 @@
+/*
+ * zht_hedge.cpp
+ *
+ *  Latency and failure bookkeeping of the client's replica-aware reads, see zht_hedge.h.
+ */
+
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include "../../inc/zht_hedge.h"
+
+static long long nowUsec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return (long long) tp.tv_sec * 1000000 + tp.tv_usec;
+}
+
+ZHTHedge::ZHTHedge() {
+	sampleCount = 0;
+	p95 = ZHT_HEDGE_DEFAULT_USEC;
+	delayUsec = 0;
+	timeoutUsec = ZHT_READ_TIMEOUT_USEC;
+	suspectAfter = ZHT_SUSPECT_AFTER;
+	suspectUsec = ZHT_SUSPECT_USEC;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ZHTHedge::~ZHTHedge() {
+	for (size_t k = 0; k < losers.size(); k++)
+		close(losers[k].fd);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ZHTHedge::configure(int delayUsec, int timeoutUsec, int suspectAfter,
+		int suspectUsec) {
+	pthread_mutex_lock(&mutex);
+	if (delayUsec >= -1)
+		this->delayUsec = delayUsec;
+	if (timeoutUsec > 0)
+		this->timeoutUsec = timeoutUsec;
+	if (suspectAfter > 0)
+		this->suspectAfter = suspectAfter;
+	if (suspectUsec >= 0)
+		this->suspectUsec = suspectUsec;
+	pthread_mutex_unlock(&mutex);
+}
+
+int ZHTHedge::delay() {
+	pthread_mutex_lock(&mutex);
+	int d = delayUsec != 0 ? delayUsec : std::max(p95, ZHT_HEDGE_MIN_USEC);
+	pthread_mutex_unlock(&mutex);
+	return d;
+}
+
+int ZHTHedge::timeout() {
+	pthread_mutex_lock(&mutex);
+	int t = timeoutUsec;
+	pthread_mutex_unlock(&mutex);
+	return t;
+}
+
+void ZHTHedge::record(long long usec) {
+	pthread_mutex_lock(&mutex);
+	samples[sampleCount % ZHT_HEDGE_SAMPLES] = usec;
+	sampleCount++;
+	if (sampleCount >= ZHT_HEDGE_SAMPLES / 8
+			&& sampleCount % (ZHT_HEDGE_SAMPLES / 8) == 0) {
+		int n = std::min(sampleCount, ZHT_HEDGE_SAMPLES);
+		long long sorted[ZHT_HEDGE_SAMPLES];
+		memcpy(sorted, samples, n * sizeof(long long));
+		std::nth_element(sorted, sorted + n * 95 / 100, sorted + n);
+		p95 = (int) sorted[n * 95 / 100];
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+//caller holds mutex
+ZHTHedge::Peer &ZHTHedge::peer(int member) {
+	if (member >= (int) peers.size()) {
+		Peer fresh;
+		fresh.failures = 0;
+		fresh.suspectUntil = 0;
+		peers.resize(member + 1, fresh);
+	}
+	return peers[member];
+}
+
+//caller holds mutex
+void ZHTHedge::failedLocked(int member) {
+	Peer &p = peer(member);
+	if (++p.failures >= suspectAfter)
+		p.suspectUntil = nowUsec() + suspectUsec; //one more failure after it runs out renews it
+}
+
+void ZHTHedge::failed(int member) {
+	pthread_mutex_lock(&mutex);
+	failedLocked(member);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ZHTHedge::succeeded(int member) {
+	pthread_mutex_lock(&mutex);
+	Peer &p = peer(member);
+	p.failures = 0;
+	p.suspectUntil = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+void ZHTHedge::lost(int member, int fd) {
+	if (fd < 0)
+		return;
+	pthread_mutex_lock(&mutex);
+	if (losers.size() >= ZHT_LOSERS_MAX) { //the oldest has had long enough
+		failedLocked(losers.front().member);
+		close(losers.front().fd);
+		losers.erase(losers.begin());
+	}
+	Loser l;
+	l.member = member;
+	l.fd = fd;
+	l.since = nowUsec();
+	losers.push_back(l);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ZHTHedge::settle() {
+	pthread_mutex_lock(&mutex);
+	if (losers.empty()) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	vector<struct pollfd> fds(losers.size());
+	for (size_t k = 0; k < losers.size(); k++) {
+		fds[k].fd = losers[k].fd;
+		fds[k].events = POLLIN;
+		fds[k].revents = 0;
+	}
+	poll(&fds[0], fds.size(), 0);
+	long long now = nowUsec();
+	size_t kept = 0;
+	for (size_t k = 0; k < losers.size(); k++) {
+		Loser &l = losers[k];
+		//answered after all, just slower. Readable may also mean closed (EOF, POLLHUP):
+		//only a byte of the reply counts.
+		char c;
+		if ((fds[k].revents & (POLLIN | POLLHUP)) != 0
+				&& recv(l.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+			Peer &p = peer(l.member);
+			p.failures = 0;
+			p.suspectUntil = 0;
+		} else if (fds[k].revents != 0 || now - l.since >= timeoutUsec) {
+			failedLocked(l.member);
+		} else {
+			losers[kept++] = l;
+			continue;
+		}
+		close(l.fd);
+	}
+	losers.resize(kept);
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ZHTHedge::suspect(int member) {
+	pthread_mutex_lock(&mutex);
+	bool s = member < (int) peers.size() && peers[member].suspectUntil > nowUsec();
+	pthread_mutex_unlock(&mutex);
+	return s;
+}
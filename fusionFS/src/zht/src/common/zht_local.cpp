@@ -0,0 +1,31 @@
+/*
+ * zht_local.cpp
+ *
+ *  Where the clients find the server embedded in their process, see zht_local.h.
+ */
+
+#include "../../inc/zht_local.h"
+
+//set once, before the clients route anything to it
+static string localHost;
+static int localPort = -1;
+static ZHTLocalServe localServe = NULL;
+
+void zhtSetLocalServer(const string &host, int port, ZHTLocalServe serve) {
+	localServe = NULL;
+	localHost = host;
+	localPort = port;
+	__sync_synchronize(); //host and port are in place before the path opens
+	localServe = serve;
+}
+
+bool zhtIsLocal(const struct HostEntity &dest) {
+	return localServe != NULL && dest.port == localPort && dest.host == localHost;
+}
+
+int zhtLocalCall(const char *req, int len, char *buff, int size) {
+	ZHTLocalServe serve = localServe;
+	if (serve == NULL)
+		return -1;
+	return serve(req, len, buff, size);
+}
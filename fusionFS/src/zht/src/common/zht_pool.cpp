@@ -0,0 +1,141 @@
+/*
+ * zht_pool.cpp
+ *
+ *  Per endpoint connection pool of the blocking client calls, see zht_pool.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <iostream>
+#include "../../inc/zht_pool.h"
+
+ZHTConnPool::ZHTConnPool(int maxPerEndpoint) {
+	this->maxPerEndpoint = maxPerEndpoint > 0 ? maxPerEndpoint : 1;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&freed, NULL);
+}
+
+ZHTConnPool::~ZHTConnPool() {
+	closeAll();
+	pthread_cond_destroy(&freed);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ZHTConnPool::setSize(int maxPerEndpoint) {
+	pthread_mutex_lock(&mutex);
+	this->maxPerEndpoint = maxPerEndpoint > 0 ? maxPerEndpoint : 1;
+	pthread_cond_broadcast(&freed);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ZHTConnPool::closeAll() {
+	pthread_mutex_lock(&mutex);
+	for (map<pair<string, int>, Endpoint>::iterator it = endpoints.begin();
+			it != endpoints.end(); it++) {
+		Endpoint &ep = it->second;
+		for (size_t i = 0; i < ep.idle.size(); i++)
+			close(ep.idle[i]);
+		ep.open -= ep.idle.size();
+		ep.idle.clear();
+	}
+	pthread_cond_broadcast(&freed);
+	pthread_mutex_unlock(&mutex);
+}
+
+//caller holds mutex. Entries are never erased, so the reference stays good without it.
+ZHTConnPool::Endpoint &ZHTConnPool::endpoint(const struct HostEntity &dest) {
+	pair<string, int> key(dest.host, dest.port);
+	map<pair<string, int>, Endpoint>::iterator it = endpoints.find(key);
+	if (it == endpoints.end()) {
+		Endpoint ep;
+		ep.open = 0;
+		ep.resolved = false;
+		it = endpoints.insert(make_pair(key, ep)).first;
+	}
+	return it->second;
+}
+
+//a fresh connection, the address is looked up once per endpoint. Caller holds mutex.
+int ZHTConnPool::connectTo(const struct HostEntity &dest, Endpoint &ep) {
+	if (!ep.resolved) {
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(dest.host.c_str(), NULL, &hints, &res) != 0 || res == NULL) {
+			cerr << "ZHTConnPool: cannot resolve " << dest.host << endl;
+			return -1;
+		}
+		memcpy(&ep.addr, res->ai_addr, sizeof(sockaddr_in));
+		ep.addr.sin_port = htons(dest.port);
+		freeaddrinfo(res);
+		ep.resolved = true;
+	}
+	sockaddr_in addr = ep.addr;
+	pthread_mutex_unlock(&mutex); //connect may take a while, others keep going
+	int sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (sock >= 0 && connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		cerr << "ZHTConnPool: connect to " << dest.host << ":" << dest.port
+				<< " failed: " << strerror(errno) << endl;
+		close(sock);
+		sock = -1;
+	}
+	pthread_mutex_lock(&mutex);
+	return sock;
+}
+
+//an idle connection is only fit for the next request if the server has not closed it and
+//nothing is left unread on it (a reply nobody picked up would be taken for the next one).
+bool ZHTConnPool::healthy(int sock) {
+	char c;
+	int r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int ZHTConnPool::checkout(const struct HostEntity &dest) {
+	pthread_mutex_lock(&mutex);
+	Endpoint &ep = endpoint(dest);
+	int sock = -1;
+	while (sock < 0) {
+		if (!ep.idle.empty()) {
+			sock = ep.idle.back();
+			ep.idle.pop_back();
+			if (!healthy(sock)) { //replace it
+				close(sock);
+				sock = -1;
+				ep.open--;
+			}
+		} else if (ep.open < maxPerEndpoint) {
+			ep.open++;
+			sock = connectTo(dest, ep);
+			if (sock < 0) {
+				ep.open--;
+				pthread_cond_broadcast(&freed);
+				break;
+			}
+		} else {
+			pthread_cond_wait(&freed, &mutex);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return sock;
+}
+
+void ZHTConnPool::checkin(const struct HostEntity &dest, int sock, bool broken) {
+	if (sock < 0)
+		return;
+	pthread_mutex_lock(&mutex);
+	Endpoint &ep = endpoint(dest);
+	if (broken || ep.open > maxPerEndpoint) { //broken, or the pool shrank meanwhile
+		close(sock);
+		ep.open--;
+	} else {
+		ep.idle.push_back(sock);
+	}
+	pthread_cond_broadcast(&freed); //waiters of every endpoint share it
+	pthread_mutex_unlock(&mutex);
+}
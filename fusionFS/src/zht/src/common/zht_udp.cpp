@@ -0,0 +1,272 @@
+/*
+ * zht_udp.cpp
+ *
+ *  Client side of the datagram transport: request ids, retransmission with backoff and
+ *  batched sends and receives. The server half (echoing ids, the duplicate cache) lives
+ *  in server_general.cpp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <iostream>
+#include "../../inc/zht_udp.h"
+
+#define ZHT_UDP_RECV_SIZE 65536
+
+void udpPutHeader(char *buff, unsigned long long id) {
+	memcpy(buff, ZHT_UDP_MAGIC, 4);
+	memcpy(buff + 4, &id, 8); //opaque to the server, it only echoes it
+}
+
+bool udpGetHeader(const char *buff, int len, unsigned long long &id) {
+	if (len < ZHT_UDP_HEADER || memcmp(buff, ZHT_UDP_MAGIC, 4) != 0)
+		return false;
+	memcpy(&id, buff + 4, 8);
+	return true;
+}
+
+static long long nowUsec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return (long long) tp.tv_sec * 1000000 + tp.tv_usec;
+}
+
+ZHTUdpTransport::ZHTUdpTransport() {
+	opened = false;
+	timeoutUsec = ZHT_UDP_TIMEOUT_USEC;
+	retries = ZHT_UDP_RETRIES;
+	//a restarted client must not reuse the ids still sitting in the servers' duplicate caches
+	nextId = ((unsigned long long) nowUsec() << 16) ^ getpid();
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ZHTUdpTransport::~ZHTUdpTransport() {
+	for (size_t i = 0; i < all.size(); i++) {
+		close(all[i]->sock);
+		delete[] all[i]->recvBuf;
+		delete all[i];
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+ZHTUdpTransport::Socket *ZHTUdpTransport::newSocket() {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		perror("ZHTUdpTransport: socket");
+		return NULL;
+	}
+	//a batch of replies arrives back to back, leave room for all of them
+	int size = 4 << 20;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	Socket *s = new Socket;
+	s->sock = sock;
+	s->recvBuf = new char[ZHT_UDP_BATCH * ZHT_UDP_RECV_SIZE];
+	s->recvTimeout = 0;
+	return s;
+}
+
+//the first socket, so that a client that cannot have one fails at initialize
+int ZHTUdpTransport::open() {
+	pthread_mutex_lock(&mutex);
+	if (!opened) {
+		Socket *s = newSocket();
+		if (s != NULL) {
+			all.push_back(s);
+			idle.push_back(s);
+			opened = true;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return opened ? 0 : -1;
+}
+
+//called with the mutex held
+ZHTUdpTransport::Socket *ZHTUdpTransport::checkout() {
+	if (!opened)
+		return NULL;
+	if (!idle.empty()) {
+		Socket *s = idle.back();
+		idle.pop_back();
+		return s;
+	}
+	Socket *s = newSocket(); //one per thread calling at the same time, kept afterwards
+	if (s != NULL)
+		all.push_back(s);
+	return s;
+}
+
+void ZHTUdpTransport::checkin(Socket *s) {
+	pthread_mutex_lock(&mutex);
+	idle.push_back(s);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ZHTUdpTransport::setTimeout(int usec, int retries) {
+	pthread_mutex_lock(&mutex);
+	if (usec > 0)
+		this->timeoutUsec = usec;
+	if (retries >= 0)
+		this->retries = retries;
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ZHTUdpTransport::resolve(const struct HostEntity &dest, sockaddr_in &addr) {
+	pair<string, int> key(dest.host, dest.port);
+	map<pair<string, int>, sockaddr_in>::iterator it = addrCache.find(key);
+	if (it != addrCache.end()) {
+		addr = it->second;
+		return true;
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(dest.host.c_str(), NULL, &hints, &res) != 0 || res == NULL) {
+		cerr << "ZHTUdpTransport: cannot resolve " << dest.host << endl;
+		return false;
+	}
+	memcpy(&addr, res->ai_addr, sizeof(sockaddr_in));
+	addr.sin_port = htons(dest.port);
+	freeaddrinfo(res);
+	addrCache[key] = addr;
+	return true;
+}
+
+//(re)send the requests listed in WHICH, request i under id BASE + i
+int ZHTUdpTransport::sendBatch(int sock, const vector<sockaddr_in> &addrs,
+		const vector<string> &requests, const vector<int> &which,
+		unsigned long long base) {
+	struct mmsghdr msgs[ZHT_UDP_BATCH];
+	struct iovec iov[ZHT_UDP_BATCH][2];
+	char heads[ZHT_UDP_BATCH][ZHT_UDP_HEADER];
+
+	for (size_t start = 0; start < which.size(); start += ZHT_UDP_BATCH) {
+		int count = 0;
+		for (size_t k = start; k < which.size() && count < ZHT_UDP_BATCH; k++, count++) {
+			int i = which[k];
+			udpPutHeader(heads[count], base + i);
+			iov[count][0].iov_base = heads[count];
+			iov[count][0].iov_len = ZHT_UDP_HEADER;
+			iov[count][1].iov_base = (void*) requests[i].data();
+			iov[count][1].iov_len = requests[i].size();
+			memset(&msgs[count], 0, sizeof(struct mmsghdr));
+			msgs[count].msg_hdr.msg_name = (void*) &addrs[i];
+			msgs[count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[count].msg_hdr.msg_iov = iov[count];
+			msgs[count].msg_hdr.msg_iovlen = 2;
+		}
+		int sent = 0;
+		while (sent < count) {
+			int ret = sendmmsg(sock, msgs + sent, count - sent, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				break; //whatever did not go out is retransmitted on the next timeout
+			}
+			sent += ret;
+		}
+	}
+	return 0;
+}
+
+int ZHTUdpTransport::call(const struct HostEntity &dest, const string &request,
+		string &reply) {
+	vector<struct HostEntity> dests(1, dest);
+	vector<string> requests(1, request);
+	vector<string> replies;
+	vector<int> statuses;
+	callMany(dests, requests, replies, statuses);
+	reply.swap(replies[0]);
+	return statuses[0];
+}
+
+void ZHTUdpTransport::callMany(const vector<struct HostEntity> &dests,
+		const vector<string> &requests, vector<string> &replies,
+		vector<int> &statuses) {
+	size_t n = requests.size();
+	replies.assign(n, "");
+	statuses.assign(n, -1);
+
+	pthread_mutex_lock(&mutex);
+	Socket *s = checkout();
+	if (s == NULL) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	vector<sockaddr_in> addrs(n);
+	vector<int> pending;
+	for (size_t i = 0; i < n; i++) {
+		if (requests[i].size() > ZHT_UDP_MAX_PAYLOAD)
+			cerr << "ZHTUdpTransport: request of " << requests[i].size()
+					<< " bytes does not fit in a datagram" << endl;
+		else if (resolve(dests[i], addrs[i]))
+			pending.push_back(i);
+	}
+	unsigned long long base = nextId;
+	nextId += n;
+	long long wait = timeoutUsec;
+	int retries = this->retries;
+	pthread_mutex_unlock(&mutex);
+
+	int sock = s->sock;
+	struct mmsghdr msgs[ZHT_UDP_BATCH];
+	struct iovec iov[ZHT_UDP_BATCH];
+	for (int attempt = 0; attempt <= retries && !pending.empty(); attempt++, wait *= 2) {
+		sendBatch(sock, addrs, requests, pending, base);
+		long long deadline = nowUsec() + wait;
+		while (!pending.empty()) {
+			long long left = deadline - nowUsec();
+			if (left <= 0)
+				break;
+			//block in recvmmsg itself rather than in poll first, one syscall less per reply.
+			//The socket timeout only changes with the attempt, so it is rarely set again.
+			if (s->recvTimeout != wait) {
+				struct timeval tv = { wait / 1000000, wait % 1000000 };
+				setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+				s->recvTimeout = wait;
+			}
+			for (int k = 0; k < ZHT_UDP_BATCH; k++) {
+				iov[k].iov_base = s->recvBuf + k * ZHT_UDP_RECV_SIZE;
+				iov[k].iov_len = ZHT_UDP_RECV_SIZE;
+				memset(&msgs[k], 0, sizeof(struct mmsghdr));
+				msgs[k].msg_hdr.msg_iov = &iov[k];
+				msgs[k].msg_hdr.msg_iovlen = 1;
+			}
+			int got = recvmmsg(sock, msgs, ZHT_UDP_BATCH, MSG_WAITFORONE, NULL);
+			if (got < 0) {
+				if (errno == EINTR)
+					continue;
+				break; //timed out
+			}
+			bool answered = false;
+			for (int k = 0; k < got; k++) {
+				const char *data = (const char*) iov[k].iov_base;
+				int len = msgs[k].msg_len;
+				unsigned long long id;
+				//replies to earlier calls that gave up on them have ids below BASE
+				if (!udpGetHeader(data, len, id) || id < base || id >= base + n
+						|| statuses[id - base] == 0)
+					continue;
+				replies[id - base].assign(data + ZHT_UDP_HEADER, len - ZHT_UDP_HEADER);
+				statuses[id - base] = 0;
+				answered = true;
+			}
+			if (answered) {
+				vector<int> still;
+				for (size_t k = 0; k < pending.size(); k++)
+					if (statuses[pending[k]] != 0)
+						still.push_back(pending[k]);
+				pending.swap(still);
+			}
+		}
+	}
+	checkin(s);
+}
@@ -0,0 +1,370 @@
+/*
+ * zht_watch.cpp
+ *
+ *  Client half of the watches, see zht_watch.h. All socket work happens on the watcher's
+ *  thread; request() only queues a registration and waits for the thread to see its ack.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <iostream>
+#include "../../inc/zht_watch.h"
+
+#define WATCH_RECV_SIZE 65536
+
+static long long nowUsec() {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return (long long) tp.tv_sec * 1000000 + tp.tv_usec;
+}
+
+ZHTWatcher::ZHTWatcher(const vector<struct HostEntity> &members) {
+	this->members = members;
+	Conn fresh;
+	fresh.sock = -1;
+	fresh.resyncing = 0;
+	fresh.retryAt = 0;
+	fresh.lost = false;
+	conns.assign(members.size(), fresh);
+	callback = NULL;
+	arg = NULL;
+	running = false;
+	wakeFds[0] = wakeFds[1] = -1;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&answered, NULL);
+}
+
+ZHTWatcher::~ZHTWatcher() {
+	pthread_mutex_lock(&mutex);
+	bool wasRunning = running;
+	running = false;
+	pthread_mutex_unlock(&mutex);
+	if (wasRunning) {
+		wake();
+		pthread_join(thread, NULL);
+		close(wakeFds[0]);
+		close(wakeFds[1]);
+	}
+	for (size_t m = 0; m < conns.size(); m++) {
+		if (conns[m].sock >= 0)
+			close(conns[m].sock);
+		for (size_t i = 0; i < conns[m].outbox.size(); i++)
+			delete conns[m].outbox[i];
+	}
+	pthread_cond_destroy(&answered);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ZHTWatcher::setCallback(ZHTWatchCallback callback, void *arg) {
+	pthread_mutex_lock(&mutex);
+	this->callback = callback;
+	this->arg = arg;
+	pthread_mutex_unlock(&mutex);
+}
+
+//caller holds mutex
+int ZHTWatcher::start() {
+	if (running)
+		return 0;
+	if (pipe(wakeFds) != 0) {
+		cerr << "zht_watch: pipe failed: " << strerror(errno) << endl;
+		return -1;
+	}
+	fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL, 0) | O_NONBLOCK);
+	running = true;
+	if (pthread_create(&thread, NULL, loopEntry, this) != 0) {
+		cerr << "zht_watch: cannot start the watch thread" << endl;
+		running = false;
+		close(wakeFds[0]);
+		close(wakeFds[1]);
+		return -1;
+	}
+	return 0;
+}
+
+void ZHTWatcher::wake() {
+	char c = 0;
+	ssize_t r = write(wakeFds[1], &c, 1);
+	(void) r; //fails only when the pipe is full, and then the thread is woken anyway
+}
+
+int ZHTWatcher::request(int member, int operation, const string &key, bool prefix) {
+	if (member < 0 || member >= (int) conns.size())
+		return -1;
+	Package package;
+	package.set_virtualpath(key);
+	package.set_mode(prefix ? 1 : 0);
+	package.set_operation(operation);
+	package.set_replicano(3);
+
+	Request *req = new Request;
+	req->data = package.SerializeAsString();
+	req->operation = operation;
+	req->watch = make_pair(key, prefix);
+	req->user = true;
+	req->sent = false;
+	req->done = false;
+	req->abandoned = false;
+	req->status = -1;
+
+	pthread_mutex_lock(&mutex);
+	if (start() != 0) {
+		pthread_mutex_unlock(&mutex);
+		delete req;
+		return -1;
+	}
+	conns[member].outbox.push_back(req);
+	wake();
+	long long deadline = nowUsec() + ZHT_WATCH_TIMEOUT_USEC;
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+	while (!req->done) {
+		if (pthread_cond_timedwait(&answered, &mutex, &ts) == ETIMEDOUT && !req->done) {
+			req->abandoned = true; //the thread deletes it once it is answered or dropped
+			pthread_mutex_unlock(&mutex);
+			return -1;
+		}
+	}
+	int status = req->status;
+	pthread_mutex_unlock(&mutex);
+	delete req;
+	return status;
+}
+
+//caller holds mutex
+void ZHTWatcher::finish(Request *req, int status) {
+	if (!req->user || req->abandoned) {
+		delete req;
+		return;
+	}
+	req->status = status;
+	req->done = true;
+	pthread_cond_broadcast(&answered);
+}
+
+//open the connection of MEMBER and queue the registration of every watch it had ahead of
+//whatever callers are waiting for. Caller holds mutex, released while connecting.
+void ZHTWatcher::connect(int member, vector<Event> &events) {
+	struct HostEntity dest = members[member];
+	pthread_mutex_unlock(&mutex);
+	int sock = -1;
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(dest.host.c_str(), NULL, &hints, &res) == 0 && res != NULL) {
+		sockaddr_in addr;
+		memcpy(&addr, res->ai_addr, sizeof(sockaddr_in));
+		addr.sin_port = htons(dest.port);
+		freeaddrinfo(res);
+		sock = socket(PF_INET, SOCK_STREAM, 0);
+		if (sock >= 0 && ::connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	pthread_mutex_lock(&mutex);
+
+	Conn &c = conns[member];
+	if (sock < 0) { //callers waiting now fail, the watches are tried again later
+		for (size_t i = 0; i < c.outbox.size(); i++)
+			finish(c.outbox[i], -1);
+		c.outbox.clear();
+		c.retryAt = nowUsec() + ZHT_WATCH_RETRY_USEC;
+		return;
+	}
+	c.sock = sock;
+	c.in.clear();
+	c.resyncing = 0;
+	for (set<pair<string, bool> >::reverse_iterator it = c.watches.rbegin();
+			it != c.watches.rend(); it++) {
+		Package package;
+		package.set_virtualpath(it->first);
+		package.set_mode(it->second ? 1 : 0);
+		package.set_operation(13);
+		package.set_replicano(3);
+		Request *req = new Request;
+		req->data = package.SerializeAsString();
+		req->operation = 13;
+		req->watch = *it;
+		req->user = false;
+		req->sent = false;
+		req->done = false;
+		req->abandoned = false;
+		req->status = -1;
+		c.outbox.push_front(req);
+		c.resyncing++;
+	}
+	if (c.resyncing == 0 && c.lost) { //nothing to register again
+		c.lost = false;
+		Event e = { ZHT_WATCH_RESTORED, "", member };
+		events.push_back(e);
+	}
+}
+
+//caller holds mutex
+void ZHTWatcher::lose(int member, vector<Event> &events) {
+	Conn &c = conns[member];
+	if (c.sock >= 0)
+		close(c.sock);
+	c.sock = -1;
+	c.in.clear();
+	for (size_t i = 0; i < c.outbox.size(); i++)
+		finish(c.outbox[i], -1);
+	c.outbox.clear();
+	c.resyncing = 0;
+	c.retryAt = nowUsec() + ZHT_WATCH_RETRY_USEC;
+	if (!c.watches.empty() && !c.lost) {
+		c.lost = true;
+		Event e = { ZHT_WATCH_LOST, "", member };
+		events.push_back(e);
+	}
+}
+
+//send the head of the outbox unless it is out already. Caller holds mutex.
+void ZHTWatcher::sendNext(int member, vector<Event> &events) {
+	Conn &c = conns[member];
+	while (c.sock >= 0 && !c.outbox.empty() && !c.outbox.front()->sent) {
+		Request *req = c.outbox.front();
+		if (req->abandoned) { //nobody waits for it any more, don't bother the server
+			c.outbox.pop_front();
+			delete req;
+			continue;
+		}
+		if (send(c.sock, req->data.data(), req->data.size(), MSG_NOSIGNAL)
+				!= (ssize_t) req->data.size()) {
+			lose(member, events);
+			return;
+		}
+		req->sent = true;
+	}
+}
+
+//read what MEMBER pushed: acks complete the head of the outbox, notices become events.
+//Caller holds mutex.
+void ZHTWatcher::consume(int member, vector<Event> &events) {
+	Conn &c = conns[member];
+	char buff[WATCH_RECV_SIZE];
+	int got = recv(c.sock, buff, sizeof(buff), MSG_DONTWAIT);
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (got <= 0) {
+		lose(member, events);
+		return;
+	}
+	c.in.append(buff, got);
+
+	size_t pos = 0;
+	while (c.in.size() - pos >= sizeof(int32_t)) {
+		int32_t len;
+		memcpy(&len, c.in.data() + pos, sizeof(int32_t));
+		if (len < 1 || len > WATCH_RECV_SIZE) {
+			lose(member, events); //not a watch connection's stream
+			return;
+		}
+		if (c.in.size() - pos - sizeof(int32_t) < (size_t) len)
+			break;
+		const char *msg = c.in.data() + pos + sizeof(int32_t);
+		pos += sizeof(int32_t) + len;
+		if (msg[0] != ZHT_WATCH_ACK) {
+			Event e = { msg[0], string(msg + 1, len - 1), member };
+			events.push_back(e);
+			continue;
+		}
+		if (len < 1 + (int) sizeof(int32_t) || c.outbox.empty()
+				|| !c.outbox.front()->sent) {
+			lose(member, events);
+			return;
+		}
+		int32_t status;
+		memcpy(&status, msg + 1, sizeof(int32_t));
+		Request *req = c.outbox.front();
+		c.outbox.pop_front();
+		if (status == 0 && req->operation == 13)
+			c.watches.insert(req->watch);
+		else if (status == 0 && req->operation == 14)
+			c.watches.erase(req->watch);
+		if (!req->user && --c.resyncing == 0 && c.lost) {
+			c.lost = false;
+			Event e = { ZHT_WATCH_RESTORED, "", member };
+			events.push_back(e);
+		}
+		finish(req, status);
+	}
+	c.in.erase(0, pos);
+	sendNext(member, events);
+}
+
+void *ZHTWatcher::loopEntry(void *watcher) {
+	((ZHTWatcher*) watcher)->loop();
+	return NULL;
+}
+
+void ZHTWatcher::loop() {
+	vector<Event> events;
+	vector<struct pollfd> fds;
+	vector<int> fdMember;
+	pthread_mutex_lock(&mutex);
+	while (running) {
+		long long now = nowUsec();
+		long long wait = -1;
+		for (int m = 0; m < (int) conns.size(); m++) {
+			Conn &c = conns[m];
+			if (c.sock < 0 && (!c.outbox.empty()
+					|| (!c.watches.empty() && c.retryAt <= now)))
+				connect(m, events);
+			if (c.sock < 0 && !c.watches.empty()) {
+				long long left = c.retryAt - now;
+				if (wait < 0 || left < wait)
+					wait = left > 0 ? left : 0;
+			}
+			sendNext(m, events);
+		}
+
+		fds.clear();
+		fdMember.clear();
+		struct pollfd p;
+		p.fd = wakeFds[0];
+		p.events = POLLIN;
+		fds.push_back(p);
+		fdMember.push_back(-1);
+		for (int m = 0; m < (int) conns.size(); m++) {
+			if (conns[m].sock < 0)
+				continue;
+			p.fd = conns[m].sock;
+			fds.push_back(p);
+			fdMember.push_back(m);
+		}
+		ZHTWatchCallback cb = callback;
+		void *cbArg = arg;
+		pthread_mutex_unlock(&mutex);
+
+		//the callback runs without the lock, it may take its time (but blocks the notices)
+		for (size_t i = 0; i < events.size() && cb != NULL; i++)
+			cb(events[i].event, events[i].key, events[i].member, cbArg);
+		events.clear();
+
+		int n = poll(&fds[0], fds.size(), wait < 0 ? -1 : (int) (wait / 1000) + 1);
+		if (n < 0 && errno != EINTR)
+			cerr << "zht_watch: poll failed: " << strerror(errno) << endl;
+		char c;
+		while (read(wakeFds[0], &c, 1) > 0)
+			;
+
+		pthread_mutex_lock(&mutex);
+		for (size_t i = 1; n > 0 && i < fds.size(); i++) {
+			int m = fdMember[i];
+			if (fds[i].revents != 0 && conns[m].sock == fds[i].fd)
+				consume(m, events);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
@@ -1,6 +1,8 @@
 #include "cpp_zhtclient.h"
 #include "lru_cache.h"
 #include <stdint.h>
+#include <poll.h>
+#include <sstream>
 
 /*******************************
  * zhouxb
@@ -29,6 +31,8 @@ int setconfigvariables(string cfgFile) {
 	while (fgets(line, 100, fp) != NULL) {
 		key = strtok(line, "=");
 		svalue = strtok(NULL, "=");
+		if (key == NULL || svalue == NULL) //blank line
+			continue;
 		ivalue = atoi(svalue);
 
 		if ((strcmp(key, "REPLICATION_TYPE")) == 0) {
@@ -57,6 +61,20 @@ ZHTClient::ZHTClient() { // default all invalid value, so the client must be ini
 	this->NUM_REPLICAS = -1;
 	this->REPLICATION_TYPE = -1;
 	this->protocolType = -1;
+	this->asyncConnsPerHost = 4;
+	this->asyncEngine = NULL;
+	this->udp = NULL;
+	this->pool = new ZHTConnPool();
+	this->hedge = new ZHTHedge();
+	this->watcher = NULL;
+	this->negative = new ZHTNegativeCache();
+}
+
+ZHTClient::~ZHTClient() {
+	tearDownTCP();
+	delete negative;
+	delete hedge;
+	delete pool;
 }
 
 int ZHTClient::initialize(string configFilePath, string memberListFilePath,
@@ -78,7 +96,9 @@ int ZHTClient::initialize(string configFilePath, string memberListFilePath,
 	while (fgets(line, 100, fp) != NULL) {
 		key = strtok(line, "=");
 		svalue = strtok(NULL, "=");
-		ivalue = atoi(svalue);
+		if (key == NULL || svalue == NULL) //blank line
+			continue;
+		ivalue = atoi(svalue); //server only keys such as STORAGE_ENGINE are skipped
 
 		if ((strcmp(key, "REPLICATION_TYPE")) == 0) {
 			this->REPLICATION_TYPE = ivalue;
@@ -88,6 +108,8 @@ int ZHTClient::initialize(string configFilePath, string memberListFilePath,
 		else if ((strcmp(key, "NUM_REPLICAS")) == 0) {
 			this->NUM_REPLICAS = ivalue + 1; //note: +1 is must
 			//cout<<"NUM_REPLICAS = "<< NUM_REPLICAS <<endl;
+		} else if ((strncmp(key, "STORAGE_", 8)) == 0) {
+			//server side only
 		} else {
 			cout << "Config file is not correct." << endl;
 			return -2;
@@ -95,6 +117,11 @@ int ZHTClient::initialize(string configFilePath, string memberListFilePath,
 
 	}
 
+	if (TCP == false && udp == NULL) {
+		udp = new ZHTUdpTransport();
+		if (udp->open() != 0)
+			return -1;
+	}
 	return 0;
 
 }
@@ -109,6 +136,11 @@ struct HostEntity ZHTClient::str2Host(string str) {
 	return host;
 }
 
+//same server str2Host picks, from the key itself
+struct HostEntity &ZHTClient::keyHost(const string &key) {
+	return this->memberList.at(myhash(key.c_str(), this->memberList.size()));
+}
+
 struct HostEntity ZHTClient::str2Host(string str, int &index) {
 	Package pkg;
 	pkg.ParseFromString(str);
@@ -167,12 +199,15 @@ int ZHTClient::str2Sock(string str) { //give socket and update the vector of net
 
 }
 
-//This store limited connections in a LRU cache, one item is one host VS one sock
+//This store limited connections in a LRU cache, one item is one host:port VS one sock.
+//Not used by insert/lookup/remove any more, they check connections out of the pool.
 int ZHTClient::str2SockLRU(string str, bool tcp) {
 	struct HostEntity dest = this->str2Host(str);
+	stringstream endpoint;
+	endpoint << dest.host << ":" << dest.port;
 	int sock = 0;
 	if (tcp == true) {
-		sock = connectionCache.fetch(dest.host, tcp);
+		sock = connectionCache.fetch(endpoint.str(), tcp);
 		if (sock <= 0) {
 //			cout << "host not found in cache, making connection..." << endl;
 			sock = makeClientSocket(dest.host.c_str(), dest.port, tcp);
@@ -182,7 +217,7 @@ int ZHTClient::str2SockLRU(string str, bool tcp) {
 				return -1;
 			} else {
 				int tobeRemoved = -1;
-				connectionCache.insert(dest.host, sock, tobeRemoved);
+				connectionCache.insert(endpoint.str(), sock, tobeRemoved);
 				if (tobeRemoved != -1) {
 //					cout << "sock " << tobeRemoved	<< ", will be removed, which shouldn't be 0."<< endl;
 					close(tobeRemoved);
@@ -202,19 +237,279 @@ int ZHTClient::str2SockLRU(string str, bool tcp) {
 }
 
 int ZHTClient::tearDownTCP() {
+	if (asyncEngine != NULL) {
+		delete asyncEngine; //fails whatever is still in flight
+		asyncEngine = NULL;
+	}
+	if (udp != NULL) {
+		delete udp;
+		udp = NULL;
+	}
+	if (watcher != NULL) {
+		delete watcher;
+		watcher = NULL;
+	}
+	pool->closeAll();
 	if (TCP == true) {
 		int size = this->memberList.size();
 		for (int i = 0; i < size; i++) {
-			struct HostEntity dest = this->memberList.at(i);
+			struct HostEntity &dest = this->memberList.at(i);
 			int sock = dest.sock;
 			if (sock > 0) {
 				close(sock);
+				dest.sock = -1; //the destructor tears down again
 			}
 		}
 	}
 	return 0;
 }
 
+int ZHTClient::setPoolSize(int connsPerHost) {
+	if (connsPerHost <= 0)
+		return -1;
+	pool->setSize(connsPerHost);
+	return 0;
+}
+
+int ZHTClient::setUdpTimeout(int usec, int retries) {
+	if (udp == NULL)
+		return -1;
+	udp->setTimeout(usec, retries);
+	return 0;
+}
+
+int ZHTClient::setHedging(int delayUsec, int timeoutUsec, int suspectAfter,
+		int suspectUsec) {
+	hedge->configure(delayUsec, timeoutUsec, suspectAfter, suspectUsec);
+	return 0;
+}
+
+//UDP insert/remove: the int32 status the server answers, -1 if it never answered
+int ZHTClient::udpStatus(const struct HostEntity &dest, const string &str) {
+	if (zhtIsLocal(dest)) {
+		int32_t ret;
+		if (zhtLocalCall(str.data(), str.size(), (char*) &ret, sizeof(int32_t))
+				< (int) sizeof(int32_t))
+			return -1;
+		return ret;
+	}
+	string reply;
+	if (udp->call(dest, str, reply) != 0
+			|| reply.size() < sizeof(int32_t))
+		return -1;
+	int32_t ret;
+	memcpy(&ret, reply.data(), sizeof(int32_t));
+	return ret;
+}
+
+//TCP request/reply on a connection of the pool, bytes received into buff or -1. A pooled
+//connection the server has dropped fails on send; the request then goes out once more on a
+//fresh one. A failed receive is not retried, the server may have run the request; the
+//connection goes, the rest of the reply may still come. The server embedded in this process
+//is called directly.
+int ZHTClient::poolCall(const struct HostEntity &dest, const char *req, int len,
+		char *buff, int size) {
+	if (zhtIsLocal(dest))
+		return zhtLocalCall(req, len, buff, size);
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int sock = pool->checkout(dest);
+		if (sock < 0)
+			return -1;
+		if (send(sock, req, len, MSG_NOSIGNAL) != len) {
+			pool->checkin(dest, sock, true);
+			continue;
+		}
+		int got = recvReplyTCP(sock, buff, size);
+		pool->checkin(dest, sock, got < 0);
+		return got;
+	}
+	return -1;
+}
+
+//a lookup the negative cache rules out is answered here. A miss that brought a filter
+//block is stored, under the server that sent it, and handed on as the plain miss it is.
+int ZHTClient::readCall(const string &key, const char *req, int len, char *buff,
+		int size) {
+	int primary = myhash(key.c_str(), this->memberList.size());
+	static const char miss[] = "-02Empty";
+	if (negative->on() && negative->absent(primary, key)) {
+		memcpy(buff, miss, sizeof(miss) - 1);
+		return sizeof(miss) - 1;
+	}
+	int replier;
+	int got = replicaCall(primary, req, len, buff, size, replier);
+	if (got >= 3 + ZHT_BLOOM_HEADER && memcmp(buff, "-02" ZHT_BLOOM_MAGIC, 6) == 0) {
+		negative->store(replier, buff + 3, got - 3);
+		memcpy(buff, miss, sizeof(miss) - 1);
+		return sizeof(miss) - 1;
+	}
+	return got;
+}
+
+//a replica is behind the key's server: its "not found" may just be an update that has not
+//reached it yet, only the key's server may say so for sure
+static bool replyFound(const char *buff, int got) {
+	return got >= 3 && memcmp(buff, "000", 3) == 0;
+}
+
+//the key's server or, when the servers replicate, the NUM_REPLICAS servers after it in the
+//ring as well (they hold copies of its keys): servers not suspect first, in ring order.
+//Reply bytes into buff and the server that sent them into REPLIER, or -1.
+int ZHTClient::replicaCall(int primary, const char *req, int len, char *buff,
+		int size, int &replier) {
+	int n = this->memberList.size();
+	int copies = NUM_REPLICAS - 1 < n - 1 ? NUM_REPLICAS - 1 : n - 1; //NUM_REPLICAS is config + 1
+	replier = primary;
+	if (zhtIsLocal(this->memberList.at(primary))) //in this process, nothing to hedge against
+		return zhtLocalCall(req, len, buff, size);
+	if (copies <= 0 && TCP == true)
+		return poolCall(this->memberList.at(primary), req, len, buff, size);
+	vector<int> order(1, primary);
+	if (copies > 0) {
+		hedge->settle(); //the late answers of earlier reads decide who is suspect
+		order.clear();
+		for (int pass = 0; pass < 2; pass++)
+			for (int i = 0; i <= copies; i++) {
+				int member = (primary + i) % n;
+				if (hedge->suspect(member) == (pass == 1))
+					order.push_back(member);
+			}
+	}
+	if (TCP == true)
+		return hedgedCall(primary, order, req, len, buff, size, replier);
+
+	//UDP retransmits on its own; a server that never answered hands over to the next one
+	string request(req, len);
+	string missed; //a copy that had not got the key (yet), answers only if nobody else does
+	int missedBy = -1;
+	for (size_t k = 0; k < order.size(); k++) {
+		string reply;
+		if (udp->call(this->memberList.at(order[k]), request, reply) != 0) {
+			hedge->failed(order[k]);
+			continue;
+		}
+		hedge->succeeded(order[k]);
+		if (order[k] != primary && !replyFound(reply.data(), reply.size())) {
+			missed = reply;
+			missedBy = order[k];
+			continue;
+		}
+		int got = reply.size() < (size_t) size ? reply.size() : size;
+		memcpy(buff, reply.data(), got);
+		replier = order[k];
+		return got;
+	}
+	if (missed.empty())
+		return -1;
+	replier = missedBy;
+	int got = missed.size() < (size_t) size ? missed.size() : size;
+	memcpy(buff, missed.data(), got);
+	return got;
+}
+
+//the request goes to ORDER[0]; whenever the hedge delay passes without an answer, or a
+//server fails outright, it also goes to the next one. The first reply of PRIMARY, or the
+//first of a copy that found the key, wins; a copy's miss sends the request on to the next
+//server at once and answers only if nobody else does. The connections still waiting are
+//closed (their late replies must not reach the next caller); their servers count a failure
+//only if they do not answer at all, see ZHTHedge::lost.
+int ZHTClient::hedgedCall(int primary, const vector<int> &order, const char *req,
+		int len, char *buff, int size, int &replier) {
+	struct Attempt {
+		int member;
+		int sock;
+		double sent;
+	};
+	vector<Attempt> out;
+	size_t next = 0;
+	int delay = hedge->delay();
+	double deadline = getTime_usec() + hedge->timeout();
+	double nextLaunch = 0;
+	int got = -1;
+	string missed;
+	int missedBy = -1;
+
+	while (got < 0) {
+		double now = getTime_usec();
+		if (next < order.size()
+				&& (out.empty() || (delay >= 0 && now >= nextLaunch))) {
+			Attempt a;
+			a.member = order[next++];
+			struct HostEntity &dest = this->memberList.at(a.member);
+			a.sock = -1;
+			for (int attempt = 0; attempt < 2 && a.sock < 0; attempt++) { //as in poolCall
+				a.sock = pool->checkout(dest);
+				if (a.sock < 0)
+					break;
+				if (send(a.sock, req, len, MSG_NOSIGNAL) != len) {
+					pool->checkin(dest, a.sock, true);
+					a.sock = -1;
+				}
+			}
+			if (a.sock < 0) {
+				hedge->failed(a.member);
+				continue;
+			}
+			a.sent = now;
+			out.push_back(a);
+			nextLaunch = now + delay;
+			continue;
+		}
+		if (out.empty() || now >= deadline)
+			break;
+
+		double wait = deadline - now;
+		if (next < order.size() && delay >= 0 && nextLaunch - now < wait)
+			wait = nextLaunch - now;
+		vector<struct pollfd> fds(out.size());
+		for (size_t k = 0; k < out.size(); k++) {
+			fds[k].fd = out[k].sock;
+			fds[k].events = POLLIN;
+			fds[k].revents = 0;
+		}
+		struct timespec ts = { (long) wait / 1000000, ((long) wait % 1000000) * 1000 };
+		if (ppoll(&fds[0], fds.size(), &ts, NULL) <= 0)
+			continue; //the next hedge is due, or the deadline passed
+		for (size_t k = 0; k < out.size(); k++) {
+			if (fds[k].revents == 0)
+				continue;
+			Attempt a = out[k];
+			out.erase(out.begin() + k);
+			struct HostEntity &dest = this->memberList.at(a.member);
+			int r = recvReplyTCP(a.sock, buff, size);
+			pool->checkin(dest, a.sock, r < 0);
+			if (r < 0) {
+				hedge->failed(a.member);
+				break; //fds no longer lines up with out
+			}
+			hedge->record(getTime_usec() - a.sent);
+			hedge->succeeded(a.member);
+			if (a.member != primary && !replyFound(buff, r)) {
+				missed.assign(buff, r);
+				missedBy = a.member;
+				nextLaunch = 0;
+				break;
+			}
+			got = r;
+			replier = a.member;
+			break;
+		}
+	}
+	for (size_t k = 0; k < out.size(); k++) {
+		if (got < 0) //out of time
+			hedge->failed(out[k].member);
+		else
+			hedge->lost(out[k].member, dup(out[k].sock));
+		pool->checkin(this->memberList.at(out[k].member), out[k].sock, true);
+	}
+	if (got < 0 && !missed.empty()) {
+		memcpy(buff, missed.data(), missed.size());
+		got = missed.size();
+		replier = missedBy;
+	}
+	return got;
+}
+
 //send a plain string to destination, receive return state.
 int ZHTClient::insert(string str) {
 
@@ -241,30 +536,18 @@ int ZHTClient::insert(string str) {
 	package.set_operation(3); //1 for look up, 2 for remove, 3 for insert
 	package.set_replicano(5); //5: original, 3 not original
 	str = package.SerializeAsString();
-
-	int sock = this->str2SockLRU(str, TCP);
-	reuseSock(sock);
-//	cout<<"sock = "<<sock<<endl;
-//	int sentSize = generalSendTCP(sock, str.c_str());
-	struct HostEntity dest = this->str2Host(str);
-	sockaddr_in recvAddr;
-	int sentSize = generalSendTo(dest.host.data(), dest.port, sock, str.c_str(),
-			TCP);
-//	cout <<"Client inseret sent: "<<sentSize<<endl;
-	int32_t* ret_buf = (int32_t*) malloc(sizeof(int32_t));
-
-//	generalReveiveTCP(sock, (void*) ret_buf, sizeof(int32_t), 0);
-	generalReceive(sock, (void*) ret_buf, 4, recvAddr, 0, TCP);
-	int ret = *(int32_t*) ret_buf;
+	inserted(package.virtualpath());
+	struct HostEntity &dest = keyHost(package.virtualpath());
+	if (TCP == false)
+		return udpStatus(dest, str);
+
+	int32_t ret;
+	if (poolCall(dest, str.data(), str.size(), (char*) &ret, sizeof(int32_t))
+			< (int) sizeof(int32_t))
+		return -1;
 	if (ret < 0) {
 //		cerr << "zht_util.h: Failed to insert." << endl;
 	}
-//cout <<"Returned status: "<< *(int32_t*) ret<<endl;
-//	d3_closeConnection(sock);
-	free(ret_buf);
-
-	//return ret_1;
-//	cout<<"insert got: "<< *ret <<endl;
 	return ret;
 }
 
@@ -280,62 +563,387 @@ int ZHTClient::lookup(string str, string &returnStr) {
 
 	package.set_operation(1); // 1 for look up, 2 for remove, 3 for insert
 	package.set_replicano(3); //5: original, 3 not original
+	if (negative->on())
+		package.set_mode(ZHT_BLOOM_ASK);
 
 	str = package.SerializeAsString();
 
-	struct HostEntity dest = this->str2Host(str);
 //	cout << "client::lookup is called, now send request..." << endl;
+	char buff[MAX_MSG_SIZE]; //MAX_MSG_SIZE
+	int rcv_size = readCall(package.virtualpath(), str.data(), str.size(), buff,
+			sizeof(buff));
+	if (rcv_size < 3) {
+		cout << "Lookup receive error." << endl;
+		return -1;
+	}
+	returnStr.assign(buff + 3, rcv_size - 3); //the left is real thing need to be deserilized.
+	//the first three chars means status code, like -1, -2, 0, -98, -99 and so on.
+	return atoi(string(buff, 3).c_str());
+}
 
-	Package pack;
-	pack.ParseFromString(str);
-//	cout<<"ZHTClient::lookup: operation = "<<pack.operation()<<endl;
+int ZHTClient::remove(string str) {
 
-//	int ret = simpleSend(str, dest, sock);
-//	sock = makeClientSocket(dest.host.c_str(), dest.port, 1);
-//	cout<<"client sock = "<< sock<<endl;
+	Package package;
+	package.ParseFromString(str);
 
-	int sock = this->str2SockLRU(str, TCP);
-	reuseSock(sock);
-//	cout<<"sock = "<<sock<<endl;
-	sockaddr_in recvAddr;
-	int sentSize = generalSendTo(dest.host.data(), dest.port, sock, str.c_str(),
-			TCP);
-//	int ret = generalSendTCP(sock, str.c_str());
+	if (package.virtualpath().empty()) //empty key not allowed.
+		return -1;
+	if (package.realfullpath().empty()) //coup, to fix ridiculous bug of protobuf!
+		package.set_realfullpath(" ");
 
-//	cout << "ZHTClient::lookup: simpleSend return = " << ret << endl;
-	char buff[MAX_MSG_SIZE]; //MAX_MSG_SIZE
-	memset(buff, 0, sizeof(buff));
-	int rcv_size = -1;
-	int status = -1;
-	string sRecv;
-	string sStatus;
+	package.set_operation(2); //1 for look up, 2 for remove, 3 for insert
+	package.set_replicano(5); //5: original, 3 not original
+	str = package.SerializeAsString();
+	struct HostEntity &dest = keyHost(package.virtualpath());
+	if (TCP == false)
+		return udpStatus(dest, str);
 
-	if (sentSize == str.length()) { //this only work for TCP. UDP need to make a new one so accept returns from server.
-//		cout << "before protocol judge" << endl;
+	int32_t ret_1;
+	if (poolCall(dest, str.data(), str.size(), (char*) &ret_1, sizeof(int32_t))
+			< (int) sizeof(int32_t))
+		return -1;
+//	cout<<"remove got: "<< ret_1 <<endl;
+	return ret_1;
+}
 
-		rcv_size = generalReceive(sock, (void*) buff, sizeof(buff), recvAddr, 0,
-				TCP);
+//typed calls: the request is a Package written field by field into a buffer on the stack
+//(meta.proto field numbers), and get reads realFullPath straight out of the reply.
+#define PKG_VIRTUALPATH 1
+#define PKG_REALFULLPATH 3
+#define PKG_OPENMODE 6
+#define PKG_MODE 7
+#define PKG_OPERATION 8
+#define PKG_REPLICANO 9
+
+static char *putVarint(char *p, unsigned long long v) {
+	while (v >= 0x80) {
+		*p++ = (char) (v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char) v;
+	return p;
+}
 
-		if (rcv_size < 0) {
-			cout << "Lookup receive error." << endl;
-		} else {
-			sRecv.assign(buff);
-			returnStr = sRecv.substr(3); //the left is real thing need to be deserilized.
-			sStatus = sRecv.substr(0, 3); //the first three chars means status code, like -1, -2, 0, -98, -99 and so on.
-		}
+static char *putString(char *p, int field, const string &s) {
+	p = putVarint(p, field << 3 | 2);
+	p = putVarint(p, s.size());
+	memcpy(p, s.data(), s.size());
+	return p + s.size();
+}
+
+static char *putInt(char *p, int field, int v) {
+	p = putVarint(p, field << 3);
+	return putVarint(p, (unsigned long long) (long long) v); //int32 sign extends, as protobuf does
+}
+
+static bool getVarint(const char *&p, const char *end, unsigned long long &v) {
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char c = *p++;
+		v |= (unsigned long long) (c & 0x7f) << shift;
+		if (c < 0x80)
+			return true;
+	}
+	return false;
+}
 
-//		cout << "after protocol judge" << endl;
+//string field FIELD of the Package serialized in [p, end), false if it is not there
+static bool packageString(const char *p, const char *end, int field, string &out) {
+	bool found = false;
+	while (p < end) {
+		unsigned long long tag, v;
+		if (!getVarint(p, end, tag))
+			return false;
+		switch (tag & 7) {
+		case 0:
+			if (!getVarint(p, end, v))
+				return false;
+			break;
+		case 1:
+			p += 8;
+			break;
+		case 5:
+			p += 4;
+			break;
+		case 2:
+			if (!getVarint(p, end, v) || v > (unsigned long long) (end - p))
+				return false;
+			if ((int) (tag >> 3) == field) { //the last one wins, as in ParseFromString
+				out.assign(p, v);
+				found = true;
+			}
+			p += v;
+			break;
+		default:
+			return false;
+		}
 	}
-//	d3_closeConnection(sock);
+	return found && p == end;
+}
 
-	if (!sStatus.empty())
-		status = atoi(sStatus.c_str());
+//encode once, send to the key's server, reply bytes into buff or -1
+int ZHTClient::typedCall(int operation, int replicano, const string &key,
+		const string *value, char *buff, int size, int openMode) {
+	if (key.empty()) //empty key not allowed.
+		return -1;
+	if (key.size() + (value != NULL ? value->size() : 0) + 32 > (size_t) MAX_MSG_SIZE)
+		return -1;
+	char req[MAX_MSG_SIZE];
+	char *p = putString(req, PKG_VIRTUALPATH, key);
+	if (value != NULL)
+		p = putString(p, PKG_REALFULLPATH, *value);
+	if (openMode >= 0) //time to live of operations 9 to 12
+		p = putInt(p, PKG_OPENMODE, openMode);
+	if (operation == 1 && negative->on())
+		p = putInt(p, PKG_MODE, ZHT_BLOOM_ASK);
+	else if (operation == 3 || operation == 9 || operation == 10)
+		inserted(key);
+	p = putInt(p, PKG_OPERATION, operation);
+	p = putInt(p, PKG_REPLICANO, replicano);
+
+	if (operation == 1)
+		return readCall(key, req, p - req, buff, size);
+	struct HostEntity &dest = keyHost(key);
+	if (TCP == true || zhtIsLocal(dest))
+		return poolCall(dest, req, p - req, buff, size);
+	string reply;
+	if (udp->call(dest, string(req, p - req), reply) != 0)
+		return -1;
+	int n = reply.size() < (size_t) size ? reply.size() : size;
+	memcpy(buff, reply.data(), n);
+	return n;
+}
 
+int ZHTClient::put(const string &key, const string &value) {
+	int32_t ret;
+	if (typedCall(3, 5, key, &value, (char*) &ret, sizeof(int32_t))
+			< (int) sizeof(int32_t))
+		return -1;
+	return ret;
+}
+
+int ZHTClient::get(const string &key, string &value) {
+	char buff[MAX_MSG_SIZE];
+	int n = typedCall(1, 3, key, NULL, buff, sizeof(buff));
+	value.clear();
+	if (n < 3)
+		return -1;
+	int status = atoi(string(buff, 3).c_str());
+	if (status == 0) //found: the stored Package, put keeps the value in realFullPath
+		packageString(buff + 3, buff + n, PKG_REALFULLPATH, value);
 	return status;
 }
 
-int ZHTClient::remove(string str) {
+int ZHTClient::erase(const string &key) {
+	int32_t ret;
+	if (typedCall(2, 5, key, NULL, (char*) &ret, sizeof(int32_t))
+			< (int) sizeof(int32_t))
+		return -1;
+	return ret;
+}
+
+int ZHTClient::put(const string &key, const string &value, int ttlMsec) {
+	int32_t ret;
+	if (typedCall(9, 5, key, &value, (char*) &ret, sizeof(int32_t),
+			ttlMsec > 0 ? ttlMsec : 0) < (int) sizeof(int32_t))
+		return -1;
+	return ret;
+}
+
+int ZHTClient::expire(const string &key, int ttlMsec) {
+	int32_t ret;
+	if (typedCall(9, 5, key, NULL, (char*) &ret, sizeof(int32_t),
+			ttlMsec > 0 ? ttlMsec : 0) < (int) sizeof(int32_t))
+		return -1;
+	return ret;
+}
+
+//the reply is "%03d" and, for -5, the lease as it stands: holder and msec left
+int ZHTClient::leaseCall(int operation, const string &key, const string &holder,
+		int ttlMsec, string *owner, int *leftMsec) {
+	if (holder.empty())
+		return -1;
+	char buff[MAX_MSG_SIZE];
+	int n = typedCall(operation, 5, key, &holder, buff, sizeof(buff),
+			ttlMsec > 0 ? ttlMsec : 0);
+	if (n < 3)
+		return -1;
+	int status = atoi(string(buff, 3).c_str());
+	if (status == -5) {
+		Package lease;
+		lease.ParseFromArray(buff + 3, n - 3);
+		if (owner != NULL)
+			*owner = lease.realfullpath();
+		if (leftMsec != NULL)
+			*leftMsec = lease.openmode();
+	}
+	return status;
+}
 
+int ZHTClient::acquireLease(const string &key, const string &holder, int ttlMsec,
+		string *owner, int *leftMsec) {
+	return leaseCall(10, key, holder, ttlMsec, owner, leftMsec);
+}
+
+int ZHTClient::renewLease(const string &key, const string &holder, int ttlMsec) {
+	return leaseCall(11, key, holder, ttlMsec, NULL, NULL);
+}
+
+int ZHTClient::releaseLease(const string &key, const string &holder) {
+	return leaseCall(12, key, holder, 0, NULL, NULL);
+}
+
+int ZHTClient::stats(int index, string &result) {
+	if (index < 0 || index >= (int) this->memberList.size())
+		return -1;
+	Package package;
+	package.set_virtualpath("stats"); //no empty fields, the request goes out strlen'd
+	package.set_realfullpath(" ");
+	package.set_operation(7);
+	package.set_replicano(3);
+	string str = package.SerializeAsString();
+	struct HostEntity dest = this->memberList.at(index);
+
+	string reply;
+	if (TCP == false) {
+		if (udp->call(dest, str, reply) != 0)
+			return -1;
+	} else {
+		//own connection, the report may take several reads
+		int sock = makeClientSocket(dest.host.c_str(), dest.port, TCP);
+		if (sock <= 0)
+			return -1;
+		generalSendTCP(sock, str.c_str());
+		char buff[MAX_MSG_SIZE];
+		int got = recvReplyTCP(sock, buff, sizeof(buff));
+		close(sock);
+		if (got < 0)
+			return -1;
+		reply.assign(buff, got);
+	}
+	if (reply.size() < 3)
+		return -1;
+	result = reply.substr(3);
+	return atoi(reply.substr(0, 3).c_str());
+}
+
+//set operation and replica number the same way insert/lookup/remove do, -1 if empty key.
+int ZHTClient::scan(const string &prefix, int limit, string &cursor,
+		vector<pair<string, string> > &out) {
+	out.clear();
+	Package package;
+	package.set_virtualpath(prefix);
+	package.set_realfullpath(cursor);
+	package.set_mode(limit > 0 ? limit : 0);
+	package.set_operation(8);
+	package.set_replicano(3);
+
+	//keys are spread by hash, so every server holds part of the range
+	int n = this->memberList.size();
+	vector<string> requests(n, package.SerializeAsString());
+	vector<string> replies(n);
+	vector<int> statuses(n, -1);
+	if (TCP == true) {
+		if (startAsync() != 0)
+			return -1;
+		vector<ZHTFuture*> futures;
+		for (int i = 0; i < n; i++) {
+			ZHTFuture *future = new ZHTFuture(8, NULL, NULL);
+			if (asyncEngine->submit(this->memberList.at(i), requests[i], future) != 0)
+				future->complete(-1, "");
+			futures.push_back(future);
+		}
+		for (int i = 0; i < n; i++) {
+			statuses[i] = futures[i]->wait(replies[i]);
+			delete futures[i];
+		}
+	} else {
+		udp->callMany(this->memberList, requests, replies, statuses);
+		for (int i = 0; i < n; i++) {
+			if (statuses[i] != 0 || replies[i].size() < 3) {
+				statuses[i] = -1;
+				continue;
+			}
+			statuses[i] = atoi(replies[i].substr(0, 3).c_str());
+			replies[i].erase(0, 3);
+		}
+	}
+
+	//a server that stopped early (page or reply full) has keys left after its last one: the
+	//merged page must end there too, or they would be skipped
+	map<string, string> merged;
+	string cut;
+	bool more = false;
+	for (int i = 0; i < n; i++) {
+		Package reply;
+		if (statuses[i] != 0 || !reply.ParseFromString(replies[i]))
+			return -1;
+		for (int k = 0; k + 1 < reply.listitem_size(); k += 2)
+			merged[reply.listitem(k)] = reply.listitem(k + 1);
+		if (reply.has_realfullpath() && (!more || reply.realfullpath() < cut)) {
+			cut = reply.realfullpath();
+			more = true;
+		}
+	}
+	for (map<string, string>::iterator it = merged.begin(); it != merged.end(); it++) {
+		if ((more && it->first > cut) || (limit > 0 && (int) out.size() == limit)) {
+			more = true;
+			break;
+		}
+		out.push_back(*it);
+	}
+	cursor = more && !out.empty() ? out.back().first : "";
+	return out.size();
+}
+
+int ZHTClient::setNegativeCache(int ttlMsec) {
+	negative->setTtl(ttlMsec);
+	return 0;
+}
+
+//an insert of this client sets the key's bits in the block it keeps, if any: it must not
+//be told its own key is missing
+void ZHTClient::inserted(const string &key) {
+	if (negative->on())
+		negative->added(myhash(key.c_str(), this->memberList.size()), key);
+}
+
+int ZHTClient::setWatchCallback(ZHTWatchCallback callback, void *arg) {
+	if (TCP == false || this->memberList.empty())
+		return -1;
+	if (watcher == NULL)
+		watcher = new ZHTWatcher(this->memberList);
+	watcher->setCallback(callback, arg);
+	return 0;
+}
+
+//a key is watched on its server, a prefix on all of them since its keys are spread by hash
+int ZHTClient::watchCall(int operation, const string &key, bool prefix) {
+	if (TCP == false || this->memberList.empty() || (key.empty() && !prefix))
+		return -1;
+	if (watcher == NULL)
+		watcher = new ZHTWatcher(this->memberList);
+	if (!prefix)
+		return watcher->request(myhash(key.c_str(), this->memberList.size()), operation,
+				key, false);
+	int ret = 0;
+	for (int i = 0; i < (int) this->memberList.size(); i++) {
+		int status = watcher->request(i, operation, key, true);
+		if (status != 0 && ret == 0)
+			ret = status;
+	}
+	return ret;
+}
+
+int ZHTClient::watch(const string &key, bool prefix) {
+	return watchCall(13, key, prefix);
+}
+
+int ZHTClient::unwatch(const string &key, bool prefix) {
+	return watchCall(14, key, prefix);
+}
+
+int ZHTClient::preparePackage(string &str, int operation, int replicano) {
 	Package package;
 	package.ParseFromString(str);
 
@@ -344,33 +952,265 @@ int ZHTClient::remove(string str) {
 	if (package.realfullpath().empty()) //coup, to fix ridiculous bug of protobuf!
 		package.set_realfullpath(" ");
 
-	package.set_operation(2); //1 for look up, 2 for remove, 3 for insert
-	package.set_replicano(3); //5: original, 3 not original
+	package.set_operation(operation); //1 for look up, 2 for remove, 3 for insert
+	package.set_replicano(replicano); //5: original, 3 not original
 	str = package.SerializeAsString();
+	if (operation == 3)
+		inserted(package.virtualpath());
+	return 0;
+}
+
+int ZHTClient::setAsyncConnections(int connsPerHost) {
+	if (asyncEngine != NULL || connsPerHost <= 0)
+		return -1;
+	asyncConnsPerHost = connsPerHost;
+	return 0;
+}
+
+int ZHTClient::startAsync() {
+	if (asyncEngine != NULL)
+		return 0;
+	asyncEngine = new ZHTAsyncEngine(asyncConnsPerHost);
+	if (asyncEngine->start() != 0) {
+		delete asyncEngine;
+		asyncEngine = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+//complete FUTURE on the caller's thread, callback style futures are freed right away.
+static void answerNow(ZHTFuture *future, int status, const string &result) {
+	bool del = future->selfDestroy;
+	future->complete(status, result);
+	if (del)
+		delete future;
+}
+
+//hand a prepared request to the event loop, or answer it right away when that is not possible.
+int ZHTClient::submitAsync(string str, int operation, int replicano,
+		ZHTFuture *future) {
+	if (preparePackage(str, operation, replicano) != 0) {
+		answerNow(future, -1, "");
+		return -1;
+	}
+
+	if (TCP == false) { //no connection to multiplex, just do it now.
+		int status;
+		string result;
+		if (operation == 1) {
+			status = lookup(str, result);
+		} else if (operation == 2) {
+			status = remove(str);
+		} else {
+			status = insert(str);
+		}
+		answerNow(future, status, result);
+		return 0;
+	}
+
+	if (startAsync() != 0) {
+		answerNow(future, -1, "");
+		return -1;
+	}
 
-	int sock = this->str2SockLRU(str, TCP);
-	reuseSock(sock);
-//	cout<<"sock = "<<sock<<endl;
 	struct HostEntity dest = this->str2Host(str);
-	sockaddr_in recvAddr;
-	int sentSize = generalSendTo(dest.host.data(), dest.port, sock, str.c_str(),
-			TCP);
-//		cout<<"remove sentSize "<< sentSize <<endl;
-	int32_t* ret_buf = (int32_t*) malloc(sizeof(int32_t));
+	if (asyncEngine->submit(dest, str, future) != 0) {
+		answerNow(future, -1, "");
+		return -1;
+	}
+	return 0;
+}
+
+ZHTFuture* ZHTClient::insertAsync(string str) {
+	ZHTFuture *future = new ZHTFuture(3, NULL, NULL);
+	submitAsync(str, 3, 5, future);
+	return future;
+}
 
-	//	generalReveiveTCP(sock, (void*) ret_buf, sizeof(int32_t), 0);
-	generalReceive(sock, (void*) ret_buf, sizeof(int32_t), recvAddr, 0, TCP);
+ZHTFuture* ZHTClient::lookupAsync(string str) {
+	ZHTFuture *future = new ZHTFuture(1, NULL, NULL);
+	submitAsync(str, 1, 3, future);
+	return future;
+}
 
-//	generalSendTCP(sock, str.c_str());
+ZHTFuture* ZHTClient::removeAsync(string str) {
+	ZHTFuture *future = new ZHTFuture(2, NULL, NULL);
+	submitAsync(str, 2, 5, future);
+	return future;
+}
 
-//	int32_t* ret = (int32_t*) malloc(sizeof(int32_t));
+int ZHTClient::insertAsync(string str, ZHTCallback callback, void *arg) {
+	ZHTFuture *future = new ZHTFuture(3, callback, arg);
+	return submitAsync(str, 3, 5, future);
+}
 
-//	generalReveiveTCP(sock, (void*) ret, sizeof(int32_t), 0);
-	int ret_1 = *(int32_t*) ret_buf;
-//	cout<<"remove got: "<< ret_1 <<endl;
-//cout <<"Returned status: "<< *(int32_t*) ret<<endl;
-//	d3_closeConnection(sock);
-	free(ret_buf);
+int ZHTClient::lookupAsync(string str, ZHTCallback callback, void *arg) {
+	ZHTFuture *future = new ZHTFuture(1, callback, arg);
+	return submitAsync(str, 1, 3, future);
+}
 
-	return ret_1;
+int ZHTClient::removeAsync(string str, ZHTCallback callback, void *arg) {
+	ZHTFuture *future = new ZHTFuture(2, callback, arg);
+	return submitAsync(str, 2, 5, future);
+}
+
+const int BATCH_MAX_KEYS = 512; //per frame
+const int BATCH_MAX_BYTES = 32768; //per frame, well below MAX_MSG_SIZE
+
+int ZHTClient::multiInsert(const vector<string> &strs, vector<int> &statuses) {
+	vector<string> results;
+	return multiOperation(6, strs, results, statuses);
+}
+
+int ZHTClient::multiLookup(const vector<string> &strs, vector<string> &results,
+		vector<int> &statuses) {
+	return multiOperation(4, strs, results, statuses);
+}
+
+int ZHTClient::multiRemove(const vector<string> &strs, vector<int> &statuses) {
+	vector<string> results;
+	return multiOperation(5, strs, results, statuses);
+}
+
+//OPERATION: 4 multi-lookup, 5 multi-remove, 6 multi-insert
+int ZHTClient::multiOperation(int operation, const vector<string> &strs,
+		vector<string> &results, vector<int> &statuses) {
+	int n = strs.size();
+	results.assign(n, "");
+	statuses.assign(n, -2);
+
+	//items are keys for lookup/remove, whole packages for insert.
+	vector<string> items(n);
+	vector<int> todo;
+	vector<vector<int> > byServer(this->memberList.size());
+	for (int i = 0; i < n; i++) {
+		Package package;
+		package.ParseFromString(strs[i]);
+		if (package.virtualpath().empty()) { //empty key not allowed.
+			statuses[i] = -1;
+			continue;
+		}
+		if (operation == 6) {
+			if (package.realfullpath().empty()) //coup, to fix ridiculous bug of protobuf!
+				package.set_realfullpath(" ");
+			package.set_operation(3);
+			package.set_replicano(5);
+			items[i] = package.SerializeAsString();
+			inserted(package.virtualpath());
+		} else {
+			items[i] = package.virtualpath();
+		}
+		todo.push_back(i);
+	}
+
+	if (TCP == true && startAsync() != 0) { //no parallel frames, go key by key
+		for (size_t t = 0; t < todo.size(); t++) {
+			int i = todo[t];
+			if (operation == 4)
+				statuses[i] = lookup(strs[i], results[i]);
+			else if (operation == 5)
+				statuses[i] = remove(strs[i]);
+			else
+				statuses[i] = insert(strs[i]);
+		}
+		todo.clear();
+	}
+
+	while (!todo.empty()) {
+		//group by destination server, exactly what str2Host would pick.
+		for (size_t s = 0; s < byServer.size(); s++)
+			byServer[s].clear();
+		for (size_t t = 0; t < todo.size(); t++) {
+			Package package;
+			package.ParseFromString(strs[todo[t]]);
+			int index = myhash(package.virtualpath().c_str(),
+					this->memberList.size());
+			byServer[index].push_back(todo[t]);
+		}
+		todo.clear();
+
+		//cut every server's keys into frames and send them all before waiting on any.
+		vector<string> frames;
+		vector<struct HostEntity> frameDests;
+		vector<vector<int> > frameKeys;
+		for (size_t s = 0; s < byServer.size(); s++) {
+			size_t k = 0;
+			while (k < byServer[s].size()) {
+				Package frame;
+				vector<int> keys;
+				int bytes = 0;
+				while (k < byServer[s].size() && (int) keys.size() < BATCH_MAX_KEYS
+						&& (keys.empty()
+								|| bytes + (int) items[byServer[s][k]].size()
+										< BATCH_MAX_BYTES)) {
+					frame.add_listitem(items[byServer[s][k]]);
+					bytes += items[byServer[s][k]].size() + 4;
+					keys.push_back(byServer[s][k]);
+					k++;
+				}
+				frame.set_num(keys.size());
+				frame.set_operation(operation);
+				frame.set_replicano(operation == 4 ? 3 : 5); //5: original, 3 not original
+
+				frames.push_back(frame.SerializeAsString());
+				frameDests.push_back(this->memberList.at(s));
+				frameKeys.push_back(keys);
+			}
+		}
+
+		vector<string> frameResults(frames.size());
+		vector<int> frameStatuses(frames.size(), -1);
+		if (TCP == true) {
+			vector<ZHTFuture*> futures;
+			for (size_t f = 0; f < frames.size(); f++) {
+				ZHTFuture *future = new ZHTFuture(operation, NULL, NULL);
+				if (asyncEngine->submit(frameDests[f], frames[f], future) != 0)
+					future->complete(-1, "");
+				futures.push_back(future);
+			}
+			for (size_t f = 0; f < futures.size(); f++) {
+				frameStatuses[f] = futures[f]->wait(frameResults[f]);
+				delete futures[f];
+			}
+		} else { //one datagram per frame, all out in one sendmmsg
+			udp->callMany(frameDests, frames, frameResults, frameStatuses);
+			for (size_t f = 0; f < frames.size(); f++) {
+				if (frameStatuses[f] != 0 || frameResults[f].size() < 3) {
+					frameStatuses[f] = -1;
+					continue;
+				}
+				frameStatuses[f] = atoi(frameResults[f].substr(0, 3).c_str());
+				frameResults[f].erase(0, 3);
+			}
+		}
+
+		for (size_t f = 0; f < frames.size(); f++) {
+			const string &result = frameResults[f];
+			int status = frameStatuses[f];
+
+			Package reply;
+			if (status != 0 || !reply.ParseFromString(result)
+					|| reply.listitem_size() != (int) frameKeys[f].size()) {
+				for (size_t k = 0; k < frameKeys[f].size(); k++)
+					statuses[frameKeys[f][k]] = status < 0 ? status : -2;
+				continue;
+			}
+			for (size_t k = 0; k < frameKeys[f].size(); k++) {
+				int i = frameKeys[f][k];
+				const string &item = reply.listitem(k);
+				statuses[i] = atoi(item.substr(0, 3).c_str());
+				if (statuses[i] == -4) //server reply was full, ask again
+					todo.push_back(i);
+				else if (operation == 4)
+					results[i] = item.substr(3);
+			}
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (statuses[i] < 0)
+			return -2;
+	}
+	return 0;
 }
@@ -10,10 +10,14 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <errno.h>
 #include <stdint.h>
 
@@ -22,38 +26,55 @@
 #include <fstream>
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
 #include "zht_util.h"
-#include "novoht.h"
+#include "zht_udp.h"
+#include "zht_watch.h"
+#include "zht_local.h"
+#include "zht_bloom.h"
+#include "storage_engine.h"
 
 using namespace std;
 #define MAXEVENTS 64
 #define PORT_FOR_REPLICA 50009
-NoVoHT *pmap; //move to main().
-map<string, string> hmap; //for pure non-persistency
+StorageEngine *store; //picked by STORAGE_ENGINE in the config file
 
 char* LISTEN_PORT; // server listen port
 
 const int MAX_NUM_REPLICA = 3;
 
 struct HostEntity Replicas[MAX_NUM_REPLICA];
+vector<struct HostEntity> hostList;
+int nHost;
+int selfIndex = -1; //this server in hostList
 
-bool TCP; // for switch between TCP and UDP
+static bool TCP; // for switch between TCP and UDP
 
 /*******************************
  * zhouxb
  */
 //================================ Global and constant ===============================
-struct timeval tp;
-int MAX_FILE_SIZE = 10000; //1GB, too big, use dynamic memory malloc.
+//static: an embedded server shares the process with the client library, which has its own
+static struct timeval tp;
+static int MAX_FILE_SIZE = 10000; //1GB, too big, use dynamic memory malloc.
 
 int const MAX_MSG_SIZE = 65535; //transferd string maximum size
 
-int REPLICATION_TYPE; //1 for Client-side replication
+static int REPLICATION_TYPE; //1 for Client-side replication
 
-int NUM_REPLICAS;
+static int NUM_REPLICAS;
+
+string STORAGE_ENGINE = "novoht"; //novoht, flat, map or cstr, see storage_engine.h
+string STORAGE_FILE = ""; //db file of persistent engines, empty for memory only
+int STORAGE_CACHE_MB = 0; //novoht with a file: values beyond this cache stay on disk
+int STORAGE_SYNC = NOVOHT_SYNC_ASYNC; //memory, async or group, when an insert is acknowledged
+int STORAGE_SYNC_USEC = 0; //fdatasync interval, 0 for the default of the level
+int STORAGE_SYNC_RECORDS = 0; //group commit: updates that trigger an early fdatasync
+bool STORAGE_INDEX = false; //"ordered": sorted key index for scans, see storage_engine.h
 //====================================================================================
 
-int setconfigvariables(string cfgFile) {
+static int setconfigvariables(string cfgFile) {
 	FILE *fp;
 	char line[100], *key, *svalue;
 	int ivalue;
@@ -65,7 +86,9 @@ int setconfigvariables(string cfgFile) {
 	}
 	while (fgets(line, 100, fp) != NULL) {
 		key = strtok(line, "=");
-		svalue = strtok(NULL, "=");
+		svalue = strtok(NULL, "=\r\n");
+		if (key == NULL || svalue == NULL)
+			continue;
 		ivalue = atoi(svalue);
 
 		if ((strcmp(key, "REPLICATION_TYPE")) == 0) {
@@ -78,6 +101,33 @@ int setconfigvariables(string cfgFile) {
 			//cout<<"NUM_REPLICAS = "<< NUM_REPLICAS <<endl;
 		}
 
+		if ((strcmp(key, "STORAGE_ENGINE")) == 0)
+			STORAGE_ENGINE = svalue;
+
+		if ((strcmp(key, "STORAGE_FILE")) == 0)
+			STORAGE_FILE = svalue;
+
+		if ((strcmp(key, "STORAGE_CACHE_MB")) == 0)
+			STORAGE_CACHE_MB = ivalue;
+
+		if ((strcmp(key, "STORAGE_SYNC")) == 0) {
+			if (strcmp(svalue, "memory") == 0)
+				STORAGE_SYNC = NOVOHT_SYNC_MEMORY;
+			else if (strcmp(svalue, "group") == 0)
+				STORAGE_SYNC = NOVOHT_SYNC_GROUP;
+			else
+				STORAGE_SYNC = NOVOHT_SYNC_ASYNC;
+		}
+
+		if ((strcmp(key, "STORAGE_SYNC_USEC")) == 0)
+			STORAGE_SYNC_USEC = ivalue;
+
+		if ((strcmp(key, "STORAGE_SYNC_RECORDS")) == 0)
+			STORAGE_SYNC_RECORDS = ivalue;
+
+		if ((strcmp(key, "STORAGE_INDEX")) == 0)
+			STORAGE_INDEX = strcmp(svalue, "ordered") == 0;
+
 	}
 	return 0;
 }
@@ -201,19 +251,231 @@ int handleRequest(int sock, void*buff) {
  }
  */
 
-int32_t HB_insert(NoVoHT *map, Package &package) {
-	//int opt = package.operation();//opt not be used?
-	string value = package.SerializeAsString();
+//================================ Watches (operations 13, 14) ========================
+//A TCP connection that registered watches gets notices pushed down it, framed as described
+//in zht_watch.h. A changed key is looked up once among the exact keys and once per prefix
+//length in use, so the cost follows the number of distinct lengths, not of watches.
+#define WATCH_SNDBUF (1 << 20) //a watcher further behind than that loses its connection
+map<string, set<int> > watchKeys; //key -> sockets
+map<string, set<int> > watchPrefixes;
+map<size_t, int> watchPrefixLens; //length -> prefixes of that length
+map<int, set<pair<string, bool> > > watchesBySock; //(key, prefix)
+long long watchCount, watchNotices, watchDropped;
+
+static bool ownKey(const string &key);
+
+static void watchRemove(int sock, const string &key, bool prefix) {
+	map<string, set<int> > &table = prefix ? watchPrefixes : watchKeys;
+	map<string, set<int> >::iterator it = table.find(key);
+	if (it == table.end() || it->second.erase(sock) == 0)
+		return;
+	watchCount--;
+	if (!it->second.empty())
+		return;
+	table.erase(it);
+	if (prefix && --watchPrefixLens[key.size()] == 0)
+		watchPrefixLens.erase(key.size());
+}
+
+//forget every watch of a connection that is closed or given up on
+void watchDrop(int sock) {
+	map<int, set<pair<string, bool> > >::iterator it = watchesBySock.find(sock);
+	if (it == watchesBySock.end())
+		return;
+	for (set<pair<string, bool> >::iterator w = it->second.begin(); w != it->second.end();
+			w++)
+		watchRemove(sock, w->first, w->second);
+	watchesBySock.erase(it);
+}
+
+//one frame to a watcher, never waiting for it: one that does not keep up loses its watches
+//and, by the shutdown, its connection, which tells the client it may have missed notices
+void watchSend(int sock, char event, const char *data, int len) {
+	char head[sizeof(int32_t) + 1];
+	int32_t frameLen = len + 1;
+	memcpy(head, &frameLen, sizeof(int32_t));
+	head[sizeof(int32_t)] = event;
+	struct iovec iov[2];
+	struct msghdr msg;
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (void*) data;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) sizeof(head) + len) {
+		watchDrop(sock);
+		shutdown(sock, SHUT_RDWR); //the event loop sees it and closes the socket
+		watchDropped++;
+	}
+}
+
+//operations 13 (watch) and 14 (unwatch) of virtualPath, a prefix if mode is 1. 0 done,
+//-1 bad request (watches need TCP), -2 unwatch of something not watched
+int32_t HB_watch(int sock, Package &package) {
+	if (TCP == false || sock < 0 || !package.has_virtualpath())
+		return -1;
+	const string &key = package.virtualpath();
+	bool prefix = package.mode() == 1;
+	if (package.operation() == 14) {
+		map<int, set<pair<string, bool> > >::iterator it = watchesBySock.find(sock);
+		if (it == watchesBySock.end() || it->second.erase(make_pair(key, prefix)) == 0)
+			return -2;
+		watchRemove(sock, key, prefix);
+		return 0;
+	}
+	set<pair<string, bool> > &mine = watchesBySock[sock];
+	if (mine.empty()) { //room for a burst of notices before the watcher counts as stuck
+		int size = WATCH_SNDBUF;
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	if (!mine.insert(make_pair(key, prefix)).second)
+		return 0;
+	if (prefix) {
+		set<int> &socks = watchPrefixes[key];
+		if (socks.empty())
+			watchPrefixLens[key.size()]++;
+		socks.insert(sock);
+	} else
+		watchKeys[key].insert(sock);
+	watchCount++;
+	return 0;
+}
+
+//tell the watchers of KEY, and of the prefixes it starts with, that it changed. Copies held
+//for other servers are left to those servers, which have the same watches.
+void watchNotify(const string &key, char event) {
+	if (watchCount == 0 || !ownKey(key))
+		return;
+	set<int> to;
+	map<string, set<int> >::iterator it = watchKeys.find(key);
+	if (it != watchKeys.end())
+		to.insert(it->second.begin(), it->second.end());
+	for (map<size_t, int>::iterator len = watchPrefixLens.begin();
+			len != watchPrefixLens.end() && len->first <= key.size(); len++) {
+		it = watchPrefixes.find(key.substr(0, len->first));
+		if (it != watchPrefixes.end())
+			to.insert(it->second.begin(), it->second.end());
+	}
+	for (set<int>::iterator sock = to.begin(); sock != to.end(); sock++) {
+		watchSend(*sock, event, key.data(), key.size());
+		watchNotices++;
+	}
+}
+
+//================================ Negative lookups ==================================
+//The Bloom filter of the table (zht_bloom.h) is built the first time a lookup asks for it
+//and kept up to date from then on. Removed keys stay in it until it is rebuilt, once the
+//removals reach half of the keys it was sized for or the inserts all of them. A build
+//walks the keys (not the values) on a thread of its own while the event loop goes on; the
+//keys inserted meanwhile are added when it is swapped in. Until the first one is done
+//misses go out without a block.
+#define BLOOM_MIN_KEYS 4096
+ZHTBloom *bloom = NULL; //what misses are answered from, kept up to date
+ZHTBloom *bloomNext = NULL; //being built by bloomThread
+long long bloomNextKeys;
+int bloomNextDone;
+vector<string> bloomNextAdded; //inserted while bloomNext was built
+long long bloomNextRemoves;
+long long bloomAdds, bloomRemoves, bloomRebuilds, bloomBlocksSent;
+
+static void bloomVisit(const string &key, void *arg) {
+	((ZHTBloom*) arg)->add(key);
+}
+
+static void *bloomThread(void *) {
+	bloomNextKeys = store->forEachKey(bloomVisit, bloomNext);
+	__sync_fetch_and_add(&bloomNextDone, 1);
+	return NULL;
+}
+
+//start building a filter of the table as it is now, unless one is under way
+static void bloomRebuild() {
+	if (bloomNext != NULL)
+		return;
+	bloomNext = new ZHTBloom();
+	bloomNext->reset(max((long long) store->size() * 2, (long long) BLOOM_MIN_KEYS));
+	bloomNextAdded.clear();
+	bloomNextRemoves = 0;
+	bloomNextDone = 0;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, bloomThread, NULL) != 0) {
+		delete bloomNext;
+		bloomNext = NULL;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+//swap in a finished build
+static void bloomPoll() {
+	if (bloomNext == NULL || __sync_fetch_and_add(&bloomNextDone, 0) == 0)
+		return;
+	for (size_t i = 0; i < bloomNextAdded.size(); i++)
+		bloomNext->add(bloomNextAdded[i]);
+	delete bloom;
+	bloom = bloomNext;
+	bloomNext = NULL;
+	bloomAdds = bloomNextKeys + bloomNextAdded.size();
+	bloomRemoves = bloomNextRemoves;
+	bloomNextAdded.clear();
+	bloomRebuilds++;
+}
 
+//every change of the table comes through here: the filter and the watchers learn of it
+void keyChanged(const string &key, char event) {
+	bloomPoll();
+	if (bloomNext != NULL) {
+		if (event == ZHT_WATCH_CHANGED)
+			bloomNextAdded.push_back(key);
+		else
+			bloomNextRemoves++;
+	}
+	if (bloom != NULL) {
+		if (event == ZHT_WATCH_CHANGED) {
+			bloom->add(key);
+			if (++bloomAdds > bloom->capacity())
+				bloomRebuild();
+		} else if (++bloomRemoves > bloom->capacity() / 2)
+			bloomRebuild();
+	}
+	watchNotify(key, event);
+}
+
+//what a lookup that asked for the filter gets on a miss: the block KEY falls into
+void bloomMissReply(const string &key, string &out) {
+	bloomPoll();
+	if (bloom == NULL) {
+		bloomRebuild();
+		out = "Empty";
+		return;
+	}
+	int32_t blocks = bloom->blocks();
+	int32_t index = bloomBlockOf(key, blocks);
+	out.assign(ZHT_BLOOM_MAGIC, 3);
+	out.append((const char*) &blocks, sizeof(int32_t));
+	out.append((const char*) &index, sizeof(int32_t));
+	out.append(bloom->block(index), ZHT_BLOOM_BLOCK);
+	bloomBlocksSent++;
+}
+
+//wire is the package as it came in, stored as is when given: it parsed cleanly, so it is
+//what SerializeAsString() would give back anyway
+int32_t HB_insert(StorageEngine *map, Package &package, const string *wire = NULL) {
+	//int opt = package.operation();//opt not be used?
 	//int ret = db.set(package.virtualpath(), package_str); //virtualpath as key
 //	cout << "Insert to pmap...value = " << value << endl;
-	string key = package.virtualpath();
 
 //      cout<<"key:"<<key<<endl;
 
 //      cout<<"value:"<<value<<endl;
 //      cout<<"Insert: k-v ready. put..."<<endl;
-	int ret = map->put(key, value);
+	int ret;
+	if (wire != NULL)
+		ret = map->put(package.virtualpath(), *wire);
+	else
+		ret = map->put(package.virtualpath(), package.SerializeAsString());
 //      cout << "end inserting, ret = " << ret << endl;
 
 	if (ret != 0) {
@@ -223,194 +485,571 @@ int32_t HB_insert(NoVoHT *map, Package &package) {
 	/*
 	 cout << "String insted: " << package_str << endl;
 	 */
-	else
+	else {
+		keyChanged(package.virtualpath(), ZHT_WATCH_CHANGED);
+		return 0;
+	}
+}
+
+static long long wallUsec() { //deadlines are wall clock, they survive a restart
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+//operation 9: store the package like an insert if it has a value, then give the key
+//openMode msec to live (0 or less: no deadline any more)
+int32_t HB_expire(StorageEngine *map, Package &package, const string *wire) {
+	if (package.has_realfullpath()) {
+		int32_t ret = HB_insert(map, package, wire);
+		if (ret != 0)
+			return ret;
+	}
+	int ttl = package.openmode();
+	int ret = map->setExpiry(package.virtualpath(),
+			ttl > 0 ? wallUsec() + ttl * 1000LL : 0);
+	if (ret == -3 && package.has_realfullpath()) {
+		map->remove(package.virtualpath()); //no expiry here, don't keep it for good
+		keyChanged(package.virtualpath(), ZHT_WATCH_REMOVED);
+	}
+	return ret;
+}
+
+//leases, operations 10 acquire, 11 renew and 12 release. The key holds a Package whose
+//realFullPath names the holder and expires with the lease, openMode is its length in msec.
+//0 granted, -1 bad request, -2 not held by this holder (renew/release), -3 storage error,
+//-5 held by someone else: RESULT then gets the lease with the msec it has left in openMode.
+int32_t HB_lease(StorageEngine *map, Package &package, string &result) {
+	const string &key = package.virtualpath();
+	const string &holder = package.realfullpath();
+	int ttl = package.openmode();
+	result.clear();
+	if (key.empty() || holder.empty() || (package.operation() != 12 && ttl <= 0))
+		return -1;
+
+	string stored;
+	Package lease;
+	bool held = map->get(key, stored) == 0 && lease.ParseFromString(stored);
+	bool mine = held && lease.realfullpath() == holder;
+	long long now = wallUsec();
+
+	switch (package.operation()) {
+	case 10:
+		if (held && !mine) {
+			long long deadline = map->getExpiry(key);
+			lease.set_openmode(deadline > now ? (int) ((deadline - now) / 1000) : 0);
+			result = lease.SerializeAsString();
+			return -5;
+		}
+		if (!mine) {
+			lease.Clear();
+			lease.set_virtualpath(key);
+			lease.set_realfullpath(holder);
+			if (map->put(key, lease.SerializeAsString()) != 0)
+				return -3;
+			keyChanged(key, ZHT_WATCH_CHANGED);
+		}
+		//acquiring one's own lease again renews it
+		// fall through
+	case 11:
+		if (!mine && package.operation() == 11)
+			return -2;
+		if (map->setExpiry(key, now + ttl * 1000LL) != 0) {
+			map->remove(key); //no expiry here, a lease that never ends is worse than none
+			keyChanged(key, ZHT_WATCH_REMOVED);
+			return -3;
+		}
+		return 0;
+	default:
+		if (!mine)
+			return -2;
+		if (map->remove(key) != 0)
+			return -3;
+		keyChanged(key, ZHT_WATCH_REMOVED);
 		return 0;
+	}
 }
 
-string HB_lookup(NoVoHT *map, Package &package) {
+string HB_lookup(StorageEngine *map, Package &package) {
 //      string value;
 //      cout << "lookup in HB_lookup" << endl;
 	string key = package.virtualpath();
 //	cout << "key:" << key << endl;
-	// string *strP = map->get(key); //problem
-	string *result = map->get(key);
+	string retStr;
 
-//	cout << "lookup result = " << (*result) << endl;
+//	cout << "lookup result = " << retStr << endl;
 
-	if (result == NULL) {
-		cout << "lookup find nothing." << endl;
+	if (map->get(key, retStr) != 0) {
 		string nullString = "Empty";
 		return nullString;
 	} else {
-		string retStr((*result));
 		return retStr;
 	}
 
 }
 
-int32_t HB_remove(NoVoHT *map, Package &package) {
+int32_t HB_remove(StorageEngine *map, Package &package) {
 	string key = package.virtualpath();
 	int ret = map->remove(key); // return 0 means correct.
 	if (ret != 0) {
 		cerr << "DB Error: fail to remove :ret= " << ret << endl;
 		return -2;
-	} else
+	} else {
+		keyChanged(key, ZHT_WATCH_REMOVED);
 		return 0; //succeed.
+	}
 }
 
-/*bool eqstr(char *s1, char *s2) {
- return strcmp(s1, s2) == 0;
- }*/
+/*
+ * Batch operations: 4 multi-lookup, 5 multi-remove, 6 multi-insert.
+ * The frame carries the keys (lookup/remove) or the serialized packages (insert) in listItem
+ * and their count in num. The reply is "%03d" plus a Package whose listItem holds one
+ * "%03d"[value] entry per key, in request order.
+ */
+const int BATCH_REPLY_LIMIT = MAX_MSG_SIZE - 1024; //leave room for the status and framing
+map<int, string> partialBatch; //TCP batch frames that arrived in several reads, by socket
+
+string HB_batch(StorageEngine *map, Package &package) {
+	Package reply;
+	int replySize = 0;
+	char statusBuff[8];
+
+	for (int i = 0; i < package.listitem_size(); i++) {
+		int32_t status = 0;
+		string value;
+		Package sub;
+
+		switch (package.operation()) {
+		case 4: { //lookup
+			sub.set_virtualpath(package.listitem(i));
+			if (sub.virtualpath().empty()) {
+				status = -1;
+				break;
+			}
+			value = HB_lookup(map, sub);
+			if (value.compare("Empty") == 0) {
+				status = -2;
+				value.clear();
+			} else if (replySize > 0
+					&& replySize + (int) value.size() + 16 > BATCH_REPLY_LIMIT) {
+				status = -4; //reply full, client asks again
+				value.clear();
+			}
+		}
+			break;
+		case 5: //remove
+			sub.set_virtualpath(package.listitem(i));
+			if (sub.virtualpath().empty())
+				status = -1;
+			else
+				status = HB_remove(map, sub);
+			break;
+		case 6: //insert
+			if (!sub.ParseFromString(package.listitem(i)))
+				status = -1;
+			else if (sub.virtualpath().empty())
+				status = -1;
+			else
+				status = HB_insert(map, sub, &package.listitem(i));
+			break;
+		}
 
-struct charscmp: public std::binary_function<const char*, const char*, bool> {
-	bool operator()(const char* s1, const char* s2) const {
-		return strcmp(s1, s2) < 0;
+		sprintf(statusBuff, "%03d", status);
+		string item(statusBuff);
+		item.append(value);
+		replySize += item.size() + 4;
+		reply.add_listitem(item);
 	}
-};
-
-typedef map<const char*, const char*, charscmp> MY_MAP;
-typedef pair<const char*, const char*> MY_PAIR;
-static MY_MAP chmap;
-
-int32_t HB_insert_cstr(MY_MAP &chmap, Package &package) {
-
-	string package_str = package.SerializeAsString();
-
-	char* value = (char*) calloc(package_str.length(), sizeof(char));
-	strcpy(value, package_str.c_str());
-
-	char* key = (char*) calloc(package.virtualpath().length(), sizeof(char));
-	strcpy(key, package.virtualpath().c_str());
-
-//	cout <<"after scrcpy, key = "<<key<<", key length = "<< strlen(key) <<endl;
-
-//      pair<map<char*, char*>::iterator, bool> ret;
-//      ret = chmap.insert(pair<char*, char*>(key, value));
-//      free(key);
-//      free(value);
-
-	pair<MY_MAP::iterator, bool> ret;
-	ret = chmap.insert(MY_PAIR(key, value));
-
-	MY_MAP::iterator it;
-	cout << "mymap.size() is " << (int) chmap.size() << endl;
-	cout << "mymap contains:\n";
-	for (it = chmap.begin(); it != chmap.end(); it++)
-		cout << (*it).first << " => " << (*it).second << endl;
-	cout << "########" << endl;
+	reply.set_num(reply.listitem_size());
+	return reply.SerializeAsString();
+}
 
-	if (ret.second == false) {
-		cout
-				<< "HB_insert_cstr: insert failed, return -3, element exists, key = "
-				<< key << ", value = " << value << endl;
+const int SCAN_MAX_PAIRS = 1000; //per reply, also the limit when the client gives none
 
-		cout << "######## done ########" << endl;
-		free(key);
-		free(value);
-		return -3;
-	} else {
-		cout << " HB_insert_cstr: insert succeeded. key = " << key
-				<< ", value = " << chmap.find(key)->second << endl;
+//the keys this server answers scans for: with replication the table also holds copies of
+//the previous servers' keys, which those servers report themselves
+static bool ownKey(const string &key) {
+	return NUM_REPLICAS <= 0 || nHost <= 1 || selfIndex < 0
+			|| (int) myhash(key.c_str(), nHost) == selfIndex;
+}
 
-		cout << "######## done ########" << endl;
-		free(key);
-		free(value);
-		return 0;
+//keys starting with virtualPath that sort after realFullPath, at most mode() of them and
+//BATCH_REPLY_LIMIT bytes. The reply lists key, value, key, value... in key order, num
+//counts the items (the same framing as a batch reply) and realFullPath is the last key
+//sent if more are left, absent after the last page.
+string HB_scan(StorageEngine *map, Package &package) {
+	Package reply;
+	const string &prefix = package.virtualpath();
+	int limit = package.mode() > 0 && package.mode() < SCAN_MAX_PAIRS ?
+			package.mode() : SCAN_MAX_PAIRS;
+	string after = package.realfullpath();
+	int replySize = 0;
+	int count = 0;
+	bool more = false;
+	vector<pair<string, string> > page;
+	while (!more) {
+		int want = limit - count + 1; //one beyond the page tells whether more are left
+		int got = map->scan(prefix, after, want, page);
+		for (int i = 0; i < got && !more; i++) {
+			const string &key = page[i].first;
+			if (!ownKey(key)) {
+				after = key;
+				continue;
+			}
+			int bytes = key.size() + page[i].second.size() + 16;
+			if (count == limit || (count > 0 && replySize + bytes > BATCH_REPLY_LIMIT)) {
+				more = true;
+				break;
+			}
+			reply.add_listitem(key);
+			reply.add_listitem(page[i].second);
+			replySize += bytes;
+			count++;
+			after = key;
+		}
+		if (got < want)
+			break;
 	}
+	if (more)
+		reply.set_realfullpath(after);
+	reply.set_num(reply.listitem_size());
+	return reply.SerializeAsString();
+}
 
+//UDP: replies of the datagrams taken by one recvmmsg, sent together by one sendmmsg
+struct UdpReply {
+	sockaddr_in to;
+	string data;
+};
+vector<UdpReply> udpReplies;
+const char *udpHeader = NULL; //id header of the datagram being served, NULL for bare ones
+
+//UDP duplicate cache: sender and request id -> reply, so a retransmitted update is answered
+//again instead of applied twice. Bulky replies (lookups) are not kept, running those again
+//is harmless.
+#define UDP_DUP_ENTRIES 4096
+#define UDP_DUP_MAX_REPLY 4096
+map<string, string> udpDone;
+deque<string> udpDoneOrder;
+
+string udpDupKey(const sockaddr_in &from, const char *header) {
+	string key((const char*) &from.sin_addr, sizeof(from.sin_addr));
+	key.append((const char*) &from.sin_port, sizeof(from.sin_port));
+	key.append(header + 4, ZHT_UDP_HEADER - 4);
+	return key;
 }
 
-int32_t HB_insert_cstr_(map<char*, char*> &chmap, Package &package) {
+//embedded server: while a request of this process is served, its reply goes here
+struct LocalReply {
+	char *buff;
+	int size;
+	int len;
+};
+LocalReply *localReply = NULL;
+
+//group commit (STORAGE_SYNC group): the storage no longer waits for the fdatasync of each
+//update, the replies to updates wait here instead, and the event loop goes on serving. One
+//fdatasync covers all of them once STORAGE_SYNC_USEC passed since the last one or
+//STORAGE_SYNC_RECORDS are queued (see groupFlush). A connection with a queued reply gets
+//the later ones queued behind it, so its replies keep their order.
+bool groupCommit = false; //the storage left the fdatasync to us
+bool groupDefer = false; //the request being served is an update, hold its reply
+long long groupUsec, groupRecords;
+long long lastGroupSync; //usec
+map<int, string> groupTcp; //socket -> framed replies
+vector<UdpReply> groupUdp;
+vector<string> groupUdpKeys; //their duplicate cache entries, "" for bare datagrams
+int groupUdpSock = -1;
+long long groupQueued; //replies in groupTcp and groupUdp
+long long groupSyncs, groupReplies;
+
+//HEAD then VALUE as one reply: a single sendmsg over TCP, behind the length of the reply so
+//the client knows when it has all of it (see recvReplyTCP), queued for the next sendmmsg
+//over UDP, where the datagram is the frame
+int sendReply(int sock, const char *head, int headLen, const string &value,
+		sockaddr_in &toAddr) {
+	if (localReply != NULL) { //a request of this process, see serveLocal
+		int n = 0;
+		if (localReply->len < localReply->size) {
+			n = min(headLen, localReply->size - localReply->len);
+			memcpy(localReply->buff + localReply->len, head, n);
+			localReply->len += n;
+		}
+		if (localReply->len < localReply->size) {
+			int v = min((int) value.size(), localReply->size - localReply->len);
+			memcpy(localReply->buff + localReply->len, value.data(), v);
+			localReply->len += v;
+			n += v;
+		}
+		return n;
+	}
+	if (TCP == false) {
+		UdpReply reply;
+		reply.to = toAddr;
+		if (udpHeader != NULL)
+			reply.data.assign(udpHeader, ZHT_UDP_HEADER);
+		reply.data.append(head, headLen);
+		reply.data.append(value);
+		if (udpHeader != NULL && reply.data.size() <= UDP_DUP_MAX_REPLY) {
+			string key = udpDupKey(toAddr, udpHeader);
+			if (udpDone.insert(make_pair(key, reply.data)).second) {
+				udpDoneOrder.push_back(key);
+				if (udpDoneOrder.size() > UDP_DUP_ENTRIES) {
+					udpDone.erase(udpDoneOrder.front());
+					udpDoneOrder.pop_front();
+				}
+			}
+		}
+		if (groupDefer) {
+			groupUdp.push_back(reply);
+			groupUdpKeys.push_back(udpHeader != NULL ? udpDupKey(toAddr, udpHeader) : string());
+			groupQueued++;
+		} else
+			udpReplies.push_back(reply);
+		return reply.data.size();
+	}
 
-	string package_str = package.SerializeAsString();
+	int32_t length = headLen + value.size();
+	map<int, string>::iterator queued = groupTcp.find(sock);
+	if (groupDefer || queued != groupTcp.end()) { //after the fdatasync, in order
+		string &out = groupTcp[sock];
+		out.append((const char*) &length, sizeof(int32_t));
+		out.append(head, headLen);
+		out.append(value);
+		groupQueued++;
+		return sizeof(int32_t) + length;
+	}
+	struct iovec iov[3];
+	struct msghdr msg;
+	iov[0].iov_base = &length;
+	iov[0].iov_len = sizeof(int32_t);
+	iov[1].iov_base = (void*) head;
+	iov[1].iov_len = headLen;
+	iov[2].iov_base = (void*) value.data();
+	iov[2].iov_len = value.size();
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	int r = sendmsg(sock, &msg, 0);
+	if (r < 0)
+		cerr << "sendReply: " << strerror(errno) << endl;
+	return r;
+}
 
-	char* value = (char*) malloc(package_str.length() * sizeof(char));
-	strcpy(value, package_str.c_str());
+//the status code and the value in one reply, without gluing them together first
+int sendStatusValue(int sock, int32_t status, const string &value,
+		sockaddr_in &toAddr) {
+	char statusBuff[16];
+	sprintf(statusBuff, "%03d", status);
+	return sendReply(sock, statusBuff, strlen(statusBuff), value, toAddr);
+}
 
-	char* key = (char*) malloc(package.virtualpath().length() * sizeof(char));
-//	cout << "package.virtualpath().c_str()="<<package.virtualpath().c_str()<<endl;
-	strcpy(key, package.virtualpath().c_str());
+int sendStatus(int sock, int32_t status, sockaddr_in &toAddr) {
+	return sendReply(sock, (const char*) &status, sizeof(int32_t), string(), toAddr);
+}
 
-//	cout <<"after scrcpy, key = "<<key<<", key length = "<< strlen(key) <<endl;
+void flushUdpReplies(int sock) {
+	struct mmsghdr msgs[ZHT_UDP_BATCH];
+	struct iovec iov[ZHT_UDP_BATCH];
+	for (size_t start = 0; start < udpReplies.size(); start += ZHT_UDP_BATCH) {
+		int count = 0;
+		for (size_t k = start; k < udpReplies.size() && count < ZHT_UDP_BATCH; k++, count++) {
+			iov[count].iov_base = (void*) udpReplies[k].data.data();
+			iov[count].iov_len = udpReplies[k].data.size();
+			memset(&msgs[count], 0, sizeof(struct mmsghdr));
+			msgs[count].msg_hdr.msg_name = &udpReplies[k].to;
+			msgs[count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[count].msg_hdr.msg_iov = &iov[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+		}
+		int sent = 0;
+		while (sent < count) {
+			int r = sendmmsg(sock, msgs + sent, count - sent, 0);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				cerr << "flushUdpReplies: " << strerror(errno) << endl;
+				break; //the clients retransmit, the duplicate cache answers them
+			}
+			sent += r;
+		}
+	}
+	udpReplies.clear();
+}
 
-//      pair<map<char*, char*>::iterator, bool> ret;
-//      ret = chmap.insert(pair<char*, char*>(key, value));
-//      free(key);
-//      free(value);
-	if (chmap.insert(pair<char*, char*>(key, value)).second == false) {
-		cout
-				<< "HB_insert_cstr: insert failed, return -3, element exists, key = "
-				<< key << ", value = " << value << endl;
-		free(key);
-		free(value);
-		return -3;
+//one fdatasync for every update served since the last one, then their replies. If it fails
+//nobody is told the update is done: TCP clients see their connection shut, UDP ones get no
+//answer and retransmit.
+void groupFlush(StorageEngine *pmap) {
+	bool ok = pmap->sync() == 0;
+	lastGroupSync = wallUsec();
+	groupSyncs++;
+	if (!ok)
+		cerr << "groupFlush: fdatasync failed, updates not acknowledged" << endl;
+	for (map<int, string>::iterator it = groupTcp.begin(); it != groupTcp.end(); ++it) {
+		if (!ok) {
+			shutdown(it->first, SHUT_RDWR);
+			continue;
+		}
+		const string &out = it->second;
+		size_t sent = 0;
+		while (sent < out.size()) {
+			ssize_t r = send(it->first, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				struct pollfd pfd;
+				pfd.fd = it->first;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, 1000);
+				continue;
+			}
+			if (r <= 0) {
+				cerr << "groupFlush: " << strerror(errno) << endl;
+				break;
+			}
+			sent += r;
+		}
+	}
+	groupTcp.clear();
+	if (ok) {
+		udpReplies.insert(udpReplies.end(), groupUdp.begin(), groupUdp.end());
+		flushUdpReplies(groupUdpSock);
 	} else {
-		cout << " HB_insert_cstr: insert succeeded. key = " << key
-				<< ", value = " << chmap.find(key)->second << endl;
-		free(key);
-		free(value);
-		return 0;
+		for (size_t k = 0; k < groupUdpKeys.size(); k++)
+			udpDone.erase(groupUdpKeys[k]); //their retransmissions run again
 	}
+	groupUdp.clear();
+	groupUdpKeys.clear();
+	groupReplies += groupQueued;
+	groupQueued = 0;
+}
 
+//the connection is going away, nobody to answer. Its updates are still made durable by the
+//next fdatasync.
+void groupDrop(int sock) {
+	map<int, string>::iterator it = groupTcp.find(sock);
+	if (it == groupTcp.end())
+		return;
+	const string &out = it->second;
+	for (size_t at = 0; at + sizeof(int32_t) <= out.size(); groupQueued--) {
+		int32_t length;
+		memcpy(&length, out.data() + at, sizeof(int32_t));
+		at += sizeof(int32_t) + length;
+	}
+	groupTcp.erase(it);
 }
 
-int32_t HB_insert(map<string, string> &hmap, Package &package) {
-	//int opt = package.operation();//opt not be used?
-	string package_str = package.SerializeAsString();
-	//int ret = db.set(package.virtualpath(), package_str); //virtualpath as key
-	//      cout<<"Insert to pmap..."<<endl;
-	string key = package.virtualpath();
-	//      cout<<"key:"<<key<<endl;
-	string value = package_str;
-	//      cout<<"value:"<<value<<endl;
-	//      cout<<"Insert: k-v ready. put..."<<endl;
+//the fdatasync is due: the window since the last one is over, or enough updates wait
+bool groupDue(long long now) {
+	return groupQueued > 0
+			&& (groupQueued >= groupRecords || now >= lastGroupSync + groupUsec);
+}
 
-	//pair<map<string,string>::iterator,bool> ret;
-	pair<map<string, string>::iterator, bool> ret;
-	ret = hmap.insert(pair<string, string>(key, value));
+//================================ Statistics (operation 7) ==========================
+#define STATS_OPS 7 //by operation code, 0 for everything else
+#define STATS_BUCKETS 24 //latency histogram: bucket b counts requests under 2^b usec
+const char *statsOpNames[STATS_OPS] = { "other", "lookup", "remove", "insert",
+		"multi_lookup", "multi_remove", "multi_insert" };
+
+struct LatencyStats {
+	long long count;
+	double usecTotal;
+	double usecMax;
+	long long hist[STATS_BUCKETS];
+};
 
-	if (ret.second == false) {
-		return -3;
-	} else
-		return 0;
+LatencyStats opStats[STATS_OPS];
+LatencyStats replicaStats; //time to hand an update to the replicas
+long long replicaFailures;
+double statsStart; //usec
+long long connsOpen, connsAccepted;
+long long udpDatagrams, udpDuplicates;
+
+void statsRecord(LatencyStats &st, double usec) {
+	int b = 0;
+	while (b < STATS_BUCKETS - 1 && usec >= (double) (1LL << b))
+		b++;
+	st.count++;
+	st.usecTotal += usec;
+	if (usec > st.usecMax)
+		st.usecMax = usec;
+	st.hist[b]++;
 }
 
-string HB_lookup(map<string, string> &hmap, Package &package) {
-	string value;
-//              cout << "lookup in HB_lookup" << endl;
-	string key = package.virtualpath();
-//              cout << "key:" << key << endl;
-	map<string, string>::iterator it;
-	it = hmap.find(key);
-	if (it == hmap.end()) {
-		string nullString = "Empty";
-		return nullString;
+//upper bound of the bucket holding the FRACTION quantile
+long long statsQuantile(const LatencyStats &st, double fraction) {
+	long long seen = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += st.hist[b];
+		if (seen >= st.count * fraction)
+			return 1LL << b;
 	}
-	return (*it).second;
+	return 1LL << (STATS_BUCKETS - 1);
 }
 
-int32_t HB_remove(map<string, string> &hmap, Package &package) {
-	unsigned int r = hmap.erase(package.virtualpath());
-
-	if (r == 0) {
+void statsLatency(stringstream &out, const string &name, const LatencyStats &st) {
+	out << name << "_count " << st.count << "\n";
+	if (st.count == 0)
+		return;
+	out << name << "_usec_avg " << (long long) (st.usecTotal / st.count) << "\n";
+	out << name << "_usec_p50 " << statsQuantile(st, 0.5) << "\n";
+	out << name << "_usec_p99 " << statsQuantile(st, 0.99) << "\n";
+	out << name << "_usec_max " << (long long) st.usecMax << "\n";
+	out << name << "_usec_hist";
+	for (int b = 0; b < STATS_BUCKETS; b++)
+		if (st.hist[b] > 0)
+			out << " " << (1LL << b) << ":" << st.hist[b];
+	out << "\n";
+}
 
-		cout << "Remove nothing, no match found, key=" << package.virtualpath()
-				<< endl;
-		return -1;
+//"name value" lines, ended by "end", see examples/zht_stats.cpp
+string statsReport(StorageEngine *pmap) {
+	stringstream out;
+	out << "uptime_sec " << (long long) ((getTime_usec() - statsStart) / 1E6) << "\n";
+	out << "engine " << pmap->name() << "\n";
+	out << "size " << pmap->size() << "\n";
+	vector<pair<string, long long> > engine;
+	pmap->stats(engine);
+	for (size_t i = 0; i < engine.size(); i++)
+		out << engine[i].first << " " << engine[i].second << "\n";
+	out << "protocol " << (TCP ? "TCP" : "UDP") << "\n";
+	out << "connections_open " << connsOpen << "\n";
+	out << "connections_accepted " << connsAccepted << "\n";
+	out << "udp_datagrams " << udpDatagrams << "\n";
+	out << "udp_duplicates " << udpDuplicates << "\n";
+	out << "group_syncs " << groupSyncs << "\n";
+	out << "group_replies " << groupReplies << "\n";
+	out << "watches " << watchCount << "\n";
+	out << "watch_connections " << watchesBySock.size() << "\n";
+	out << "watch_notices " << watchNotices << "\n";
+	out << "watch_dropped " << watchDropped << "\n";
+	out << "bloom_blocks " << (bloom != NULL ? bloom->blocks() : 0) << "\n";
+	out << "bloom_rebuilds " << bloomRebuilds << "\n";
+	out << "bloom_blocks_sent " << bloomBlocksSent << "\n";
+	for (int op = 1; op < STATS_OPS; op++)
+		statsLatency(out, statsOpNames[op], opStats[op]);
+	statsLatency(out, statsOpNames[0], opStats[0]);
+	//replication is fire and forget: what the replicas have not acknowledged yet is the lag
+	out << "replicas " << (NUM_REPLICAS > 0 ? NUM_REPLICAS : 0) << "\n";
+	statsLatency(out, "replica", replicaStats);
+	out << "replica_failures " << replicaFailures << "\n";
+	for (int i = 0; i < NUM_REPLICAS && i < MAX_NUM_REPLICA; i++) {
+		int queued = 0;
+		if (Replicas[i].sock > 0 && ioctl(Replicas[i].sock, SIOCOUTQ, &queued) == 0)
+			out << "replica_" << i << "_unacked_bytes " << queued << "\n";
 	}
-	return 0;
-
+	out << "end\n";
+	return out.str();
 }
 
 struct threaddata {
 	int socket;
-	NoVoHT *p_pmap;
+	StorageEngine *p_pmap;
 	char receivedData[]; //or char* something?
 };
 
 int turn_off;
-vector<struct HostEntity> hostList;
-int nHost;
 static int server_sock = 0;
 pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
 int numthreads = 0;
@@ -529,30 +1168,43 @@ int general_replica(Package package, struct HostEntity &destination) {
 	//      generalSend(destination.host, destination.port, sock, str.c_str(), 1);
 //      cout << "socket_replica--------2, sock = " << sock << endl;
 //        generalSendTCP(sock, str.c_str());
-	generalSendTo(destination.host.c_str(), destination.port, sock, str.c_str(),
-			TCP);
+	int sent = generalSendTo(destination.host.c_str(), destination.port, sock,
+			str.data(), str.size(), TCP); //explicit length, the package may hold NULs
 //      cout << "socket_replica--------3" << endl;
 	void *buff_return = (void*) malloc(sizeof(int32_t));
 	//      int r = d3_svr_recv(sock, buff_return, sizeof(int32_t), 0, &recv_addr);
 	// int r = generalReveiveTCP(sock, buff_return, sizeof buff_return, 0);
-	struct sockaddr_in recvAddr;
 //		int r =generalReceive(sock, buff_return, sizeof(int32_t), recvAddr, 0, TCP);
 	int r = 0;
+	//nobody waits for the replica's statuses, but they must not pile up until its send blocks
+	char acks[4096];
+	if (TCP == true && sock >= 0) {
+		int got;
+		while ((got = recv(sock, acks, sizeof(acks), MSG_DONTWAIT)) > 0)
+			;
+		if (sent <= 0 || got == 0) { //the replica went away, connect again next time
+			close(sock);
+			destination.sock = -1;
+		}
+	}
 //      cout << "socket_replica--------4" << endl;
 	//connect (int socket, struct sockaddr *addr, size_t length)
 	if (r < 0) {
 		cerr << "general_replica: got bad news from relica: " << r << endl;
 	}
+	free(buff_return);
+	return sent;
 }
 
-void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
-		NoVoHT* pmap) {
+//buff holds the len bytes of one request. The server handles one request at a time, so the
+//package and the lookup buffer below are reused instead of allocated per request.
+void dataService(int client_sock, const char* buff, int len, sockaddr_in fromAddr,
+		StorageEngine* pmap) {
 
 //	cout << strlen((char*)buff) << "{" << ((char*)buff) << "}" << endl;
 
 //cout<<"dataService: from port "<<	fromAddr.sin_port<<endl;
 
-	srand(getpid() + clock());
 	//srand(kyotocabinet::getpid() + clock());
 	//cout << "Current service thread ID = " << pthread_self()<< ", dbService() begin..." << endl;
 
@@ -561,10 +1213,40 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 //	sockaddr_in toAddr;
 	int r;
 	void* buff1;
+	double start = getTime_usec();
 
+	//per call: the embedded server (zht_local.h) serves requests of other threads too
 	Package package;
-	package.ParseFromArray(buff, MAX_MSG_SIZE);
+	bool whole; //parsed cleanly, the bytes are a valid serialization of package
+	map<int, string>::iterator partial = partialBatch.find(client_sock);
+	bool glued = partial != partialBatch.end();
+	if (glued) { //rest of a batch frame, glue it to what came before
+		partial->second.append(buff, len);
+		if (partial->second.size() >= (size_t) MAX_MSG_SIZE) {
+			cerr << "Batch frame too large, dropped." << endl;
+			partialBatch.erase(partial);
+			return;
+		}
+		whole = package.ParseFromString(partial->second);
+	} else {
+		whole = package.ParseFromArray(buff, len);
+	}
+	//only batch frames set num, and it is serialized ahead of the items and the operation.
+	if (package.has_num()
+			&& (package.listitem_size() < package.num()
+					|| !package.has_operation())) {
+		if (TCP == false)
+			return; //datagrams are never split, this one is broken
+		if (!glued)
+			partialBatch[client_sock].assign(buff, len);
+		return; //wait for the rest
+	}
+	if (glued)
+		partialBatch.erase(partial);
 	string result;
+	int op = package.operation();
+	bool update = op == 2 || op == 3 || op == 5 || op == 6 || (op >= 9 && op <= 12);
+	groupDefer = groupCommit && update && localReply == NULL;
 //	cout << endl << endl << "in dbService: received replicano = "<< package.replicano() << endl;
 
 //	cout << "Server got package size: " << package.ByteSize() << endl;
@@ -574,36 +1256,23 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 	case 1: //lookup
 	{
 //		cout << "Lookup..." << endl;
+		string value; //the one copy of the stored value, the reply is sent from it
 		if (package.virtualpath().empty()) {
 //			cerr << "Bad key: nothing to find" << endl;
 			operation_status = -1;
+		} else if (pmap->get(package.virtualpath(), value) == 0) {
+			operation_status = 0;
 		} else {
-			//result = HB_lookup(db, package);
-//			cout << "Lookup...2" << endl;
-//cout<<"Will lookup key: "<< package.virtualpath()<<endl;
-//			result = HB_lookup(hmap, package);
-			result = HB_lookup(pmap, package);
-//			cout << "Lookup...3" << endl;
-			//don't really send result back to client now, do it latter.
-
-			if (result.compare("Empty") == 0) {
-				operation_status = -2;
-			} else {
-				operation_status = 0;
-			}
+			//the client may answer its next misses itself, from the filter of its own keys
+			if (package.mode() == ZHT_BLOOM_ASK && ownKey(package.virtualpath()))
+				bloomMissReply(package.virtualpath(), value);
+			else
+				value = "Empty";
+			operation_status = -2;
 		}
 
-		/*
-		 * pack the status and lookup-result into one string
-		 */
-		buff1 = &operation_status;
-		char statusBuff[3];
-		sprintf(statusBuff, "%03d", operation_status);
-		string sAllInOne;
-		sAllInOne.append(statusBuff);
-		sAllInOne.append(result);
-
-		generalSendBack(client_sock, sAllInOne.c_str(), fromAddr, 0, TCP);
+		//status and lookup-result go out in one reply, without gluing them together
+		sendStatusValue(client_sock, operation_status, value, fromAddr);
 	}
 		break;
 	case 2: {
@@ -615,19 +1284,13 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 			operation_status = -1;
 		} else {
 			//operation_status = HB_remove(db, package);
-			//			operation_status = HB_remove(hmap, package);
 			operation_status = HB_remove(pmap, package);
 			//r = d3_send_data(client_sock, buff1, sizeof(int32_t), 0, &toAddr);
 			//r = generalSendBack(client_sock, (const char*) buff1, fromAddr, 0,TCP);
 		}
 
 		buff1 = &operation_status;
-		if (TCP == true) {
-			r = send(client_sock, &operation_status, sizeof(int32_t), 0);
-		} else {
-			r = sendto(client_sock, &operation_status, sizeof(int32_t), 0,
-					(struct sockaddr *) &fromAddr, sizeof(struct sockaddr));
-		}
+		r = sendStatus(client_sock, operation_status, fromAddr);
 
 		if (r <= 0) {
 			cout
@@ -645,9 +1308,11 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 		} else {
 			//		cout << "Insert..." << endl;
 			//operation_status = HB_insert(db, package);
-			operation_status = HB_insert(pmap, package);
-//			operation_status = HB_insert_cstr(chmap, package);
-			//		operation_status = HB_insert(hmap, package);
+			if (whole && !glued) {
+				string wire(buff, len); //the request bytes are stored as they came
+				operation_status = HB_insert(pmap, package, &wire);
+			} else
+				operation_status = HB_insert(pmap, package);
 			//cout<<"Inserted: key: "<< package.virtualpath()<<endl;
 			//		cout << "insert finished, return: " << operation_status << endl;
 			//		r = d3_send_data(client_sock, buff1, sizeof(int32_t), 0, &toAddr);
@@ -656,12 +1321,7 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 		}
 
 		buff1 = &operation_status;
-		if (TCP == true) {
-			r = send(client_sock, &operation_status, sizeof(int32_t), 0);
-		} else {
-			r = sendto(client_sock, &operation_status, sizeof(int32_t), 0,
-					(struct sockaddr *) &fromAddr, sizeof(struct sockaddr));
-		}
+		r = sendStatus(client_sock, operation_status, fromAddr);
 
 		//cout << "Insert: Server  send acknowledgement to client: sendto r = " <<r<< endl;
 		//cout<<"send back status: "<< *(int*)buff1<<endl;
@@ -672,6 +1332,52 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 		}
 	}
 		break;
+	case 4: //multi-lookup
+	case 5: //multi-remove
+	case 6: { //multi-insert
+		operation_status = 0;
+		result = HB_batch(pmap, package);
+		sendStatusValue(client_sock, operation_status, result, fromAddr);
+	}
+		break;
+	case 7: { //statistics
+		result = statsReport(pmap);
+		sendStatusValue(client_sock, 0, result, fromAddr);
+	}
+		break;
+	case 8: { //prefix scan, one page
+		result = HB_scan(pmap, package);
+		sendStatusValue(client_sock, 0, result, fromAddr);
+	}
+		break;
+	case 9: { //insert with a time to live, or change it
+		if (package.virtualpath().empty())
+			operation_status = -1;
+		else if (whole && !glued) {
+			string wire(buff, len);
+			operation_status = HB_expire(pmap, package, &wire);
+		} else
+			operation_status = HB_expire(pmap, package, NULL);
+		sendStatus(client_sock, operation_status, fromAddr);
+	}
+		break;
+	case 10: //lease acquire
+	case 11: //lease renew
+	case 12: { //lease release
+		operation_status = HB_lease(pmap, package, result);
+		sendStatusValue(client_sock, operation_status, result, fromAddr);
+	}
+		break;
+	case 13: //watch
+	case 14: { //unwatch
+		operation_status = HB_watch(client_sock, package);
+		if (TCP == true && localReply == NULL) //framed like the notices that may precede it
+			watchSend(client_sock, ZHT_WATCH_ACK, (const char*) &operation_status,
+					sizeof(int32_t));
+		else
+			sendStatus(client_sock, operation_status, fromAddr);
+	}
+		break;
 	case 99: { //shut the server
 //		cout << "Server will be shut shortly." << endl;
 		turn_off = 1; //turn off service.
@@ -681,31 +1387,35 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 		operation_status = -98; //unrecognized operation
 
 		buff1 = &operation_status;
-		if (TCP == true) {
-			r = send(client_sock, &operation_status, sizeof(int32_t), 0);
-		} else {
-			r = sendto(client_sock, &operation_status, sizeof(int32_t), 0,
-					(struct sockaddr *) &fromAddr, sizeof(struct sockaddr));
-		}
+		r = sendStatus(client_sock, operation_status, fromAddr);
 	}
 		break;
 	} //end switch-case
 
+	groupDefer = false;
+	if (groupCommit && update && localReply != NULL && pmap->sync() != 0)
+		localReply->len = 0; //not durable, the caller gets an error
 	buff1 = &operation_status;
+	statsRecord(opStats[op > 0 && op < STATS_OPS ? op : 0], getTime_usec() - start);
 
 //	cout << "Before handle Replication " << endl;
 	if (NUM_REPLICAS > 0) { // infinite loop if not limited by replicano, coz it will send the replica to itself infinitely
 		if (package.replicano() == 5) {
-			if (package.operation() == 3 || package.operation() == 2) {
+			if (package.operation() == 3 || package.operation() == 2
+					|| package.operation() == 5 || package.operation() == 6
+					|| (package.operation() >= 9 && package.operation() <= 12)) {
 
 				int i = NUM_REPLICAS;
-				unsigned int n;
 				//			package.set_replicano(3);
 				while (i > 0) { //change from numReplica to i
-					n = myhash((package.virtualpath()).c_str(), nHost) + i;
-					n = n % hostList.size();
-					struct HostEntity destination = hostList.at(n);
-					general_replica(package, Replicas[i - 1]);
+					if (i >= nHost || i > MAX_NUM_REPLICA) { //fewer servers than copies, or itself
+						i--;
+						continue;
+					}
+					double replicaStart = getTime_usec();
+					if (general_replica(package, Replicas[i - 1]) <= 0)
+						replicaFailures++;
+					statsRecord(replicaStats, getTime_usec() - replicaStart);
 					//				cout << "Replica remove: sent to " << destination.port 	<< " and before send replicano() = "<< package.replicano() << endl;
 
 //				cout << "Replication: i = " << i << endl;
@@ -718,6 +1428,69 @@ void dataService(int client_sock, void* buff, sockaddr_in fromAddr,
 
 } //end function
 
+//edge triggered: drain the socket, ZHT_UDP_BATCH datagrams per recvmmsg, and answer each
+//batch with one sendmmsg. RECVBUFF holds ZHT_UDP_BATCH datagrams of MAX_MSG_SIZE.
+void udpService(int sock, StorageEngine *pmap, char *recvBuff) {
+	struct mmsghdr msgs[ZHT_UDP_BATCH];
+	struct iovec iov[ZHT_UDP_BATCH];
+	sockaddr_in fromAddr[ZHT_UDP_BATCH];
+
+	while (1) {
+		for (int k = 0; k < ZHT_UDP_BATCH; k++) {
+			iov[k].iov_base = recvBuff + (size_t) k * MAX_MSG_SIZE;
+			iov[k].iov_len = MAX_MSG_SIZE;
+			memset(&msgs[k], 0, sizeof(struct mmsghdr));
+			msgs[k].msg_hdr.msg_name = &fromAddr[k];
+			msgs[k].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[k].msg_hdr.msg_iov = &iov[k];
+			msgs[k].msg_hdr.msg_iovlen = 1;
+		}
+		int got = recvmmsg(sock, msgs, ZHT_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recvmmsg");
+			return;
+		}
+		udpDatagrams += got;
+		groupUdpSock = sock;
+		for (int k = 0; k < got; k++) {
+			const char *data = recvBuff + (size_t) k * MAX_MSG_SIZE;
+			int len = msgs[k].msg_len;
+			unsigned long long id;
+			udpHeader = NULL;
+			if (udpGetHeader(data, len, id)) {
+				map<string, string>::iterator done = udpDone.find(
+						udpDupKey(fromAddr[k], data));
+				if (done != udpDone.end()) { //retransmission of an answered request
+					udpDuplicates++;
+					UdpReply reply;
+					reply.to = fromAddr[k];
+					reply.data = done->second;
+					if (groupUdp.empty())
+						udpReplies.push_back(reply);
+					else { //the first answer may still wait for its fdatasync
+						groupUdp.push_back(reply);
+						groupUdpKeys.push_back(string());
+						groupQueued++;
+					}
+					continue;
+				}
+				udpHeader = data;
+				data += ZHT_UDP_HEADER;
+				len -= ZHT_UDP_HEADER;
+			}
+			if (len > 0)
+				dataService(sock, data, len, fromAddr[k], pmap);
+		}
+		udpHeader = NULL;
+		flushUdpReplies(sock);
+		if (groupDue(wallUsec()))
+			groupFlush(pmap);
+	}
+}
+
 int __main(int argc, char *argv[]) {
 	cout << "hello!" << endl;
 	return 0;
@@ -749,7 +1522,68 @@ int Host2Index(const char* hostName) {
 
 }
 
+//================================ Embedded server ===================================
+//zhtServerStart runs the event loop below on a thread of its own; the process's clients
+//then call serveLocal for the keys this server owns (see zht_local.h). The event loop and
+//those callers take turns through serveLock, so the server stays single threaded inside.
+pthread_mutex_t serveLock = PTHREAD_MUTEX_INITIALIZER;
+static bool embedded = false;
+static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCond = PTHREAD_COND_INITIALIZER;
+static bool started = false;
+
+static int serveLocal(const char *req, int len, char *buff, int size) {
+	LocalReply reply;
+	reply.buff = buff;
+	reply.size = size;
+	reply.len = 0;
+	sockaddr_in none;
+	memset(&none, 0, sizeof(none));
+	pthread_mutex_lock(&serveLock);
+	localReply = &reply;
+	dataService(-1, req, len, none, store);
+	localReply = NULL;
+	pthread_mutex_unlock(&serveLock);
+	return reply.len > 0 ? reply.len : -1;
+}
+
+int zhtServerMain(int argc, char *argv[]);
+
+static void *serverThread(void *args) {
+	zhtServerMain(5, (char**) args);
+	return NULL;
+}
+
+int zhtServerStart(int port, const string &memberFile, const string &cfgFile, bool tcp) {
+	if (embedded)
+		return -1; //one server per process, its state is global
+	embedded = true;
+	char portStr[16];
+	sprintf(portStr, "%d", port);
+	static char *args[5]; //the server keeps pointing into them
+	args[0] = strdup("server_zht");
+	args[1] = strdup(portStr);
+	args[2] = strdup(memberFile.c_str());
+	args[3] = strdup(cfgFile.c_str());
+	args[4] = strdup(tcp ? "TCP" : "UDP");
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, serverThread, args) != 0)
+		return -1;
+	pthread_detach(thread);
+	pthread_mutex_lock(&startLock);
+	while (!started)
+		pthread_cond_wait(&startCond, &startLock);
+	pthread_mutex_unlock(&startLock);
+	return 0;
+}
+
+#ifndef ZHT_EMBEDDED
 int main(int argc, char *argv[]) {
+	return zhtServerMain(argc, argv);
+}
+#endif
+
+int zhtServerMain(int argc, char *argv[]) {
 
 //----------- Settings about ZHT server----------------
 // General version, work for both TCP and UDP.
@@ -759,6 +1593,7 @@ int main(int argc, char *argv[]) {
 		cout << "argc = " << argc << endl;
 		exit(EXIT_FAILURE);
 	}
+	statsStart = getTime_usec();
 
 	char* isTCP = argv[4];
 
@@ -783,11 +1618,6 @@ int main(int argc, char *argv[]) {
 //	string fileName = "hashmap.data"; //= "hashmap.data."+randStr;
 //	string fileName = "hashmap.data." + randStr;
 //	string fileName = "hashmap.txt";
-	const char* fileName = "";
-	pmap = new NoVoHT(fileName, 100000, 10000, 0.7);
-
-	map<string, string> hashMap;
-	hmap = hashMap;
 //cout<<"2"<<endl;
 	string membershipFile(argv[2]);
 	hostList = getMembership(membershipFile);
@@ -798,6 +1628,16 @@ int main(int argc, char *argv[]) {
 		cout << "Server: Not able to read configuration file." << endl;
 		exit(1);
 	}
+	store = createStorageEngine(STORAGE_ENGINE, STORAGE_FILE,
+			(long) STORAGE_CACHE_MB << 20, STORAGE_SYNC, STORAGE_SYNC_USEC,
+			STORAGE_SYNC_RECORDS, STORAGE_INDEX);
+	if (store == NULL) {
+		cout << "Server: unknown STORAGE_ENGINE " << STORAGE_ENGINE << endl;
+		exit(1);
+	}
+	groupCommit = store->deferSync();
+	groupUsec = STORAGE_SYNC_USEC > 0 ? STORAGE_SYNC_USEC : NOVOHT_GROUP_USEC;
+	groupRecords = STORAGE_SYNC_RECORDS > 0 ? STORAGE_SYNC_RECORDS : NOVOHT_GROUP_RECORDS;
 
 //cout<<"4"<<endl;
 
@@ -812,14 +1652,18 @@ int main(int argc, char *argv[]) {
 	 string myIP = checkIP;
 	 int myIndex = Host2Index(checkIP.c_str());
 	 */
-	int myIndex = Host2Index("localhost");
-	Replicas[0].host = hostList.at((myIndex + 1) % nHost).host;
-	Replicas[0].port = PORT_FOR_REPLICA;
-	Replicas[0].sock = -1;
-
-	Replicas[1].host = hostList.at((myIndex + 2) % nHost).host;
-	Replicas[1].port = PORT_FOR_REPLICA;
-	Replicas[1].sock = -1;
+	//the keys this server owns are copied to the servers after it in the member list, on
+	//the port they serve clients on, which is where the clients' replica reads look for them
+	struct HostEntity me;
+	me.host = "localhost";
+	me.port = atoi(LISTEN_PORT);
+	selfIndex = myIndex(hostList, me);
+	if (selfIndex < 0)
+		selfIndex = Host2Index("localhost");
+	for (int i = 0; i < MAX_NUM_REPLICA; i++) {
+		Replicas[i] = hostList.at((selfIndex + i + 1) % nHost);
+		Replicas[i].sock = -1;
+	}
 
 	/*
 	 Replicas[0].host = "localhost";
@@ -841,6 +1685,8 @@ int main(int argc, char *argv[]) {
 //		exit(EXIT_FAILURE);
 //	}
 //cout<<"6"<<endl;
+	//a replica or client that went away shows up as a failed send, not a dead server
+	signal(SIGPIPE, SIG_IGN);
 	//listener = create_and_bind(LISTEN_PORT);
 	listener = makeSvrSocket(atoi(LISTEN_PORT), TCP);
 	if (listener == -1)
@@ -879,23 +1725,55 @@ int main(int argc, char *argv[]) {
 	// Buffer where events are returned
 	events = (epoll_event *) calloc(MAXEVENTS, sizeof event);
 	char buf[MAX_MSG_SIZE];
+	vector<char> udpBuff(TCP ? 1 : (size_t) ZHT_UDP_BATCH * MAX_MSG_SIZE);
+
+	if (embedded) { //listening: the process's own clients may come in now
+		if (selfIndex >= 0)
+			zhtSetLocalServer(hostList.at(selfIndex).host, hostList.at(selfIndex).port,
+					serveLocal);
+		pthread_mutex_lock(&startLock);
+		started = true;
+		pthread_cond_broadcast(&startCond);
+		pthread_mutex_unlock(&startLock);
+	}
 
 	int epollCounter = 0;
+	long long nextExpiry = 0;
 //cout<<"I'm a server..."<<endl;
 	// The event loop
 	while (1) {
 		int n, i;
 
-		n = epoll_wait(efd, events, MAXEVENTS, -1);
+		//keys with a time to live are reaped every tick of the storage's timer wheel, so an
+		//idle server still wakes up for them
+		//queued update replies shorten the wait to what is left of the group commit window
+		int timeout = NOVOHT_WHEEL_TICK / 1000;
+		if (groupQueued > 0)
+			timeout = (int) min((long long) timeout,
+					max(0LL, (lastGroupSync + groupUsec - wallUsec() + 999) / 1000));
+		n = epoll_wait(efd, events, MAXEVENTS, timeout);
+		long long now = wallUsec();
+		if (now >= nextExpiry) {
+			vector<string> reaped;
+			pthread_mutex_lock(&serveLock);
+			store->expireDue(watchCount > 0 ? &reaped : NULL);
+			for (size_t k = 0; k < reaped.size(); k++)
+				keyChanged(reaped[k], ZHT_WATCH_REMOVED);
+			pthread_mutex_unlock(&serveLock);
+			nextExpiry = now + NOVOHT_WHEEL_TICK;
+		}
 
 		epollCounter++;
 //		printf("epoll %d times ", epollCounter);
 
+		pthread_mutex_lock(&serveLock); //the process's own clients wait for this round
 		for (i = 0; i < n; i++) {
 			if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)
 					|| (!(events[i].events & EPOLLIN))) {
 				// An error has occured on this fd, or the socket is not ready for reading (why were we notified then?)
 				fprintf(stderr, "epoll error\n");
+				groupDrop(events[i].data.fd);
+				watchDrop(events[i].data.fd);
 				close(events[i].data.fd);
 				continue;
 			}
@@ -929,6 +1807,8 @@ int main(int argc, char *argv[]) {
 							 "(host=%s, port=%s)\n", infd, hbuf, sbuf);	*/
 						}
 
+						connsAccepted++;
+						connsOpen++;
 						// Make the incoming socket non-blocking and add it to the list of fds to monitor.
 						s = make_socket_non_blocking(infd);
 
@@ -949,14 +1829,7 @@ int main(int argc, char *argv[]) {
 
 				} //end if(TCP==true)
 				else if (TCP == false) {
-					sockaddr_in fromAddr;
-					char recvBuff[MAX_MSG_SIZE];
-					int recvSize = udpRecvFrom(events[i].data.fd, recvBuff,
-							MAX_MSG_SIZE, fromAddr, 0);
-					//cout<<"epool server receive size = "<<recvSize<<endl;
-					dataService(events[i].data.fd, recvBuff, fromAddr, pmap);
-					memset(recvBuff, '\0', sizeof(recvBuff));
-
+					udpService(events[i].data.fd, store, &udpBuff[0]);
 				}
 			} else {
 
@@ -1001,8 +1874,8 @@ int main(int argc, char *argv[]) {
 						else { //count > 0
 //						cout<<"Receive string..."<<endl;
 							sockaddr_in fromAddr; // no use for TCP, just to fill the parameter
-							dataService(events[i].data.fd, buf, fromAddr, pmap);
-							memset(buf, '\0', sizeof(buf));
+							dataService(events[i].data.fd, buf, count, fromAddr,
+									store);
 //						free(buf);
 
 						}
@@ -1017,13 +1890,20 @@ int main(int argc, char *argv[]) {
 //					printf("Closed connection on descriptor %d\n",events[i].data.fd);
 
 						// Closing the descriptor will make epoll remove it from the set of descriptors which are monitored.
+						partialBatch.erase(events[i].data.fd);
+						groupDrop(events[i].data.fd);
+						watchDrop(events[i].data.fd);
 						close(events[i].data.fd);
+						connsOpen--;
 					}
 
 				} //if TCP == true
 
 			} //end else
 		} //end for
+		if (groupDue(wallUsec()))
+			groupFlush(store);
+		pthread_mutex_unlock(&serveLock);
 	} //end main while
 
 	free(events);
@@ -3,40 +3,88 @@
  * Author: dzhao8@iit.edu
  * History:
  *		- 07/25/2012: initial development
+ *		- 10/19/2026: parallel processes, directory trees, shared/unique directories,
+ *		  more phases and latency percentiles, in the spirit of mdtest
+ *
+ * N processes work under one directory, which may be on any mount point (a local
+ * directory gives the baseline). Each phase starts on all processes at once and is
+ * reported with its aggregate ops/sec and the latency percentiles of single calls:
+ *		mkdir	the directory tree: depth levels below its root, fanout directories each
+ *		create	creat() and close() of items files per process in every directory of the tree
+ *		stat	stat() of each file
+ *		readdir	opendir(), readdir() to the end and closedir() of every directory
+ *		open	open() and close() of each file
+ *		rename	rename() of each file within its directory
+ *		unlink	unlink() of each file
+ *		rmdir	the tree, deepest first
+ * In shared mode (default) all processes put their files into one tree, made and removed by
+ * process 0; with -u each process has a tree of its own.
+ *
+ * Usage: ./benchmark_metadata [-d dir] [-n processes] [-i items] [-z depth] [-b fanout]
+ *		[-u] [-P phase,phase,...]
+ *		default: current directory, 1 process, 10 items, depth 0 (no subdirectories),
+ *		fanout 2, all phases
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #define FILENAME "f_"
-#define TOTAL_FILE 10
+#define RENAMED "r_"
+#define DIRNAME "d_"
 
-int main()
-{
-	int retstat;
+enum {
+	PH_MKDIR, PH_CREATE, PH_STAT, PH_READDIR, PH_OPEN, PH_RENAME, PH_UNLINK, PH_RMDIR,
+	PHASES
+};
+const char *phase_names[PHASES] = { "mkdir", "create", "stat", "readdir", "open",
+		"rename", "unlink", "rmdir" };
 
-	retstat = creat_file(TOTAL_FILE);
-	if (retstat) {
-		return retstat;
-	}
+/* latency histogram in usec: exact below 64, then 32 buckets per power of two */
+#define HIST_EXACT 64
+#define HIST_SUB 32
+#define HIST_BUCKETS (HIST_EXACT + 40 * HIST_SUB)
 
-	retstat = open_file(TOTAL_FILE);
-	if (retstat) {
-		return retstat;
-	}
+struct result {
+	long long counts[HIST_BUCKETS];
+	long long ops;
+	long long errors;
+	double sum; /* usec */
+	long long max; /* usec */
+	double start, end; /* sec */
+};
 
-	retstat = remove_file(TOTAL_FILE);
-	if (retstat) {
-		return retstat;
-	}
+/* in memory shared by all processes */
+struct shared {
+	pthread_barrier_t barrier;
+	struct result results[]; /* process * PHASES + phase */
+};
 
-	return 0;
-}
+char *base = ".";
+int procs = 1;
+int items = 10;
+int depth = 0;
+int fanout = 2;
+int unique = 0;
+int run_phase[PHASES];
+int did_rename = 0;
+
+struct shared *shm;
+char **dirs; /* the tree of a process, parents before children */
+int ndirs;
 
 /*
  *get current timestamp
@@ -48,86 +96,277 @@ double getFloatTime()
 	return (double) t.tv_sec + (double) t.tv_usec / 1000000.0;
 }
 
-int creat_file(int num_of_files)
+int hist_index(long long v)
 {
-	double start, end, ops;
-	start = getFloatTime();
-	int fileno = 0;
-	char fname[PATH_MAX] = {0}, fileid[10] = {0};
-	for (; fileno < num_of_files; fileno++){
-		sprintf(fileid, "%d", fileno);
-		strcpy(fname, FILENAME);
-		strcat(fname, fileid);
-		int fd = creat(fname, 0755);
-		if (fd < 0) {
-			perror("creat_file() failed to create file. ");
-			return 1;
+	if (v < HIST_EXACT)
+		return v < 0 ? 0 : (int) v;
+	int e = 63 - __builtin_clzll((unsigned long long) v);
+	int i = HIST_EXACT + (e - 6) * HIST_SUB + (int) (v >> (e - 5)) - HIST_SUB;
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+long long hist_upper(int i)
+{
+	if (i < HIST_EXACT)
+		return i;
+	int e = (i - HIST_EXACT) / HIST_SUB + 6;
+	long long sub = (i - HIST_EXACT) % HIST_SUB + HIST_SUB;
+	return ((sub + 1) << (e - 5)) - 1;
+}
+
+long long percentile(struct result *r, double p)
+{
+	long long rank = (long long) ceil(p / 100 * r->ops), seen = 0;
+	int i;
+	if (r->ops == 0)
+		return 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += r->counts[i];
+		if (seen >= rank)
+			return hist_upper(i) < r->max ? hist_upper(i) : r->max;
+	}
+	return r->max;
+}
+
+/* time one call: RETSTAT below 0 counts as an error, the first one of a phase is shown */
+void record(struct result *r, double start, int retstat, const char *what,
+		const char *path)
+{
+	long long usec = (long long) ((getFloatTime() - start) * 1000000);
+	r->counts[hist_index(usec)]++;
+	r->ops++;
+	r->sum += usec;
+	if (usec > r->max)
+		r->max = usec;
+	if (retstat < 0 && r->errors++ == 0)
+		fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+}
+
+/* the directories of the tree below ROOT, breadth first */
+void build_tree(const char *root)
+{
+	int level, i, j, first = 0, count = 1, total = 0;
+	for (level = 0, i = 1; level <= depth; level++, i *= fanout)
+		total += i;
+	dirs = calloc(total, sizeof(char*));
+	dirs[0] = strdup(root);
+	ndirs = 1;
+	for (level = 0; level < depth; level++) {
+		for (i = first; i < first + count; i++)
+			for (j = 0; j < fanout; j++) {
+				char path[PATH_MAX];
+				snprintf(path, PATH_MAX, "%s/%s%d", dirs[i], DIRNAME, j);
+				dirs[ndirs++] = strdup(path);
+			}
+		first += count;
+		count *= fanout;
+	}
+}
+
+void file_path(char *path, int dir, int rank, int item, const char *prefix)
+{
+	snprintf(path, PATH_MAX, "%s/%s%d.%d", dirs[dir], prefix, rank, item);
+}
+
+/* the files of process RANK: ITEMS in every directory */
+void each_file(int rank, int phase, struct result *r)
+{
+	int d, i;
+	char path[PATH_MAX], to[PATH_MAX];
+	for (d = 0; d < ndirs; d++)
+		for (i = 0; i < items; i++) {
+			struct stat st;
+			int retstat, fd;
+			double start;
+			file_path(path, d, rank, i, did_rename ? RENAMED : FILENAME);
+			start = getFloatTime();
+			switch (phase) {
+			case PH_CREATE:
+				fd = creat(path, 0755);
+				retstat = fd < 0 ? -1 : close(fd);
+				break;
+			case PH_STAT:
+				retstat = stat(path, &st);
+				break;
+			case PH_OPEN:
+				fd = open(path, O_RDONLY);
+				retstat = fd < 0 ? -1 : close(fd);
+				break;
+			case PH_RENAME:
+				file_path(to, d, rank, i, RENAMED);
+				retstat = rename(path, to);
+				break;
+			default:
+				retstat = unlink(path);
+				break;
+			}
+			record(r, start, retstat, phase_names[phase], path);
 		}
-		memset(fname, 0, PATH_MAX);
-		memset(fileid, 0, 10);
+}
+
+void each_dir(int phase, struct result *r)
+{
+	int d;
+	for (d = 0; d < ndirs; d++) {
+		int at = phase == PH_RMDIR ? ndirs - 1 - d : d, retstat = 0;
+		double start = getFloatTime();
+		if (phase == PH_MKDIR) {
+			retstat = mkdir(dirs[at], 0755);
+		} else if (phase == PH_RMDIR) {
+			retstat = rmdir(dirs[at]);
+		} else {
+			DIR *dp = opendir(dirs[at]);
+			if (dp == NULL)
+				retstat = -1;
+			else {
+				while (readdir(dp) != NULL)
+					;
+				closedir(dp);
+			}
+		}
+		record(r, start, retstat, phase_names[phase], dirs[at]);
 	}
-	end = getFloatTime();
-	ops = (double) num_of_files / (end - start);
-	printf("Create file: %10.2f ops. \n", ops);
-	return 0;
 }
 
-int open_file(int num_of_files)
+void worker(int rank)
 {
-	double start, end, ops;
-	start = getFloatTime();
-	int fileno = 0;
-	char fname[PATH_MAX] = {0}, fileid[10] = {0};
-	for (; fileno < num_of_files; fileno++){
-		sprintf(fileid, "%d", fileno);
-		strcpy(fname, FILENAME);
-		strcat(fname, fileid);
-		int fd = open(fname, O_RDONLY);
-		if (fd < 0) {
-			perror("open_file() failed to open file. ");
-			return 1;
+	int phase;
+	char root[PATH_MAX];
+	if (unique)
+		snprintf(root, PATH_MAX, "%s/mdtest.%d.%d", base, (int) getppid(), rank);
+	else
+		snprintf(root, PATH_MAX, "%s/mdtest.%d", base, (int) getppid());
+	build_tree(root);
+
+	for (phase = 0; phase < PHASES; phase++) {
+		struct result *r = &shm->results[rank * PHASES + phase];
+		if (!run_phase[phase])
+			continue;
+		pthread_barrier_wait(&shm->barrier);
+		r->start = getFloatTime();
+		if (phase == PH_MKDIR || phase == PH_RMDIR) {
+			if (unique || rank == 0)
+				each_dir(phase, r);
+		} else if (phase == PH_READDIR) {
+			each_dir(phase, r);
+		} else {
+			each_file(rank, phase, r);
 		}
-		int stat = close(fd);
-		if (stat < 0) {
-			perror("open_file() failed to close file. ");
+		if (phase == PH_RENAME)
+			did_rename = 1;
+		r->end = getFloatTime();
+	}
+}
+
+int parse_phases(char *list)
+{
+	int phase;
+	char *name;
+	memset(run_phase, 0, sizeof(run_phase));
+	for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		for (phase = 0; phase < PHASES; phase++)
+			if (!strcmp(name, phase_names[phase]))
+				break;
+		if (phase == PHASES)
 			return 1;
-		}
-		memset(fname, 0, PATH_MAX);
-		memset(fileid, 0, 10);
+		run_phase[phase] = 1;
 	}
-	end = getFloatTime();
-	ops = (double) num_of_files / (end - start);
-	printf("Open/close file: %10.2f ops. \n", ops);
 	return 0;
 }
 
-int remove_file(int num_of_files)
+void report()
 {
-	double start, end, ops;
-	start = getFloatTime();
-	int fileno = 0;
-	char fname[PATH_MAX] = {0}, fileid[10] = {0};
-	for (; fileno < num_of_files; fileno++){
-		sprintf(fileid, "%d", fileno);
-		strcpy(fname, FILENAME);
-		strcat(fname, fileid);
-
-//		char cmd_rm[PATH_MAX] = {0};
-//		strcpy(cmd_rm, "rm ");
-//		strcat(cmd_rm, fname);
-//		system(cmd_rm);
-
-		/*remove is actually rename in Linux...*/
-		int stat = remove(fname);
-		if (stat < 0) {
-			perror("open_file() failed to close file. ");
+	int phase, rank, i;
+	printf("phase,ops,errors,sec,ops_per_sec,avg_usec,p50_usec,p90_usec,p99_usec,"
+			"max_usec\n");
+	for (phase = 0; phase < PHASES; phase++) {
+		struct result all;
+		double first = 0, last = 0;
+		if (!run_phase[phase])
+			continue;
+		memset(&all, 0, sizeof(all));
+		for (rank = 0; rank < procs; rank++) {
+			struct result *r = &shm->results[rank * PHASES + phase];
+			for (i = 0; i < HIST_BUCKETS; i++)
+				all.counts[i] += r->counts[i];
+			all.ops += r->ops;
+			all.errors += r->errors;
+			all.sum += r->sum;
+			if (r->max > all.max)
+				all.max = r->max;
+			if (first == 0 || r->start < first)
+				first = r->start;
+			if (r->end > last)
+				last = r->end;
+		}
+		printf("%s,%lld,%lld,%.3f,%.2f,%.1f,%lld,%lld,%lld,%lld\n", phase_names[phase],
+				all.ops, all.errors, last - first,
+				last > first ? all.ops / (last - first) : 0.0,
+				all.ops > 0 ? all.sum / all.ops : 0.0, percentile(&all, 50),
+				percentile(&all, 90), percentile(&all, 99), all.max);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int c, rank, failed = 0;
+	pthread_barrierattr_t attr;
+	size_t size;
+
+	for (c = 0; c < PHASES; c++)
+		run_phase[c] = 1;
+	while ((c = getopt(argc, argv, "d:n:i:z:b:uP:")) != -1) {
+		switch (c) {
+		case 'd': base = optarg; break;
+		case 'n': procs = atoi(optarg); break;
+		case 'i': items = atoi(optarg); break;
+		case 'z': depth = atoi(optarg); break;
+		case 'b': fanout = atoi(optarg); break;
+		case 'u': unique = 1; break;
+		case 'P':
+			if (parse_phases(optarg))
+				failed = 1;
+			break;
+		default: failed = 1; break;
+		}
+	}
+	if (failed || procs <= 0 || items < 0 || depth < 0 || fanout <= 0) {
+		fprintf(stderr, "Usage: %s [-d dir] [-n processes] [-i items] [-z depth] "
+				"[-b fanout] [-u] [-P mkdir,create,stat,readdir,open,rename,unlink,rmdir]\n",
+				argv[0]);
+		return 1;
+	}
+
+	size = sizeof(struct shared) + sizeof(struct result) * procs * PHASES;
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap() failed. ");
+		return 1;
+	}
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shm->barrier, &attr, procs);
+
+	printf("# %s, %d processes, %s directories, depth %d, fanout %d, %d items per "
+			"directory and process\n", base, procs, unique ? "unique" : "shared", depth,
+			fanout, items);
+	fflush(stdout);
+	for (rank = 0; rank < procs; rank++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork() failed. ");
 			return 1;
 		}
-		memset(fname, 0, PATH_MAX);
-		memset(fileid, 0, 10);
+		if (pid == 0) {
+			worker(rank);
+			_exit(0);
+		}
 	}
-	end = getFloatTime();
-	ops = (double) num_of_files / (end - start);
-	printf("Remove file: %10.2f ops. \n", ops);
-	return 0;
+	for (rank = 0; rank < procs; rank++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	report();
+	return failed;
 }